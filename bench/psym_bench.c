@@ -0,0 +1,658 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <locale.h>
+
+#include "copy.h"
+#include "date_sort.h"
+#include "opt_parser.h"
+#include "psym.h"
+#include "ref_map.h"
+#include "scan.h"
+#include "serialize.h"
+#include "synth.h"
+#include "thread_pool.h"
+#include "timestamp.h"
+#include "util.h"
+
+/*
+* psym_bench synth builds a synthetic library to try psym on, psym_bench run times every phase of gen and ext
+* on such libraries of several sizes and prints the results as json or csv; the same options and seed give the
+* same library on every run. the date filter, sort, shuffle, write and parse run on a table made in memory, list
+* writes a listing of it and generates from that; scan and copy need the files on disk and only run for counts up to -m
+*/
+
+#define DEF_UNIT_SIZE 5
+#define DEF_DISK_MAX 100000
+static const wchar_t *_DEF_COUNTS[] = { L"10000", L"1000000", L"10000000" };
+static const wchar_t *_DEF_EXTENSIONS[] = { L"jpg", L"jpeg", L"png", L"heic" };
+static const uint32_t _DEF_EXT_WEIGHTS[] = { 6, 1, 2, 1 };
+// indexed by SYNTH_DATES_*
+static const wchar_t *_DATE_NAMES[] = { L"uniform", L"burst", L"same" };
+
+typedef struct
+{
+    const wchar_t *phase;
+    uint32_t count;
+    double seconds;
+    uint64_t bytes; // written, read or copied, 0 where it does not apply
+} bench_result;
+
+typedef struct
+{
+    synth_opts synth;
+    const wchar_t *dir;
+    uint32_t unit_size;
+    int workers;
+    uint32_t disk_max;
+    bench_result *results;
+    int result_count;
+    int result_cap;
+} bench_ctx;
+
+static int log_err_and_return(const wchar_t* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfwprintf(stderr, format, args);
+    va_end(args);
+    return -1;
+}
+
+static void add_result(bench_ctx *ctx, const wchar_t *phase, uint32_t count, double seconds, uint64_t bytes)
+{
+    if (ctx->result_count == ctx->result_cap)
+    {
+        ctx->result_cap = ctx->result_cap ? ctx->result_cap * 2 : 16;
+        ctx->results = (bench_result *)realloc(ctx->results, sizeof(bench_result) * ctx->result_cap);
+    }
+    bench_result *result = ctx->results + ctx->result_count++;
+    result->phase = phase;
+    result->count = count;
+    result->seconds = seconds;
+    result->bytes = bytes;
+    fwprintf(stderr, L"%-14ls %10u files %10.4f s\n", phase, count, seconds);
+}
+
+static uint64_t file_size(const wchar_t *path)
+{
+    file_map map;
+    if (map_file(&map, path, 0))
+        return 0;
+    const uint64_t size = map.size;
+    unmap_file(&map);
+    return size;
+}
+
+// the extract side: every unit through the table, every name decoded
+static int parse_units(const wchar_t *path, uint64_t *files)
+{
+    ref_map ref;
+    if (open_ref_map(&ref, path, 0))
+        return -1;
+    file_iter iter;
+    init_file_iter(&iter, &ref);
+    int ret = 0;
+    *files = 0;
+    for (uint64_t i = 0; i < ref.unit_count && !ret; ++i)
+    {
+        unit_view unit;
+        file_view file;
+        if ((ret = read_unit_view(&ref, ref_unit_offset(&ref, ref_unit_index(&ref, i)), &unit)))
+            break;
+        start_unit_files(&iter, &unit);
+        while (next_file(&iter, &file))
+            ++*files;
+    }
+    free_file_iter(&iter);
+    close_ref_map(&ref);
+    return ret;
+}
+
+// the old scan took a file time through calendar fields and mktime, FileTimeToSystemTime on windows
+static time_t fields_time(file_stamp stamp)
+{
+    struct tm time;
+#ifdef _WIN32
+    SYSTEMTIME stime;
+    const FILETIME filetime = { (DWORD)stamp, (DWORD)((uint64_t)stamp >> 32) };
+    FileTimeToSystemTime(&filetime, &stime);
+    memset(&time, 0, sizeof(struct tm));
+    time.tm_year = stime.wYear - 1900;
+    time.tm_mon = stime.wMonth - 1;
+    time.tm_mday = stime.wDay;
+    time.tm_hour = stime.wHour;
+    time.tm_min = stime.wMinute;
+    time.tm_sec = stime.wSecond;
+#else
+    const time_t seconds = stamp_to_time(stamp);
+    gmtime_r(&seconds, &time);
+#endif
+    time.tm_isdst = -1;
+    return mktime(&time);
+}
+
+// the per file date work of the scan, the old calendar round trip against stamps compared in their own domain;
+// the bounds keep about half of the files so neither side gets a predictable branch
+static void bench_dates(bench_ctx *ctx, const file_table *files)
+{
+    const uint32_t count = files->count;
+    file_stamp *stamps = (file_stamp *)malloc(sizeof(file_stamp) * (count ? count : 1));
+    time_t lower = LLONG_MAX, upper = LLONG_MIN;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        stamps[i] = time_to_stamp(files->dates[i]) + i % 1000;
+        lower = files->dates[i] < lower ? files->dates[i] : lower;
+        upper = files->dates[i] > upper ? files->dates[i] : upper;
+    }
+    upper = lower + (upper - lower) / 2;
+
+    volatile time_t sink = 0;
+    time_t sum = 0;
+    double start = time_now();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const time_t date = fields_time(stamps[i]);
+        if (date > lower && date < upper)
+            sum += date;
+    }
+    add_result(ctx, L"date_fields", count, time_now() - start, 0);
+    sink = sum;
+
+    sum = 0;
+    start = time_now();
+    stamp_range range;
+    init_stamp_range(&range, lower, upper);
+    for (uint32_t i = 0; i < count; ++i)
+        if (in_stamp_range(&range, stamps[i]))
+            sum += stamp_to_time(stamps[i]);
+    add_result(ctx, L"date_stamp", count, time_now() - start, 0);
+    sink = sum;
+    (void)sink;
+    free(stamps);
+}
+
+static int bench_write(bench_ctx *ctx, const file_table *files, const uint32_t *order, char compact)
+{
+    wchar_t path[PSYM_MAX_PATH];
+    swprintf(path, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls", ctx->dir, compact ? L"bench_compact.bin" : L"bench.bin");
+
+    const wchar_t *dir = ctx->dir;
+    scan_opts opts;
+    memset(&opts, 0, sizeof opts);
+    opts.dirs = &dir;
+    opts.dir_count = 1;
+    opts.exts = ctx->synth.exts;
+    opts.ext_count = ctx->synth.ext_count;
+    opts.bound_upper = LLONG_MAX;
+    opts.recursive = 1;
+    opts.workers = ctx->workers;
+    dir_state state;
+    init_dir_state(&state);
+
+    // synthetic names stay far below UINT16_MAX characters
+    unit_format format = { compact, LLONG_MIN, ctx->synth.ext_count, needs_wide(&opts, ctx->unit_size, 0) };
+    for (uint32_t i = 0; i < files->count; ++i)
+        if (files->dates[i] > format.date_base)
+            format.date_base = files->dates[i];
+
+    double start = time_now();
+    if (write_bin(&opts, path, ctx->unit_size, NULL, &format, 0, files, order, &state))
+        return log_err_and_return(L"could not write to file %ls\n", path);
+    add_result(ctx, compact ? L"write_compact" : L"write", files->count, time_now() - start, file_size(path));
+
+    uint64_t parsed;
+    start = time_now();
+    const int ret = parse_units(path, &parsed);
+    const double seconds = time_now() - start;
+    if (ret || parsed != files->count)
+        return log_err_and_return(L"could not read back file %ls\n", path);
+    add_result(ctx, compact ? L"parse_compact" : L"parse", files->count, seconds, file_size(path));
+    return remove_path(path);
+}
+
+// gen --from-list end to end, from a listing of the table like find -printf gives to the written file
+static int bench_list(bench_ctx *ctx, const file_table *files)
+{
+    wchar_t list[PSYM_MAX_PATH], path[PSYM_MAX_PATH];
+    swprintf(list, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"bench.lst", ctx->dir);
+    swprintf(path, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"bench_list.bin", ctx->dir);
+    FILE *file = file_open(list, L"wb");
+    if (!file)
+        return log_err_and_return(L"could not write to file %ls\n", list);
+    // synthetic paths are short, 4 bytes a character is plenty
+    wchar_t name[PSYM_MAX_PATH];
+    uint8_t line[PSYM_MAX_PATH * 4 + 64];
+    for (uint32_t i = 0; i < files->count; ++i)
+    {
+        int len = sprintf((char *)line, "%lld\t%llu\t", (long long)files->dates[i],
+                          (unsigned long long)ctx->synth.file_size);
+        const int name_len = swprintf(name, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls.%ls", ctx->dir, FILE_NAME(files, i),
+                                      ctx->synth.exts[files->exts[i]]);
+        len += wcs_to_utf8(line + len, name, name_len);
+        line[len++] = '\n';
+        fwrite(line, 1, len, file);
+    }
+    if (fclose(file))
+        return log_err_and_return(L"could not write to file %ls\n", list);
+
+    const wchar_t *dir = ctx->dir;
+    scan_opts opts;
+    memset(&opts, 0, sizeof opts);
+    opts.dirs = &dir;
+    opts.dir_count = 1;
+    opts.exts = ctx->synth.exts;
+    opts.ext_count = ctx->synth.ext_count;
+    opts.bound_upper = LLONG_MAX;
+    opts.workers = ctx->workers;
+    const psym_write_opts wopts = { ctx->unit_size, 0, NULL, 0, 0, 0 };
+    psym_list_result result;
+    const double start = time_now();
+    int ret = psym_gen_list(list, &opts, path, &wopts, &result, NULL);
+    const double seconds = time_now() - start;
+    uint64_t total = 0;
+    for (uint64_t i = 0; !ret && i < (uint64_t)result.opts.dir_count * result.opts.ext_count; ++i)
+        total += result.counts[i];
+    psym_free_list_result(&result);
+    if (ret || total != files->count)
+        ret = log_err_and_return(L"the listing gave %llu of %u files\n", (unsigned long long)total, files->count);
+    else
+        add_result(ctx, L"list", files->count, seconds, file_size(list));
+    remove_path(path);
+    remove_path(list);
+    return ret;
+}
+
+static int bench_disk(bench_ctx *ctx, uint32_t count)
+{
+    wchar_t tree[PSYM_MAX_PATH], out[PSYM_MAX_PATH], dst[PSYM_MAX_PATH], src[PSYM_MAX_PATH];
+    swprintf(tree, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"bench_tree", ctx->dir);
+    swprintf(out, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"bench_copy", ctx->dir);
+    if (create_dir(tree) || create_dir(out))
+        return log_err_and_return(L"could not create directories in %ls, they must not exist already\n", ctx->dir);
+    if (synth_tree(&ctx->synth, tree, count))
+    {
+        remove_synth_tree(&ctx->synth, tree, count);
+        remove_path(tree);
+        remove_path(out);
+        return log_err_and_return(L"could not create the library in %ls\n", tree);
+    }
+
+    const wchar_t *dir = tree;
+    scan_opts opts;
+    memset(&opts, 0, sizeof opts);
+    opts.dirs = &dir;
+    opts.dir_count = 1;
+    opts.exts = ctx->synth.exts;
+    opts.ext_count = ctx->synth.ext_count;
+    opts.bound_upper = LLONG_MAX;
+    opts.recursive = 1;
+    opts.workers = ctx->workers;
+    file_table files;
+    dir_state state;
+    const double start = time_now();
+    int ret = scan_dirs(&opts, &files, &state);
+    const double seconds = time_now() - start;
+    // a failed scan frees the results itself
+    const char scanned = !ret;
+    if (ret || files.count != count)
+        ret = log_err_and_return(L"scan found %u of %u files\n", scanned ? files.count : 0, count);
+    else
+        add_result(ctx, L"scan", count, seconds, 0);
+
+    // flat, like the unit directories of ext
+    copy_job *jobs = (copy_job *)malloc(sizeof(copy_job) * (!ret && files.count ? files.count : 1));
+    uint32_t job_count = 0;
+    for (; !ret && job_count < files.count; ++job_count)
+    {
+        const uint32_t i = job_count;
+        swprintf(src, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls.%ls", tree, FILE_NAME(&files, i), opts.exts[files.exts[i]]);
+        swprintf(dst, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%u.%ls", out, i, opts.exts[files.exts[i]]);
+        jobs[i].src = wcscpy((wchar_t *)malloc(sizeof(wchar_t) * (wcslen(src) + 1)), src);
+        jobs[i].dst = wcscpy((wchar_t *)malloc(sizeof(wchar_t) * (wcslen(dst) + 1)), dst);
+    }
+    if (!ret)
+    {
+        copy_stats stats;
+        // the tree was just written and sits in the page cache, nothing to read ahead
+        copy_files(jobs, job_count, ctx->workers, COPY_MODE_COPY, 0, &stats);
+        if (stats.failed)
+            ret = log_err_and_return(L"could not copy %i files\n", stats.failed);
+        else
+            add_result(ctx, L"copy", count, stats.seconds, stats.bytes);
+    }
+    for (uint32_t i = 0; i < job_count; ++i)
+    {
+        remove_path(jobs[i].dst);
+        free((wchar_t *)jobs[i].src);
+        free((wchar_t *)jobs[i].dst);
+    }
+    free(jobs);
+    if (scanned)
+    {
+        free_file_table(&files);
+        free_dir_state(&state);
+    }
+
+    if (remove_synth_tree(&ctx->synth, tree, count) || remove_path(tree) || remove_path(out))
+        fwprintf(stderr, L"could not remove everything in %ls\n", ctx->dir);
+    return ret;
+}
+
+static int bench_count(bench_ctx *ctx, uint32_t count)
+{
+    file_table files;
+    if (synth_table(&ctx->synth, count, &files))
+        return log_err_and_return(L"too many files to fit in memory\n");
+
+    bench_dates(ctx, &files);
+
+    uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * (count ? count : 1));
+    double start = time_now();
+    sort_by_date_desc(order, files.dates, count, ctx->workers);
+    add_result(ctx, L"sort", count, time_now() - start, 0);
+
+    seed_rand(ctx->synth.seed);
+    start = time_now();
+    shuffle_units(order, count, ctx->unit_size);
+    add_result(ctx, L"shuffle", count, time_now() - start, 0);
+
+    int ret = bench_write(ctx, &files, order, 0);
+    if (!ret)
+        ret = bench_write(ctx, &files, order, 1);
+    if (!ret)
+        ret = bench_list(ctx, &files);
+    free(order);
+    free_file_table(&files);
+
+    if (!ret && count <= ctx->disk_max)
+        ret = bench_disk(ctx, count);
+    return ret;
+}
+
+static void print_results(const bench_ctx *ctx, char csv)
+{
+    if (csv)
+    {
+        wprintf(L"phase,count,seconds,ns_per_file,bytes\n");
+        for (int i = 0; i < ctx->result_count; ++i)
+        {
+            const bench_result *res = ctx->results + i;
+            wprintf(L"%ls,%u,%.6f,%.2f,%llu\n", res->phase, res->count, res->seconds,
+                res->count ? res->seconds * 1e9 / res->count : 0.0, (unsigned long long)res->bytes);
+        }
+        return;
+    }
+
+    const synth_opts *synth = &ctx->synth;
+    wprintf(L"{\n  \"seed\": %llu,\n  \"unit_size\": %i,\n  \"workers\": %i,\n  \"depth\": %i,\n  \"fanout\": %i,\n"
+        L"  \"name_len\": %i,\n  \"random_names\": %ls,\n  \"dates\": \"%ls\",\n  \"file_size\": %llu,\n  \"extensions\": [",
+        (unsigned long long)synth->seed, ctx->unit_size, ctx->workers, synth->depth, synth->fanout, synth->name_len,
+        synth->random_names ? L"true" : L"false", _DATE_NAMES[synth->dates], (unsigned long long)synth->file_size);
+    for (int i = 0; i < synth->ext_count; ++i)
+        wprintf(L"%ls{ \"ext\": \"%ls\", \"weight\": %u }", i ? L", " : L"", synth->exts[i], synth->ext_weights[i]);
+    wprintf(L"],\n  \"results\": [\n");
+    for (int i = 0; i < ctx->result_count; ++i)
+    {
+        const bench_result *res = ctx->results + i;
+        wprintf(L"    { \"phase\": \"%ls\", \"count\": %u, \"seconds\": %.6f, \"ns_per_file\": %.2f, \"bytes\": %llu }%ls\n",
+            res->phase, res->count, res->seconds, res->count ? res->seconds * 1e9 / res->count : 0.0,
+            (unsigned long long)res->bytes, i + 1 < ctx->result_count ? L"," : L"");
+    }
+    wprintf(L"  ]\n}\n");
+}
+
+static int parse_count(const wchar_t *str, uint32_t *count)
+{
+    wchar_t *end;
+    const unsigned long long value = wcstoull(str, &end, 10);
+    if (end == str || *end != L'\0' || !value || value > UINT32_MAX)
+        return -1;
+    *count = (uint32_t)value;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+#ifndef _WIN32
+    setlocale(LC_ALL, "");
+#endif
+    wchar_t **wargv_mem = get_wargv(&argc, argv);
+    wchar_t **wargv = wargv_mem;
+
+    int ret = -1;
+    opt_ctx *ctx = NULL;
+    bench_ctx bench;
+    memset(&bench, 0, sizeof bench);
+    uint32_t *ext_weights = NULL;
+
+    if (argc == 2 && !wcscmp(wargv[1], L"--help"))
+    {
+        wprintf(
+            L"usage: psym_bench {synth | run} [options...] <dir>\n" \
+            L"<dir>                 \tdirectory to build the library in, or to keep the temporary files of a run in\n" \
+            L"mode description:\n" \
+            L"synth                 \tbuild a synthetic library, <dir> is its root and must exist\n" \
+            L"run                   \ttime the date filter, sort, shuffle, write, parse, list, scan and copy, results go to stdout\n" \
+            L"common options:\n" \
+            L"-n <count...>         \tnumber of files, run takes several\n" \
+            L"-d <depth> , -d<depth>\tdirectory levels under the root\n" \
+            L"-f <num> , -f<num>    \tsubdirectories per directory\n" \
+            L"-w <len> , -w<len>    \tname length without the extension\n" \
+            L"-a                    \trandom names instead of IMG_ and a counter\n" \
+            L"-e <ext[:weight]...>  \textensions and how often each one comes up\n" \
+            L"-t <dist> , -t<dist>  \tdates: uniform, burst(runs of files seconds apart) or same\n" \
+            L"-z <bytes> , -z<bytes>\tfile size\n" \
+            L"-x <seed> , -x<seed>  \tlibrary seed\n" \
+            L"run options:\n" \
+            L"-s <size> , -s<size>  \tunit size\n" \
+            L"-j <num> , -j<num>    \tnumber of threads\n" \
+            L"-m <count> , -m<count>\tlargest count built on disk for scan and copy\n" \
+            L"-o <format>           \tjson or csv\n\n" \
+            L"defaults:\n" \
+            L"-n:\t10000(synth), 10000 1000000 10000000(run)\n" \
+            L"-d:\t2\n" \
+            L"-f:\t8\n" \
+            L"-w:\t12\n" \
+            L"-e:\tjpg:6 jpeg:1 png:2 heic:1\n" \
+            L"-t:\tburst\n" \
+            L"-z:\t0\n" \
+            L"-x:\t1\n" \
+            L"-s:\t%i\n" \
+            L"-j:\tnumber of processors\n" \
+            L"-m:\t%i\n" \
+            L"-o:\tjson\n", DEF_UNIT_SIZE, DEF_DISK_MAX);
+        ret = 0;
+        goto ret_point;
+    }
+    if (argc < 3 || (wcscmp(wargv[1], L"synth") && wcscmp(wargv[1], L"run")))
+    {
+        ret = log_err_and_return(L"usage: psym_bench {synth | run} [options...] <dir>\n");
+        goto ret_point;
+    }
+
+    const char run = !wcscmp(wargv[1], L"run");
+    synth_opts *synth = &bench.synth;
+    synth->exts = _DEF_EXTENSIONS;
+    synth->ext_weights = _DEF_EXT_WEIGHTS;
+    synth->ext_count = sizeof(_DEF_EXTENSIONS) / sizeof(wchar_t *);
+    synth->depth = 2;
+    synth->fanout = 8;
+    synth->name_len = 12;
+    synth->random_names = 0;
+    synth->dates = SYNTH_DATES_BURST;
+    synth->file_size = 0;
+    synth->seed = 1;
+    bench.dir = wargv[argc - 1];
+    bench.unit_size = DEF_UNIT_SIZE;
+    bench.workers = cpu_count();
+    bench.disk_max = DEF_DISK_MAX;
+    const wchar_t **counts = _DEF_COUNTS;
+    int count_count = run ? sizeof(_DEF_COUNTS) / sizeof(wchar_t *) : 1;
+    char csv = 0;
+
+    argc -= 3;
+    wargv += 2;
+    int opt_counts[13] = { OPT_ARGS_NON_ZERO, 1, 1, 1, OPT_FLAG, OPT_ARGS_NON_ZERO, 1, 1, 1, 1, 1, 1, 1 };
+    ctx = parse_options(argc, wargv, L"ndfwaetzxsjmo", opt_counts, 13, NULL);
+    if (!ctx && argc)
+        goto ret_point;
+    if (ctx)
+    {
+        opt_node *opt = find_opt(ctx, L'n');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            counts = (const wchar_t **)opt->args;
+            count_count = run ? opt->count : 1;
+        }
+        opt = find_opt(ctx, L'd');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            synth->depth = wcstol(opt->args[0], NULL, 10);
+            if (synth->depth < 0 || synth->depth > 8)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -d\n");
+                goto ret_point;
+            }
+        }
+        opt = find_opt(ctx, L'f');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            synth->fanout = wcstol(opt->args[0], NULL, 10);
+            if (synth->fanout <= 0 || synth->fanout > 64)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -f\n");
+                goto ret_point;
+            }
+        }
+        opt = find_opt(ctx, L'w');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            synth->name_len = wcstol(opt->args[0], NULL, 10);
+            if (synth->name_len <= 0 || synth->name_len > 200)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -w\n");
+                goto ret_point;
+            }
+        }
+        opt = find_opt(ctx, L'a');
+        if (OPT_FLAG_EXISTS(*opt))
+            synth->random_names = 1;
+        opt = find_opt(ctx, L'e');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            if (opt->count > SCAN_LIST_MAX)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -e\n");
+                goto ret_point;
+            }
+            ext_weights = (uint32_t *)malloc(sizeof(uint32_t) * opt->count);
+            for (int i = 0; i < opt->count; ++i)
+            {
+                // the weight is cut off the argument in place
+                wchar_t *weight = wcschr(opt->args[i], L':');
+                ext_weights[i] = 1;
+                if (weight)
+                {
+                    *weight = L'\0';
+                    ext_weights[i] = wcstoul(weight + 1, NULL, 10);
+                }
+                if (!ext_weights[i] || !*opt->args[i])
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -e\n");
+                    goto ret_point;
+                }
+            }
+            synth->exts = (const wchar_t **)opt->args;
+            synth->ext_weights = ext_weights;
+            synth->ext_count = opt->count;
+        }
+        opt = find_opt(ctx, L't');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            synth->dates = -1;
+            for (int i = 0; i < (int)(sizeof(_DATE_NAMES) / sizeof(wchar_t *)); ++i)
+                if (!wcscmp(opt->args[0], _DATE_NAMES[i]))
+                    synth->dates = i;
+            if (synth->dates < 0)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -t\n");
+                goto ret_point;
+            }
+        }
+        opt = find_opt(ctx, L'z');
+        if (OPT_ARGS_EXISTS(*opt))
+            synth->file_size = wcstoull(opt->args[0], NULL, 10);
+        opt = find_opt(ctx, L'x');
+        if (OPT_ARGS_EXISTS(*opt))
+            synth->seed = wcstoull(opt->args[0], NULL, 10);
+        opt = find_opt(ctx, L's');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            const long unit_size = wcstol(opt->args[0], NULL, 10);
+            if (unit_size <= 0 || unit_size > PSYM_UNIT_SIZE_MAX)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -s\n");
+                goto ret_point;
+            }
+            bench.unit_size = unit_size;
+        }
+        opt = find_opt(ctx, L'j');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            bench.workers = wcstol(opt->args[0], NULL, 10);
+            if (bench.workers <= 0 || bench.workers > 1024)
+            {
+                fwprintf(stderr, L"invalid/out of range value: -j\n");
+                goto ret_point;
+            }
+        }
+        opt = find_opt(ctx, L'm');
+        if (OPT_ARGS_EXISTS(*opt) && parse_count(opt->args[0], &bench.disk_max))
+        {
+            fwprintf(stderr, L"invalid/out of range value: -m\n");
+            goto ret_point;
+        }
+        opt = find_opt(ctx, L'o');
+        if (OPT_ARGS_EXISTS(*opt))
+        {
+            if (wcscmp(opt->args[0], L"json") && wcscmp(opt->args[0], L"csv"))
+            {
+                fwprintf(stderr, L"invalid/out of range value: -o\n");
+                goto ret_point;
+            }
+            csv = !wcscmp(opt->args[0], L"csv");
+        }
+    }
+
+    if (!is_dir(bench.dir))
+    {
+        ret = log_err_and_return(L"could not find directory %ls\n", bench.dir);
+        goto ret_point;
+    }
+    ret = 0;
+    for (int i = 0; i < count_count && !ret; ++i)
+    {
+        uint32_t count;
+        if (parse_count(counts[i], &count))
+            ret = log_err_and_return(L"invalid/out of range value: -n\n");
+        else if (!run)
+            ret = synth_tree(synth, bench.dir, count) ?
+                log_err_and_return(L"could not create the library in %ls\n", bench.dir) : 0;
+        else
+            ret = bench_count(&bench, count);
+    }
+    if (run && !ret)
+        print_results(&bench, csv);
+
+ret_point:
+    free(bench.results);
+    free(ext_weights);
+    if (ctx)
+        delete_opt_ctx(ctx);
+    free_wargv(wargv_mem);
+    return ret;
+}
@@ -0,0 +1,180 @@
+#include "synth.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// 2015-01-01 and ten years on
+#define DATE_FIRST 1420070400
+#define DATE_SPAN 315360000
+#define BURST_FILES 32
+#define BURST_STEP 3
+#define ZERO_BUF_SIZE (1 << 16)
+
+// one independent draw per field of a file
+static uint64_t draw(const synth_opts *opts, uint64_t index, int field)
+{
+    return mix_u64(opts->seed ^ mix_u64(index * 4 + field));
+}
+
+static uint64_t node_count(const synth_opts *opts)
+{
+    uint64_t count = 0, level = 1;
+    for (int i = 0; i <= opts->depth; ++i, level *= opts->fanout)
+        count += level;
+    return count;
+}
+
+// levels are numbered from the root, nodes of a level in order; the parent of a node always comes before it
+static int node_path(const synth_opts *opts, uint64_t node, wchar_t *dst)
+{
+    int level = 0;
+    uint64_t level_size = 1;
+    while (node >= level_size)
+    {
+        node -= level_size;
+        level_size *= opts->fanout;
+        ++level;
+    }
+    int len = 0;
+    for (int i = 0; i < level; ++i)
+    {
+        level_size /= opts->fanout;
+        len += swprintf(dst + len, 16, L"d%llu" PSYM_SEP, (unsigned long long)(node / level_size % opts->fanout));
+    }
+    dst[len] = L'\0';
+    return len;
+}
+
+int synth_file(const synth_opts *opts, uint64_t index, wchar_t *dst, uint16_t *ext, time_t *date)
+{
+    int len = node_path(opts, index % node_count(opts), dst);
+    if (opts->random_names)
+    {
+        static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        uint64_t bits = draw(opts, index, 0);
+        for (int i = 0; i < opts->name_len; ++i)
+        {
+            if (i && !(i % 10))
+                bits = mix_u64(bits);
+            dst[len++] = chars[bits % 36];
+            bits /= 36;
+        }
+        dst[len] = L'\0';
+    }
+    else
+    {
+        const int width = opts->name_len > 4 ? opts->name_len - 4 : 1;
+        len += swprintf(dst + len, width + 32, L"IMG_%0*llu", width, (unsigned long long)index);
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < opts->ext_count; ++i)
+        total += opts->ext_weights[i];
+    uint64_t pick = total ? draw(opts, index, 1) % total : 0;
+    for (*ext = 0; *ext + 1 < opts->ext_count && pick >= opts->ext_weights[*ext]; ++*ext)
+        pick -= opts->ext_weights[*ext];
+
+    switch (opts->dates)
+    {
+    case SYNTH_DATES_UNIFORM:
+        *date = DATE_FIRST + draw(opts, index, 2) % DATE_SPAN;
+        break;
+    case SYNTH_DATES_BURST:
+        *date = DATE_FIRST + draw(opts, index / BURST_FILES, 3) % DATE_SPAN + index % BURST_FILES * BURST_STEP;
+        break;
+    default:
+        *date = DATE_FIRST;
+        break;
+    }
+    return len;
+}
+
+int synth_table(const synth_opts *opts, uint32_t count, file_table *files)
+{
+    wchar_t *name = (wchar_t *)malloc(sizeof(wchar_t) * (opts->depth * 12 + opts->name_len + 32));
+    int ret = 0;
+    init_file_table(files);
+    for (uint32_t i = 0; i < count && !ret; ++i)
+    {
+        uint16_t ext;
+        time_t date;
+        const int len = synth_file(opts, i, name, &ext, &date);
+        wchar_t *dst = add_file(files, date, 0, ext, len);
+        if (dst)
+            memcpy(dst, name, sizeof(wchar_t) * len);
+        else
+            ret = -1;
+    }
+    free(name);
+    if (ret)
+        free_file_table(files);
+    return ret;
+}
+
+static int synth_path(const synth_opts *opts, const wchar_t *root, uint64_t index, wchar_t *dst, time_t *date)
+{
+    wchar_t *name = (wchar_t *)malloc(sizeof(wchar_t) * (opts->depth * 12 + opts->name_len + 32));
+    uint16_t ext;
+    synth_file(opts, index, name, &ext, date);
+    const int len = swprintf(dst, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls.%ls", root, name, opts->exts[ext]);
+    free(name);
+    return len < 0 ? -1 : 0;
+}
+
+int synth_tree(const synth_opts *opts, const wchar_t *root, uint32_t count)
+{
+    wchar_t path[PSYM_MAX_PATH], node[PSYM_MAX_PATH];
+    const uint64_t nodes = node_count(opts) < count ? node_count(opts) : count;
+    for (uint64_t i = 1; i < nodes; ++i)
+    {
+        node_path(opts, i, node);
+        swprintf(path, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls", root, node);
+        if (create_dir(path) < 0)
+            return -1;
+    }
+
+    uint8_t *zeros = (uint8_t *)calloc(ZERO_BUF_SIZE, 1);
+    int ret = 0;
+    for (uint32_t i = 0; i < count && !ret; ++i)
+    {
+        time_t date;
+        FILE *file = NULL;
+        if (synth_path(opts, root, i, path, &date) || !(file = file_open(path, L"wb")))
+        {
+            ret = -1;
+            break;
+        }
+        for (uint64_t left = opts->file_size; left && !ret;)
+        {
+            const size_t size = left < ZERO_BUF_SIZE ? (size_t)left : ZERO_BUF_SIZE;
+            ret = fwrite(zeros, 1, size, file) == size ? 0 : -1;
+            left -= size;
+        }
+        if (fclose(file) || set_modify_time(path, date))
+            ret = -1;
+    }
+    free(zeros);
+    return ret;
+}
+
+int remove_synth_tree(const synth_opts *opts, const wchar_t *root, uint32_t count)
+{
+    wchar_t path[PSYM_MAX_PATH], node[PSYM_MAX_PATH];
+    int ret = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        time_t date;
+        if (synth_path(opts, root, i, path, &date) || remove_path(path))
+            ret = -1;
+    }
+    // children first
+    for (uint64_t i = node_count(opts) < count ? node_count(opts) : count; i-- > 1;)
+    {
+        node_path(opts, i, node);
+        swprintf(path, PSYM_MAX_PATH, L"%ls" PSYM_SEP L"%ls", root, node);
+        if (remove_path(path))
+            ret = -1;
+    }
+    return ret;
+}
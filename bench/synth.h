@@ -0,0 +1,39 @@
+#ifndef PSYM_SYNTH
+#define PSYM_SYNTH
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "file_table.h"
+
+#define SYNTH_DATES_UNIFORM 0
+#define SYNTH_DATES_BURST 1 // camera sessions, runs of files a few seconds apart
+#define SYNTH_DATES_SAME 2 // every file has the same date, all ties
+
+// synthetic library, every file is a function of the seed and its index so any scale is reproducible
+// without generating the ones before it
+typedef struct
+{
+    const wchar_t **exts;
+    const uint32_t *ext_weights;
+    uint16_t ext_count;
+    int depth; // directory levels under the root, files are spread over every level
+    int fanout; // subdirectories per directory
+    int name_len;
+    char random_names; // otherwise IMG_ and a counter
+    int dates; // one of SYNTH_DATES_*
+    uint64_t file_size;
+    uint64_t seed;
+} synth_opts;
+
+// name relative to the root without the extension, dst must have room for depth * 12 + name_len + 1 characters
+int synth_file(const synth_opts *opts, uint64_t index, wchar_t *dst, uint16_t *ext, time_t *date);
+// what a recursive scan of the tree would find, in index order
+int synth_table(const synth_opts *opts, uint32_t count, file_table *files);
+// root must exist, every file is file_size bytes of zeros with the synthetic modification date
+int synth_tree(const synth_opts *opts, const wchar_t *root, uint32_t count);
+// removes what synth_tree made, root stays
+int remove_synth_tree(const synth_opts *opts, const wchar_t *root, uint32_t count);
+
+#endif
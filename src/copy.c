@@ -0,0 +1,176 @@
+#include "copy.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+// the sources of the jobs ahead of the copies, a batch of depth jobs at a time
+typedef struct
+{
+    const copy_job *jobs;
+    int count;
+    int depth;
+    thread_pool *pool; // one worker
+    volatile int64_t next_batch; // every task reads the next batch, whatever order the pool runs them in
+    volatile int64_t prefetched;
+} copy_ahead;
+
+typedef struct
+{
+    const wchar_t *src;
+    int dir_len;
+    ahead_file file;
+} ahead_item;
+
+typedef struct
+{
+    copy_job *jobs;
+    int count;
+    int mode;
+    copy_ahead *ahead; // NULL without prefetch
+    volatile int64_t next; // jobs are taken in order, so the reads ahead stay ahead
+} copy_ctx;
+
+// by source directory, then by the key that follows the layout on disk
+static int compare_ahead(const void *a, const void *b)
+{
+    const ahead_item *x = (const ahead_item *)a, *y = (const ahead_item *)b;
+    const int cmp = wcsncmp(x->src, y->src, x->dir_len < y->dir_len ? x->dir_len : y->dir_len);
+    if (cmp)
+        return cmp;
+    if (x->dir_len != y->dir_len)
+        return x->dir_len < y->dir_len ? -1 : 1;
+    return x->file.key < y->file.key ? -1 : x->file.key > y->file.key;
+}
+
+// every source of the batch is opened for its key first, then they are read ahead in disk order
+static void ahead_task(void *arg, int worker)
+{
+    (void)worker;
+    copy_ahead *ahead = (copy_ahead *)arg;
+    const int first = (int)(interlocked_add(&ahead->next_batch, 1) - 1) * ahead->depth;
+    const int end = first + ahead->depth < ahead->count ? first + ahead->depth : ahead->count;
+    ahead_item *items = (ahead_item *)malloc(sizeof(ahead_item) * ahead->depth);
+    int count = 0;
+    for (int i = first; i < end; ++i)
+    {
+        ahead_item *item = items + count;
+        item->src = ahead->jobs[i].src;
+        const wchar_t *sep = wcsrchr(item->src, PSYM_SEP_CHAR);
+        item->dir_len = sep ? (int)(sep - item->src) : 0;
+        count += !open_ahead_file(&item->file, item->src);
+    }
+    qsort(items, count, sizeof(ahead_item), compare_ahead);
+    for (int i = 0; i < count; ++i)
+        read_ahead_file(&items[i].file);
+    interlocked_add(&ahead->prefetched, count);
+    free(items);
+}
+
+static void copy_job_run(copy_job *job, int mode, copy_ahead *ahead)
+{
+    // the first copy of a batch asks for the next one, read while this one is written
+    const int index = ahead ? (int)(job - ahead->jobs) : 0;
+    if (ahead && !(index % ahead->depth) && index + ahead->depth < ahead->count)
+        pool_submit(ahead->pool, -1, ahead_task, ahead);
+
+    job->size = 0;
+    job->fell_back = 0;
+    job->cached = 0;
+    if (mode != COPY_MODE_COPY)
+    {
+        const int ret = link_file(job->src, job->dst, mode);
+        job->failed = ret < 0;
+        if (ret <= 0)
+            return;
+        job->fell_back = 1;
+    }
+    job->failed = copy_file(job->src, job->dst, &job->size, &job->cached) != 0;
+}
+
+static void copy_task(void *arg, int worker)
+{
+    (void)worker;
+    copy_ctx *ctx = (copy_ctx *)arg;
+    int64_t i;
+    while ((i = interlocked_add(&ctx->next, 1) - 1) < ctx->count)
+        copy_job_run(ctx->jobs + i, ctx->mode, ctx->ahead);
+}
+
+void copy_files(copy_job *jobs, int count, int workers, int mode, int prefetch, copy_stats *stats)
+{
+    const double start = time_now();
+    if (workers > count)
+        workers = count;
+
+    // links don't read the sources
+    copy_ahead ahead_state;
+    copy_ahead *ahead = NULL;
+    if (prefetch > 0 && mode == COPY_MODE_COPY && count > 0)
+    {
+        ahead = &ahead_state;
+        ahead->jobs = jobs;
+        ahead->count = count;
+        ahead->depth = prefetch;
+        ahead->pool = create_thread_pool(1);
+        ahead->next_batch = 0;
+        ahead->prefetched = 0;
+        pool_submit(ahead->pool, -1, ahead_task, ahead);
+    }
+
+    copy_ctx ctx = { jobs, count, mode, ahead, 0 };
+    if (workers > 1)
+    {
+        // the copies block in the kernel, so every worker is one copy in flight
+        thread_pool *pool = create_thread_pool(workers);
+        for (int i = 0; i < workers; ++i)
+            pool_submit(pool, -1, copy_task, &ctx);
+        pool_wait(pool);
+        delete_thread_pool(pool);
+    }
+    else
+        copy_task(&ctx, -1);
+
+    stats->prefetched = 0;
+    if (ahead)
+    {
+        // reads that lost the race with their copies are still waited for
+        pool_wait(ahead->pool);
+        delete_thread_pool(ahead->pool);
+        stats->prefetched = (int)ahead->prefetched;
+    }
+
+    stats->bytes = 0;
+    stats->copied = 0;
+    stats->linked = 0;
+    stats->fell_back = 0;
+    stats->failed = 0;
+    stats->cached = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        stats->fell_back += jobs[i].fell_back;
+        stats->cached += jobs[i].cached;
+        if (jobs[i].failed)
+            ++stats->failed;
+        else if (mode == COPY_MODE_COPY || jobs[i].fell_back)
+        {
+            ++stats->copied;
+            stats->bytes += jobs[i].size;
+        }
+        else
+            ++stats->linked;
+    }
+    stats->seconds = time_now() - start;
+
+    if (stats_enabled)
+    {
+        stat_end(STAT_COPY, start);
+        stat_add(STAT_FILES_COPIED, stats->copied + stats->linked);
+        stat_add(STAT_FILES_FAILED, stats->failed);
+        stat_add(STAT_FILES_PREFETCHED, stats->prefetched);
+        stat_add(STAT_FILES_CACHED, stats->cached);
+        stat_add(STAT_BYTES_READ, stats->bytes);
+        stat_add(STAT_BYTES_WRITTEN, stats->bytes);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef PSYM_COPY
+#define PSYM_COPY
+
+#include <stdint.h>
+#include <wchar.h>
+
+#define COPY_MODE_COPY -1 // otherwise one of LINK_*
+
+typedef struct
+{
+    const wchar_t *src;
+    const wchar_t *dst;
+    uint64_t size; // bytes copied, 0 when linked
+    char failed;
+    char fell_back;
+    char cached; // the source was in the page cache when its copy started, only checked on linux
+} copy_job;
+
+typedef struct
+{
+    uint64_t bytes;
+    int copied;
+    int linked;
+    int fell_back;
+    int failed;
+    int cached;
+    int prefetched; // sources read ahead
+    double seconds;
+} copy_stats;
+
+// sources read ahead of the copies by default
+#define COPY_PREFETCH_DEF 32
+
+// keeps up to workers copies in flight, destination directories must exist already;
+// link modes fall back to a copy per file where the filesystem refuses them,
+// failed jobs are flagged for the caller to report in order;
+// copies read the sources of the next prefetch jobs ahead on a thread of their own, a batch of prefetch files at a
+// time ordered by directory and inode, 0 turns it off
+void copy_files(copy_job *jobs, int count, int workers, int mode, int prefetch, copy_stats *stats);
+
+#endif
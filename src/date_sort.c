@@ -0,0 +1,177 @@
+#include "date_sort.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// below that one thread sorts faster than the pool starts
+#define PARALLEL_MIN_COUNT (1 << 16)
+
+typedef struct
+{
+    uint64_t key;
+    uint32_t ind;
+} sort_item;
+
+typedef struct
+{
+    const sort_item *src;
+    sort_item *dst;
+    uint32_t count;
+    int chunks;
+    int shift;
+    uint32_t (*hist)[256]; // per chunk, counts first, write positions after the prefix sum
+} sort_pass;
+
+typedef struct
+{
+    sort_pass *pass;
+    int chunk;
+} sort_task;
+
+static uint32_t chunk_bound(const sort_pass *pass, int chunk)
+{
+    return (uint64_t)pass->count * chunk / pass->chunks;
+}
+
+static void count_task(void *arg, int worker)
+{
+    (void)worker;
+    const sort_task *task = (const sort_task *)arg;
+    const sort_pass *pass = task->pass;
+    uint32_t *hist = pass->hist[task->chunk];
+    memset(hist, 0, sizeof(uint32_t) * 256);
+    for (uint32_t i = chunk_bound(pass, task->chunk); i < chunk_bound(pass, task->chunk + 1); ++i)
+        ++hist[(pass->src[i].key >> pass->shift) & 0xFF];
+}
+
+static void scatter_task(void *arg, int worker)
+{
+    (void)worker;
+    const sort_task *task = (const sort_task *)arg;
+    const sort_pass *pass = task->pass;
+    uint32_t *pos = pass->hist[task->chunk];
+    for (uint32_t i = chunk_bound(pass, task->chunk); i < chunk_bound(pass, task->chunk + 1); ++i)
+        pass->dst[pos[(pass->src[i].key >> pass->shift) & 0xFF]++] = pass->src[i];
+}
+
+static void run_tasks(thread_pool *pool, pool_task_fn fn, sort_task *tasks, int count)
+{
+    if (!pool)
+    {
+        fn(tasks, 0);
+        return;
+    }
+    for (int i = 0; i < count; ++i)
+        pool_submit(pool, -1, fn, tasks + i);
+    pool_wait(pool);
+}
+
+void sort_by_date_desc(uint32_t *order, const time_t *dates, uint32_t count, int workers)
+{
+    if (!count)
+        return;
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = i;
+
+    // an already ordered scan is common enough to check for, the identity is the stable result
+    uint32_t sorted = 1;
+    while (sorted < count && dates[sorted - 1] >= dates[sorted])
+        ++sorted;
+    if (sorted == count)
+        return;
+
+    // newest first is ascending in max - date, signed dates are fine since only the difference is kept
+    time_t max = dates[0];
+    for (uint32_t i = 1; i < count; ++i)
+        if (dates[i] > max)
+            max = dates[i];
+    sort_item *items = (sort_item *)malloc(sizeof(sort_item) * count);
+    sort_item *tmp = (sort_item *)malloc(sizeof(sort_item) * count);
+    uint64_t diff = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        items[i].key = (uint64_t)max - (uint64_t)dates[i];
+        items[i].ind = i;
+        diff |= items[i].key ^ items[0].key;
+    }
+
+    const int chunks = count >= PARALLEL_MIN_COUNT && workers > 1 ? workers : 1;
+    thread_pool *pool = chunks > 1 ? create_thread_pool(chunks) : NULL;
+    sort_pass pass;
+    pass.count = count;
+    pass.chunks = chunks;
+    pass.hist = (uint32_t (*)[256])malloc(sizeof(uint32_t) * 256 * chunks);
+    sort_task *tasks = (sort_task *)malloc(sizeof(sort_task) * chunks);
+    for (int i = 0; i < chunks; ++i)
+    {
+        tasks[i].pass = &pass;
+        tasks[i].chunk = i;
+    }
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        if (!((diff >> shift) & 0xFF))
+            continue;
+        pass.src = items;
+        pass.dst = tmp;
+        pass.shift = shift;
+        run_tasks(pool, count_task, tasks, chunks);
+
+        // chunks of a digit are placed in chunk order, which keeps the sort stable
+        uint32_t pos = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            for (int i = 0; i < chunks; ++i)
+            {
+                const uint32_t n = pass.hist[i][digit];
+                pass.hist[i][digit] = pos;
+                pos += n;
+            }
+        }
+        run_tasks(pool, scatter_task, tasks, chunks);
+
+        sort_item *swap = items;
+        items = tmp;
+        tmp = swap;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = items[i].ind;
+
+    if (pool)
+        delete_thread_pool(pool);
+    free(tasks);
+    free(pass.hist);
+    free(tmp);
+    free(items);
+}
+
+void shuffle_units(uint32_t *order, int file_count, uint32_t unit_size)
+{
+    const int count = file_count / unit_size - 1; // round down, appendix is left in place
+    const int unit_byte_size = sizeof(uint32_t) * unit_size;
+    uint32_t *tmp = (uint32_t *)malloc(unit_byte_size);
+    for (int i = 0; i < count; ++i)
+    {
+        const int ind = rand_range(i + 1, count) * unit_size;
+        memcpy(tmp, order + ind, unit_byte_size);
+        memcpy(order + ind, order + i * unit_size, unit_byte_size);
+        memcpy(order + i * unit_size, tmp, unit_byte_size);
+    }
+    free(tmp);
+}
+
+void order_units(uint32_t *order, const time_t *dates, int file_count, uint32_t unit_size, char shuffle, int workers)
+{
+    double start = stat_begin();
+    sort_by_date_desc(order, dates, file_count, workers);
+    stat_end(STAT_SORT, start);
+    if (!shuffle)
+        return;
+    start = stat_begin();
+    shuffle_units(order, file_count, unit_size);
+    stat_end(STAT_SHUFFLE, start);
+}
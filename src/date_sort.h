@@ -0,0 +1,15 @@
+#ifndef PSYM_DATE_SORT
+#define PSYM_DATE_SORT
+
+#include <stdint.h>
+#include <time.h>
+
+// order gets the indices of dates newest first, equal dates keep their index order;
+// LSD radix over (date, index) pairs, bytes every date shares are skipped
+void sort_by_date_desc(uint32_t *order, const time_t *dates, uint32_t count, int workers);
+// swaps whole units of unit_size indices from the global rand, the appendix is left in place
+void shuffle_units(uint32_t *order, int file_count, uint32_t unit_size);
+// the two above, the shuffle is optional
+void order_units(uint32_t *order, const time_t *dates, int file_count, uint32_t unit_size, char shuffle, int workers);
+
+#endif
@@ -0,0 +1,274 @@
+#include "dedup.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+// files per stat task, hashing tasks are cut by bytes as well
+#define STAT_TASK_FILES 1024
+#define HASH_TASK_FILES 64
+#define HASH_TASK_BYTES (64ull << 20)
+
+typedef struct
+{
+    int64_t size; // -1 when the file is gone or can't be read
+    uint64_t hash;
+    time_t date;
+    uint32_t ind;
+    char copy; // the same bytes as an earlier file of its run
+    char fixed; // one of the first fixed files, it stays whatever it is a copy of
+} dedup_item;
+
+typedef struct
+{
+    const scan_opts *opts;
+    const file_table *files;
+    dedup_item *items;
+    uint32_t first;
+    uint32_t count;
+} dedup_task;
+
+// the source path of a file, buf grows to fit
+static const wchar_t *file_path(const scan_opts *opts, const file_table *files, uint32_t i, wchar_t **buf, size_t *cap)
+{
+    const wchar_t *dir = opts->dirs[files->dirs[i]], *name = FILE_NAME(files, i), *ext = opts->exts[files->exts[i]];
+    const size_t len = wcslen(dir) + wcslen(name) + wcslen(ext) + 3;
+    if (len > *cap)
+    {
+        *cap = len * 2;
+        *buf = (wchar_t *)realloc(*buf, sizeof(wchar_t) * *cap);
+    }
+    swprintf(*buf, len, L"%ls" PSYM_SEP L"%ls.%ls", dir, name, ext);
+    return *buf;
+}
+
+static void stat_task(void *arg, int worker)
+{
+    (void)worker;
+    const dedup_task *task = (const dedup_task *)arg;
+    wchar_t *path = NULL;
+    size_t cap = 0;
+    for (uint32_t i = task->first; i < task->first + task->count; ++i)
+    {
+        dedup_item *item = task->items + i;
+        item->size = path_size(file_path(task->opts, task->files, item->ind, &path, &cap));
+    }
+    STAT_ADD(STAT_SYSCALLS, task->count);
+    free(path);
+}
+
+// items are the candidates here, the mapping reads the file with the page cache's own readahead
+static void hash_task(void *arg, int worker)
+{
+    (void)worker;
+    const dedup_task *task = (const dedup_task *)arg;
+    wchar_t *path = NULL;
+    size_t cap = 0;
+    for (uint32_t i = task->first; i < task->first + task->count; ++i)
+    {
+        dedup_item *item = task->items + i;
+        file_map map;
+        if (map_file(&map, file_path(task->opts, task->files, item->ind, &path, &cap), 0))
+        {
+            item->size = -1;
+            continue;
+        }
+        // a file that changed since the scan is left alone
+        if ((int64_t)map.size != item->size)
+            item->size = -1;
+        else
+            item->hash = XXH3_64bits(map.data, map.size);
+        STAT_ADD(STAT_SYSCALLS, 4); // open, fstat, mmap, munmap
+        STAT_ADD(STAT_BYTES_READ, map.size);
+        unmap_file(&map);
+    }
+    free(path);
+}
+
+// items are a run of equal size and hash in the order to keep, every file is compared byte for byte against the ones
+// kept before it, so a hash collision never takes a file out; a run with more than one content is all but unheard of
+static void compare_task(void *arg, int worker)
+{
+    (void)worker;
+    const dedup_task *task = (const dedup_task *)arg;
+    wchar_t *path = NULL;
+    size_t cap = 0;
+    file_map *kept = (file_map *)malloc(sizeof(file_map) * task->count);
+    uint32_t kept_count = 0;
+    for (uint32_t i = task->first; i < task->first + task->count; ++i)
+    {
+        dedup_item *item = task->items + i;
+        file_map map;
+        if (map_file(&map, file_path(task->opts, task->files, item->ind, &path, &cap), 0))
+            continue;
+        STAT_ADD(STAT_SYSCALLS, 4);
+        STAT_ADD(STAT_BYTES_READ, map.size);
+        if ((int64_t)map.size != item->size)
+        {
+            unmap_file(&map);
+            continue;
+        }
+        for (uint32_t j = 0; j < kept_count && !item->copy; ++j)
+            item->copy = !memcmp(kept[j].data, map.data, map.size);
+        if (item->copy)
+            unmap_file(&map);
+        else
+            kept[kept_count++] = map;
+    }
+    for (uint32_t i = 0; i < kept_count; ++i)
+        unmap_file(kept + i);
+    free(kept);
+    free(path);
+}
+
+static int compare_size(const void *a, const void *b)
+{
+    const dedup_item *x = (const dedup_item *)a, *y = (const dedup_item *)b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return x->ind < y->ind ? -1 : x->ind > y->ind;
+}
+
+// equal contents next to each other, the one to keep first: fixed files, then the oldest
+static int compare_content(const void *a, const void *b)
+{
+    const dedup_item *x = (const dedup_item *)a, *y = (const dedup_item *)b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->fixed != y->fixed)
+        return x->fixed ? -1 : 1;
+    if (x->date != y->date)
+        return x->date < y->date ? -1 : 1;
+    return x->ind < y->ind ? -1 : x->ind > y->ind;
+}
+
+static void run_tasks(thread_pool *pool, pool_task_fn fn, dedup_task *tasks, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (pool)
+            pool_submit(pool, -1, fn, tasks + i);
+        else
+            fn(tasks + i, -1);
+    }
+    if (pool)
+        pool_wait(pool);
+}
+
+void dedup_files(const scan_opts *opts, file_table *files, uint32_t fixed, dedup_result *result)
+{
+    memset(result, 0, sizeof(dedup_result));
+    const uint32_t count = files->count;
+    if (count < 2)
+        return;
+
+    const double start = stat_begin();
+    dedup_item *items = (dedup_item *)malloc(sizeof(dedup_item) * count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        items[i].size = -1;
+        items[i].hash = 0;
+        items[i].date = files->dates[i];
+        items[i].ind = i;
+        items[i].copy = 0;
+        items[i].fixed = i < fixed;
+    }
+    thread_pool *pool = opts->workers > 1 ? create_thread_pool(opts->workers) : NULL;
+
+    // sizes come from the scan when it kept them, otherwise they are looked up again
+    int task_count = files->keep_sizes ? 0 : (count + STAT_TASK_FILES - 1) / STAT_TASK_FILES;
+    dedup_task *tasks = (dedup_task *)malloc(sizeof(dedup_task) * (task_count + 1));
+    for (uint32_t i = 0; i < count && files->keep_sizes; ++i)
+        items[i].size = (int64_t)files->sizes[i];
+    for (int i = 0; i < task_count; ++i)
+    {
+        const uint32_t first = (uint32_t)i * STAT_TASK_FILES;
+        dedup_task task = { opts, files, items, first, count - first < STAT_TASK_FILES ? count - first : STAT_TASK_FILES };
+        tasks[i] = task;
+    }
+    run_tasks(pool, stat_task, tasks, task_count);
+    free(tasks);
+
+    // a size nobody else has is unique content, only the rest is read; empty files are equal without reading them;
+    // a size only fixed files have has nothing to remove
+    qsort(items, count, sizeof(dedup_item), compare_size);
+    uint32_t candidates = 0, first_hashed = 0;
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t end = i + 1;
+        char loose = !items[i].fixed;
+        for (; end < count && items[end].size == items[i].size; ++end)
+            loose |= !items[end].fixed;
+        if (items[i].size >= 0 && end - i > 1 && loose)
+            for (; i < end; ++i)
+                items[candidates++] = items[i];
+        i = end;
+    }
+    while (first_hashed < candidates && !items[first_hashed].size)
+        ++first_hashed;
+
+    // a task is a few files or one big one
+    task_count = 0;
+    tasks = (dedup_task *)malloc(sizeof(dedup_task) * (candidates - first_hashed + 1));
+    for (uint32_t i = first_hashed; i < candidates;)
+    {
+        uint32_t end = i;
+        uint64_t bytes = 0;
+        while (end < candidates && end - i < HASH_TASK_FILES && bytes < HASH_TASK_BYTES)
+            bytes += items[end++].size;
+        dedup_task task = { opts, files, items, i, end - i };
+        tasks[task_count++] = task;
+        result->hashed += end - i;
+        result->hashed_bytes += bytes;
+        i = end;
+    }
+    run_tasks(pool, hash_task, tasks, task_count);
+
+    // runs of equal size and hash are compared, empty files are equal as they are
+    qsort(items, candidates, sizeof(dedup_item), compare_content);
+    task_count = 0;
+    for (uint32_t i = 0; i < candidates;)
+    {
+        uint32_t end = i + 1;
+        while (end < candidates && items[end].size == items[i].size && items[end].hash == items[i].hash)
+            ++end;
+        const char loose = !items[end - 1].fixed; // fixed files come first
+        if (loose && items[i].size > 0 && end - i > 1)
+        {
+            dedup_task task = { opts, files, items, i, end - i };
+            tasks[task_count++] = task;
+            result->compared_bytes += (uint64_t)items[i].size * (end - i);
+        }
+        else if (loose && !items[i].size)
+            for (uint32_t j = i + 1; j < end; ++j)
+                items[j].copy = 1;
+        i = end;
+    }
+    run_tasks(pool, compare_task, tasks, task_count);
+    if (pool)
+        delete_thread_pool(pool);
+
+    char *keep = (char *)malloc(count);
+    memset(keep, 1, count);
+    for (uint32_t i = 0; i < candidates; ++i)
+    {
+        if (!items[i].copy || items[i].fixed)
+            continue;
+        keep[items[i].ind] = 0;
+        ++result->removed;
+        result->removed_bytes += items[i].size;
+    }
+    if (result->removed)
+        filter_file_table(files, keep);
+    free(keep);
+    free(tasks);
+    free(items);
+    stat_end(STAT_DEDUP, start);
+}
@@ -0,0 +1,25 @@
+#ifndef PSYM_DEDUP
+#define PSYM_DEDUP
+
+#include <stdint.h>
+
+#include "file_table.h"
+#include "scan.h"
+
+typedef struct
+{
+    uint32_t hashed; // files that share their size with another one, the only ones read
+    uint64_t hashed_bytes;
+    uint64_t compared_bytes; // copies of equal hash read again
+    uint32_t removed;
+    uint64_t removed_bytes;
+} dedup_result;
+
+// keeps one file per content: files are grouped by size(the table's own with keep_sizes, looked up otherwise) and only
+// the groups are hashed, whole files with XXH3 on opts->workers threads, and files of equal hash are compared byte for
+// byte before one goes; the oldest copy stays(the first in table order between equal dates), the table keeps its
+// order and files that can't be read are kept as they are; the first fixed files are already in the reference, they
+// always stay and win over the copies after them
+void dedup_files(const scan_opts *opts, file_table *files, uint32_t fixed, dedup_result *result);
+
+#endif
@@ -0,0 +1,120 @@
+#include "dir_state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void init_dir_state(dir_state *state)
+{
+    memset(state, 0, sizeof(dir_state));
+}
+
+void free_dir_state(dir_state *state)
+{
+    free(state->stamps);
+    free(state->paths);
+    free(state->roots);
+    free(state->arena);
+    init_dir_state(state);
+}
+
+int add_dir_state(dir_state *state, uint16_t root, const wchar_t *path, int len, uint64_t stamp)
+{
+    if (state->count == state->cap)
+    {
+        const uint32_t cap = state->cap ? state->cap * 2 : 64;
+        uint64_t *stamps = (uint64_t *)realloc(state->stamps, sizeof(uint64_t) * cap);
+        if (stamps)
+            state->stamps = stamps;
+        uint32_t *paths = (uint32_t *)realloc(state->paths, sizeof(uint32_t) * cap);
+        if (paths)
+            state->paths = paths;
+        uint16_t *roots = (uint16_t *)realloc(state->roots, sizeof(uint16_t) * cap);
+        if (roots)
+            state->roots = roots;
+        if (!stamps || !paths || !roots)
+            return -1;
+        state->cap = cap;
+    }
+    if ((uint64_t)state->arena_size + len + 1 > state->arena_cap)
+    {
+        uint64_t cap = state->arena_cap ? state->arena_cap : 1024;
+        while (cap < (uint64_t)state->arena_size + len + 1)
+            cap *= 2;
+        if (cap > UINT32_MAX)
+            return -1;
+        wchar_t *arena = (wchar_t *)realloc(state->arena, sizeof(wchar_t) * cap);
+        if (!arena)
+            return -1;
+        state->arena = arena;
+        state->arena_cap = cap;
+    }
+
+    const uint32_t i = state->count++;
+    state->stamps[i] = stamp;
+    state->roots[i] = root;
+    state->paths[i] = state->arena_size;
+    memcpy(state->arena + state->arena_size, path, sizeof(wchar_t) * len);
+    state->arena[state->arena_size + len] = L'\0';
+    state->arena_size += len + 1;
+    return 0;
+}
+
+typedef struct
+{
+    const wchar_t *path;
+    uint32_t ind;
+    uint16_t root;
+} dir_key;
+
+static int cmp_dir(const void *lhs, const void *rhs)
+{
+    const dir_key *l = (const dir_key *)lhs, *r = (const dir_key *)rhs;
+    if (l->root != r->root)
+        return l->root < r->root ? -1 : 1;
+    return wcscmp(l->path, r->path);
+}
+
+void sort_dir_state(dir_state *state)
+{
+    if (state->count < 2)
+        return;
+    dir_key *keys = (dir_key *)malloc(sizeof(dir_key) * state->count);
+    for (uint32_t i = 0; i < state->count; ++i)
+    {
+        keys[i].path = DIR_PATH(state, i);
+        keys[i].ind = i;
+        keys[i].root = state->roots[i];
+    }
+    qsort(keys, state->count, sizeof(dir_key), cmp_dir);
+
+    uint64_t *stamps = (uint64_t *)malloc(sizeof(uint64_t) * state->cap);
+    uint32_t *paths = (uint32_t *)malloc(sizeof(uint32_t) * state->cap);
+    for (uint32_t i = 0; i < state->count; ++i)
+    {
+        stamps[i] = state->stamps[keys[i].ind];
+        paths[i] = state->paths[keys[i].ind];
+        state->roots[i] = keys[i].root;
+    }
+    free(state->stamps);
+    free(state->paths);
+    state->stamps = stamps;
+    state->paths = paths;
+    free(keys);
+}
+
+int64_t find_dir_state(const dir_state *state, uint16_t root, const wchar_t *path)
+{
+    uint32_t lo = 0, hi = state->count;
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const int cmp = state->roots[mid] != root ? (state->roots[mid] < root ? -1 : 1) : wcscmp(DIR_PATH(state, mid), path);
+        if (!cmp)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
@@ -0,0 +1,32 @@
+#ifndef PSYM_DIR_STATE
+#define PSYM_DIR_STATE
+
+#include <stdint.h>
+#include <wchar.h>
+
+// every directory a scan went through with its modification stamp, lets an update skip the unchanged ones;
+// stamps are opaque and only compared for equality
+typedef struct
+{
+    uint64_t *stamps;
+    uint32_t *paths; // offsets into arena, relative to the root, empty for the root itself
+    uint16_t *roots;
+    wchar_t *arena;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t arena_size;
+    uint32_t arena_cap;
+    char dedup; // the files were deduplicated, an update dedups the new ones against them
+} dir_state;
+
+#define DIR_PATH(state, i) ((state)->arena + (state)->paths[i])
+
+void init_dir_state(dir_state *state);
+void free_dir_state(dir_state *state);
+int add_dir_state(dir_state *state, uint16_t root, const wchar_t *path, int len, uint64_t stamp);
+// by(root, path), find_dir_state needs it
+void sort_dir_state(dir_state *state);
+// index or -1
+int64_t find_dir_state(const dir_state *state, uint16_t root, const wchar_t *path);
+
+#endif
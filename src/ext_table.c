@@ -0,0 +1,150 @@
+#include "ext_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+typedef struct
+{
+    uint32_t key;
+    uint16_t len;
+    int32_t ind;
+} ext_slot;
+
+struct ext_table
+{
+    ext_slot *slots;
+    wchar_t *keys;
+    uint32_t mask;
+    uint32_t seed;
+    int max_len;
+};
+
+static wchar_t fold_char(wchar_t c)
+{
+#ifdef _WIN32
+    if (c < 0x80)
+        return c >= L'A' && c <= L'Z' ? c | 0x20 : c;
+    return towlower(c);
+#else
+    return c;
+#endif
+}
+
+static uint32_t hash_ext(const wchar_t *str, int len, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (int i = 0; i < len; ++i)
+    {
+        hash ^= (uint32_t)fold_char(str[i]);
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+static int place_keys(ext_table *table, const uint32_t *key_offs, const uint16_t *key_lens, const int32_t *inds, int count)
+{
+    for (uint32_t i = 0; i <= table->mask; ++i)
+        table->slots[i].ind = -1;
+    for (int i = 0; i < count; ++i)
+    {
+        ext_slot *slot = table->slots + (hash_ext(table->keys + key_offs[i], key_lens[i], table->seed) & table->mask);
+        if (slot->ind >= 0)
+            return 0;
+        slot->key = key_offs[i];
+        slot->len = key_lens[i];
+        slot->ind = inds[i];
+    }
+    return 1;
+}
+
+ext_table *create_ext_table(const wchar_t **exts, uint16_t count)
+{
+    ext_table *table = (ext_table *)malloc(sizeof(ext_table));
+    uint32_t *key_offs = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    uint16_t *key_lens = (uint16_t *)malloc(sizeof(uint16_t) * (count + 1));
+    int32_t *inds = (int32_t *)malloc(sizeof(int32_t) * (count + 1));
+
+    int key_size = 0;
+    for (int i = 0; i < count; ++i)
+        key_size += wcslen(exts[i]);
+    table->keys = (wchar_t *)malloc(sizeof(wchar_t) * (key_size + 1));
+    table->max_len = 0;
+
+    // fold once, repeated extensions keep the first index like the linear search did
+    int key_count = 0;
+    key_size = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const int len = wcslen(exts[i]);
+        for (int j = 0; j < len; ++j)
+            table->keys[key_size + j] = fold_char(exts[i][j]);
+
+        int dup = 0;
+        for (int j = 0; j < key_count && !dup; ++j)
+            dup = key_lens[j] == len && !wmemcmp(table->keys + key_offs[j], table->keys + key_size, len);
+        if (dup)
+            continue;
+
+        key_offs[key_count] = key_size;
+        key_lens[key_count] = len;
+        inds[key_count++] = i;
+        key_size += len;
+        if (len > table->max_len)
+            table->max_len = len;
+    }
+
+    // grow the table until a seed without collisions shows up
+    uint32_t size = 8;
+    while (size < (uint32_t)key_count * 2)
+        size *= 2;
+    table->slots = NULL;
+    for (int placed = 0; !placed; size *= 2)
+    {
+        table->mask = size - 1;
+        table->slots = (ext_slot *)realloc(table->slots, sizeof(ext_slot) * size);
+        for (table->seed = 0; table->seed < 64 && !placed; ++table->seed)
+            placed = place_keys(table, key_offs, key_lens, inds, key_count);
+    }
+    --table->seed;
+
+    free(inds);
+    free(key_lens);
+    free(key_offs);
+    return table;
+}
+
+void delete_ext_table(ext_table *table)
+{
+    free(table->keys);
+    free(table->slots);
+    free(table);
+}
+
+int find_ext(const ext_table *table, const wchar_t *name, int len)
+{
+    // only the tail can hold an accepted extension, longer ones are rejected without a full scan
+    const int stop = len - table->max_len - 1 > 1 ? len - table->max_len - 1 : 1;
+    int dot = len - 1;
+    while (dot >= stop && name[dot] != L'.')
+        --dot;
+    if (dot < stop)
+        return -1;
+    return match_ext(table, name + dot + 1, len - dot - 1);
+}
+
+int match_ext(const ext_table *table, const wchar_t *ext, int ext_len)
+{
+    const ext_slot *slot = table->slots + (hash_ext(ext, ext_len, table->seed) & table->mask);
+    if (slot->ind < 0 || slot->len != ext_len)
+        return -1;
+
+    const wchar_t *key = table->keys + slot->key;
+    for (int i = 0; i < ext_len; ++i)
+        if (fold_char(ext[i]) != key[i])
+            return -1;
+    return slot->ind;
+}
@@ -0,0 +1,17 @@
+#ifndef PSYM_EXT_TABLE
+#define PSYM_EXT_TABLE
+
+#include <stdint.h>
+#include <wchar.h>
+
+typedef struct ext_table ext_table;
+
+// collision free hash over the extensions, case folded where the file system ignores case
+ext_table *create_ext_table(const wchar_t **exts, uint16_t count);
+void delete_ext_table(ext_table *table);
+// index into exts of the extension of name(after the last dot), -1 if it is not accepted
+int find_ext(const ext_table *table, const wchar_t *name, int len);
+// the same for an extension already split off the name, without the dot
+int match_ext(const ext_table *table, const wchar_t *ext, int ext_len);
+
+#endif
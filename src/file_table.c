@@ -0,0 +1,153 @@
+#include "file_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void init_file_table(file_table *table)
+{
+    memset(table, 0, sizeof(file_table));
+}
+
+void free_file_table(file_table *table)
+{
+    free(table->dates);
+    free(table->dirs);
+    free(table->exts);
+    free(table->names);
+    free(table->sizes);
+    free(table->arena);
+    init_file_table(table);
+}
+
+int reserve_file_table(file_table *table, uint32_t count, uint32_t arena_size)
+{
+    if (count > table->cap)
+    {
+        table->dates = (time_t *)realloc(table->dates, sizeof(time_t) * count);
+        table->dirs = (uint16_t *)realloc(table->dirs, sizeof(uint16_t) * count);
+        table->exts = (uint16_t *)realloc(table->exts, sizeof(uint16_t) * count);
+        table->names = (uint32_t *)realloc(table->names, sizeof(uint32_t) * count);
+        if (table->keep_sizes)
+            table->sizes = (uint64_t *)realloc(table->sizes, sizeof(uint64_t) * count);
+        if (!table->dates || !table->dirs || !table->exts || !table->names || (table->keep_sizes && !table->sizes))
+            return -1;
+        table->cap = count;
+    }
+    if (arena_size > table->arena_cap)
+    {
+        table->arena = (wchar_t *)realloc(table->arena, sizeof(wchar_t) * arena_size);
+        if (!table->arena)
+            return -1;
+        table->arena_cap = arena_size;
+    }
+    return 0;
+}
+
+static uint32_t grow_size(uint32_t cap, uint64_t needed)
+{
+    uint64_t ret = cap ? cap : 256;
+    while (ret < needed)
+        ret *= 2;
+    return ret > UINT32_MAX ? UINT32_MAX : (uint32_t)ret;
+}
+
+wchar_t *add_file(file_table *table, time_t date, uint16_t dir, uint16_t ext, int name_len)
+{
+    const uint64_t arena_needed = (uint64_t)table->arena_size + name_len + 1;
+    if (table->count == UINT32_MAX || arena_needed > UINT32_MAX)
+        return NULL;
+    if (reserve_file_table(table,
+            table->count < table->cap ? table->cap : grow_size(table->cap, (uint64_t)table->count + 1),
+            arena_needed <= table->arena_cap ? table->arena_cap : grow_size(table->arena_cap, arena_needed)))
+        return NULL;
+
+    const uint32_t i = table->count++;
+    table->dates[i] = date;
+    table->dirs[i] = dir;
+    table->exts[i] = ext;
+    table->names[i] = table->arena_size;
+
+    wchar_t *name = table->arena + table->arena_size;
+    name[name_len] = L'\0';
+    table->arena_size += name_len + 1;
+    return name;
+}
+
+int append_files(file_table *table, const file_table *src)
+{
+    const uint64_t count = (uint64_t)table->count + src->count;
+    const uint64_t arena_size = (uint64_t)table->arena_size + src->arena_size;
+    if (!src->count)
+        return 0;
+    if (count > UINT32_MAX || arena_size > UINT32_MAX)
+        return -1;
+    if (reserve_file_table(table,
+            count <= table->cap ? table->cap : grow_size(table->cap, count),
+            arena_size <= table->arena_cap ? table->arena_cap : grow_size(table->arena_cap, arena_size)))
+        return -1;
+
+    memcpy(table->dates + table->count, src->dates, sizeof(time_t) * src->count);
+    memcpy(table->dirs + table->count, src->dirs, sizeof(uint16_t) * src->count);
+    memcpy(table->exts + table->count, src->exts, sizeof(uint16_t) * src->count);
+    if (table->keep_sizes && src->keep_sizes)
+        memcpy(table->sizes + table->count, src->sizes, sizeof(uint64_t) * src->count);
+    else if (table->keep_sizes)
+        memset(table->sizes + table->count, 0, sizeof(uint64_t) * src->count);
+    for (uint32_t i = 0; i < src->count; ++i)
+        table->names[table->count + i] = src->names[i] + table->arena_size;
+    memcpy(table->arena + table->arena_size, src->arena, sizeof(wchar_t) * src->arena_size);
+    table->count = count;
+    table->arena_size = arena_size;
+    return 0;
+}
+
+void permute_file_table(file_table *table, const uint32_t *order)
+{
+    time_t *dates = (time_t *)malloc(sizeof(time_t) * table->cap);
+    for (uint32_t i = 0; i < table->count; ++i)
+        dates[i] = table->dates[order[i]];
+    free(table->dates);
+    table->dates = dates;
+
+    uint32_t *names = (uint32_t *)malloc(sizeof(uint32_t) * table->cap);
+    for (uint32_t i = 0; i < table->count; ++i)
+        names[i] = table->names[order[i]];
+    free(table->names);
+    table->names = names;
+
+    if (table->keep_sizes)
+    {
+        uint64_t *sizes = (uint64_t *)malloc(sizeof(uint64_t) * table->cap);
+        for (uint32_t i = 0; i < table->count; ++i)
+            sizes[i] = table->sizes[order[i]];
+        free(table->sizes);
+        table->sizes = sizes;
+    }
+
+    // the old dirs column is reused for the exts
+    uint16_t *dirs = (uint16_t *)malloc(sizeof(uint16_t) * table->cap);
+    for (uint32_t i = 0; i < table->count; ++i)
+        dirs[i] = table->dirs[order[i]];
+    for (uint32_t i = 0; i < table->count; ++i)
+        table->dirs[i] = table->exts[order[i]];
+    free(table->exts);
+    table->exts = table->dirs;
+    table->dirs = dirs;
+}
+
+void filter_file_table(file_table *table, const char *keep)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < table->count; ++i)
+    {
+        if (!keep[i])
+            continue;
+        table->dates[count] = table->dates[i];
+        table->dirs[count] = table->dirs[i];
+        table->exts[count] = table->exts[i];
+        if (table->keep_sizes)
+            table->sizes[count] = table->sizes[i];
+        table->names[count++] = table->names[i];
+    }
+    table->count = count;
+}
@@ -0,0 +1,38 @@
+#ifndef PSYM_FILE_TABLE
+#define PSYM_FILE_TABLE
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+// one column per field, names are null terminated back to back in a single arena
+typedef struct
+{
+    time_t *dates;
+    uint16_t *dirs;
+    uint16_t *exts;
+    uint32_t *names; // offsets into arena
+    uint64_t *sizes; // in bytes, only with keep_sizes set before the first file; add_file leaves them to the caller
+    wchar_t *arena;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t arena_size;
+    uint32_t arena_cap;
+    char keep_sizes;
+} file_table;
+
+#define FILE_NAME(table, i) ((table)->arena + (table)->names[i])
+
+void init_file_table(file_table *table);
+void free_file_table(file_table *table);
+int reserve_file_table(file_table *table, uint32_t count, uint32_t arena_size);
+// returns the buffer to fill with name_len characters, the null term is set already;
+// NULL once the table is out of range
+wchar_t *add_file(file_table *table, time_t date, uint16_t dir, uint16_t ext, int name_len);
+int append_files(file_table *table, const file_table *src);
+// reorders the columns, names stay where they are in the arena
+void permute_file_table(file_table *table, const uint32_t *order);
+// drops the files without keep set, the rest stay in order; their names stay where they are in the arena
+void filter_file_table(file_table *table, const char *keep);
+
+#endif
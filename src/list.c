@@ -0,0 +1,433 @@
+#include "list.h"
+#include "ext_table.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+// records are parsed in place in chunks of the listing, one longer than a chunk is skipped
+#define LIST_BUF_SIZE (1 << 20)
+#define INTERN_SLOTS_MIN 256
+
+#ifdef _WIN32
+// listings are utf-8 on windows, both separators are taken
+#define bytes_to_wcs(dst, src, len) utf8_to_wcs(dst, (const uint8_t *)(src), len)
+#define IS_SEP(c) ((c) == '\\' || (c) == '/')
+#else
+#define bytes_to_wcs(dst, src, len) path_to_wcs(dst, src, len)
+#define IS_SEP(c) ((c) == '/')
+#endif
+
+// strings of the listing by their bytes, each new one gets the next index
+typedef struct
+{
+    uint32_t *slots; // index + 1, 0 is free
+    uint32_t mask;
+    char **keys;
+    int *key_lens;
+    wchar_t **strs; // as they go in the file
+    int count;
+    int cap;
+} intern_table;
+
+struct list_reader
+{
+    FILE *file;
+    char *buf;
+    int begin;
+    int end;
+    char eof;
+    int delim; // -1 until the first chunk is read
+    char skipping; // the rest of a record longer than the buffer
+    wchar_t *name;
+    int name_cap;
+    time_t lower;
+    time_t upper;
+    // the given directories resolved like the scan resolves them, a path is matched against the resolved and the
+    // given spelling of each
+    char **roots;
+    int *root_lens;
+    int *root_dirs; // directory of each root
+    int root_count;
+    int last_root;
+    int dir_count;
+    intern_table dirs; // without roots
+    wchar_t **full_dirs;
+    ext_table *filter; // the given extensions, NULL interns them
+    const wchar_t **given_exts;
+    int given_ext_count;
+    intern_table exts;
+    list_tally tally;
+};
+
+static void init_intern_table(intern_table *table)
+{
+    memset(table, 0, sizeof(intern_table));
+    table->mask = INTERN_SLOTS_MIN - 1;
+    table->slots = (uint32_t *)calloc(INTERN_SLOTS_MIN, sizeof(uint32_t));
+}
+
+static void free_intern_table(intern_table *table)
+{
+    for (int i = 0; i < table->count; ++i)
+    {
+        free(table->keys[i]);
+        free(table->strs[i]);
+    }
+    free(table->keys);
+    free(table->key_lens);
+    free(table->strs);
+    free(table->slots);
+}
+
+static uint32_t *find_slot(const intern_table *table, const char *key, int len)
+{
+    uint32_t i = (uint32_t)XXH3_64bits(key, len) & table->mask;
+    for (; table->slots[i]; i = (i + 1) & table->mask)
+    {
+        const int ind = table->slots[i] - 1;
+        if (table->key_lens[ind] == len && !memcmp(table->keys[ind], key, len))
+            break;
+    }
+    return table->slots + i;
+}
+
+// index of the string, -1 once SCAN_LIST_MAX are taken
+static int intern(intern_table *table, const char *key, int len)
+{
+    uint32_t *slot = find_slot(table, key, len);
+    if (*slot)
+        return *slot - 1;
+    if (table->count == SCAN_LIST_MAX)
+        return -1;
+
+    if (table->count == table->cap)
+    {
+        table->cap = table->cap ? table->cap * 2 : 64;
+        table->keys = (char **)realloc(table->keys, sizeof(char *) * table->cap);
+        table->key_lens = (int *)realloc(table->key_lens, sizeof(int) * table->cap);
+        table->strs = (wchar_t **)realloc(table->strs, sizeof(wchar_t *) * table->cap);
+    }
+    const int ind = table->count++;
+    table->keys[ind] = (char *)memcpy(malloc(len), key, len);
+    table->key_lens[ind] = len;
+    table->strs[ind] = (wchar_t *)malloc(sizeof(wchar_t) * (len + 1));
+    table->strs[ind][bytes_to_wcs(table->strs[ind], key, len)] = L'\0';
+    *slot = ind + 1;
+
+    // kept under half full
+    if ((uint32_t)table->count * 2 > table->mask)
+    {
+        free(table->slots);
+        table->mask = table->mask * 2 + 1;
+        table->slots = (uint32_t *)calloc(table->mask + 1, sizeof(uint32_t));
+        for (int i = 0; i < table->count; ++i)
+            *find_slot(table, table->keys[i], table->key_lens[i]) = i + 1;
+    }
+    return ind;
+}
+
+int open_list(list_reader **reader, const wchar_t *path, const scan_opts *opts)
+{
+    FILE *file;
+    if (!wcscmp(path, L"-"))
+    {
+        file = stdin;
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    }
+    else if (!(file = file_open(path, L"rb")))
+        return LIST_ERR_OPEN;
+
+    list_reader *r = (list_reader *)calloc(1, sizeof(list_reader));
+    r->file = file;
+    r->buf = (char *)malloc(LIST_BUF_SIZE);
+    r->delim = -1;
+    r->lower = opts->bound_lower;
+    r->upper = opts->bound_upper;
+
+    r->dir_count = opts->dir_count;
+    r->full_dirs = (wchar_t **)malloc(sizeof(wchar_t *) * (r->dir_count + 1));
+    r->roots = (char **)malloc(sizeof(char *) * (r->dir_count * 2 + 1));
+    r->root_lens = (int *)malloc(sizeof(int) * (r->dir_count * 2 + 1));
+    r->root_dirs = (int *)malloc(sizeof(int) * (r->dir_count * 2 + 1));
+    for (int i = 0; i < r->dir_count * 2; ++i)
+    {
+        const int dir = i / 2;
+        if (!(i & 1))
+            r->full_dirs[dir] = full_path(opts->dirs[dir]);
+        else if (!wcscmp(r->full_dirs[dir], opts->dirs[dir]))
+            continue;
+        const wchar_t *path = i & 1 ? opts->dirs[dir] : r->full_dirs[dir];
+        const int k = r->root_count++;
+        r->root_dirs[k] = dir;
+#ifdef _WIN32
+        const int len = wcslen(path);
+        r->roots[k] = (char *)malloc(len * 4 + 1);
+        r->root_lens[k] = wcs_to_utf8((uint8_t *)r->roots[k], path, len);
+#else
+        r->roots[k] = wcs_to_path(path);
+        r->root_lens[k] = strlen(r->roots[k]);
+#endif
+        // the separator after the root is matched on its own
+        while (r->root_lens[k] > 1 && IS_SEP(r->roots[k][r->root_lens[k] - 1]))
+            --r->root_lens[k];
+    }
+    init_intern_table(&r->dirs);
+
+    if (opts->ext_count)
+    {
+        r->filter = create_ext_table(opts->exts, opts->ext_count);
+        r->given_exts = opts->exts;
+        r->given_ext_count = opts->ext_count;
+    }
+    init_intern_table(&r->exts);
+    *reader = r;
+    return 0;
+}
+
+void close_list(list_reader *reader)
+{
+    if (reader->file != stdin)
+        fclose(reader->file);
+    for (int i = 0; i < reader->root_count; ++i)
+        free(reader->roots[i]);
+    for (int i = 0; i < reader->dir_count; ++i)
+        free(reader->full_dirs[i]);
+    free(reader->full_dirs);
+    free(reader->roots);
+    free(reader->root_lens);
+    free(reader->root_dirs);
+    free_intern_table(&reader->dirs);
+    if (reader->filter)
+        delete_ext_table(reader->filter);
+    free_intern_table(&reader->exts);
+    free(reader->name);
+    free(reader->buf);
+    free(reader);
+}
+
+// the next record out of the buffer without its delimiter, 0 at the end of the listing
+static int next_record(list_reader *r, const char **record, int *len)
+{
+    for (;;)
+    {
+        const char *start = r->buf + r->begin;
+        const char *stop = r->delim >= 0 ? (const char *)memchr(start, r->delim, r->end - r->begin) : NULL;
+        if (stop || (r->eof && r->begin < r->end))
+        {
+            *record = start;
+            *len = stop ? (int)(stop - start) : r->end - r->begin;
+            r->begin += *len + (stop != NULL);
+            if (!r->skipping)
+                return 1;
+            r->skipping = 0;
+            ++r->tally.malformed;
+            continue;
+        }
+        if (r->eof)
+            return 0;
+
+        // the part of a record at the end moves to the front, the rest of it is read after it
+        memmove(r->buf, start, r->end - r->begin);
+        r->end -= r->begin;
+        r->begin = 0;
+        if (r->end == LIST_BUF_SIZE)
+        {
+            r->skipping = 1;
+            r->end = 0;
+        }
+        const size_t got = fread(r->buf + r->end, 1, LIST_BUF_SIZE - r->end, r->file);
+        if (!got && ferror(r->file))
+            return LIST_ERR_READ;
+        // find -print0 and the like, a listing with a null in its first chunk is null terminated
+        if (r->delim < 0)
+            r->delim = memchr(r->buf, '\0', got) ? '\0' : '\n';
+        r->eof = got == 0;
+        r->end += got;
+        r->tally.bytes += got;
+    }
+}
+
+// seconds with an optional fraction that is rounded down, NULL when there are no digits
+static const char *parse_date(const char *it, const char *end, time_t *date)
+{
+    const char neg = it < end && *it == '-';
+    it += neg;
+    const char *digits = it;
+    int64_t value = 0;
+    for (; it < end && *it >= '0' && *it <= '9'; ++it)
+    {
+        if (value > (INT64_MAX - 9) / 10)
+            return NULL;
+        value = value * 10 + (*it - '0');
+    }
+    if (it == digits)
+        return NULL;
+    char fraction = 0;
+    if (it < end && *it == '.')
+        for (++it; it < end && *it >= '0' && *it <= '9'; ++it)
+            fraction |= *it != '0';
+    *date = neg ? -value - fraction : value;
+    return it;
+}
+
+// the directory of path and the name in it, -1 when the path has no name in one of them, -2 past SCAN_LIST_MAX
+static int split_path(list_reader *r, const char *path, int len, const char **name)
+{
+    if (r->root_count)
+    {
+        // listings come a directory at a time, the root of the last file is tried first
+        for (int n = 0; n < r->root_count; ++n)
+        {
+            const int i = (r->last_root + n) % r->root_count;
+            const int root_len = r->root_lens[i];
+            const char ends_sep = IS_SEP(r->roots[i][root_len - 1]);
+            if (root_len + !ends_sep < len && !memcmp(path, r->roots[i], root_len) &&
+                (ends_sep || IS_SEP(path[root_len])))
+            {
+                r->last_root = i;
+                *name = path + root_len + !ends_sep;
+                return r->root_dirs[i];
+            }
+        }
+        return -1;
+    }
+
+    int sep = len - 1;
+    while (sep >= 0 && !IS_SEP(path[sep]))
+        --sep;
+    if (sep == len - 1)
+        return -1;
+    *name = path + sep + 1;
+    // a file in the current directory or in the root
+    const int dir = sep < 0 ? intern(&r->dirs, ".", 1) : intern(&r->dirs, path, sep ? sep : 1);
+    return dir < 0 ? -2 : dir;
+}
+
+int next_list_file(list_reader *reader, list_file *file)
+{
+    const char *record;
+    int len, ret;
+    while ((ret = next_record(reader, &record, &len)) > 0)
+    {
+        const char *end = record + len;
+        if (reader->delim == '\n' && len && end[-1] == '\r')
+            --end;
+        if (end == record)
+            continue;
+        ++reader->tally.records;
+
+        time_t date;
+        const char *it = parse_date(record, end, &date);
+        if (!it || it == end || (*it != '\t' && *it != ','))
+        {
+            ++reader->tally.malformed;
+            continue;
+        }
+        const char sep = *it++;
+        // digits up to the next separator are the size, anything else starts the path
+        const char *field = it;
+        int64_t size = 0;
+        for (; it < end && *it >= '0' && *it <= '9' && size <= (INT64_MAX - 9) / 10; ++it)
+            size = size * 10 + (*it - '0');
+        if (it > field && it < end && *it == sep)
+            ++it;
+        else
+        {
+            it = field;
+            size = -1;
+        }
+        if (it == end)
+        {
+            ++reader->tally.malformed;
+            continue;
+        }
+        if (date <= reader->lower || date >= reader->upper)
+        {
+            ++reader->tally.filtered;
+            continue;
+        }
+
+        const char *name;
+        const int dir = split_path(reader, it, (int)(end - it), &name);
+        if (dir == -2)
+            return LIST_ERR_TOO_MANY;
+        if (dir < 0)
+        {
+            ++reader->tally.filtered;
+            continue;
+        }
+        // the same as a scan: no extension, an empty one or a name that is only one is not a file it keeps
+        const int name_len = (int)(end - name);
+        int dot = name_len - 1;
+        while (dot > 0 && name[dot] != '.' && !IS_SEP(name[dot]))
+            --dot;
+        if (dot <= 0 || name[dot] != '.' || IS_SEP(name[dot - 1]) || dot == name_len - 1)
+        {
+            ++reader->tally.filtered;
+            continue;
+        }
+
+        if (reader->name_cap < name_len + 1)
+        {
+            reader->name_cap = (name_len + 1) * 2;
+            reader->name = (wchar_t *)realloc(reader->name, sizeof(wchar_t) * reader->name_cap);
+        }
+        int ext;
+        const char *ext_bytes = name + dot + 1;
+        if (reader->filter)
+            ext = match_ext(reader->filter, reader->name, bytes_to_wcs(reader->name, ext_bytes, name_len - dot - 1));
+        else if ((ext = intern(&reader->exts, ext_bytes, name_len - dot - 1)) < 0)
+            return LIST_ERR_TOO_MANY;
+        if (ext < 0)
+        {
+            ++reader->tally.filtered;
+            continue;
+        }
+
+        file->len = bytes_to_wcs(reader->name, name, dot);
+        reader->name[file->len] = L'\0';
+#ifdef _WIN32
+        for (int i = 0; i < file->len; ++i)
+            if (reader->name[i] == L'/')
+                reader->name[i] = PSYM_SEP_CHAR;
+#endif
+        file->name = reader->name;
+        file->date = date;
+        file->dir = (uint16_t)dir;
+        file->ext = (uint16_t)ext;
+        file->size = size;
+        return 1;
+    }
+    if (!ret)
+    {
+        STAT_ADD(STAT_ENTRIES_SEEN, reader->tally.records);
+        STAT_ADD(STAT_BYTES_READ, reader->tally.bytes);
+    }
+    return ret;
+}
+
+void list_scan_opts(const list_reader *reader, scan_opts *opts)
+{
+    opts->dirs = (const wchar_t **)(reader->dir_count ? reader->full_dirs : reader->dirs.strs);
+    opts->dir_count = reader->dir_count ? reader->dir_count : reader->dirs.count;
+    opts->exts = reader->filter ? reader->given_exts : (const wchar_t **)reader->exts.strs;
+    opts->ext_count = reader->filter ? reader->given_ext_count : reader->exts.count;
+}
+
+const list_tally *list_reader_tally(const list_reader *reader)
+{
+    return &reader->tally;
+}
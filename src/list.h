@@ -0,0 +1,48 @@
+#ifndef PSYM_LIST
+#define PSYM_LIST
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "scan.h"
+
+#define LIST_ERR_OPEN -1
+#define LIST_ERR_READ -2
+#define LIST_ERR_TOO_MANY -3 // over SCAN_LIST_MAX directories or extensions
+
+// a file listing read instead of a scan, a record per line or per null terminated string, whichever the first chunk
+// has: <date>[<sep><size>]<sep><path>, sep is a tab or a comma, date in seconds since 1970(fractions are dropped);
+// a field of digits between the date and the path is the size
+typedef struct list_reader list_reader;
+
+typedef struct
+{
+    const wchar_t *name; // relative to its directory and without the extension, valid until the next file
+    int len;
+    time_t date;
+    uint16_t dir;
+    uint16_t ext;
+    int64_t size; // -1 when the record has none
+} list_file;
+
+typedef struct
+{
+    uint64_t records;
+    uint64_t malformed; // no date, no path or longer than the buffer
+    uint64_t filtered; // out of the date bounds, under none of the directories or without an accepted extension
+    uint64_t bytes;
+} list_tally;
+
+// path - is stdin; opts gives the date bounds, the directories the paths are made relative to(none: the directory of
+// each file becomes one of its own) and the extensions kept(none: every extension is kept as it is found); the
+// directories are resolved to full paths like a scan's, a listed path may start with either spelling
+int open_list(list_reader **reader, const wchar_t *path, const scan_opts *opts);
+void close_list(list_reader *reader);
+// 1 with a file, 0 at the end of the listing or one of LIST_ERR_*; records that don't make a file are skipped
+int next_list_file(list_reader *reader, list_file *file);
+// the directories and extensions so far, owned by the reader and moved as they grow; the rest of opts is left alone
+void list_scan_opts(const list_reader *reader, scan_opts *opts);
+const list_tally *list_reader_tally(const list_reader *reader);
+
+#endif
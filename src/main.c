@@ -1,418 +1,542 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <locale.h>
+#include <signal.h>
 
 #include "opt_parser.h"
+#include "psym.h"
+#include "stats.h"
+#include "thread_pool.h"
 #include "util.h"
 
-/*
-* ===FILE STRUCTURE===
-* 5b: "PSYM"
-* 1b: unit size
-* 1b: extension count
-* Sb: extensions
-* 1b: directory count
-* Sb: directories(full paths)
-* 4b: position in file
-* Ub: units
-* 
-* Sb = 2b: length without null term, 2b(wchar_t) * length: string without null term
-* Ub = 1b: unit size, 8b(time_t): date, Fb: files
-* Fb = 1b: directory index, 1b: extension index, Sb: filename
-*/
+// the file format is described in psym.h
 
 #define DEF_UNIT_SIZE 5
+// long only options, keys nobody can type as short ones
+#define OPT_KEY_UPDATE L"\x01"
+#define OPT_KEY_MEM L"\x02"
+#define OPT_KEY_PERMUTE L"\x03"
+#define OPT_KEY_COMPACT L"\x04"
+#define OPT_KEY_STATS L"\x05"
+#define OPT_KEY_CURSORS L"\x06"
+#define OPT_KEY_DEDUP L"\x07"
+#define OPT_KEY_TIME L"\x08"
+#define OPT_KEY_PREFETCH L"\x09"
+#define OPT_KEY_SHARDS L"\x0a"
+#define OPT_KEY_HASH L"\x0b"
+#define OPT_KEY_FROM_LIST L"\x0c"
 static const wchar_t* _DEF_EXTENSIONS[] = { L"jpg", L"jpeg", L"png" };
-
-typedef struct
-{
-    wchar_t *name;
-    time_t date;
-    uint8_t ext;
-    uint8_t dir_ind;
-} psym_file;
+// indexed by the COPY_MODE_COPY/LINK_* value + 1
+static const wchar_t* _MODE_NAMES[] = { L"copy", L"reflink", L"hardlink", L"symlink" };
 
 static int log_err_and_return(const wchar_t* format, ...)
 {
     va_list args;
     va_start(args, format);
-    fwprintf(stderr, format, args);
+    vfwprintf(stderr, format, args);
     va_end(args);
     return -1;
 }
 
-static void strip_file_extension(wchar_t *name)
+// path is the file the library was working on
+static int log_psym_err(int err, const wchar_t *path)
 {
-    for (int i = wcslen(name) - 1; i; --i)
+    switch (err)
     {
-        if (name[i] == L'.')
-        {
-            name[i] = '\0';
-            return;
-        }
+    case 0:
+        return 0;
+    case PSYM_ERR_OPEN:
+        return log_err_and_return(L"could not open file %ls\n", path);
+    case PSYM_ERR_FORMAT:
+        return log_err_and_return(L"could not identify input file %ls\n", path);
+    case PSYM_ERR_FLAGS:
+        return log_err_and_return(L"unsupported features in input file %ls\n", path);
+    case PSYM_ERR_TRUNCATED:
+        return log_err_and_return(L"input file %ls is truncated\n", path);
+    case PSYM_ERR_WRITE:
+        return log_err_and_return(L"could not write to file %ls\n", path);
+    case PSYM_ERR_MEMORY:
+        return log_err_and_return(L"too many files to fit in memory\n");
+    case PSYM_ERR_SPILL:
+        return log_err_and_return(L"could not spill files next to %ls\n", path);
+    case PSYM_ERR_TOO_MANY:
+        return log_err_and_return(L"too many files\n");
+    case PSYM_ERR_NO_STATE:
+        return log_err_and_return(L"%ls has no directory state, generate it again to update it\n", path);
+    case PSYM_ERR_NOT_PERMUTED:
+        return log_err_and_return(L"only files generated with --permute can be reshuffled\n");
+    case PSYM_ERR_OUTPUT_DIR:
+        return log_err_and_return(L"could not create output directory %ls\n", path);
+    case PSYM_ERR_VERSION:
+        return log_err_and_return(L"%ls is a PSYM3 file, generate it again to use it here\n", path);
+    case PSYM_ERR_SOCKET:
+        return log_err_and_return(L"could not listen on %ls\n", path);
+    case PSYM_ERR_PLATFORM:
+        return log_err_and_return(L"not available on this platform\n");
+    case PSYM_ERR_NO_CURSORS:
+        return log_err_and_return(L"%ls has no named cursors, generate it again with --cursors\n", path);
+    case PSYM_ERR_NO_CURSOR:
+        return log_err_and_return(L"no such cursor in %ls\n", path);
+    case PSYM_ERR_CURSORS_FULL:
+        return log_err_and_return(L"every cursor slot of %ls is taken\n", path);
+    case PSYM_ERR_CURSOR_NAME:
+        return log_err_and_return(L"cursor names are 1 to %i utf-8 bytes\n", (int)CURSOR_NAME_MAX);
+    case PSYM_ERR_MISMATCH:
+        return log_err_and_return(L"%ls has other directories, extensions or units than the files before it\n", path);
+    case PSYM_ERR_LIST:
+        return log_err_and_return(L"could not read file list %ls\n", path);
+    default:
+        return log_err_and_return(L"unexpected error %i on %ls\n", err, path);
     }
 }
 
-static void sort_quick_desc(psym_file *arr, int n)
+// returns the total
+static uint64_t print_dir_counts(const scan_opts *opts, const uint64_t *counts)
 {
-    if (n < 2) return;
-
-    const time_t pivot = arr[n / 2].date;
-    int i = 0, j = n - 1;
-    while (1)
+    uint64_t total = 0;
+    for (int i = 0; i < opts->dir_count; ++i)
     {
-        while (arr[i].date > pivot) ++i;
-        while (arr[j].date < pivot) --j;
-        if (i >= j) break;
-
-        const psym_file tmp = arr[i];
-        arr[i++] = arr[j];
-        arr[j--] = tmp;
+        uint64_t dir_total = 0;
+        wprintf(L"directory %ls\n", opts->dirs[i]);
+        for (int ext = 0; ext < opts->ext_count; ++ext)
+        {
+            const uint64_t count = counts[(uint64_t)i * opts->ext_count + ext];
+            wprintf(L"\t.%ls files: %llu\n", opts->exts[ext], (unsigned long long)count);
+            dir_total += count;
+        }
+        wprintf(L"\ttotal: %llu\n", (unsigned long long)dir_total);
+        total += dir_total;
     }
-
-    sort_quick_desc(arr, i);
-    sort_quick_desc(arr + i, n - i);
+    wprintf(L"total files: %llu\n", (unsigned long long)total);
+    if (!total)
+        wprintf(L"nothing to write\n");
+    return total;
 }
 
-static void write_wstr_to_file(FILE *file, const wchar_t *str)
+// a listing without directories has one per directory of its files, only the extensions are worth a line each
+static uint64_t print_list_counts(const psym_list_result *result, char per_dir)
 {
-    const uint16_t len = wcslen(str);
-    fwrite(&len, sizeof len, 1, file);
-    fwrite(str, sizeof(wchar_t), len, file);
+    wprintf(L"records: %llu, malformed: %llu, filtered out: %llu\n", (unsigned long long)result->records,
+        (unsigned long long)result->malformed, (unsigned long long)result->filtered);
+    if (per_dir)
+        return print_dir_counts(&result->opts, result->counts);
+
+    uint64_t total = 0;
+    wprintf(L"directories: %i\n", result->opts.dir_count);
+    for (int ext = 0; ext < result->opts.ext_count; ++ext)
+    {
+        uint64_t count = 0;
+        for (int i = 0; i < result->opts.dir_count; ++i)
+            count += result->counts[(uint64_t)i * result->opts.ext_count + ext];
+        wprintf(L"\t.%ls files: %llu\n", result->opts.exts[ext], (unsigned long long)count);
+        total += count;
+    }
+    wprintf(L"total files: %llu\n", (unsigned long long)total);
+    if (!total)
+        wprintf(L"nothing to write\n");
+    return total;
 }
 
-static void read_wstrs_w_lengths(wchar_t** str_arr, uint16_t* len_arr, int count, FILE* file)
+// <file>.0 to <file>.<count - 1>
+static wchar_t **shard_paths(const wchar_t *file, int count)
 {
+    const size_t len = wcslen(file) + 16;
+    wchar_t **paths = (wchar_t **)malloc(sizeof(wchar_t *) * count);
     for (int i = 0; i < count; ++i)
     {
-        fread(len_arr + i, sizeof(uint16_t), 1, file);
-        str_arr[i] = (wchar_t *)malloc(sizeof(wchar_t) * (len_arr[i] + 1));
-        str_arr[i][len_arr[i]] = L'\0';
-        fread(str_arr[i], sizeof(wchar_t), len_arr[i], file);
+        paths[i] = (wchar_t *)malloc(sizeof(wchar_t) * len);
+        swprintf(paths[i], len, L"%ls.%i", file, i);
     }
+    return paths;
 }
 
-static int write_bin(const wchar_t **dirs, uint8_t dir_count, const wchar_t** exts, uint8_t ext_count, 
-                     const wchar_t* output, uint8_t unit_size, const psym_file *files, int file_count)
+static void free_shard_paths(wchar_t **paths, int count)
 {
-    FILE *file = _wfopen(output, L"wb");
-    if (!file)
-        return log_err_and_return(L"could not open file %s\n", output);
-
-    fwrite("PSYM3", sizeof(char), 5, file);
-    fwrite(&unit_size, sizeof unit_size, 1, file);
-
-    fwrite(&ext_count, sizeof ext_count, 1, file);
-    for (int i = 0; i < ext_count; ++i)
-        write_wstr_to_file(file, exts[i]);
-
-    fwrite(&dir_count, sizeof dir_count, 1, file);
-    for (int i = 0; i < dir_count; ++i)
-        write_wstr_to_file(file, dirs[i]);
+    for (int i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+}
 
-    uint32_t file_iter = ftell(file) + sizeof file_iter;
-    fwrite(&file_iter, sizeof file_iter, 1, file);
+static int split(const wchar_t *input, int count, int by)
+{
+    wchar_t **paths = shard_paths(input, count);
+    uint64_t *unit_counts = (uint64_t *)malloc(sizeof(uint64_t) * count);
+    const int ret = psym_split(input, (const wchar_t **)paths, count, by, unit_counts);
+    if (!ret)
+        for (int i = 0; i < count; ++i)
+            wprintf(L"%ls: %llu units\n", paths[i], (unsigned long long)unit_counts[i]);
+    free(unit_counts);
+    free_shard_paths(paths, count);
+    // any of the shards could have failed
+    if (ret == PSYM_ERR_WRITE)
+        return log_err_and_return(L"could not write the shards of %ls\n", input);
+    return log_psym_err(ret, input);
+}
 
-    for (int i = 0; i < file_count; i += unit_size)
+static int merge(const wchar_t **inputs, int count, const wchar_t *output)
+{
+    // the output is only written once the inputs are read, not over one of them
+    wchar_t *output_full = full_path(output);
+    for (int i = 0; i < count; ++i)
     {
-        const uint8_t unit_size_curr = (file_count - i) > unit_size ? unit_size : file_count - i;
-        fwrite(&unit_size_curr, sizeof unit_size_curr, 1, file);
-        fwrite(&files[i].date, sizeof(time_t), 1, file);
-        for (int j = 0; j < unit_size_curr; ++j)
+        wchar_t *input_full = full_path(inputs[i]);
+        const int same = !wcscmp(input_full, output_full);
+        free(input_full);
+        if (same)
         {
-            fwrite(&files[i + j].dir_ind, sizeof(uint8_t), 1, file);
-            fwrite(&files[i + j].ext, sizeof(uint8_t), 1, file);
-            write_wstr_to_file(file, files[i + j].name);
+            free(output_full);
+            return log_err_and_return(L"the merged file can't be one of the inputs\n");
         }
     }
-    fclose(file);
-    return 0;
+    free(output_full);
+
+    uint64_t unit_count;
+    int failed;
+    const int ret = psym_merge(inputs, count, output, &unit_count, &failed);
+    if (!ret)
+        wprintf(L"merged %i files, %llu units\n", count, (unsigned long long)unit_count);
+    return log_psym_err(ret, failed >= 0 ? inputs[failed] : output);
 }
 
-static int gen(const wchar_t **dirs, uint8_t dir_count, const wchar_t** exts, uint8_t ext_count,
-               const wchar_t *output, uint8_t unit_size, time_t bound_lower, time_t bound_upper)
+// shards above 0 split the written file into them, by a PSYM_SHARD_* value
+// list is a file listing to take the files from instead of scanning the directories, NULL scans them
+static int gen(const scan_opts *opts, const wchar_t *list, const wchar_t *output, const psym_write_opts *wopts,
+               int shards, int by)
 {
-    for (int i = 0; i < dir_count; ++i)
+    dedup_result dedup;
+    uint64_t total = 0;
+    int ret;
+    if (list)
     {
-        DWORD attribs = GetFileAttributesW(dirs[i]);
-        if (attribs == INVALID_FILE_ATTRIBUTES || !(attribs & FILE_ATTRIBUTE_DIRECTORY))
-            return log_err_and_return(L"could not find directory %s\n", dirs[i]);
+        psym_list_result result;
+        ret = psym_gen_list(list, opts, output, wopts, &result, &dedup);
+        if (!ret)
+            total = print_list_counts(&result, opts->dir_count != 0);
+        if (!ret && result.records && result.filtered == result.records)
+            fwprintf(stderr, L"warning: every record of %ls was filtered out, check the directories%ls\n", list,
+                opts->ext_count ? L", extensions and dates" : L" and dates");
+        psym_free_list_result(&result);
+        if (ret == PSYM_ERR_TOO_MANY)
+            return log_err_and_return(L"more than %i directories or extensions in %ls\n", SCAN_LIST_MAX, list);
+        if (ret == PSYM_ERR_LIST)
+            return log_psym_err(ret, list);
     }
-
-    wchar_t dir_path[MAX_PATH];
-    int alloc_size = 512;
-    int file_count = 0;
-    psym_file *files = (psym_file *)malloc(alloc_size * sizeof(psym_file));
-    memset(files, 0, sizeof(psym_file) * alloc_size);
-
-    // get files
-    for (uint8_t i = 0; i < dir_count; ++i)
+    else
     {
-        wprintf(L"directory %s\n", dirs[i]);
-        const int dir_beg_count = file_count;
-        for (uint8_t ext = 0; ext < ext_count; ++ext)
+        uint64_t *counts = (uint64_t *)calloc((uint64_t)opts->dir_count * opts->ext_count + 1, sizeof(uint64_t));
+        ret = psym_gen(opts, output, wopts, counts, &dedup);
+        if (ret == PSYM_ERR_NO_DIR)
         {
-            wprintf(L"\t.%s files: ", exts[ext]);
-            const int ext_beg_count = file_count;
-
-            WIN32_FIND_DATAW find_data;
-            HANDLE find;
-
-            wsprintfW(dir_path, L"%s\\*.%s", dirs[i], exts[ext]);
-
-            if ((find = FindFirstFileW(dir_path, &find_data)) == INVALID_HANDLE_VALUE)
-            {
-                wprintf(L"0\n");
-                continue;
-            }
-
-            do
-            {
-                time_t modify_time = file_modify_time(&find_data.ftLastWriteTime);
-                if (modify_time > bound_lower && modify_time < bound_upper)
+            for (int i = 0; i < opts->dir_count; ++i)
+                if (!is_dir(opts->dirs[i]))
                 {
-                    if (file_count >= alloc_size)
-                    {
-                        alloc_size *= 2;
-                        files = (psym_file*)realloc(files, alloc_size * sizeof(psym_file));
-                        memset(files + file_count, 0, sizeof(psym_file) * (alloc_size - file_count));
-                    }
-                    strip_file_extension(find_data.cFileName);
-                    files[file_count].name = _wcsdup(find_data.cFileName);
-                    files[file_count].ext = ext;
-                    files[file_count].dir_ind = i;
-                    files[file_count].date = modify_time;
-                    ++file_count;
+                    free(counts);
+                    return log_err_and_return(L"could not find directory %ls\n", opts->dirs[i]);
                 }
-            } while (FindNextFileW(find, &find_data));
-            FindClose(find);
-            wprintf(L"%i\n", file_count - ext_beg_count);
         }
-        wprintf(L"\ttotal: %i\n", file_count - dir_beg_count);
+        if (!ret)
+            total = print_dir_counts(opts, counts);
+        free(counts);
     }
-    wprintf(L"total files: %i\n", file_count);
-    if (!file_count)
-    {
-        wprintf(L"nothing to write\n");
+    if (!ret && wopts->dedup)
+        wprintf(L"duplicates: %u files, %.1f MB removed; %u files, %.1f MB hashed and %.1f MB compared to find them\n",
+            dedup.removed, dedup.removed_bytes / 1e6, dedup.hashed, dedup.hashed_bytes / 1e6,
+            dedup.compared_bytes / 1e6);
+    if (ret)
+        return log_psym_err(ret, output);
+
+    // nothing was written without files
+    if (!shards || !total)
         return 0;
+    const int split_ret = split(output, shards, by);
+    if (!split_ret)
+        remove_path(output);
+    return split_ret;
+}
+
+static int update(const wchar_t *input, int workers)
+{
+    psym_update_result result;
+    const int ret = psym_update(input, workers, &result);
+    if (ret)
+        return log_psym_err(ret, input);
+    wprintf(L"changed directories: %u of %u\n", result.changed_dirs, result.dir_count);
+    wprintf(L"new files: %u, new units: %llu\n", result.new_files, (unsigned long long)result.new_units);
+    if (result.duplicates)
+        wprintf(L"duplicates left out: %u\n", result.duplicates);
+    return 0;
+}
+
+// directories with missing files, then the totals and how fast the files were looked up
+static int verify(const wchar_t *input, int workers, char prune)
+{
+    psym_verify_result result;
+    const int ret = prune ? psym_prune(input, workers, &result) : psym_verify(input, workers, &result);
+    if (!ret)
+    {
+        for (uint32_t i = 0; i < result.dir_count; ++i)
+            if (result.dir_missing[i])
+                wprintf(L"directory %ls\n\tfiles: %llu, missing: %llu\n", result.dirs[i],
+                    (unsigned long long)result.dir_files[i], (unsigned long long)result.dir_missing[i]);
+        wprintf(L"total files: %llu, missing: %llu\n", (unsigned long long)result.files,
+            (unsigned long long)result.missing);
+        wprintf(L"looked up in %.3f s, %.0f files/s on %i threads\n", result.seconds,
+            result.seconds > 0.0 ? result.files / result.seconds : 0.0, workers);
+        if (prune && result.missing)
+            wprintf(L"removed %llu files and %llu empty units, %llu units left\n", (unsigned long long)result.missing,
+                (unsigned long long)(result.units - result.units_left), (unsigned long long)result.units_left);
+        else if (prune)
+            wprintf(L"nothing to remove\n");
     }
+    psym_free_verify_result(&result);
+    return log_psym_err(ret, input);
+}
 
-    sort_quick_desc(files, file_count);
+// bytes with an optional K, M or G suffix, 0 when invalid
+static uint64_t parse_size(const wchar_t *str)
+{
+    wchar_t *end;
+    const unsigned long long value = wcstoull(str, &end, 10);
+    int shift = 0;
+    switch (*end)
+    {
+    case L'K': case L'k': shift = 10; ++end; break;
+    case L'M': case L'm': shift = 20; ++end; break;
+    case L'G': case L'g': shift = 30; ++end; break;
+    }
+    if (end == str || *end != L'\0' || value > (UINT64_MAX >> shift))
+        return 0;
+    return (uint64_t)value << shift;
+}
 
-    // shuffle
-    const int count = file_count / unit_size - 1; // round down, appendix is left in place
-    const int unit_byte_size = sizeof(psym_file) * unit_size;
-    psym_file *tmp = (psym_file *)malloc(unit_byte_size);
-    for (int i = 0; i < count; ++i)
+static int extract(const wchar_t *input, const wchar_t *output, int count, char keep_pos, int64_t start,
+                   const wchar_t *cursor, int workers, int mode, int prefetch)
+{
+    psym_reader *reader;
+    int ret = psym_open_reader(&reader, input, !keep_pos);
+    if (ret)
+        return log_psym_err(ret, input);
+    // a cursor that is read for the first time is made
+    if ((cursor && (ret = psym_use_cursor(reader, cursor, !keep_pos))) || (start >= 0 && (ret = psym_seek(reader, start))))
     {
-        const int ind = rand_range(i + 1, count) * unit_size;
-        memcpy(tmp, files + ind, unit_byte_size);
-        memcpy(files + ind, files + i * unit_size, unit_byte_size);
-        memcpy(files + i * unit_size, tmp, unit_byte_size);
+        psym_close_reader(reader);
+        return log_psym_err(ret, input);
     }
-    free(tmp);
-    
-    // get full dir paths
-    wchar_t **full_dirs = (wchar_t **)malloc(sizeof(wchar_t *) * dir_count);
-    for (int i = 0; i < dir_count; ++i)
+
+    // read and move the position, the units stay in the mapping
+    unit_view *units = (unit_view *)malloc(sizeof(unit_view) * count);
+    const int unit_count = psym_next_units(reader, units, count);
+    if (unit_count < 0)
     {
-        const DWORD len = GetFullPathNameW(dirs[i], 0, NULL, NULL);
-        full_dirs[i] = malloc(sizeof(wchar_t) * len);
-        GetFullPathNameW(dirs[i], len, full_dirs[i], NULL);
+        free(units);
+        psym_close_reader(reader);
+        return log_psym_err(unit_count, input);
     }
 
-    int ret = write_bin(full_dirs, dir_count, exts, ext_count, output, unit_size, files, file_count);
+    wchar_t *dir_path;
+    copy_job *jobs;
+    int job_count;
+    ret = psym_extract_jobs(reader, units, unit_count, output, &dir_path, &jobs, &job_count);
+    if (!ret)
+    {
+        copy_stats stats;
+        copy_files(jobs, job_count, workers, mode, prefetch, &stats);
+        for (int i = 0; i < job_count; ++i)
+            if (jobs[i].failed)
+                fwprintf(stderr, L"could not copy file %ls\n", jobs[i].src);
+        psym_free_jobs(jobs, job_count);
+        if (mode != COPY_MODE_COPY)
+            wprintf(L"%ls: %i files, %i fell back to copy\n", _MODE_NAMES[mode + 1], stats.linked, stats.fell_back);
+        wprintf(L"copied %i files, %.1f MB in %.2f s, %.1f MB/s\n", stats.copied, stats.bytes / 1e6,
+            stats.seconds, stats.seconds > 0 ? stats.bytes / 1e6 / stats.seconds : 0.0);
+    }
+    else
+        log_psym_err(ret, ret == PSYM_ERR_OUTPUT_DIR ? dir_path : input);
 
     // cleanup
-    for (int i = 0; i < dir_count; ++i)
-        free(full_dirs[i]);
-    free(full_dirs);
-    for (int i = 0; i < file_count; ++i)
-        free(files[i].name);
-    free(files);
+    free(dir_path);
+    free(units);
+    psym_close_reader(reader);
+
     return ret;
 }
 
-static int extract(const wchar_t *input, const wchar_t *output, int count, char keep_pos)
+static int rst(const wchar_t *input, const uint64_t *seed, const wchar_t *cursor)
 {
-    typedef struct
-    {
-        wchar_t* name;
-        uint8_t dir_ind;
-        uint8_t ext_ind;
-    } psym_cmp_file;
-    typedef struct
-    {
-        psym_cmp_file *files;
-        time_t date;
-        uint8_t count;
-    } psym_cmp_unit;
-
-    FILE *file = _wfopen(input, keep_pos ? L"rb" : L"rb+");
-    if (!file)
-        return log_err_and_return(L"could not open file %s\n", input);
+    psym_reader *reader;
+    int ret = psym_open_reader(&reader, input, 1);
+    if (ret)
+        return log_psym_err(ret, input);
+    if (cursor)
+        ret = psym_use_cursor(reader, cursor, 0);
+    if (!ret && seed)
+        ret = psym_reseed(reader, *seed);
+    if (!ret)
+        ret = psym_seek(reader, 0);
+    psym_close_reader(reader);
+    return log_psym_err(ret, input);
+}
 
-    uint8_t unit_size, ext_count, dir_count;
-    char id_buf[6] = { '\0' };
+static int info(const wchar_t *input)
+{
+    psym_reader *reader;
+    const int ret = psym_open_reader(&reader, input, 0);
+    if (ret)
+        return log_psym_err(ret, input);
+    const ref_map *ref = psym_reader_ref(reader);
 
-    fread(id_buf, sizeof(char), 5, file);
-    if (strcmp(id_buf, "PSYM3"))
+    uint64_t unit_count = 0, unit_pos = 0, file_count = 0, files_left = 0;
+    if (ref->version == 4)
     {
-        fclose(file);
-        return log_err_and_return(L"could not identify input file %s\n", input);
-    }
-    // unit size
-    fread(&unit_size, sizeof unit_size, 1, file);
-
-    // exts
-    fread(&ext_count, sizeof ext_count, 1, file);
-    wchar_t **exts = (wchar_t **)malloc(sizeof(wchar_t *) * ext_count);
-    uint16_t *ext_lengths = (uint16_t *)malloc(sizeof(uint16_t) * ext_count);
-    read_wstrs_w_lengths(exts, ext_lengths, ext_count, file);
-
-    // dirs
-    fread(&dir_count, sizeof dir_count, 1, file);
-    wchar_t **dirs = (wchar_t **)malloc(sizeof(wchar_t *) * dir_count);
-    uint16_t*dir_lengths = (uint16_t *)malloc(sizeof(uint16_t) * dir_count);
-    read_wstrs_w_lengths(dirs, dir_lengths, dir_count, file);
-
-    // seek to pos
-    const uint32_t file_iter_pos = ftell(file);
-    uint32_t file_iter;
-    fread(&file_iter, sizeof file_iter, 1, file);
-    fseek(file, file_iter, SEEK_SET);
-
-    // read
-    psym_cmp_unit *units = (psym_cmp_unit *)malloc(sizeof(psym_cmp_unit) * count);
-    memset(units, 0, sizeof(psym_cmp_unit) * count);
-    int unit_count = 0;
-
-    for (; unit_count < count; ++unit_count)
-    {
-        if (!fread(&units[unit_count].count, sizeof(uint8_t), 1, file))
-            break;
-        fread(&units[unit_count].date, sizeof(time_t), 1, file);
-
-        units[unit_count].files = (psym_cmp_file *)malloc(sizeof(psym_cmp_file) * units[unit_count].count);
-        for (uint8_t j = 0; j < units[unit_count].count; ++j)
+        unit_count = ref->unit_count;
+        unit_pos = ref->pos < unit_count ? ref->pos : unit_count;
+        for (uint64_t i = 0; i < unit_count; ++i)
         {
-            uint16_t len;
-            fread(&units[unit_count].files[j].dir_ind, sizeof(uint8_t), 1, file);
-            fread(&units[unit_count].files[j].ext_ind, sizeof(uint8_t), 1, file);
-            read_wstrs_w_lengths(&units[unit_count].files[j].name, &len, 1, file);
+            const uint32_t count = ref_unit_count(ref, ref_unit_index(ref, i));
+            file_count += count;
+            if (i >= unit_pos)
+                files_left += count;
         }
     }
-
-    // update pos
-    if (!keep_pos)
-    {
-        file_iter = ftell(file);
-        fseek(file, file_iter_pos, 0);
-        fwrite(&file_iter, sizeof file_iter, 1, file);
-    }
-    fclose(file);
-
-    wchar_t dir_path[MAX_PATH], dir_path_unit[MAX_PATH], dst_path[MAX_PATH], src_path[MAX_PATH];
-    if (output)
-        wsprintfW(src_path, L"%s\\%s", output, L"psym_extr"); // tmp usage of src_path
     else
-        wsprintfW(src_path, L"%s", L"psym_extr");
-
-    int ret = create_dir_dupsafe(dir_path, src_path);
-
-    if (!ret)
     {
-        for (int i = 0; i < unit_count; ++i)
+        // no table, every unit has to be walked
+        unit_view unit;
+        for (uint64_t offset = ref->units_offset; offset < ref->map.size; offset += unit.size)
         {
-            struct tm* time = localtime(&units[i].date);
-            wsprintfW(dir_path_unit, L"%s\\[%i]%i.%i.%i", dir_path,
-                i + 1, time->tm_mday, time->tm_mon + 1, time->tm_year - 100);
-
-            CreateDirectoryW(dir_path_unit, NULL);
-            for (int j = 0; j < units[i].count; ++j)
+            if (read_unit_view(ref, offset, &unit))
             {
-                wsprintfW(src_path, L"%s\\%s.%s",
-                    dirs[units[i].files[j].dir_ind],
-                    units[i].files[j].name,
-                    exts[units[i].files[j].ext_ind]);
-                wsprintfW(dst_path, L"%s\\%s.%s",
-                    dir_path_unit,
-                    units[i].files[j].name,
-                    exts[units[i].files[j].ext_ind]);
-                if (!CopyFileW(src_path, dst_path, FALSE))
-                    fwprintf(stderr, L"could not copy file %s\n", src_path);
+                psym_close_reader(reader);
+                return log_psym_err(PSYM_ERR_TRUNCATED, input);
             }
+            if (offset < ref->pos)
+                ++unit_pos;
+            else
+                files_left += unit.count;
+            ++unit_count;
+            file_count += unit.count;
         }
     }
-    else
-        fwprintf(stderr, L"could not create output directory %s\n", dir_path);
 
-    // cleanup
-    for (int i = 0; i < unit_count; ++i)
+    // big enough for the longest string and any cursor name
+    uint32_t str_max = CURSOR_NAME_MAX;
+    for (uint32_t i = 0; i < ref->ext_count + ref->dir_count; ++i)
     {
-        for (int j = 0; j < units[i].count; ++j)
-            free(units[i].files[j].name);
-        free(units[i].files);
+        const uint32_t len = i < ref->ext_count ? ref->exts[i].len : ref->dirs[i - ref->ext_count].len;
+        str_max = len > str_max ? len : str_max;
+    }
+    wchar_t *str = (wchar_t *)malloc(sizeof(wchar_t) * (str_max + 1));
+    wprintf(L"format: PSYM%i\n", ref->version);
+    wprintf(L"unit size: %u\n", ref->unit_size);
+    wprintf(L"extensions:");
+    for (uint32_t i = 0; i < ref->ext_count; ++i)
+    {
+        str_view_to_wcs(str, ref->exts[i]);
+        wprintf(L" %ls", str);
+    }
+    wprintf(L"\n");
+    for (uint32_t i = 0; i < ref->dir_count; ++i)
+    {
+        str_view_to_wcs(str, ref->dirs[i]);
+        wprintf(L"directory %ls\n", str);
+    }
+    if (ref->flags & PSYM4_FLAG_PERMUTED)
+        wprintf(L"order: date, permuted with seed %llu\n", (unsigned long long)ref->seed);
+    else
+        wprintf(L"order: shuffled\n");
+    wprintf(L"units: %ls\n", ref->flags & PSYM4_FLAG_COMPACT ? L"compact" : L"plain");
+    wprintf(L"fields: %ls\n", ref->flags & PSYM4_FLAG_WIDE ? L"wide" : L"narrow");
+    wprintf(L"units: %llu, files: %llu\n", (unsigned long long)unit_count, (unsigned long long)file_count);
+    wprintf(L"position: %llu\n", (unsigned long long)unit_pos);
+    wprintf(L"remaining: %llu units, %llu files\n",
+        (unsigned long long)(unit_count - unit_pos), (unsigned long long)files_left);
+    if (ref->flags & PSYM4_FLAG_CURSORS)
+    {
+        int used = 0;
+        for (uint64_t i = 0; i < ref->cursor_count; ++i)
+        {
+            int len;
+            const uint8_t *name = ref_cursor_name(ref, i, &len);
+            if (!len)
+                continue;
+            const uint64_t pos = ref_cursor_pos(ref, i);
+            const int str_len = utf8_to_wcs(str, name, len);
+            str[str_len] = L'\0';
+            wprintf(L"cursor %ls: %llu\n", str, (unsigned long long)(pos < unit_count ? pos : unit_count));
+            ++used;
+        }
+        wprintf(L"cursor slots: %i of %llu taken\n", used, (unsigned long long)ref->cursor_count);
     }
-    free(units);
-    for (int i = 0; i < dir_count; ++i)
-        free(dirs[i]);
-    free(dir_lengths);
-    free(dirs);
-    for (int i = 0; i < ext_count; ++i)
-        free(exts[i]);
-    free(ext_lengths);
-    free(exts);
 
-    return ret;
+    free(str);
+    psym_close_reader(reader);
+    return 0;
 }
 
-int rst(const wchar_t *input)
-{
-    FILE* file = _wfopen(input, L"rb+");
-    if (!file)
-        return log_err_and_return(L"could not open file %s\n", input);
+static volatile sig_atomic_t _serve_stop = 0;
 
-    uint16_t int_buf;
-    char id_buf[6] = { '\0' };
+static void stop_serving(int sig)
+{
+    (void)sig;
+    _serve_stop = 1;
+}
 
-    fread(id_buf, sizeof(char), 5, file);
-    if (strcmp(id_buf, "PSYM3"))
+static int serve(const wchar_t **paths, int count, const wchar_t *socket_path)
+{
+    psym_server *server;
+    int failed;
+    int ret = psym_open_server(&server, socket_path, paths, count, &failed);
+    if (!ret)
     {
-        fclose(file);
-        return log_err_and_return(L"could not identify input file %s\n", input);
+        signal(SIGINT, stop_serving);
+        signal(SIGTERM, stop_serving);
+        wprintf(L"serving %i files on %ls\n", count, socket_path);
+        fflush(stdout);
+        ret = psym_run_server(server, &_serve_stop);
     }
+    psym_close_server(server);
+    return log_psym_err(ret, failed >= 0 ? paths[failed] : socket_path);
+}
 
-    fseek(file, 1, SEEK_CUR);
-    // both exts and dirs
-    for (int i = 0; i < 2; ++i)
-    {
-        fread((uint8_t *)&int_buf, sizeof(uint8_t), 1, file);
-        for (uint8_t i = *(uint8_t *)&int_buf; i; --i)
-        {
-            fread(&int_buf, sizeof int_buf, 1, file);
-            fseek(file, int_buf * sizeof(wchar_t), SEEK_CUR);
-        }
-    }
-    uint32_t pos_buf = ftell(file) + sizeof pos_buf;
-    fwrite(&pos_buf, sizeof pos_buf, 1, file);
-    fclose(file);
+// --stats or --stats=json
+static int parse_stats(opt_ctx *ctx, char *json)
+{
+    const opt_node *opt = find_opt(ctx, OPT_KEY_STATS[0]);
+    if (!OPT_FLAG_EXISTS(*opt))
+        return 0;
+    if (opt->args && wcscmp(opt->args[0], L"json"))
+        return log_err_and_return(L"invalid/out of range value: --stats\n");
+    *json = opt->args != NULL;
+    enable_stats();
     return 0;
 }
 
 int main(int argc, char **argv)
 {
-    srand(time(NULL));
-    wchar_t **wargv_mem = CommandLineToArgvW(GetCommandLineW(), &argc);
+#ifndef _WIN32
+    setlocale(LC_ALL, "");
+#endif
+    seed_rand(time(NULL));
+    wchar_t **wargv_mem = get_wargv(&argc, argv);
     wchar_t **wargv = wargv_mem;
 
     int ret = -1;
     opt_ctx* ctx = NULL;
+    char stats_json = 0;
 
     if (argc == 2 && !wcscmp(wargv[1], L"--help"))
     {
         wprintf(
-            L"usage: psym {gen <dirs...> | ext <num> | rst} [options...] <file>\n" \
+            L"usage: psym {gen <dirs...> | gen [dirs...] --from-list <list> | gen --update | ext <num> | rst | inf}\n" \
+            L"       [options...] <file>\n" \
+            L"       psym serve <files...> <socket>\n" \
+            L"       psym split <num> [--hash] <file>\n" \
+            L"       psym merge <files...> <file>\n" \
+            L"       psym {verify | prune} [-j <num>] [--stats[=json]] <file>\n" \
             L"<dirs..>              \tdirectories to cycle through\n" \
             L"<num>                 \tnumber of entries to extract\n" \
             L"<file>                \tfile to operate on/save to\n" \
@@ -420,29 +544,89 @@ int main(int argc, char **argv)
             L"gen                   \tgenerate reference file\n" \
             L"ext                   \textract entries\n" \
             L"rst                   \treset position in reference file\n" \
+            L"inf                   \tshow reference file contents and position\n" \
+            L"serve                 \thand out the units of PSYM4 files over a unix socket until interrupted,\n" \
+            L"                      \tsee psym.h for the requests\n" \
+            L"split                 \tdeal the units left in a PSYM4 file out to num files, <file>.0 and on,\n" \
+            L"                      \teach with every directory and extension, for a reader per node\n" \
+            L"merge                 \tput the units left in split files(or any with the same directories and\n" \
+            L"                      \textensions) back into one, a unit of each in turn\n" \
+            L"verify                \tlook every file of the reference file up, -j threads at a time, and count the\n" \
+            L"                      \tmissing ones per directory\n" \
+            L"prune                 \tverify, then write the PSYM4 file again without the missing files and the units\n" \
+            L"                      \tleft empty; reading order, position and cursors stay where they were\n" \
             L"gen options:\n" \
             L"-e <ext...> , -e<ext> \tspecify accepted file extensions(without leading .)\n" \
-            L"-s <size> , -s<size>  \tspecify generated entry size\n" \
-            L"-l <date> , -l<date>  \tspecify the lower file date bound in dd.mm.yy format\n" \
-            L"-u <date> , -u<date>  \tspecify the upper file date bound in dd.mm.yy format\n" \
+            L"-s <size> , -s<size>  \tspecify generated entry size, 1 to 65535; past 255 older versions can't read the file\n" \
+            L"-l <date> , -l<date>  \tspecify the lower file date bound in dd.mm.yy or dd.mm.yyyy format, yy from 69\n" \
+            L"                      \tis 19yy\n" \
+            L"-u <date> , -u<date>  \tspecify the upper file date bound in the same format\n" \
+            L"-r                    \tscan subdirectories as well\n" \
+            L"-j <num> , -j<num>    \tspecify the number of scanning threads\n" \
+            L"-x <seed> , -x<seed>  \tspecify the shuffle seed\n" \
+            L"--update              \tadd the new files of changed directories to the file, keeps the position;\n" \
+            L"                      \tonly -j and -x apply, the rest is taken from the file\n" \
+            L"--mem <size>          \tkeep memory use under size(K, M or G suffix) by sorting through temporary files\n" \
+            L"                      \tnext to the output, the result is the same; at least %lluM\n" \
+            L"--permute             \tkeep the units in date order and permute them as they are read, from a seed\n" \
+            L"                      \ttaken from -x; older versions can't read such files\n" \
+            L"--compact             \tstore names as front coded utf-8 and dates as varints, 2 to 5 times smaller;\n" \
+            L"                      \tolder versions can't read such files\n" \
+            L"--stats[=json]        \tprint phase times and counters to stderr when done, as a table or one json line\n" \
+            L"--cursors <num>       \treserve slots for num named cursors, each reader of one gets units the others\n" \
+            L"                      \tof it don't; older versions can't read such files\n" \
+            L"--dedup               \tkeep one file per content, the oldest copy: files of the same size are hashed,\n" \
+            L"                      \tequal hashes compared byte for byte, the rest is never read; --update dedups\n" \
+            L"                      \tthe new files against the ones there already\n" \
+            L"--time <time>         \tthe file time taken for its date: mtime, ctime(creation on windows), btime(birth,\n" \
+            L"                      \tmtime where the filesystem has none) or oldest(the earlier of mtime and btime)\n" \
+            L"--shards <num>        \tsplit the written file into num shards like split does, the file itself is\n" \
+            L"                      \tremoved; up to %i\n" \
+            L"--hash                \tdeal the units out by the hash of their contents instead of in turn, so the\n" \
+            L"                      \tsame unit goes to the same shard; also for split\n" \
+            L"--from-list <list>    \ttake the files from a listing(- for stdin) instead of scanning: a record per\n" \
+            L"                      \tline, or null terminated, of <date>[\\t<size>]\\t<path>, date in seconds since\n" \
+            L"                      \t1970 like find -printf '%%T@\\t%%s\\t%%p\\n' gives, commas work too; paths are\n" \
+            L"                      \ttaken relative to the dirs given, without any every file's directory is one;\n" \
+            L"                      \tevery extension is taken unless -e is given; not with -r or --time\n" \
             L"ext options:\n" \
             L"-o <out> -o<out>      \tspecify output directory\n" \
             L"-k                    \tdon't update the reading position\n" \
+            L"-p <unit> , -p<unit>  \tstart at the given unit(from 0), implies -k\n" \
+            L"-j <num> , -j<num>    \tspecify the number of copies in flight\n" \
+            L"-m <mode> , -m<mode>  \tcopy, reflink, hardlink or symlink, falls back to copy per file\n" \
+            L"-c <name> , -c<name>  \tread from the named cursor instead of the file position, made on first use\n" \
+            L"--prefetch <num>      \tread the sources of the next num files ahead while the current ones are copied,\n" \
+            L"                      \tin directory and inode order; 0 turns it off\n" \
+            L"--stats[=json]        \tsame as for gen\n" \
             L"rst options:\n" \
+            L"-x <seed> , -x<seed>  \treshuffle a file generated with --permute, every cursor goes back too\n" \
+            L"-c <name> , -c<name>  \treset the named cursor instead of the file position\n" \
+            L"verify and prune options:\n" \
+            L"-j <num> , -j<num>    \tspecify the number of lookup threads\n" \
+            L"--stats[=json]        \tsame as for gen\n" \
+            L"inf options:\n" \
             L"no options\n\n" \
 
             L"defaults:\n" \
-            L"-e:\t");
+            L"-e:\t", (unsigned long long)(PSYM_MEM_MIN >> 20), PSYM_SHARDS_MAX);
         const int def_ext_count = sizeof(_DEF_EXTENSIONS) / sizeof(wchar_t *) - 1;
         for (int i = 0; i < def_ext_count; ++i)
-            wprintf(L"%s, ", _DEF_EXTENSIONS[i]);
-        wprintf(L"%s\n", _DEF_EXTENSIONS[def_ext_count]);
+            wprintf(L"%ls, ", _DEF_EXTENSIONS[i]);
+        wprintf(L"%ls\n", _DEF_EXTENSIONS[def_ext_count]);
         wprintf(
             L"-s:\t%i\n" \
             L"-l:\tlowest possible\n" \
             L"-u:\thighest possible\n" \
-            L"-o:\tcurrent directory\n"
-            , DEF_UNIT_SIZE);
+            L"--time:\tmtime\n" \
+            L"-j:\tnumber of processors\n" \
+            L"-x:\tcurrent time\n" \
+            L"--mem:\tno limit\n" \
+            L"-o:\tcurrent directory\n" \
+            L"-p:\treading position\n" \
+            L"-m:\tcopy\n" \
+            L"--prefetch:\t%i\n"
+            , DEF_UNIT_SIZE, COPY_PREFETCH_DEF);
         ret = 0;
         goto ret_point;
     }
@@ -456,47 +640,213 @@ int main(int argc, char **argv)
     const wchar_t *file = wargv[argc - 1];
     if (!wcscmp(wargv[1], L"rst"))
     {
-        ret = argc == 3 ? 
-            rst(file) :
+        argc -= 3;
+        wargv += 2;
+        int opt_counts[2] = { 1, 1 };
+        ctx = parse_options(argc, wargv, L"xc", opt_counts, 2, NULL);
+        if (!ctx && argc)
+            goto ret_point;
+        uint64_t seed = 0;
+        char reseed = 0;
+        const wchar_t *cursor = NULL;
+        if (ctx)
+        {
+            opt_node *opt = find_opt(ctx, L'c');
+            if (OPT_ARGS_EXISTS(*opt))
+                cursor = opt->args[0];
+            opt = find_opt(ctx, L'x');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                // the same seed as gen --permute -x gets
+                seed_rand(wcstoull(opt->args[0], NULL, 10));
+                seed = rand_u64();
+                reseed = 1;
+            }
+        }
+        ret = rst(file, reseed ? &seed : NULL, cursor);
+    }
+    else if (!wcscmp(wargv[1], L"serve"))
+    {
+        ret = argc > 3 ?
+            serve((const wchar_t **)wargv + 2, argc - 3, file) :
+            log_err_and_return(L"not enough arguments\n");
+    }
+    else if (!wcscmp(wargv[1], L"split"))
+    {
+        argc -= 3;
+        wargv += 2;
+        wchar_t *end;
+        const long count = wcstol(wargv[0], &end, 10);
+        if (*end != L'\0' || count <= 0 || count > PSYM_SHARDS_MAX)
+        {
+            ret = log_err_and_return(L"invalid/out of range value: shard count\n");
+            goto ret_point;
+        }
+        int opt_counts[1] = { OPT_FLAG };
+        const wchar_t *long_opts[1] = { L"hash" };
+        ctx = parse_options(argc - 1, wargv + 1, OPT_KEY_HASH, opt_counts, 1, long_opts);
+        if (!ctx && argc > 1)
+            goto ret_point;
+        const char hash = ctx && OPT_FLAG_EXISTS(*find_opt(ctx, OPT_KEY_HASH[0]));
+        ret = split(file, count, hash ? PSYM_SHARD_HASH : PSYM_SHARD_ROUND_ROBIN);
+    }
+    else if (!wcscmp(wargv[1], L"merge"))
+    {
+        ret = argc > 3 ?
+            merge((const wchar_t **)wargv + 2, argc - 3, file) :
+            log_err_and_return(L"not enough arguments\n");
+    }
+    else if (!wcscmp(wargv[1], L"verify") || !wcscmp(wargv[1], L"prune"))
+    {
+        const char prune = !wcscmp(wargv[1], L"prune");
+        argc -= 3;
+        wargv += 2;
+        int workers = cpu_count();
+        int opt_counts[2] = { 1, OPT_ARG_OPTIONAL };
+        const wchar_t *long_opts[2] = { NULL, L"stats" };
+        ctx = parse_options(argc, wargv, L"j" OPT_KEY_STATS, opt_counts, 2, long_opts);
+        if (!ctx && argc)
+            goto ret_point;
+        if (ctx)
+        {
+            if (parse_stats(ctx, &stats_json))
+                goto ret_point;
+            opt_node *opt = find_opt(ctx, L'j');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                workers = wcstol(opt->args[0], NULL, 10);
+                if (workers <= 0 || workers > 1024)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -j\n");
+                    goto ret_point;
+                }
+            }
+        }
+        ret = verify(file, workers, prune);
+    }
+    else if (!wcscmp(wargv[1], L"inf"))
+    {
+        ret = argc == 3 ?
+            info(file) :
             log_err_and_return(L"too many arguments\n");
     }
     else if (!wcscmp(wargv[1], L"gen"))
     {
         argc -= 3;
         wargv += 2;
-        uint8_t dir_count = 0, ext_count = sizeof(_DEF_EXTENSIONS) / sizeof(wchar_t *);
-        uint8_t unit_size = DEF_UNIT_SIZE;
-        time_t l_bound = 0, u_bound = LLONG_MAX;
-        const wchar_t **dirs = wargv, **exts = _DEF_EXTENSIONS;
+        uint32_t unit_size = DEF_UNIT_SIZE;
+        scan_opts opts;
+        opts.dirs = (const wchar_t **)wargv;
+        opts.exts = _DEF_EXTENSIONS;
+        opts.dir_count = 0;
+        opts.ext_count = sizeof(_DEF_EXTENSIONS) / sizeof(wchar_t *);
+        opts.bound_lower = 0;
+        opts.bound_upper = LLONG_MAX;
+        opts.recursive = 0;
+        opts.stamp_source = STAMP_MTIME;
+        opts.sizes = 0;
+        opts.workers = cpu_count();
+        opts.prev = NULL;
+        opts.spill = NULL;
 
+        int dir_count = 0;
         while (wargv[dir_count][0] != '-' && dir_count < argc)
             ++dir_count;
+        if (dir_count > SCAN_LIST_MAX)
+        {
+            fwprintf(stderr, L"at most %i directories\n", SCAN_LIST_MAX);
+            goto ret_point;
+        }
+        opts.dir_count = dir_count;
 
-        int opt_counts[4] = { OPT_ARGS_NON_ZERO, 1, 1, 1 };
-        ctx = parse_options(argc - dir_count, wargv + dir_count, L"eslu", opt_counts, 4);
+        char update_mode = 0;
+        char permute = 0;
+        char compact = 0;
+        uint64_t mem = 0;
+        uint32_t cursors = 0;
+        char dedup = 0;
+        int shards = 0;
+        char hash = 0;
+        const wchar_t *list = NULL;
+        int opt_counts[18] = { OPT_ARGS_NON_ZERO, 1, 1, 1, OPT_FLAG, 1, 1, OPT_FLAG, 1, OPT_FLAG, OPT_FLAG, OPT_ARG_OPTIONAL,
+                               1, OPT_FLAG, 1, 1, OPT_FLAG, 1 };
+        const wchar_t *long_opts[18] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, L"update", L"mem", L"permute", L"compact",
+                                         L"stats", L"cursors", L"dedup", L"time", L"shards", L"hash", L"from-list" };
+        ctx = parse_options(argc - opts.dir_count, wargv + opts.dir_count,
+                            L"eslurjx" OPT_KEY_UPDATE OPT_KEY_MEM OPT_KEY_PERMUTE OPT_KEY_COMPACT OPT_KEY_STATS OPT_KEY_CURSORS
+                            OPT_KEY_DEDUP OPT_KEY_TIME OPT_KEY_SHARDS OPT_KEY_HASH OPT_KEY_FROM_LIST, opt_counts, 18, long_opts);
+        if (!ctx && argc > opts.dir_count)
+            goto ret_point;
         if (ctx)
         {
-            opt_node* opt = find_opt(ctx, L'e');
+            if (parse_stats(ctx, &stats_json))
+                goto ret_point;
+            opt_node *opt = find_opt(ctx, OPT_KEY_UPDATE[0]);
+            if (OPT_FLAG_EXISTS(*opt))
+            {
+                // everything but the threads and the seed comes from the file
+                for (const wchar_t *it = L"eslur"; *it; ++it)
+                {
+                    if (OPT_FLAG_EXISTS(*find_opt(ctx, *it)))
+                    {
+                        fwprintf(stderr, L"option -%lc can't be combined with --update\n", *it);
+                        goto ret_point;
+                    }
+                }
+                if (OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_MEM[0])) || OPT_FLAG_EXISTS(*find_opt(ctx, OPT_KEY_PERMUTE[0])) ||
+                    OPT_FLAG_EXISTS(*find_opt(ctx, OPT_KEY_COMPACT[0])) || OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_CURSORS[0])) ||
+                    OPT_FLAG_EXISTS(*find_opt(ctx, OPT_KEY_DEDUP[0])) ||
+                    OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_TIME[0])) ||
+                    OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_SHARDS[0])) ||
+                    OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_FROM_LIST[0])))
+                {
+                    fwprintf(stderr, L"options --mem, --permute, --compact, --cursors, --dedup, --time, --shards and "
+                                     L"--from-list can't be combined with --update\n");
+                    goto ret_point;
+                }
+                update_mode = 1;
+            }
+
+            opt = find_opt(ctx, OPT_KEY_FROM_LIST[0]);
             if (OPT_ARGS_EXISTS(*opt))
             {
-                exts = opt->args;
-                ext_count = opt->count;
+                // the listing has the dates and every file, subdirectories included
+                if (OPT_FLAG_EXISTS(*find_opt(ctx, L'r')) || OPT_ARGS_EXISTS(*find_opt(ctx, OPT_KEY_TIME[0])))
+                {
+                    fwprintf(stderr, L"options -r and --time can't be combined with --from-list\n");
+                    goto ret_point;
+                }
+                list = opt->args[0];
+                // every extension in the listing unless -e narrows it down
+                opts.ext_count = 0;
+            }
+            opt = find_opt(ctx, L'e');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                if (opt->count > SCAN_LIST_MAX)
+                {
+                    fwprintf(stderr, L"at most %i extensions\n", SCAN_LIST_MAX);
+                    goto ret_point;
+                }
+                opts.exts = (const wchar_t **)opt->args;
+                opts.ext_count = opt->count;
             }
             opt = find_opt(ctx, L's');
             if (OPT_ARGS_EXISTS(*opt))
             {
-                unit_size = wcstol(opt->args[0], NULL, 10);
-                if (unit_size == UCHAR_MAX || unit_size <= 0)
+                const long size = wcstol(opt->args[0], NULL, 10);
+                if (size <= 0 || size > PSYM_UNIT_SIZE_MAX)
                 {
                     fwprintf(stderr, L"invalid/out of range value: -s\n");
                     goto ret_point;
                 }
+                unit_size = size;
             }
             opt = find_opt(ctx, L'l');
             if (OPT_ARGS_EXISTS(*opt))
             {
-                l_bound = wcstot_t(opt->args[0]);
-                if (l_bound == -1)
+                opts.bound_lower = wcstot_t(opt->args[0]);
+                if (opts.bound_lower == -1)
                 {
                     fwprintf(stderr, L"invalid/out of range value: -l\n");
                     goto ret_point;
@@ -505,16 +855,116 @@ int main(int argc, char **argv)
             opt = find_opt(ctx, L'u');
             if (OPT_ARGS_EXISTS(*opt))
             {
-                u_bound = wcstot_t(opt->args[0]);
-                if (u_bound == -1)
+                opts.bound_upper = wcstot_t(opt->args[0]);
+                if (opts.bound_upper == -1)
                 {
                     fwprintf(stderr, L"invalid/out of range value: -u\n");
                     goto ret_point;
                 }
             }
+            opt = find_opt(ctx, L'r');
+            if (OPT_FLAG_EXISTS(*opt))
+                opts.recursive = 1;
+            opt = find_opt(ctx, OPT_KEY_TIME[0]);
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                const int source = stamp_source(opt->args[0]);
+                if (source < 0)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: --time\n");
+                    goto ret_point;
+                }
+                opts.stamp_source = source;
+            }
+            opt = find_opt(ctx, L'j');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                opts.workers = wcstol(opt->args[0], NULL, 10);
+                if (opts.workers <= 0 || opts.workers > 1024)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -j\n");
+                    goto ret_point;
+                }
+            }
+            opt = find_opt(ctx, L'x');
+            if (OPT_ARGS_EXISTS(*opt))
+                seed_rand(wcstoull(opt->args[0], NULL, 10));
+            opt = find_opt(ctx, OPT_KEY_PERMUTE[0]);
+            if (OPT_FLAG_EXISTS(*opt))
+                permute = 1;
+            opt = find_opt(ctx, OPT_KEY_COMPACT[0]);
+            if (OPT_FLAG_EXISTS(*opt))
+                compact = 1;
+            opt = find_opt(ctx, OPT_KEY_MEM[0]);
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                mem = parse_size(opt->args[0]);
+                if (!mem)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: --mem\n");
+                    goto ret_point;
+                }
+                if (mem < PSYM_MEM_MIN)
+                {
+                    fwprintf(stderr, L"--mem takes at least %lluM\n", (unsigned long long)(PSYM_MEM_MIN >> 20));
+                    goto ret_point;
+                }
+            }
+            opt = find_opt(ctx, OPT_KEY_DEDUP[0]);
+            if (OPT_FLAG_EXISTS(*opt))
+            {
+                // the sizes are grouped over the whole library, which a bounded scan never holds
+                if (mem)
+                {
+                    fwprintf(stderr, L"option --dedup can't be combined with --mem\n");
+                    goto ret_point;
+                }
+                dedup = 1;
+            }
+            opt = find_opt(ctx, OPT_KEY_CURSORS[0]);
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                wchar_t *end;
+                const long long value = wcstoll(opt->args[0], &end, 10);
+                if (*end != L'\0' || value <= 0 || value > PSYM_CURSORS_MAX)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: --cursors\n");
+                    goto ret_point;
+                }
+                cursors = value;
+            }
+            opt = find_opt(ctx, OPT_KEY_SHARDS[0]);
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                wchar_t *end;
+                shards = wcstol(opt->args[0], &end, 10);
+                if (*end != L'\0' || shards <= 0 || shards > PSYM_SHARDS_MAX)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: --shards\n");
+                    goto ret_point;
+                }
+            }
+            opt = find_opt(ctx, OPT_KEY_HASH[0]);
+            if (OPT_FLAG_EXISTS(*opt))
+            {
+                if (!shards)
+                {
+                    fwprintf(stderr, L"option --hash needs --shards\n");
+                    goto ret_point;
+                }
+                hash = 1;
+            }
         }
 
-        ret = gen(dirs, dir_count, exts, ext_count, file, unit_size, l_bound, u_bound);
+        if (update_mode && opts.dir_count)
+            ret = log_err_and_return(L"--update takes the directories from the reference file\n");
+        else
+        {
+            const uint64_t seed = permute ? rand_u64() : 0;
+            const psym_write_opts wopts = { unit_size, mem, permute ? &seed : NULL, compact, cursors, dedup };
+            ret = update_mode ? update(file, opts.workers) :
+                gen(&opts, list, file, &wopts, shards, hash ? PSYM_SHARD_HASH : PSYM_SHARD_ROUND_ROBIN);
+        }
     }
     else if (!wcscmp(wargv[1], L"ext"))
     {
@@ -522,31 +972,91 @@ int main(int argc, char **argv)
         wargv += 2;
         int unit_count = -1;
         char keep_pos = 0;
+        int64_t start = -1;
         wchar_t *output = NULL;
+        int workers = cpu_count();
+        int mode = COPY_MODE_COPY;
+        int prefetch = COPY_PREFETCH_DEF;
 
         unit_count = wcstol(wargv[0], NULL, 10);
         if (unit_count == INT_MAX || unit_count <= 0)
             return log_err_and_return(L"invalid/out of range value: unit count\n");
 
-        int opt_counts[2] = { 1, OPT_FLAG };
-        ctx = parse_options(argc - 1, wargv + 1, L"ok", opt_counts, 2);
+        const wchar_t *cursor = NULL;
+        int opt_counts[8] = { 1, OPT_FLAG, 1, 1, 1, OPT_ARG_OPTIONAL, 1, 1 };
+        const wchar_t *long_opts[8] = { NULL, NULL, NULL, NULL, NULL, L"stats", NULL, L"prefetch" };
+        ctx = parse_options(argc - 1, wargv + 1, L"okpjm" OPT_KEY_STATS L"c" OPT_KEY_PREFETCH, opt_counts, 8, long_opts);
+        if (!ctx && argc > 1)
+            goto ret_point;
         if (ctx)
         {
+            if (parse_stats(ctx, &stats_json))
+                goto ret_point;
             opt_node *opt = find_opt(ctx, L'o');
             if (OPT_ARGS_EXISTS(*opt))
                 output = opt->args[0];
             opt = find_opt(ctx, L'k');
             if (OPT_FLAG_EXISTS(*opt))
                 keep_pos = 1;
+            opt = find_opt(ctx, L'p');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                wchar_t *end;
+                start = wcstoll(opt->args[0], &end, 10);
+                if (*end != L'\0' || start < 0)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -p\n");
+                    goto ret_point;
+                }
+                keep_pos = 1;
+            }
+            opt = find_opt(ctx, L'j');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                workers = wcstol(opt->args[0], NULL, 10);
+                if (workers <= 0 || workers > 1024)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -j\n");
+                    goto ret_point;
+                }
+            }
+            opt = find_opt(ctx, L'm');
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                const int mode_count = sizeof(_MODE_NAMES) / sizeof(wchar_t *);
+                for (mode = 0; mode < mode_count && wcscmp(opt->args[0], _MODE_NAMES[mode]); ++mode);
+                if (mode == mode_count)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: -m\n");
+                    goto ret_point;
+                }
+                mode += COPY_MODE_COPY;
+            }
+            opt = find_opt(ctx, L'c');
+            if (OPT_ARGS_EXISTS(*opt))
+                cursor = opt->args[0];
+            opt = find_opt(ctx, OPT_KEY_PREFETCH[0]);
+            if (OPT_ARGS_EXISTS(*opt))
+            {
+                wchar_t *end;
+                prefetch = wcstol(opt->args[0], &end, 10);
+                if (*end != L'\0' || prefetch < 0 || prefetch > 65536)
+                {
+                    fwprintf(stderr, L"invalid/out of range value: --prefetch\n");
+                    goto ret_point;
+                }
+            }
         }
 
-        ret = extract(file, output, unit_count, keep_pos);
+        ret = extract(file, output, unit_count, keep_pos, start, cursor, workers, mode, prefetch);
     }
     else
         ret = log_err_and_return(L"invalid usage, type --help to learn more\n");
 
 ret_point:
-    LocalFree(wargv_mem);
+    if (stats_enabled)
+        print_stats(stats_json);
+    free_wargv(wargv_mem);
     if (ctx)
         delete_opt_ctx(ctx);
     return ret;
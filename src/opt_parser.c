@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 struct opt_ctx
 {
@@ -23,7 +24,34 @@ opt_node *find_opt(opt_ctx *ctx, wchar_t opt)
     return NULL;
 }
 
-opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_arg_count, int arg_count)
+static opt_node *find_long_opt(opt_ctx *ctx, const wchar_t **long_opts, const wchar_t *name, int len)
+{
+    if (!long_opts)
+        return NULL;
+    for (int i = 0; i < ctx->count; ++i)
+        if (long_opts[i] && (int)wcslen(long_opts[i]) == len && !wcsncmp(long_opts[i], name, len))
+            return ctx->nodes + i;
+    return NULL;
+}
+
+// a lone - is an argument, it usually stands for stdin
+#define IS_OPT(arg) ((arg)[0] == L'-' && (arg)[1] != L'\0')
+
+static int take_args(opt_node *node, int max_count, wchar_t ***argv, wchar_t **argv_end, const wchar_t *name)
+{
+    while (++*argv != argv_end && !IS_OPT(**argv) && (max_count == OPT_ARGS_NON_ZERO || node->count < max_count))
+        ++node->count;
+    if (!node->count)
+    {
+        fwprintf(stderr, L"no arguments provided for option %ls\n", name);
+        return -1;
+    }
+    node->args = *argv - node->count;
+    return 0;
+}
+
+opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_arg_count, int arg_count,
+                       const wchar_t **long_opts)
 {
     if (!argc)
         return NULL;
@@ -34,27 +62,73 @@ opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_a
     for (int i = 0; i < arg_count; ++i)
     {
         ctx->nodes[i].opt = opts[i];
+        ctx->nodes[i].args = NULL;
         ctx->nodes[i].count = 0;
     }
 
     wchar_t **argv_end = argv + argc;
     while (argv != argv_end)
     {
-        if (argv[0][0] != L'-')
+        if (!IS_OPT(argv[0]))
         {
-            fwprintf(stderr, L"unrecognized token %s\n", argv[0]);
+            fwprintf(stderr, L"unrecognized token %ls\n", argv[0]);
             goto err_ret;
         }
 
+        if (argv[0][1] == L'-')
+        {
+            wchar_t *name = argv[0] + 2;
+            wchar_t *value = wcschr(name, L'=');
+            const int len = value ? value - name : (int)wcslen(name);
+            opt_node *node = find_long_opt(ctx, long_opts, name, len);
+            if (!node)
+            {
+                fwprintf(stderr, L"unrecognized option %ls\n", argv[0]);
+                goto err_ret;
+            }
+            if (node->count)
+            {
+                fwprintf(stderr, L"option %ls already specified\n", argv[0]);
+                goto err_ret;
+            }
+
+            const int ind = node - ctx->nodes;
+            if (opt_arg_count[ind] == OPT_FLAG)
+            {
+                if (value)
+                {
+                    fwprintf(stderr, L"option %ls takes no arguments\n", argv[0]);
+                    goto err_ret;
+                }
+                node->count = 1;
+                ++argv;
+            }
+            else if (opt_arg_count[ind] == OPT_ARG_OPTIONAL && !value)
+            {
+                node->count = 1;
+                ++argv;
+            }
+            else if (value)
+            {
+                const int value_len = wcslen(value + 1);
+                memmove(argv[0], value + 1, sizeof(wchar_t) * (value_len + 1));
+                node->count = 1;
+                node->args = argv++;
+            }
+            else if (take_args(node, opt_arg_count[ind], &argv, argv_end, argv[0]))
+                goto err_ret;
+            continue;
+        }
+
         opt_node *node = find_opt(ctx, argv[0][1]);
         if (!node)
         {
-            fwprintf(stderr, L"unrecognized option -%c\n", argv[0][1]);
+            fwprintf(stderr, L"unrecognized option -%lc\n", argv[0][1]);
             goto err_ret;
         }
         if (node->count)
         {
-            fwprintf(stderr, L"option -%c already specified\n", argv[0][1]);
+            fwprintf(stderr, L"option -%lc already specified\n", argv[0][1]);
             goto err_ret;
         }
 
@@ -67,13 +141,13 @@ opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_a
                 node = find_opt(ctx, *(str_it++));
                 if (!node || opt_arg_count[node - ctx->nodes] != OPT_FLAG)
                 {
-                    fwprintf(stderr, L"unrecognized option -%c\n", argv[0][1]);
+                    fwprintf(stderr, L"unrecognized option -%lc\n", argv[0][1]);
                     goto err_ret;
                 }
 
                 if (node->count)
                 {
-                    fwprintf(stderr, L"option -%c already specified\n", argv[0][1]);
+                    fwprintf(stderr, L"option -%lc already specified\n", argv[0][1]);
                     goto err_ret;
                 }
 
@@ -83,26 +157,20 @@ opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_a
         }
         else
         {
-            if (argv[0][2] != L'\0')
+            if (opt_arg_count[node - ctx->nodes] == OPT_ARG_OPTIONAL && argv[0][2] == L'\0')
+            {
+                node->count = 1;
+                ++argv;
+            }
+            else if (argv[0][2] != L'\0')
             {
                 const int len = wcslen(argv[0] + 2);
                 memmove(argv[0], argv[0] + 2, sizeof(wchar_t) * (len + 1));
                 node->count = 1;
                 node->args = argv++;
             }
-            else
-            {
-                const int ind = node - ctx->nodes;
-                while (++argv != argv_end && argv[0][0] != L'-' &&  node->count < opt_arg_count[ind])
-                    ++node->count;
-                if (!node->count)
-                {
-                    fwprintf(stderr, L"no arguments provided for option -%c\n", argv[0][1]);
-                    goto err_ret;
-                }
-
-                node->args = argv - node->count;
-            }
+            else if (take_args(node, opt_arg_count[node - ctx->nodes], &argv, argv_end, argv[0]))
+                goto err_ret;
         }       
     }
     return ctx;
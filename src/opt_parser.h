@@ -5,6 +5,8 @@
 
 #define OPT_FLAG (0)
 #define OPT_ARGS_NON_ZERO (-1)
+// a flag that may carry one value, only inline as in --name=value or -xvalue; args is NULL without it
+#define OPT_ARG_OPTIONAL (-2)
 
 #define OPT_FLAG_EXISTS(node) ((node).count)
 #define OPT_ARGS_EXISTS OPT_FLAG_EXISTS
@@ -20,6 +22,9 @@ typedef struct opt_ctx opt_ctx;
 
 void delete_opt_ctx(opt_ctx *ctx);
 opt_node *find_opt(opt_ctx* ctx, wchar_t opt);
-opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_arg_count, int arg_count);
+// long_opts may be NULL or hold a --name(or NULL) per option, --name=value passes the value inline;
+// options meant to be long only take a key that can't be typed as a short one
+opt_ctx *parse_options(int argc, wchar_t **argv, const wchar_t *opts, int *opt_arg_count, int arg_count,
+                       const wchar_t **long_opts);
 
 #endif
@@ -0,0 +1,30 @@
+#include "permute.h"
+#include "util.h"
+
+// each half goes through the round function 3 times
+#define FEISTEL_ROUNDS 6
+
+uint64_t permute_index(uint64_t index, uint64_t count, uint64_t seed)
+{
+    if (count < 2)
+        return index;
+
+    int bits = 1;
+    while (bits < 64 && (count - 1) >> bits)
+        ++bits;
+    const int half = (bits + 1) / 2;
+    const uint64_t mask = ((uint64_t)1 << half) - 1;
+
+    do
+    {
+        uint64_t left = index >> half, right = index & mask;
+        for (int round = 0; round < FEISTEL_ROUNDS; ++round)
+        {
+            const uint64_t next = left ^ (mix_u64(right ^ mix_u64(seed + round)) & mask);
+            left = right;
+            right = next;
+        }
+        index = (left << half) | right;
+    } while (index >= count);
+    return index;
+}
@@ -0,0 +1,10 @@
+#ifndef PSYM_PERMUTE
+#define PSYM_PERMUTE
+
+#include <stdint.h>
+
+// keyed bijection of [0, count): a Feistel network over the smallest even bit width that holds count,
+// results past count are fed back in until they land inside it, which takes under 4 tries on average
+uint64_t permute_index(uint64_t index, uint64_t count, uint64_t seed);
+
+#endif
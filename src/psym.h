@@ -0,0 +1,284 @@
+#ifndef PSYM_LIB
+#define PSYM_LIB
+
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "copy.h"
+#include "dedup.h"
+#include "dir_state.h"
+#include "ref_map.h"
+#include "scan.h"
+
+/*
+* libpsym, everything the cli does as a library; the cli in main.c is a client of it like any other
+*
+* ===FILE STRUCTURE===
+* 5b: "PSYM4"
+* 1b: unit size, 0 with flag 0x10
+* 2b: flags, 0x1: directory state, 0x2: permuted, 0x4: compact units, 0x8: named cursors, 0x10: wide fields
+* 8b: position: index of the next unit
+* 8b: unit count
+* 8b: unit table offset
+* 8b: directory state offset, with flag 0x1 only
+* 8b: permutation seed, with flag 0x2 only
+* 8b(time_t): date base, with flag 0x4 only
+* 8b: unit size, with flag 0x10 only
+* 8b: cursor slot count, with flag 0x8 only
+* 64b * slot count: named cursors, with flag 0x8 only
+* 1b: extension count
+* Sb: extensions
+* 1b: directory count
+* Sb: directories(full paths)
+* Tb: unit table
+* Ub: units
+* Db: directory state
+*
+* Tb = 8b * unit count: unit offsets from the file start, 1b * unit count: files per unit
+* Db = 1b: recursive scan | time source(STAMP_*, timestamp.h) << 1 | gen --dedup << 3, 8b(time_t): lower date bound,
+*      8b(time_t): upper date bound, 4b: directory count,
+*      per directory 1b: root index, 8b: modification stamp, Sb: path relative to the root
+* gen --update writes new units, the table and the state past the end of the file, the old ones are left unused
+* without flag 0x2 the table is in reading order; with it the unit at reading position i is table entry
+* permute_index(i, unit count, seed)(permute.h) and gen writes the table and the units in date order
+* with flag 0x4 the units are Cb instead of Ub, the rest of the file is the same:
+* Cb = 1b: unit size, Vb: zigzag(date - date base), per file Vb: directory index * extension count + extension index,
+*      Vb: bytes shared with the previous name of the unit, Vb: length, utf-8 name bytes past the shared ones
+* Vb = little endian base 128 varint; names are utf-8 with lone surrogates encoded like any other code point
+* with flag 0x10 the 1b extension and directory counts, string lengths, directory and extension indices of Ub and
+* the root index of Db are Vb, the files per unit in Tb and Ub are 4b; set when a count, the unit size or a name
+* does not fit the narrow fields
+* a cursor slot is 8b: position, 1b: name length(0: free), 55b: utf-8 name; positions, the header one too, are 8b aligned
+* and only changed with atomic compare and swap on the mapping, slots are added under a byte range lock on the slots
+*
+* ===PSYM3, read only===
+* 5b: "PSYM3"
+* 1b: unit size
+* 1b: extension count
+* Sb: extensions
+* 1b: directory count
+* Sb: directories(full paths)
+* 4b: position in file
+* Ub: units
+*
+* Sb = 2b: length without null term, 2b(utf-16) * length: string without null term
+* Ub = 1b: unit size, 8b(time_t): date, Fb: files
+* Fb = 1b: directory index, 1b: extension index, Sb: filename(relative to the directory for recursive scans)
+*/
+
+// the first four are the REF_ERR_* of ref_map.h
+#define PSYM_ERR_OPEN -1
+#define PSYM_ERR_FORMAT -2
+#define PSYM_ERR_TRUNCATED -3
+#define PSYM_ERR_FLAGS -4
+#define PSYM_ERR_WRITE -5
+#define PSYM_ERR_NO_DIR -6 // a directory to scan does not exist
+#define PSYM_ERR_MEMORY -7 // the scan did not fit in memory
+#define PSYM_ERR_SPILL -8 // temporary files next to the output
+#define PSYM_ERR_TOO_MANY -9 // more units than a table takes
+#define PSYM_ERR_NO_STATE -10 // an update needs a file with a directory state
+#define PSYM_ERR_NOT_PERMUTED -11
+#define PSYM_ERR_OUTPUT_DIR -12 // the extraction directory could not be made
+#define PSYM_ERR_READ_ONLY -13
+#define PSYM_ERR_VERSION -14 // PSYM3 files can't do it
+#define PSYM_ERR_SOCKET -15
+#define PSYM_ERR_PLATFORM -16 // not available on this platform
+#define PSYM_ERR_NO_CURSORS -17 // the file was generated without --cursors
+#define PSYM_ERR_NO_CURSOR -18
+#define PSYM_ERR_CURSORS_FULL -19
+#define PSYM_ERR_CURSOR_NAME -20 // empty or over CURSOR_NAME_MAX bytes
+#define PSYM_ERR_MISMATCH -21 // files to merge differ in directories, extensions or unit layout
+#define PSYM_ERR_LIST -22 // a file listing could not be opened or read
+
+// named cursor slots a writer reserves at most
+#define PSYM_CURSORS_MAX 65536
+
+// largest unit size, directory and extension counts are capped at SCAN_LIST_MAX(scan.h)
+#define PSYM_UNIT_SIZE_MAX UINT16_MAX
+
+// smallest memory budget of a bounded writer
+#define PSYM_MEM_MIN (16ull << 20)
+
+// shards a file is split into at most
+#define PSYM_SHARDS_MAX 1024
+
+// a file as the scanner found it, name is relative to its directory and only valid during the call
+typedef struct
+{
+    const wchar_t *name;
+    int len;
+    time_t date;
+    uint16_t dir;
+    uint16_t ext;
+} psym_record;
+
+// nonzero stops the scan and fails it
+typedef int (*psym_record_fn)(const psym_record *record, void *arg);
+
+// streams every file through fn in the order the workers finish their directories, never from two threads at once,
+// without holding the library in memory; state may be NULL, opts->spill is ignored
+int psym_scan(const scan_opts *opts, psym_record_fn fn, void *arg, dir_state *state);
+
+typedef struct
+{
+    uint32_t unit_size; // 1 to PSYM_UNIT_SIZE_MAX
+    uint64_t mem; // 0 keeps every file in memory, otherwise a budget of at least PSYM_MEM_MIN
+    const uint64_t *seed; // NULL shuffles the table, otherwise the units stay in date order and are permuted as read
+    char compact;
+    uint32_t cursors; // named cursor slots up to PSYM_CURSORS_MAX, 0 for none
+    char dedup; // psym_gen in memory only(mem 0): one file per content, see dedup_files(dedup.h)
+} psym_write_opts;
+
+// files go in, a reference file comes out once the writer is finished;
+// the unit shuffle draws from the global rand(util.h) when the writer is finished
+typedef struct psym_writer psym_writer;
+
+// opts gives the header: directories, extensions, date bounds and whether the scan was recursive, it has to outlive
+// the writer and may gain directories and extensions at the end of its lists between files(a listing finds them as it
+// goes); writes nothing until psym_finish_writer, bounded writers spill next to output
+int psym_open_writer(psym_writer **writer, const wchar_t *output, const scan_opts *opts, const psym_write_opts *wopts);
+// files added in the scan order(root, directory, extension, name) give the same file with or without a budget,
+// equal dates otherwise keep the order they were added in
+int psym_add_file(psym_writer *writer, const psym_record *record);
+// files per directory and extension so far, ext_count entries per directory
+const uint64_t *psym_writer_counts(const psym_writer *writer);
+// sorts, shuffles and writes the file, state is stored for psym_update and may be NULL;
+// nothing is written when there are no files
+int psym_finish_writer(psym_writer *writer, const dir_state *state);
+void psym_close_writer(psym_writer *writer);
+
+// scan and write in one go, counts gets ext_count entries per directory after dedup and may be NULL, so may dedup
+// which gets what wopts->dedup removed
+int psym_gen(const scan_opts *opts, const wchar_t *output, const psym_write_opts *wopts, uint64_t *counts,
+             dedup_result *dedup);
+
+typedef struct
+{
+    scan_opts opts; // the directories and extensions the file got, the rest as given
+    uint64_t *counts; // ext_count entries per directory
+    uint64_t records;
+    uint64_t malformed; // records without a date or a path, skipped
+    uint64_t filtered; // out of the date bounds, under none of the directories or without an accepted extension
+} psym_list_result;
+
+// gen from a file listing(list.h has the record format, - reads stdin) instead of a scan: opts gives the date bounds,
+// the directories the paths are taken relative to(none: the directory of every file becomes one) and the extensions
+// (none: every extension found is taken), the dates are the ones of the listing; the rest is psym_gen's, duplicates
+// are found by the sizes of the listing when every record has one; the directory state is empty, so an update finds
+// nothing to add. free the result whatever it returns
+int psym_gen_list(const wchar_t *list, const scan_opts *opts, const wchar_t *output, const psym_write_opts *wopts,
+                  psym_list_result *result, dedup_result *dedup);
+void psym_free_list_result(psym_list_result *result);
+
+typedef struct
+{
+    uint32_t changed_dirs;
+    uint32_t dir_count;
+    uint32_t new_files;
+    uint64_t new_units;
+    uint32_t duplicates; // new files left out as copies, files made with --dedup only
+} psym_update_result;
+
+// adds the new files of changed directories to a file written with a directory state, the position stays
+int psym_update(const wchar_t *path, int workers, psym_update_result *result);
+
+// how psym_split deals the units out
+#define PSYM_SHARD_ROUND_ROBIN 0 // unit i to shard i % count
+#define PSYM_SHARD_HASH 1 // by the XXH3 of the unit's bytes, a unit lands in the same shard wherever it is
+
+// the units left past the position of a PSYM4 file into count(up to PSYM_SHARDS_MAX) new files that each stand on
+// their own: every shard has all the directories and extensions, the unit layout and as many free cursor slots as
+// input, its units keep their reading order; no shard gets a directory state or a permutation, unit_counts gets the
+// units of each
+int psym_split(const wchar_t *input, const wchar_t **outputs, int count, int by, uint64_t *unit_counts);
+// the units left of every input into one new file, a unit of each in turn; the inputs must have the same directories,
+// extensions and unit layout, shards of one split or whatever is left of them; failed gets the index of the input
+// that could not be merged or -1, cursor slots are the most of any input
+int psym_merge(const wchar_t **inputs, int count, const wchar_t *output, uint64_t *unit_count, int *failed);
+
+typedef struct
+{
+    uint32_t dir_count;
+    wchar_t **dirs; // the directories of the file
+    uint64_t *dir_files; // per directory
+    uint64_t *dir_missing;
+    uint64_t files;
+    uint64_t missing;
+    double seconds; // spent looking the files up
+    uint64_t units; // psym_prune only: before and after
+    uint64_t units_left;
+} psym_verify_result;
+
+// looks every file of the reference file up where it says the file is, on workers threads with a task per run of files
+// in one directory that opens it once; nothing is read or written. free the result whatever it returns
+int psym_verify(const wchar_t *path, int workers, psym_verify_result *result);
+// psym_verify, then a PSYM4 file is written again without the missing files and the units they leave empty; the rest
+// keeps its reading order, permutation seed, directory state and layout, the position and every cursor stay on the
+// unit they were at(or the next one left). the new file replaces path, which nothing should read in the meantime;
+// a file with nothing missing is left as it is
+int psym_prune(const wchar_t *path, int workers, psym_verify_result *result);
+void psym_free_verify_result(psym_verify_result *result);
+
+// a reference file opened once, the header is parsed when it is opened and units are handed out of the mapping;
+// one thread at a time per reader
+typedef struct psym_reader psym_reader;
+
+// writable readers keep the position in the file, PSYM4 positions are claimed atomically in the mapping so readers in
+// any number of processes drain a file without getting the same unit twice
+int psym_open_reader(psym_reader **reader, const wchar_t *path, char writable);
+void psym_close_reader(psym_reader *reader);
+// header fields, table lookups and file iterators of ref_map.h work on it
+const ref_map *psym_reader_ref(const psym_reader *reader);
+// up to count units from the position on, returns how many there were or one of PSYM_ERR_*;
+// views point into the mapping and stay valid until the reader is closed
+int psym_peek_units(psym_reader *reader, unit_view *units, int count);
+// the same and moves the position past them
+int psym_next_units(psym_reader *reader, unit_view *units, int count);
+// moves the position past up to count units without reading them, returns how many or PSYM_ERR_VERSION;
+// first gets the reading position of the first one
+int64_t psym_claim_units(psym_reader *reader, uint64_t count, uint64_t *first);
+// current position, other readers of a writable one move it too
+uint64_t psym_tell(psym_reader *reader);
+// to a unit index, PSYM3 files are walked up to it
+int psym_seek(psym_reader *reader, uint64_t unit);
+// the reader works on a named cursor of a PSYM4_FLAG_CURSORS file from then on, NULL goes back to the header position;
+// create adds a missing one at the first unit
+int psym_use_cursor(psym_reader *reader, const wchar_t *name, char create);
+// PSYM4_FLAG_PERMUTED files of a writable reader only, every position and cursor goes back to the first unit
+int psym_reseed(psym_reader *reader, uint64_t seed);
+// the position of a writable reader reaches the disk with the rest of the mapping, this pushes it there now;
+// without wait the writeback is only started
+int psym_sync_reader(psym_reader *reader, char wait);
+
+// makes a new psym_extr directory in output(NULL for the current one) with a directory per unit and a job per file,
+// files of a unit that share a name get " (2)", " (3)"... before the extension;
+// dir_path gets the extraction directory(or the one that could not be made), allocated to fit like the job paths and
+// freed by the caller whatever it returns;
+// the jobs are for copy_files(copy.h)
+int psym_extract_jobs(const psym_reader *reader, const unit_view *units, int count, const wchar_t *output,
+                      wchar_t **dir_path, copy_job **jobs, int *job_count);
+void psym_free_jobs(copy_job *jobs, int job_count);
+
+/*
+* psym serve: PSYM4 files opened once and served over a unix domain socket, one request per line and one event loop
+* thread for all clients, so every unit is handed out once; the cursors are written back every second while they move
+* requests, <file> is a path as given to the server or its index:
+* next <file> <n>                  hands out the next n units and moves the position past them
+* range <file> <from> <to> [limit] units dated from..to(time_t, inclusive) newest first, 1024 by default; nothing moves
+* reset <file> [seed]              back to the first unit, the seed reshuffles a permuted file like rst -x
+* stats                            a line per file, then a line for the server
+* replies are ok or err <reason>, then for unit lists per unit "unit <position> <date> <file count>" and a line per
+* file with its source path(utf-8, \\ and \n escaped), then an empty line
+*/
+typedef struct psym_server psym_server;
+
+// opens every file writable, failed gets the index of the one that could not be served or -1;
+// close the server whatever it returns
+int psym_open_server(psym_server **server, const wchar_t *socket_path, const wchar_t **paths, int count, int *failed);
+// serves until stop is set, from a signal handler for example
+int psym_run_server(psym_server *server, volatile sig_atomic_t *stop);
+void psym_close_server(psym_server *server);
+
+#endif
@@ -0,0 +1,382 @@
+#include "psym.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct psym_reader
+{
+    ref_map ref;
+    char writable;
+};
+
+int psym_open_reader(psym_reader **reader, const wchar_t *path, char writable)
+{
+    psym_reader *r = (psym_reader *)malloc(sizeof(psym_reader));
+    const int ret = open_ref_map(&r->ref, path, writable);
+    if (ret)
+    {
+        free(r);
+        return ret;
+    }
+    r->writable = writable;
+    *reader = r;
+    return 0;
+}
+
+void psym_close_reader(psym_reader *reader)
+{
+    close_ref_map(&reader->ref);
+    free(reader);
+}
+
+const ref_map *psym_reader_ref(const psym_reader *reader)
+{
+    return &reader->ref;
+}
+
+// from pos on, end gets the position past the last unit read
+static int read_units(const ref_map *ref, uint64_t pos, unit_view *units, int count, uint64_t *end)
+{
+    const double start = stat_begin();
+    int unit_count = 0;
+    if (ref->version == 3)
+    {
+        for (; unit_count < count && pos < ref->map.size; pos += units[unit_count++].size)
+            if (read_unit_view(ref, pos, units + unit_count))
+                return PSYM_ERR_TRUNCATED;
+        *end = pos;
+    }
+    else
+    {
+        // any unit is one table lookup away
+        for (uint64_t i = pos; unit_count < count && i < ref->unit_count; ++i, ++unit_count)
+            if (read_unit_view(ref, ref_unit_offset(ref, ref_unit_index(ref, i)), units + unit_count))
+                return PSYM_ERR_TRUNCATED;
+        *end = pos + unit_count;
+    }
+    stat_end(STAT_UNIT_PARSE, start);
+    return unit_count;
+}
+
+// positions of writable PSYM4 readers live in the file, other processes move them too
+static char shared_pos(const psym_reader *reader)
+{
+    return reader->writable && reader->ref.version == 4;
+}
+
+int psym_peek_units(psym_reader *reader, unit_view *units, int count)
+{
+    uint64_t end;
+    if (shared_pos(reader))
+        load_ref_pos(&reader->ref);
+    return read_units(&reader->ref, reader->ref.pos, units, count, &end);
+}
+
+int64_t psym_claim_units(psym_reader *reader, uint64_t count, uint64_t *first)
+{
+    ref_map *ref = &reader->ref;
+    if (ref->version == 3)
+        return PSYM_ERR_VERSION;
+    if (shared_pos(reader))
+        return claim_ref_units(ref, count, first);
+    // nobody else sees this position
+    *first = ref->pos < ref->unit_count ? ref->pos : ref->unit_count;
+    const uint64_t claimed = ref->unit_count - *first < count ? ref->unit_count - *first : count;
+    ref->pos = *first + claimed;
+    return claimed;
+}
+
+int psym_next_units(psym_reader *reader, unit_view *units, int count)
+{
+    ref_map *ref = &reader->ref;
+    uint64_t end;
+    if (ref->version == 3)
+    {
+        // the 4b position of PSYM3 is read and written back, concurrent readers may get the same units
+        const int ret = read_units(ref, ref->pos, units, count, &end);
+        if (ret >= 0 && reader->writable)
+            set_ref_pos(ref, end);
+        else if (ret >= 0)
+            ref->pos = end;
+        return ret;
+    }
+    // the units are taken before they are read, a failed read loses them
+    uint64_t first;
+    const int64_t claimed = psym_claim_units(reader, count, &first);
+    return read_units(ref, first, units, (int)claimed, &end);
+}
+
+uint64_t psym_tell(psym_reader *reader)
+{
+    return shared_pos(reader) ? load_ref_pos(&reader->ref) : reader->ref.pos;
+}
+
+int psym_seek(psym_reader *reader, uint64_t unit)
+{
+    ref_map *ref = &reader->ref;
+    uint64_t pos = unit;
+    if (ref->version == 3)
+    {
+        // the position is the offset of the unit, no table to look it up in
+        unit_view view;
+        pos = ref->units_offset;
+        for (uint64_t i = 0; i < unit && pos < ref->map.size; ++i, pos += view.size)
+            if (read_unit_view(ref, pos, &view))
+                return PSYM_ERR_TRUNCATED;
+    }
+    if (reader->writable)
+        set_ref_pos(ref, pos);
+    else
+        ref->pos = pos;
+    return 0;
+}
+
+int psym_use_cursor(psym_reader *reader, const wchar_t *name, char create)
+{
+    ref_map *ref = &reader->ref;
+    // PSYM3 has no cursors, its position sits after the header strings and is the one in use already
+    if (!name)
+    {
+        if (ref->version == 4)
+        {
+            ref->pos_offset = PSYM4_POS_OFFSET;
+            load_ref_pos(ref);
+        }
+        return 0;
+    }
+    if (!(ref->flags & PSYM4_FLAG_CURSORS))
+        return PSYM_ERR_NO_CURSORS;
+    if (create && !reader->writable)
+        return PSYM_ERR_READ_ONLY;
+    uint8_t utf8[CURSOR_NAME_MAX * 4];
+    const int name_len = wcslen(name);
+    if (!name_len || name_len > (int)CURSOR_NAME_MAX)
+        return PSYM_ERR_CURSOR_NAME;
+    const int len = wcs_to_utf8(utf8, name, name_len);
+    if (len > (int)CURSOR_NAME_MAX)
+        return PSYM_ERR_CURSOR_NAME;
+
+    // two readers creating the same name have to agree on the slot, positions don't need the lock
+    const uint64_t table_size = CURSOR_SLOT_SIZE * ref->cursor_count;
+    if (reader->writable && lock_file_map(&ref->map, ref->cursors_offset, table_size))
+        return PSYM_ERR_WRITE;
+    int64_t slot = find_ref_cursor(ref, utf8, len);
+    if (slot < 0 && create)
+        slot = add_ref_cursor(ref, utf8, len);
+    if (reader->writable)
+        unlock_file_map(&ref->map, ref->cursors_offset, table_size);
+    if (slot < 0)
+        return create ? PSYM_ERR_CURSORS_FULL : PSYM_ERR_NO_CURSOR;
+    use_ref_cursor(ref, slot);
+    return 0;
+}
+
+int psym_reseed(psym_reader *reader, uint64_t seed)
+{
+    ref_map *ref = &reader->ref;
+    if (!reader->writable)
+        return PSYM_ERR_READ_ONLY;
+    if (!(ref->flags & PSYM4_FLAG_PERMUTED))
+        return PSYM_ERR_NOT_PERMUTED;
+    // a new seed is a new order, every position starts over in it
+    set_ref_seed(ref, seed);
+    const uint64_t pos_offset = ref->pos_offset;
+    ref->pos_offset = PSYM4_POS_OFFSET;
+    set_ref_pos(ref, 0);
+    for (uint64_t i = 0; i < ref->cursor_count; ++i)
+    {
+        use_ref_cursor(ref, i);
+        set_ref_pos(ref, 0);
+    }
+    ref->pos_offset = pos_offset;
+    ref->pos = 0;
+    return 0;
+}
+
+int psym_sync_reader(psym_reader *reader, char wait)
+{
+    return reader->writable && sync_file_map(&reader->ref.map, wait) ? PSYM_ERR_WRITE : 0;
+}
+
+// dir/name.ext in a new buffer, names of wide files are not bound by PSYM_MAX_PATH
+static wchar_t *join_path(const wchar_t *dir, const wchar_t *name, const wchar_t *ext)
+{
+    const size_t len = wcslen(dir) + wcslen(name) + wcslen(ext) + 3;
+    wchar_t *path = (wchar_t *)malloc(sizeof(wchar_t) * len);
+    swprintf(path, len, L"%ls" PSYM_SEP L"%ls.%ls", dir, name, ext);
+    return path;
+}
+
+// names the filesystem takes for the same file
+#ifdef _WIN32
+#define DST_CMP _wcsicmp
+#else
+#define DST_CMP wcscmp
+#endif
+
+typedef struct
+{
+    const wchar_t *dst;
+    int ind;
+} dst_entry;
+
+static int compare_dst_name(const void *a, const void *b)
+{
+    return DST_CMP(((const dst_entry *)a)->dst, ((const dst_entry *)b)->dst);
+}
+
+static int compare_dst(const void *a, const void *b)
+{
+    const int cmp = compare_dst_name(a, b);
+    const int x = ((const dst_entry *)a)->ind, y = ((const dst_entry *)b)->ind;
+    return cmp ? cmp : (x > y) - (x < y);
+}
+
+// files of one unit from different directories can share a name, every one after the first in unit order gets
+// " (2)", " (3)"... before the extension, past the names the unit has already
+static void unique_dsts(copy_job *jobs, int count)
+{
+    if (count < 2)
+        return;
+    dst_entry *entries = (dst_entry *)malloc(sizeof(dst_entry) * count);
+    for (int i = 0; i < count; ++i)
+    {
+        entries[i].dst = jobs[i].dst;
+        entries[i].ind = i;
+    }
+    qsort(entries, count, sizeof(dst_entry), compare_dst);
+
+    // the sorted names are looked up while renaming, the new ones go in after
+    wchar_t **renamed = (wchar_t **)calloc(count, sizeof(wchar_t *));
+    for (int i = 1, n = 2; i < count; ++i)
+    {
+        if (compare_dst_name(entries + i, entries + i - 1))
+        {
+            n = 2;
+            continue;
+        }
+        const wchar_t *dst = entries[i].dst, *dot = wcsrchr(dst, L'.');
+        const size_t len = wcslen(dst) + 16;
+        wchar_t *name = (wchar_t *)malloc(sizeof(wchar_t) * len);
+        dst_entry key = { name, 0 };
+        do
+            swprintf(name, len, L"%.*ls (%i)%ls", (int)(dot - dst), dst, n++, dot);
+        while (bsearch(&key, entries, count, sizeof(dst_entry), compare_dst_name));
+        renamed[entries[i].ind] = name;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (!renamed[i])
+            continue;
+        free((wchar_t *)jobs[i].dst);
+        jobs[i].dst = renamed[i];
+    }
+    free(renamed);
+    free(entries);
+}
+
+// every string of the header decoded once, one past the end is empty for indices out of range
+static wchar_t **decode_strs(const str_view *strs, uint32_t count)
+{
+    wchar_t **wcs = (wchar_t **)malloc(sizeof(wchar_t *) * (count + 1));
+    for (uint32_t i = 0; i <= count; ++i)
+    {
+        const str_view str = i < count ? strs[i] : (str_view){ NULL, 0 };
+        wcs[i] = (wchar_t *)malloc(sizeof(wchar_t) * (str.len + 1));
+        str_view_to_wcs(wcs[i], str);
+    }
+    return wcs;
+}
+
+static void free_strs(wchar_t **strs, uint32_t count)
+{
+    for (uint32_t i = 0; i <= count; ++i)
+        free(strs[i]);
+    free(strs);
+}
+
+int psym_extract_jobs(const psym_reader *reader, const unit_view *units, int count, const wchar_t *output,
+                      wchar_t **dir_path, copy_job **jobs, int *job_count)
+{
+    const ref_map *ref = &reader->ref;
+    *dir_path = NULL;
+    // unit directories are named after the date, one localtime can't take is a broken file
+    for (int i = 0; i < count; ++i)
+        if (!localtime(&units[i].date))
+            return PSYM_ERR_FORMAT;
+    const size_t extr_len = (output ? wcslen(output) : 0) + 16;
+    wchar_t *extr_path = (wchar_t *)malloc(sizeof(wchar_t) * extr_len);
+    if (output)
+        swprintf(extr_path, extr_len, L"%ls" PSYM_SEP L"%ls", output, L"psym_extr");
+    else
+        swprintf(extr_path, extr_len, L"%ls", L"psym_extr");
+    *dir_path = create_dir_dupsafe(extr_path);
+    if (!*dir_path)
+    {
+        // the error names the directory it could not make
+        *dir_path = extr_path;
+        return PSYM_ERR_OUTPUT_DIR;
+    }
+    free(extr_path);
+    // [unit]day.month.year
+    const size_t unit_len = wcslen(*dir_path) + 48;
+    wchar_t *dir_path_unit = (wchar_t *)malloc(sizeof(wchar_t) * unit_len);
+
+    int file_count = 0;
+    for (int i = 0; i < count; ++i)
+        file_count += units[i].count;
+    copy_job *job = (copy_job *)malloc(sizeof(copy_job) * (file_count ? file_count : 1));
+    *jobs = job;
+
+    wchar_t **dirs = decode_strs(ref->dirs, ref->dir_count);
+    wchar_t **exts = decode_strs(ref->exts, ref->ext_count);
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    // the unit directories are made in the same loop, their time goes along
+    const double start = stat_begin();
+    for (int i = 0; i < count; ++i)
+    {
+        struct tm* time = localtime(&units[i].date);
+        swprintf(dir_path_unit, unit_len, L"%ls" PSYM_SEP L"[%i]%i.%i.%i", *dir_path,
+            i + 1, time->tm_mday, time->tm_mon + 1, time->tm_year % 100);
+
+        // every unit directory exists before the first copy starts
+        create_dir(dir_path_unit);
+        copy_job *unit_jobs = job;
+        file_view file;
+        start_unit_files(&iter, units + i);
+        while (next_file(&iter, &file))
+        {
+            const wchar_t *name = file.name;
+            const wchar_t *dir = dirs[file.dir < ref->dir_count ? file.dir : ref->dir_count];
+            const wchar_t *ext = exts[file.ext < ref->ext_count ? file.ext : ref->ext_count];
+
+            // files from subdirectories land flat in the unit directory, names that meet are numbered after
+            const wchar_t *base = wcsrchr(name, PSYM_SEP_CHAR);
+            base = base ? base + 1 : name;
+            job->src = join_path(dir, name, ext);
+            job->dst = join_path(dir_path_unit, base, ext);
+            ++job;
+        }
+        unique_dsts(unit_jobs, (int)(job - unit_jobs));
+    }
+    stat_end(STAT_UNIT_PARSE, start);
+    free(dir_path_unit);
+    free_file_iter(&iter);
+    free_strs(dirs, ref->dir_count);
+    free_strs(exts, ref->ext_count);
+    *job_count = job - *jobs;
+    return 0;
+}
+
+void psym_free_jobs(copy_job *jobs, int job_count)
+{
+    for (int i = 0; i < job_count; ++i)
+    {
+        free((wchar_t *)jobs[i].src);
+        free((wchar_t *)jobs[i].dst);
+    }
+    free(jobs);
+}
@@ -0,0 +1,592 @@
+#include "ref_map.h"
+#include "permute.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    const uint8_t *it;
+    const uint8_t *end;
+} cursor;
+
+static int take(cursor *cur, void *dst, size_t size)
+{
+    if ((size_t)(cur->end - cur->it) < size)
+        return -1;
+    memcpy(dst, cur->it, size);
+    cur->it += size;
+    return 0;
+}
+
+static int take_varint(cursor *cur, uint64_t *value);
+
+// 2b length, a varint with PSYM4_FLAG_WIDE
+static int take_str(cursor *cur, str_view *str, char wide)
+{
+    uint64_t len;
+    if (wide)
+    {
+        if (take_varint(cur, &len))
+            return -1;
+    }
+    else
+    {
+        uint16_t narrow;
+        if (take(cur, &narrow, sizeof narrow))
+            return -1;
+        len = narrow;
+    }
+    if ((uint64_t)(cur->end - cur->it) / sizeof(uint16_t) < len)
+        return -1;
+    str->len = (uint32_t)len;
+    str->data = cur->it;
+    cur->it += sizeof(uint16_t) * str->len;
+    return 0;
+}
+
+static int take_varint(cursor *cur, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (cur->it == cur->end)
+            return -1;
+        const uint8_t byte = *cur->it++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+// 1b count, a varint with PSYM4_FLAG_WIDE; strs is allocated even when it fails
+static int take_strs(cursor *cur, str_view **strs, uint32_t *count, char wide)
+{
+    uint64_t value = 0;
+    uint8_t narrow;
+    if (wide ? take_varint(cur, &value) : take(cur, &narrow, sizeof narrow))
+        return -1;
+    value = wide ? value : narrow;
+    // every string takes a byte at least
+    if (value > (uint64_t)(cur->end - cur->it))
+        return -1;
+    *count = (uint32_t)value;
+    *strs = (str_view *)malloc(sizeof(str_view) * (*count ? *count : 1));
+    for (uint32_t i = 0; i < *count; ++i)
+        if (take_str(cur, *strs + i, wide))
+            return -1;
+    return 0;
+}
+
+// the unit file count, UNIT_COUNT_SIZE bytes
+static int take_unit_count(cursor *cur, uint32_t *count, char wide)
+{
+    uint8_t narrow;
+    if (wide)
+        return take(cur, count, sizeof *count);
+    if (take(cur, &narrow, sizeof narrow))
+        return -1;
+    *count = narrow;
+    return 0;
+}
+
+int open_ref_map(ref_map *ref, const wchar_t *path, char writable)
+{
+    const double start = stat_begin();
+    memset(ref, 0, sizeof(ref_map));
+    if (map_file(&ref->map, path, writable))
+        return REF_ERR_OPEN;
+    STAT_ADD(STAT_SYSCALLS, 3); // open, fstat, mmap
+
+    cursor cur = { ref->map.data, ref->map.data + ref->map.size };
+    char id[5];
+    if (take(&cur, id, sizeof id))
+        goto format_err;
+    if (!memcmp(id, "PSYM4", sizeof id))
+        ref->version = 4;
+    else if (!memcmp(id, "PSYM3", sizeof id))
+        ref->version = 3;
+    else
+        goto format_err;
+
+    uint8_t narrow_size;
+    if (take(&cur, &narrow_size, sizeof narrow_size))
+        goto truncated_err;
+    ref->unit_size = narrow_size;
+    if (ref->version == 4)
+    {
+        if (take(&cur, &ref->flags, sizeof ref->flags) || take(&cur, &ref->pos, sizeof ref->pos) ||
+            take(&cur, &ref->unit_count, sizeof ref->unit_count) || take(&cur, &ref->table_offset, sizeof ref->table_offset))
+            goto truncated_err;
+        if (ref->flags & ~PSYM4_KNOWN_FLAGS)
+        {
+            close_ref_map(ref);
+            return REF_ERR_FLAGS;
+        }
+        if ((ref->flags & PSYM4_FLAG_DIR_STATE) && take(&cur, &ref->state_offset, sizeof ref->state_offset))
+            goto truncated_err;
+        ref->seed_offset = cur.it - ref->map.data;
+        if ((ref->flags & PSYM4_FLAG_PERMUTED) && take(&cur, &ref->seed, sizeof ref->seed))
+            goto truncated_err;
+        if ((ref->flags & PSYM4_FLAG_COMPACT) && take(&cur, &ref->date_base, sizeof ref->date_base))
+            goto truncated_err;
+        if (ref->flags & PSYM4_FLAG_WIDE)
+        {
+            uint64_t wide_size;
+            if (take(&cur, &wide_size, sizeof wide_size))
+                goto truncated_err;
+            if (!wide_size || wide_size > UINT32_MAX)
+                goto format_err;
+            ref->unit_size = (uint32_t)wide_size;
+        }
+        if (ref->flags & PSYM4_FLAG_CURSORS)
+        {
+            if (take(&cur, &ref->cursor_count, sizeof ref->cursor_count) ||
+                ref->cursor_count > (uint64_t)(cur.end - cur.it) / CURSOR_SLOT_SIZE)
+                goto truncated_err;
+            ref->cursors_offset = cur.it - ref->map.data;
+            for (uint64_t i = 0; i < ref->cursor_count; ++i)
+                if (cur.it[CURSOR_SLOT_SIZE * i + sizeof(uint64_t)] > CURSOR_NAME_MAX)
+                    goto format_err;
+            cur.it += CURSOR_SLOT_SIZE * ref->cursor_count;
+        }
+        ref->pos_offset = PSYM4_POS_OFFSET;
+        if (ref->table_offset > ref->map.size || ref->state_offset > ref->map.size ||
+            ref->unit_count > (ref->map.size - ref->table_offset) / TABLE_ENTRY_SIZE(ref->flags & PSYM4_FLAG_WIDE))
+            goto truncated_err;
+    }
+
+    const char wide = (ref->flags & PSYM4_FLAG_WIDE) != 0;
+    if (take_strs(&cur, &ref->exts, &ref->ext_count, wide) || take_strs(&cur, &ref->dirs, &ref->dir_count, wide))
+        goto truncated_err;
+
+    if (ref->version == 3)
+    {
+        uint32_t pos;
+        ref->pos_offset = cur.it - ref->map.data;
+        if (take(&cur, &pos, sizeof pos))
+            goto truncated_err;
+        ref->pos = pos;
+        ref->units_offset = cur.it - ref->map.data;
+    }
+    STAT_ADD(STAT_BYTES_READ, cur.it - ref->map.data);
+    stat_end(STAT_HEADER_PARSE, start);
+    return 0;
+
+format_err:
+    close_ref_map(ref);
+    return REF_ERR_FORMAT;
+truncated_err:
+    close_ref_map(ref);
+    return REF_ERR_TRUNCATED;
+}
+
+void close_ref_map(ref_map *ref)
+{
+    unmap_file(&ref->map);
+    free(ref->exts);
+    free(ref->dirs);
+    ref->exts = ref->dirs = NULL;
+}
+
+static volatile int64_t *pos_word(ref_map *ref)
+{
+    return (volatile int64_t *)(ref->map.data + ref->pos_offset);
+}
+
+void set_ref_pos(ref_map *ref, uint64_t pos)
+{
+    if (ref->version == 4)
+    {
+        int64_t prev = interlocked_load(pos_word(ref)), seen;
+        while ((seen = interlocked_cas(pos_word(ref), prev, pos)) != prev)
+            prev = seen;
+    }
+    else
+    {
+        const uint32_t file_iter = pos;
+        memcpy(ref->map.data + ref->pos_offset, &file_iter, sizeof file_iter);
+    }
+    ref->pos = pos;
+}
+
+uint64_t claim_ref_units(ref_map *ref, uint64_t count, uint64_t *first)
+{
+    // a fetch-add could run past the last unit, the compare and swap stops there
+    int64_t pos = interlocked_load(pos_word(ref));
+    for (;;)
+    {
+        const uint64_t start = (uint64_t)pos < ref->unit_count ? (uint64_t)pos : ref->unit_count;
+        const uint64_t end = ref->unit_count - start < count ? ref->unit_count : start + count;
+        const int64_t seen = interlocked_cas(pos_word(ref), pos, end);
+        if (seen == pos)
+        {
+            *first = start;
+            ref->pos = end;
+            return end - start;
+        }
+        pos = seen;
+    }
+}
+
+uint64_t load_ref_pos(ref_map *ref)
+{
+    if (ref->version == 4)
+        ref->pos = interlocked_load(pos_word(ref));
+    return ref->pos;
+}
+
+void set_ref_seed(ref_map *ref, uint64_t seed)
+{
+    memcpy(ref->map.data + ref->seed_offset, &seed, sizeof seed);
+    ref->seed = seed;
+}
+
+static uint8_t *cursor_slot(const ref_map *ref, int64_t slot)
+{
+    return ref->map.data + ref->cursors_offset + CURSOR_SLOT_SIZE * slot;
+}
+
+int64_t find_ref_cursor(const ref_map *ref, const uint8_t *name, int len)
+{
+    for (uint64_t i = 0; i < ref->cursor_count; ++i)
+    {
+        const uint8_t *slot = cursor_slot(ref, i);
+        if (slot[sizeof(uint64_t)] == len && len && !memcmp(slot + sizeof(uint64_t) + 1, name, len))
+            return i;
+    }
+    return -1;
+}
+
+int64_t add_ref_cursor(ref_map *ref, const uint8_t *name, int len)
+{
+    for (uint64_t i = 0; i < ref->cursor_count; ++i)
+    {
+        uint8_t *slot = cursor_slot(ref, i);
+        if (slot[sizeof(uint64_t)])
+            continue;
+        const uint64_t pos = 0;
+        memcpy(slot, &pos, sizeof pos);
+        memcpy(slot + sizeof pos + 1, name, len);
+        slot[sizeof pos] = len;
+        return i;
+    }
+    return -1;
+}
+
+void use_ref_cursor(ref_map *ref, int64_t slot)
+{
+    ref->pos_offset = cursor_slot(ref, slot) - ref->map.data;
+    load_ref_pos(ref);
+}
+
+uint64_t ref_cursor_pos(const ref_map *ref, int64_t slot)
+{
+    return interlocked_load((const volatile int64_t *)cursor_slot(ref, slot));
+}
+
+const uint8_t *ref_cursor_name(const ref_map *ref, int64_t slot, int *len)
+{
+    // checked when the file was opened, but the mapping is shared with other writers
+    const uint8_t *data = cursor_slot(ref, slot);
+    *len = data[sizeof(uint64_t)] > CURSOR_NAME_MAX ? CURSOR_NAME_MAX : data[sizeof(uint64_t)];
+    return data + sizeof(uint64_t) + 1;
+}
+
+// count, zigzag date delta, per file: dir * ext count + ext, shared prefix, suffix length, suffix
+static int read_compact_unit(const ref_map *ref, cursor *cur, unit_view *unit)
+{
+    uint64_t zigzag, key, prefix, suffix;
+    if (take_unit_count(cur, &unit->count, ref->flags & PSYM4_FLAG_WIDE) || take_varint(cur, &zigzag))
+        return -1;
+    unit->date = (time_t)((uint64_t)ref->date_base + ((zigzag >> 1) ^ (0 - (zigzag & 1))));
+
+    // keys past the last directory, without dividing every one
+    const uint64_t key_end = (uint64_t)(UINT16_MAX + 1) * (ref->ext_count ? ref->ext_count : 1);
+    uint64_t prev_len = 0;
+    unit->files = cur->it;
+    for (uint32_t i = 0; i < unit->count; ++i)
+    {
+        // names are only bounded by the file, the iterator grows its buffers to them; most fields are one byte
+        if (cur->end - cur->it >= 3 && !((cur->it[0] | cur->it[1] | cur->it[2]) & 0x80))
+        {
+            key = cur->it[0];
+            prefix = cur->it[1];
+            suffix = cur->it[2];
+            cur->it += 3;
+            if (key >= key_end || prefix > prev_len || (uint64_t)(cur->end - cur->it) < suffix)
+                return -1;
+        }
+        else if (take_varint(cur, &key) || key >= key_end || take_varint(cur, &prefix) ||
+            take_varint(cur, &suffix) || prefix > prev_len || (uint64_t)(cur->end - cur->it) < suffix ||
+            prefix + suffix > INT32_MAX)
+            return -1;
+        cur->it += suffix;
+        prev_len = prefix + suffix;
+    }
+    return 0;
+}
+
+int read_unit_view(const ref_map *ref, uint64_t offset, unit_view *unit)
+{
+    if (offset >= ref->map.size)
+        return -1;
+    cursor cur = { ref->map.data + offset, ref->map.data + ref->map.size };
+    if (ref->flags & PSYM4_FLAG_COMPACT)
+    {
+        if (read_compact_unit(ref, &cur, unit))
+            return -1;
+    }
+    else
+    {
+        const char wide = (ref->flags & PSYM4_FLAG_WIDE) != 0;
+        if (take_unit_count(&cur, &unit->count, wide) || take(&cur, &unit->date, sizeof unit->date))
+            return -1;
+
+        unit->files = cur.it;
+        for (uint32_t i = 0; i < unit->count; ++i)
+        {
+            str_view name;
+            uint64_t dir, ext;
+            if (wide)
+            {
+                if (take_varint(&cur, &dir) || take_varint(&cur, &ext) || dir > UINT16_MAX || ext > UINT16_MAX)
+                    return -1;
+            }
+            else if ((size_t)(cur.end - cur.it) < sizeof(uint8_t) * 2)
+                return -1;
+            else
+                cur.it += sizeof(uint8_t) * 2;
+            if (take_str(&cur, &name, wide) || name.len > INT32_MAX / 2)
+                return -1;
+        }
+    }
+    unit->offset = offset;
+    unit->size = cur.it - (ref->map.data + offset);
+    STAT_ADD(STAT_BYTES_READ, unit->size);
+    return 0;
+}
+
+uint64_t ref_unit_index(const ref_map *ref, uint64_t pos)
+{
+    return ref->flags & PSYM4_FLAG_PERMUTED ? permute_index(pos, ref->unit_count, ref->seed) : pos;
+}
+
+uint64_t ref_unit_offset(const ref_map *ref, uint64_t index)
+{
+    uint64_t offset;
+    memcpy(&offset, ref->map.data + ref->table_offset + sizeof(uint64_t) * index, sizeof offset);
+    return offset;
+}
+
+uint32_t ref_unit_count(const ref_map *ref, uint64_t index)
+{
+    const uint8_t *counts = ref->map.data + ref->table_offset + sizeof(uint64_t) * ref->unit_count;
+    if (!(ref->flags & PSYM4_FLAG_WIDE))
+        return counts[index];
+    uint32_t count;
+    memcpy(&count, counts + sizeof count * index, sizeof count);
+    return count;
+}
+
+void init_file_iter(file_iter *iter, const ref_map *ref)
+{
+    iter->ref = ref;
+    iter->it = NULL;
+    iter->left = 0;
+    iter->ascii = 1;
+    iter->utf8_cap = ref->flags & PSYM4_FLAG_COMPACT ? 1024 : 0;
+    iter->utf8 = iter->utf8_cap ? (uint8_t *)malloc(iter->utf8_cap) : NULL;
+    iter->name_cap = 1024;
+    iter->name = (wchar_t *)malloc(sizeof(wchar_t) * iter->name_cap);
+}
+
+// a utf-8 byte decodes to at most one character, a utf-16 unit too
+static void reserve_name(file_iter *iter, uint32_t len)
+{
+    if (len < iter->name_cap)
+        return;
+    while (len >= iter->name_cap)
+        iter->name_cap *= 2;
+    iter->name = (wchar_t *)realloc(iter->name, sizeof(wchar_t) * iter->name_cap);
+}
+
+void free_file_iter(file_iter *iter)
+{
+    free(iter->utf8);
+    free(iter->name);
+}
+
+void start_unit_files(file_iter *iter, const unit_view *unit)
+{
+    iter->it = unit->files;
+    iter->left = unit->count;
+    iter->ascii = 1;
+}
+
+// the unit was validated by read_unit_view, the varints can't run off
+static uint64_t next_varint(const uint8_t **it)
+{
+    if (**it < 0x80)
+        return *(*it)++;
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        const uint8_t byte = *(*it)++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+}
+
+int next_file(file_iter *iter, file_view *file)
+{
+    if (!iter->left)
+        return 0;
+    --iter->left;
+
+    if (!(iter->ref->flags & PSYM4_FLAG_COMPACT))
+    {
+        str_view name;
+        if (iter->ref->flags & PSYM4_FLAG_WIDE)
+        {
+            file->dir = (uint16_t)next_varint(&iter->it);
+            file->ext = (uint16_t)next_varint(&iter->it);
+            name.len = (uint32_t)next_varint(&iter->it);
+        }
+        else
+        {
+            uint16_t len;
+            file->dir = iter->it[0];
+            file->ext = iter->it[1];
+            memcpy(&len, iter->it + 2, sizeof len);
+            name.len = len;
+            iter->it += 2 + sizeof len;
+        }
+        name.data = iter->it;
+        iter->it = name.data + sizeof(uint16_t) * name.len;
+        reserve_name(iter, name.len);
+        file->len = str_view_to_wcs(iter->name, name);
+        file->name = iter->name;
+        return 1;
+    }
+
+    // read_unit_view kept keys under 65536 * ext_count, a 32-bit division is enough
+    const uint32_t ext_count = iter->ref->ext_count ? iter->ref->ext_count : 1;
+    const uint32_t key = (uint32_t)next_varint(&iter->it);
+    const int prefix = (int)next_varint(&iter->it);
+    const int suffix = (int)next_varint(&iter->it);
+    file->dir = (uint16_t)(key / ext_count);
+    file->ext = (uint16_t)(key % ext_count);
+    reserve_name(iter, prefix + suffix);
+    // after an ascii name the prefix is already in name, only the suffix is decoded; utf8 is left behind until a
+    // name that is not ascii needs it
+    const uint8_t *src = iter->it;
+    int i = 0;
+    if (iter->ascii)
+        for (; i < suffix && src[i] < 0x80; ++i)
+            iter->name[prefix + i] = src[i];
+    iter->it += suffix;
+    if (iter->ascii && i == suffix)
+        file->len = prefix + suffix;
+    else
+    {
+        if ((uint32_t)(prefix + suffix) > iter->utf8_cap)
+        {
+            while ((uint32_t)(prefix + suffix) > iter->utf8_cap)
+                iter->utf8_cap *= 2;
+            iter->utf8 = (uint8_t *)realloc(iter->utf8, iter->utf8_cap);
+        }
+        if (iter->ascii)
+            for (int j = 0; j < prefix; ++j)
+                iter->utf8[j] = (uint8_t)iter->name[j];
+        memcpy(iter->utf8 + prefix, src, suffix);
+        file->len = utf8_to_wcs(iter->name, iter->utf8, prefix + suffix);
+        iter->ascii = 1;
+        for (i = 0; i < prefix + suffix && iter->ascii; ++i)
+            iter->ascii = iter->utf8[i] < 0x80;
+    }
+    iter->name[file->len] = L'\0';
+    file->name = iter->name;
+    return 1;
+}
+
+int read_ref_dir_state(const ref_map *ref, dir_state *state, char *recursive, char *stamp_source, time_t *bound_lower,
+                       time_t *bound_upper)
+{
+    init_dir_state(state);
+    if (!(ref->flags & PSYM4_FLAG_DIR_STATE))
+        return -1;
+
+    cursor cur = { ref->map.data + ref->state_offset, ref->map.data + ref->map.size };
+    uint32_t count;
+    char scan_flags;
+    if (take(&cur, &scan_flags, sizeof scan_flags) || take(&cur, bound_lower, sizeof *bound_lower) ||
+        take(&cur, bound_upper, sizeof *bound_upper) || take(&cur, &count, sizeof count))
+        return -1;
+    *recursive = scan_flags & 1;
+    *stamp_source = (scan_flags >> 1) & 3;
+    state->dedup = (scan_flags >> 3) & 1;
+
+    const char wide = (ref->flags & PSYM4_FLAG_WIDE) != 0;
+    uint32_t path_cap = 1024;
+    wchar_t *path = (wchar_t *)malloc(sizeof(wchar_t) * path_cap);
+    int ret = 0;
+    for (uint32_t i = 0; i < count && !ret; ++i)
+    {
+        uint64_t root = 0;
+        uint8_t narrow = 0;
+        uint64_t stamp;
+        str_view path_view;
+        if ((wide ? take_varint(&cur, &root) : take(&cur, &narrow, sizeof narrow)) || take(&cur, &stamp, sizeof stamp) ||
+            take_str(&cur, &path_view, wide) || (wide ? root : narrow) > UINT16_MAX)
+            ret = -1;
+        else
+        {
+            if (path_view.len >= path_cap)
+            {
+                path_cap = path_view.len + 1;
+                path = (wchar_t *)realloc(path, sizeof(wchar_t) * path_cap);
+            }
+            ret = add_dir_state(state, (uint16_t)(wide ? root : narrow), path, str_view_to_wcs(path, path_view), stamp);
+        }
+    }
+    free(path);
+    if (ret)
+        free_dir_state(state);
+    else
+        sort_dir_state(state);
+    return ret;
+}
+
+int str_view_to_wcs(wchar_t *dst, str_view str)
+{
+#if WCHAR_MAX > 0xFFFF
+    int out = 0;
+    for (uint32_t i = 0; i < str.len; ++i)
+    {
+        uint16_t c, next;
+        memcpy(&c, str.data + sizeof(uint16_t) * i, sizeof c);
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < str.len)
+        {
+            memcpy(&next, str.data + sizeof(uint16_t) * (i + 1), sizeof next);
+            if (next >= 0xDC00 && next < 0xE000)
+            {
+                dst[out++] = 0x10000 + ((c - 0xD800) << 10) + (next - 0xDC00);
+                ++i;
+                continue;
+            }
+        }
+        dst[out++] = c;
+    }
+    dst[out] = L'\0';
+    return out;
+#else
+    memcpy(dst, str.data, sizeof(uint16_t) * str.len);
+    dst[str.len] = L'\0';
+    return str.len;
+#endif
+}
@@ -0,0 +1,146 @@
+#ifndef PSYM_REF_MAP
+#define PSYM_REF_MAP
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "dir_state.h"
+#include "util.h"
+
+#define PSYM4_POS_OFFSET 8
+#define PSYM4_UNIT_COUNT_OFFSET 16
+#define PSYM4_TABLE_OFFSET 24
+#define PSYM4_STATE_OFFSET 32
+
+#define PSYM4_FLAG_DIR_STATE 0x1
+#define PSYM4_FLAG_PERMUTED 0x2
+#define PSYM4_FLAG_COMPACT 0x4
+#define PSYM4_FLAG_CURSORS 0x8
+#define PSYM4_FLAG_WIDE 0x10
+#define PSYM4_KNOWN_FLAGS (PSYM4_FLAG_DIR_STATE | PSYM4_FLAG_PERMUTED | PSYM4_FLAG_COMPACT | PSYM4_FLAG_CURSORS | \
+                           PSYM4_FLAG_WIDE)
+
+// file counts of the units and the table are 1b, 4b with PSYM4_FLAG_WIDE
+#define UNIT_COUNT_SIZE(wide) ((wide) ? sizeof(uint32_t) : sizeof(uint8_t))
+#define TABLE_ENTRY_SIZE(wide) (sizeof(uint64_t) + UNIT_COUNT_SIZE(wide))
+
+// a named cursor slot: 8b position, 1b name length(0: free), utf-8 name
+#define CURSOR_SLOT_SIZE 64
+#define CURSOR_NAME_MAX (CURSOR_SLOT_SIZE - sizeof(uint64_t) - sizeof(uint8_t))
+
+#define REF_ERR_OPEN -1
+#define REF_ERR_FORMAT -2
+#define REF_ERR_TRUNCATED -3
+#define REF_ERR_FLAGS -4
+
+// on disk string, the utf-16 units are not aligned
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t len;
+} str_view;
+
+// reference file read in place from a mapping, nothing is copied out of it;
+// every view handed out is checked against the file size first
+typedef struct
+{
+    file_map map;
+    int version;
+    uint16_t flags;
+    uint32_t unit_size;
+    uint32_t ext_count;
+    uint32_t dir_count;
+    str_view *exts;
+    str_view *dirs;
+    uint64_t pos; // byte offset of the next unit in PSYM3, its index in PSYM4
+    uint64_t pos_offset; // the header position or the one of a named cursor
+    uint64_t unit_count; // PSYM4 only, PSYM3 has to be walked
+    uint64_t table_offset;
+    uint64_t state_offset; // with PSYM4_FLAG_DIR_STATE
+    uint64_t seed; // with PSYM4_FLAG_PERMUTED
+    uint64_t seed_offset;
+    time_t date_base; // with PSYM4_FLAG_COMPACT
+    uint64_t cursors_offset; // first slot, with PSYM4_FLAG_CURSORS
+    uint64_t cursor_count;
+    uint64_t units_offset; // first unit in PSYM3
+} ref_map;
+
+typedef struct
+{
+    const uint8_t *files;
+    uint64_t offset;
+    uint64_t size; // including the unit header
+    time_t date;
+    uint32_t count;
+} unit_view;
+
+// name is decoded into the iterator and stays valid until the next file
+typedef struct
+{
+    const wchar_t *name;
+    int len;
+    uint16_t dir;
+    uint16_t ext;
+} file_view;
+
+typedef struct
+{
+    const ref_map *ref;
+    const uint8_t *it;
+    uint32_t left;
+    char ascii; // the previous name of a compact unit is all ascii: name holds it and utf8 is stale
+    uint8_t *utf8; // the previous name when it is not
+    wchar_t *name;
+    uint32_t utf8_cap; // both buffers grow to the longest name so far
+    uint32_t name_cap;
+} file_iter;
+
+// returns one of REF_ERR_*
+int open_ref_map(ref_map *ref, const wchar_t *path, char writable);
+void close_ref_map(ref_map *ref);
+// PSYM4 positions are 8b aligned in the mapping and only changed atomically, every process that maps the file sees
+// a position move at once
+void set_ref_pos(ref_map *ref, uint64_t pos);
+// moves the position past up to count units and returns how many, first gets the one it was at;
+// concurrent claims on the same position get disjoint units
+uint64_t claim_ref_units(ref_map *ref, uint64_t count, uint64_t *first);
+// current value of the position, ref->pos is only what it was when last looked at
+uint64_t load_ref_pos(ref_map *ref);
+// PSYM4_FLAG_PERMUTED only, the caller resets the position
+void set_ref_seed(ref_map *ref, uint64_t seed);
+
+// unit at the byte offset, files are validated up front so iterating them can't fail
+int read_unit_view(const ref_map *ref, uint64_t offset, unit_view *unit);
+// table index of the unit at a reading position, the two differ in PSYM4_FLAG_PERMUTED files only
+uint64_t ref_unit_index(const ref_map *ref, uint64_t pos);
+// PSYM4 table lookups, index must be below unit_count
+uint64_t ref_unit_offset(const ref_map *ref, uint64_t index);
+uint32_t ref_unit_count(const ref_map *ref, uint64_t index);
+
+void init_file_iter(file_iter *iter, const ref_map *ref);
+void free_file_iter(file_iter *iter);
+// unit must come from read_unit_view of the same file
+void start_unit_files(file_iter *iter, const unit_view *unit);
+// returns 0 once the unit is done
+int next_file(file_iter *iter, file_view *file);
+
+// named cursors, slot index or -1; the caller holds the range lock of the slots(lock_file_map) while it looks them
+// up or adds one, the positions don't need it
+int64_t find_ref_cursor(const ref_map *ref, const uint8_t *name, int len);
+// -1 when every slot is taken, the new cursor starts at the first unit
+int64_t add_ref_cursor(ref_map *ref, const uint8_t *name, int len);
+// the slot's position becomes the one set_ref_pos, claim_ref_units and load_ref_pos work on
+void use_ref_cursor(ref_map *ref, int64_t slot);
+// name of a taken slot, len is 0 for a free one
+const uint8_t *ref_cursor_name(const ref_map *ref, int64_t slot, int *len);
+uint64_t ref_cursor_pos(const ref_map *ref, int64_t slot);
+
+// the directory state and the scan settings it was made with, PSYM4_FLAG_DIR_STATE must be set
+int read_ref_dir_state(const ref_map *ref, dir_state *state, char *recursive, char *stamp_source, time_t *bound_lower,
+                       time_t *bound_upper);
+
+// dst must have room for len + 1 characters, returns the length written
+int str_view_to_wcs(wchar_t *dst, str_view str);
+
+#endif
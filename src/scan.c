@@ -0,0 +1,604 @@
+#include "scan.h"
+#include "ext_table.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <dirent.h>
+#endif
+
+// files of one directory, in the order the listing returned them
+typedef struct
+{
+    wchar_t *rel_path;
+    uint32_t first;
+    uint32_t count;
+    uint16_t root;
+} scan_block;
+
+typedef struct
+{
+    const scan_opts *opts;
+    ext_table *exts;
+    stamp_range range; // the date bounds in the stamps of the platform
+    thread_pool *pool;
+    file_table *staging; // per worker, reused from directory to directory
+    psym_mutex lock;
+    file_table *files;
+    scan_block *blocks;
+    int block_count;
+    int block_cap;
+    dir_state *state;
+    // children of the previous state's directories, child_first has one more entry than there are directories
+    uint32_t *child_first;
+    uint32_t *children;
+    char failed;
+} scan_ctx;
+
+typedef struct scan_dir scan_dir;
+struct scan_dir
+{
+    scan_ctx *ctx;
+    wchar_t *rel_path; // empty for the root itself
+    int rel_len;
+    uint16_t root;
+#ifndef _WIN32
+    scan_dir *parent; // valid until this directory is opened
+    char *name;       // relative to the parent, the full path for roots
+    int fd;
+    volatile int64_t refs; // own task and the children that have not opened themselves yet
+#endif
+};
+
+// counted per directory, they go to the stats once it is listed
+typedef struct
+{
+    uint64_t syscalls;
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t kept;
+} dir_tally;
+
+static void add_tally(const dir_tally *tally)
+{
+    STAT_ADD(STAT_SYSCALLS, tally->syscalls);
+    STAT_ADD(STAT_BYTES_READ, tally->bytes);
+    STAT_ADD(STAT_ENTRIES_SEEN, tally->entries);
+    STAT_ADD(STAT_FILES_KEPT, tally->kept);
+}
+
+#ifdef __linux__
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static void scan_task(void *arg, int worker);
+
+// len is without the extension, subdirectory files keep their path relative to the root
+static void stage_file(file_table *files, const scan_dir *dir, const wchar_t *name, int len, uint16_t ext, time_t date,
+                       uint64_t size)
+{
+    const int prefix = dir->rel_len ? dir->rel_len + 1 : 0;
+    wchar_t *full = add_file(files, date, dir->root, ext, prefix + len);
+    if (!full)
+        return;
+    if (files->keep_sizes)
+        files->sizes[files->count - 1] = size;
+    if (prefix)
+    {
+        memcpy(full, dir->rel_path, sizeof(wchar_t) * dir->rel_len);
+        full[dir->rel_len] = PSYM_SEP_CHAR;
+    }
+    memcpy(full + prefix, name, sizeof(wchar_t) * len);
+}
+
+static scan_dir *make_dir(scan_ctx *ctx, uint16_t root, const scan_dir *parent, const wchar_t *name, int len)
+{
+    scan_dir *dir = (scan_dir *)malloc(sizeof(scan_dir));
+    dir->ctx = ctx;
+    dir->root = root;
+    dir->rel_len = parent ? (parent->rel_len ? parent->rel_len + 1 : 0) + len : 0;
+    dir->rel_path = (wchar_t *)malloc(sizeof(wchar_t) * (dir->rel_len + 1));
+    if (parent && parent->rel_len)
+    {
+        memcpy(dir->rel_path, parent->rel_path, sizeof(wchar_t) * parent->rel_len);
+        dir->rel_path[parent->rel_len] = PSYM_SEP_CHAR;
+    }
+    if (parent)
+        memcpy(dir->rel_path + dir->rel_len - len, name, sizeof(wchar_t) * len);
+    dir->rel_path[dir->rel_len] = L'\0';
+    return dir;
+}
+
+#ifdef _WIN32
+static void release_dir(scan_dir *dir)
+{
+    free(dir->rel_path);
+    free(dir);
+}
+
+static void submit_child(scan_dir *dir, int worker, const wchar_t *name, int len)
+{
+    pool_submit(dir->ctx->pool, worker, scan_task, make_dir(dir->ctx, dir->root, dir, name, len));
+}
+
+static int check_dir(scan_dir *dir, int worker, uint64_t stamp);
+
+static void list_dir(scan_dir *dir, int worker, file_table *files)
+{
+    const scan_opts *opts = dir->ctx->opts;
+    const wchar_t *root = opts->dirs[dir->root];
+    const int path_len = wcslen(root) + dir->rel_len + 4;
+    wchar_t *path = (wchar_t *)malloc(sizeof(wchar_t) * path_len);
+    if (dir->rel_len)
+        swprintf(path, path_len, L"%ls\\%ls", root, dir->rel_path);
+    else
+        swprintf(path, path_len, L"%ls", root);
+
+    dir_tally tally = { 2, 0, 0, 0 };
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attribs) ||
+        check_dir(dir, worker, ((uint64_t)attribs.ftLastWriteTime.dwHighDateTime << 32) | attribs.ftLastWriteTime.dwLowDateTime))
+    {
+        free(path);
+        return;
+    }
+    wcscat(path, L"\\*");
+
+    WIN32_FIND_DATAW find_data;
+    HANDLE find = FindFirstFileExW(path, FindExInfoBasic, &find_data, FindExSearchNameMatch,
+                                   NULL, FIND_FIRST_EX_LARGE_FETCH);
+    free(path);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+
+    do
+    {
+        const wchar_t *name = find_data.cFileName;
+        const int len = wcslen(name);
+        ++tally.syscalls;
+        ++tally.entries;
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            // reparse points are skipped to stay out of cycles
+            if (opts->recursive && !(find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+                wcscmp(name, L".") && wcscmp(name, L".."))
+                submit_child(dir, worker, name, len);
+            continue;
+        }
+
+        // the listing has the times already, the date goes first
+        const file_stamp stamp = find_data_stamp(&find_data, opts->stamp_source);
+        if (!in_stamp_range(&dir->ctx->range, stamp))
+            continue;
+        const int ext = find_ext(dir->ctx->exts, name, len);
+        if (ext < 0)
+            continue;
+        int base = len;
+        while (name[--base] != L'.');
+        stage_file(files, dir, name, base, ext, stamp_to_time(stamp),
+                   ((uint64_t)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow);
+        ++tally.kept;
+    } while (FindNextFileW(find, &find_data));
+    FindClose(find);
+    add_tally(&tally);
+}
+#else
+static void release_dir(scan_dir *dir)
+{
+    if (interlocked_add(&dir->refs, -1))
+        return;
+    if (dir->fd >= 0)
+        close(dir->fd);
+    free(dir->name);
+    free(dir->rel_path);
+    free(dir);
+}
+
+// takes name
+static void submit_child(scan_dir *dir, int worker, const wchar_t *wname, int len, char *name)
+{
+    scan_dir *child = make_dir(dir->ctx, dir->root, dir, wname, len);
+    child->parent = dir;
+    child->name = name;
+    child->fd = -1;
+    child->refs = 1;
+    interlocked_add(&dir->refs, 1);
+    pool_submit(dir->ctx->pool, worker, scan_task, child);
+}
+
+static int check_dir(scan_dir *dir, int worker, uint64_t stamp);
+
+static void list_entry(scan_dir *dir, int worker, file_table *files, const char *name, unsigned char type,
+                       dir_tally *tally)
+{
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return;
+    ++tally->entries;
+
+    const scan_opts *opts = dir->ctx->opts;
+    struct stat st;
+    char has_stat = 0;
+    if (type == DT_UNKNOWN)
+    {
+        ++tally->syscalls;
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW))
+            return;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        has_stat = 1;
+    }
+    if (type == DT_LNK)
+    {
+        // links to files are followed, links to directories are not to stay out of cycles
+        ++tally->syscalls;
+        if (fstatat(dir->fd, name, &st, 0) || !S_ISREG(st.st_mode))
+            return;
+        type = DT_REG;
+        has_stat = 1;
+    }
+
+    wchar_t wname[NAME_MAX + 1];
+    const int name_len = strlen(name);
+    if (type == DT_DIR)
+    {
+        if (opts->recursive)
+        {
+            const int len = path_to_wcs(wname, name, name_len);
+            wname[len] = L'\0';
+            submit_child(dir, worker, wname, len, strdup(name));
+        }
+        return;
+    }
+    if (type != DT_REG)
+        return;
+
+    // a dot is a byte of its own in utf-8, only the extension is converted to match it;
+    // the name is converted once the date kept the file
+    int dot = name_len - 1;
+    while (dot > 0 && name[dot] != '.')
+        --dot;
+    if (dot <= 0)
+        return;
+    const int ext = match_ext(dir->ctx->exts, wname, path_to_wcs(wname, name + dot + 1, name_len - dot - 1));
+    if (ext < 0)
+        return;
+
+    file_stamp stamp;
+    uint64_t size;
+    if (has_stat && STAMP_FROM_STAT(opts->stamp_source))
+    {
+        stamp = stat_stamp(&st, opts->stamp_source);
+        size = st.st_size;
+    }
+    else
+    {
+        ++tally->syscalls;
+        if (stat_file_stamp(dir->fd, name, opts->stamp_source, &stamp, &size))
+            return;
+    }
+    if (!in_stamp_range(&dir->ctx->range, stamp))
+        return;
+    stage_file(files, dir, wname, path_to_wcs(wname, name, dot), ext, stamp_to_time(stamp), size);
+    ++tally->kept;
+}
+
+static void list_dir(scan_dir *dir, int worker, file_table *files)
+{
+    scan_dir *parent = dir->parent;
+    dir->fd = openat(parent ? parent->fd : AT_FDCWD, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (parent ? O_NOFOLLOW : 0));
+    dir->parent = NULL;
+    if (parent)
+        release_dir(parent);
+    struct stat st;
+    dir_tally tally = { 2, 0, 0, 0 };
+    if (dir->fd < 0 || fstat(dir->fd, &st) ||
+        check_dir(dir, worker, (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec))
+    {
+        add_tally(&tally);
+        return;
+    }
+
+#ifdef __linux__
+    _Alignas(8) char buf[1 << 15];
+    long n;
+    while ((n = syscall(SYS_getdents64, dir->fd, buf, sizeof buf)) > 0)
+    {
+        ++tally.syscalls;
+        tally.bytes += n;
+        for (long off = 0; off < n;)
+        {
+            const struct linux_dirent64 *ent = (const struct linux_dirent64 *)(buf + off);
+            off += ent->d_reclen;
+            list_entry(dir, worker, files, ent->d_name, ent->d_type, &tally);
+        }
+    }
+    ++tally.syscalls;
+#else
+    DIR *dir_stream = fdopendir(dup(dir->fd));
+    if (dir_stream)
+    {
+        struct dirent *ent;
+        while ((ent = readdir(dir_stream)))
+            list_entry(dir, worker, files, ent->d_name, ent->d_type, &tally);
+        closedir(dir_stream);
+    }
+#endif
+    add_tally(&tally);
+}
+#endif
+
+// records the directory; when its stamp matches the previous state only its known subdirectories are queued
+static int check_dir(scan_dir *dir, int worker, uint64_t stamp)
+{
+    scan_ctx *ctx = dir->ctx;
+    if (ctx->state)
+    {
+        mutex_lock(&ctx->lock);
+        if (add_dir_state(ctx->state, dir->root, dir->rel_path, dir->rel_len, stamp))
+            ctx->failed = 1;
+        mutex_unlock(&ctx->lock);
+    }
+
+    const dir_state *prev = ctx->opts->prev;
+    const int64_t ind = prev ? find_dir_state(prev, dir->root, dir->rel_path) : -1;
+    if (ind < 0 || prev->stamps[ind] != stamp)
+        return 0;
+    if (ctx->opts->recursive)
+    {
+        for (uint32_t i = ctx->child_first[ind]; i < ctx->child_first[ind + 1]; ++i)
+        {
+            const wchar_t *name = DIR_PATH(prev, ctx->children[i]) + (dir->rel_len ? dir->rel_len + 1 : 0);
+#ifdef _WIN32
+            submit_child(dir, worker, name, wcslen(name));
+#else
+            submit_child(dir, worker, name, wcslen(name), wcs_to_path(name));
+#endif
+        }
+    }
+    return 1;
+}
+
+static void index_children(scan_ctx *ctx, const dir_state *prev)
+{
+    int64_t *parents = (int64_t *)malloc(sizeof(int64_t) * (prev->count ? prev->count : 1));
+    wchar_t *parent_path = (wchar_t *)malloc(sizeof(wchar_t) * (prev->arena_size ? prev->arena_size : 1));
+    ctx->child_first = (uint32_t *)calloc(prev->count + 2, sizeof(uint32_t));
+    ctx->children = (uint32_t *)malloc(sizeof(uint32_t) * (prev->count ? prev->count : 1));
+    for (uint32_t i = 0; i < prev->count; ++i)
+    {
+        const wchar_t *path = DIR_PATH(prev, i);
+        parents[i] = -1;
+        if (!*path)
+            continue;
+        const wchar_t *sep = wcsrchr(path, PSYM_SEP_CHAR);
+        const int len = sep ? sep - path : 0;
+        memcpy(parent_path, path, sizeof(wchar_t) * len);
+        parent_path[len] = L'\0';
+        parents[i] = find_dir_state(prev, prev->roots[i], parent_path);
+        if (parents[i] >= 0)
+            ++ctx->child_first[parents[i] + 2];
+    }
+    // counts are shifted by one so that the fill below leaves child_first in place
+    for (uint32_t i = 2; i < prev->count + 2; ++i)
+        ctx->child_first[i] += ctx->child_first[i - 1];
+    for (uint32_t i = 0; i < prev->count; ++i)
+        if (parents[i] >= 0)
+            ctx->children[ctx->child_first[parents[i] + 1]++] = i;
+    free(parent_path);
+    free(parents);
+}
+
+// the table keeps its reserved size, whatever would not fit is handed over first
+static void spill_files(scan_ctx *ctx, const file_table *staging)
+{
+    const scan_spill *spill = ctx->opts->spill;
+    file_table *files = ctx->files;
+    mutex_lock(&ctx->lock);
+    if ((uint64_t)files->count + staging->count > files->cap ||
+        (uint64_t)files->arena_size + staging->arena_size > files->arena_cap)
+    {
+        if (files->count && spill->fn(files, spill->arg))
+            ctx->failed = 1;
+        files->count = 0;
+        files->arena_size = 0;
+    }
+    // a directory bigger than the whole table goes out on its own
+    if (staging->count > files->cap || staging->arena_size > files->arena_cap)
+    {
+        if (spill->fn(staging, spill->arg))
+            ctx->failed = 1;
+    }
+    else if (append_files(files, staging))
+        ctx->failed = 1;
+    mutex_unlock(&ctx->lock);
+}
+
+static void scan_task(void *arg, int worker)
+{
+    scan_dir *dir = (scan_dir *)arg;
+    scan_ctx *ctx = dir->ctx;
+    file_table *staging = ctx->staging + worker;
+
+    list_dir(dir, worker, staging);
+
+    if (staging->count && ctx->opts->spill)
+    {
+        spill_files(ctx, staging);
+        staging->count = 0;
+        staging->arena_size = 0;
+    }
+    else if (staging->count)
+    {
+        mutex_lock(&ctx->lock);
+        if (ctx->block_count == ctx->block_cap)
+        {
+            ctx->block_cap = ctx->block_cap ? ctx->block_cap * 2 : 64;
+            ctx->blocks = (scan_block *)realloc(ctx->blocks, sizeof(scan_block) * ctx->block_cap);
+        }
+        scan_block *block = ctx->blocks + ctx->block_count++;
+        block->rel_path = dir->rel_path;
+        block->first = ctx->files->count;
+        block->count = staging->count;
+        block->root = dir->root;
+        dir->rel_path = NULL;
+        if (append_files(ctx->files, staging))
+            ctx->failed = 1;
+        mutex_unlock(&ctx->lock);
+
+        staging->count = 0;
+        staging->arena_size = 0;
+    }
+    release_dir(dir);
+}
+
+static int cmp_block(const void *lhs, const void *rhs)
+{
+    const scan_block *l = (const scan_block *)lhs, *r = (const scan_block *)rhs;
+    if (l->root != r->root)
+        return l->root < r->root ? -1 : 1;
+    return wcscmp(l->rel_path, r->rel_path);
+}
+
+typedef struct
+{
+    const wchar_t *name;
+    uint32_t ind;
+    uint16_t ext;
+} scan_key;
+
+static int cmp_key(const void *lhs, const void *rhs)
+{
+    const scan_key *l = (const scan_key *)lhs, *r = (const scan_key *)rhs;
+    if (l->ext != r->ext)
+        return l->ext < r->ext ? -1 : 1;
+    return wcscmp(l->name, r->name);
+}
+
+int scan_dirs(const scan_opts *opts, file_table *files, dir_state *state)
+{
+    const double start = stat_begin();
+    scan_ctx ctx;
+    ctx.opts = opts;
+    ctx.exts = create_ext_table(opts->exts, opts->ext_count);
+    init_stamp_range(&ctx.range, opts->bound_lower, opts->bound_upper);
+    ctx.pool = create_thread_pool(opts->workers > 0 ? opts->workers : cpu_count());
+    ctx.staging = (file_table *)malloc(sizeof(file_table) * pool_worker_count(ctx.pool));
+    for (int i = 0; i < pool_worker_count(ctx.pool); ++i)
+    {
+        init_file_table(ctx.staging + i);
+        ctx.staging[i].keep_sizes = opts->sizes;
+    }
+    ctx.files = files;
+    ctx.blocks = NULL;
+    ctx.block_count = 0;
+    ctx.block_cap = 0;
+    ctx.state = state;
+    ctx.child_first = NULL;
+    ctx.children = NULL;
+    ctx.failed = 0;
+    mutex_init(&ctx.lock);
+    init_file_table(files);
+    files->keep_sizes = opts->sizes;
+    if (opts->spill && reserve_file_table(files, opts->spill->count, opts->spill->arena_size))
+        ctx.failed = 1;
+    if (state)
+        init_dir_state(state);
+    if (opts->prev)
+        index_children(&ctx, opts->prev);
+
+    for (int i = 0; i < opts->dir_count; ++i)
+    {
+        scan_dir *root = make_dir(&ctx, i, NULL, NULL, 0);
+#ifndef _WIN32
+        root->parent = NULL;
+        root->name = wcs_to_path(opts->dirs[i]);
+        root->fd = -1;
+        root->refs = 1;
+#endif
+        pool_submit(ctx.pool, -1, scan_task, root);
+    }
+    pool_wait(ctx.pool);
+    for (int i = 0; i < pool_worker_count(ctx.pool); ++i)
+        free_file_table(ctx.staging + i);
+    free(ctx.staging);
+    delete_thread_pool(ctx.pool);
+    delete_ext_table(ctx.exts);
+    mutex_destroy(&ctx.lock);
+    free(ctx.child_first);
+    free(ctx.children);
+    if (state)
+        sort_dir_state(state);
+
+    if (opts->spill)
+    {
+        if (!ctx.failed && files->count && opts->spill->fn(files, opts->spill->arg))
+            ctx.failed = 1;
+        free_file_table(files);
+        if (ctx.failed && state)
+            free_dir_state(state);
+        stat_end(STAT_SCAN, start);
+        return ctx.failed ? -1 : 0;
+    }
+
+    // blocks arrive in completion order, put them back into a fixed one
+    if (ctx.block_count)
+        qsort(ctx.blocks, ctx.block_count, sizeof(scan_block), cmp_block);
+
+    uint32_t max_count = 0;
+    for (int i = 0; i < ctx.block_count; ++i)
+        if (ctx.blocks[i].count > max_count)
+            max_count = ctx.blocks[i].count;
+
+    uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * (files->count ? files->count : 1));
+    scan_key *keys = (scan_key *)malloc(sizeof(scan_key) * (max_count ? max_count : 1));
+    uint32_t order_it = 0;
+    for (int i = 0; i < ctx.block_count; ++i)
+    {
+        const scan_block *block = ctx.blocks + i;
+        for (uint32_t j = 0; j < block->count && !ctx.failed; ++j)
+        {
+            keys[j].name = FILE_NAME(files, block->first + j);
+            keys[j].ind = block->first + j;
+            keys[j].ext = files->exts[block->first + j];
+        }
+        if (ctx.failed)
+        {
+            free(block->rel_path);
+            continue;
+        }
+        qsort(keys, block->count, sizeof(scan_key), cmp_key);
+        for (uint32_t j = 0; j < block->count; ++j)
+            order[order_it++] = keys[j].ind;
+        free(block->rel_path);
+    }
+    free(keys);
+    free(ctx.blocks);
+
+    if (!ctx.failed)
+        permute_file_table(files, order);
+    else
+    {
+        free_file_table(files);
+        if (state)
+            free_dir_state(state);
+    }
+    free(order);
+    stat_end(STAT_SCAN, start);
+    return ctx.failed ? -1 : 0;
+}
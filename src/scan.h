@@ -0,0 +1,47 @@
+#ifndef PSYM_SCAN
+#define PSYM_SCAN
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "dir_state.h"
+#include "file_table.h"
+#include "timestamp.h"
+
+// gets the files gathered so far in completion order, the table is emptied after; nonzero fails the scan
+typedef int (*scan_spill_fn)(const file_table *files, void *arg);
+
+typedef struct
+{
+    scan_spill_fn fn;
+    void *arg;
+    uint32_t count; // files held before they are handed to fn
+    uint32_t arena_size;
+} scan_spill;
+
+// directories or extensions a scan takes at most
+#define SCAN_LIST_MAX UINT16_MAX
+
+typedef struct
+{
+    const wchar_t **dirs;
+    const wchar_t **exts;
+    uint16_t dir_count; // up to SCAN_LIST_MAX
+    uint16_t ext_count;
+    time_t bound_lower; // exclusive, the scan compares stamps against them(stamp_range)
+    time_t bound_upper;
+    char recursive;
+    char stamp_source; // STAMP_*, the time of a file that is its date
+    char sizes; // the result keeps the file sizes(file_table.sizes), the stat is made anyway
+    int workers;
+    const dir_state *prev; // sorted, directories whose stamp did not change are not listed again
+    const scan_spill *spill; // NULL keeps every file in the result
+} scan_opts;
+
+// one pool task per directory, files of subdirectories are named relative to their root directory;
+// the result is ordered by(root, directory, extension, name) no matter how many workers ran;
+// state gets every directory that was reached, sorted; with spill set files stay empty and nothing is ordered
+int scan_dirs(const scan_opts *opts, file_table *files, dir_state *state);
+
+#endif
@@ -0,0 +1,511 @@
+#include "serialize.h"
+#include "ref_map.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+// big enough to keep the write count low, small enough for a round of them to stay in memory
+#define UNITS_PER_TASK 16384
+// the order is shuffled, every file is a cache miss on each column without looking ahead
+#define PREFETCH_DIST 16
+
+typedef struct
+{
+    const file_table *files;
+    const uint32_t *order;
+    unit_encoder enc;
+    uint64_t first_unit;
+    uint64_t unit_count;
+    uint64_t *unit_offsets; // relative to buf until the round is written
+    uint32_t *unit_counts;
+    byte_buf buf;
+    uint32_t unit_size;
+} unit_chunk;
+
+void init_byte_buf(byte_buf *buf)
+{
+    buf->data = NULL;
+    buf->size = 0;
+    buf->cap = 0;
+}
+
+void free_byte_buf(byte_buf *buf)
+{
+    free(buf->data);
+    init_byte_buf(buf);
+}
+
+void buf_reserve(byte_buf *buf, size_t size)
+{
+    if (size <= buf->cap)
+        return;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < size)
+        cap *= 2;
+    buf->data = (uint8_t *)realloc(buf->data, cap);
+    buf->cap = cap;
+}
+
+void buf_put(byte_buf *buf, const void *data, size_t size)
+{
+    buf_reserve(buf, buf->size + size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+void buf_put_wstr(byte_buf *buf, const wchar_t *str, int len, char wide)
+{
+    const uint32_t units = wcs_utf16_len(str, len);
+    buf_reserve(buf, buf->size + sizeof units + 1 + sizeof(uint16_t) * units);
+    if (wide)
+        buf_put_varint(buf, units);
+    else
+    {
+        const uint16_t narrow = units;
+        buf_put(buf, &narrow, sizeof narrow);
+    }
+#if WCHAR_MAX > 0xFFFF
+    uint16_t conv[256];
+    for (int i = 0; i < len; i += 128)
+    {
+        const int chunk = len - i < 128 ? len - i : 128;
+        buf_put(buf, conv, sizeof(uint16_t) * wcs_to_utf16(conv, str + i, chunk));
+    }
+#else
+    buf_put(buf, str, sizeof(uint16_t) * len);
+#endif
+}
+
+void buf_put_varint(byte_buf *buf, uint64_t value)
+{
+    uint8_t bytes[10];
+    int len = 0;
+    for (; value >= 0x80; value >>= 7)
+        bytes[len++] = 0x80 | (value & 0x7F);
+    bytes[len++] = value;
+    buf_put(buf, bytes, len);
+}
+
+char needs_wide(const scan_opts *opts, uint32_t unit_size, uint64_t name_max)
+{
+    return unit_size > UINT8_MAX || opts->dir_count > UINT8_MAX || opts->ext_count > UINT8_MAX || name_max > UINT16_MAX;
+}
+
+void put_unit_count(uint8_t *dst, uint32_t count, char wide)
+{
+    if (wide)
+        memcpy(dst, &count, sizeof count);
+    else
+        *dst = (uint8_t)count;
+}
+
+uint32_t get_unit_count(const uint8_t *src, char wide)
+{
+    uint32_t count = *src;
+    if (wide)
+        memcpy(&count, src, sizeof count);
+    return count;
+}
+
+int write_unit_counts(FILE *file, const uint32_t *counts, uint64_t count, char wide)
+{
+    if (wide)
+        return fwrite(counts, sizeof(uint32_t), count, file) == count ? 0 : -1;
+    uint8_t narrow[4096];
+    for (uint64_t i = 0; i < count; i += sizeof narrow)
+    {
+        const size_t chunk = count - i < sizeof narrow ? count - i : sizeof narrow;
+        for (size_t j = 0; j < chunk; ++j)
+            narrow[j] = (uint8_t)counts[i + j];
+        if (fwrite(narrow, sizeof(uint8_t), chunk, file) != chunk)
+            return -1;
+    }
+    return 0;
+}
+
+void init_unit_encoder(unit_encoder *enc, const unit_format *format)
+{
+    enc->format = format;
+    enc->cap = format->compact ? 1024 : 0;
+    enc->prev = format->compact ? (uint8_t *)malloc(enc->cap) : NULL;
+    enc->cur = format->compact ? (uint8_t *)malloc(enc->cap) : NULL;
+    enc->prev_len = 0;
+}
+
+void free_unit_encoder(unit_encoder *enc)
+{
+    free(enc->prev);
+    free(enc->cur);
+}
+
+void put_unit_head(unit_encoder *enc, byte_buf *buf, uint32_t count, time_t date)
+{
+    uint8_t count_bytes[sizeof count];
+    put_unit_count(count_bytes, count, enc->format->wide);
+    buf_put(buf, count_bytes, UNIT_COUNT_SIZE(enc->format->wide));
+    if (!enc->format->compact)
+    {
+        buf_put(buf, &date, sizeof date);
+        return;
+    }
+    const int64_t delta = (int64_t)((uint64_t)date - (uint64_t)enc->format->date_base);
+    buf_put_varint(buf, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    enc->prev_len = 0;
+}
+
+void put_unit_file(unit_encoder *enc, byte_buf *buf, uint16_t dir, uint16_t ext, const wchar_t *name, int len)
+{
+    if (!enc->format->compact)
+    {
+        if (enc->format->wide)
+        {
+            buf_put_varint(buf, dir);
+            buf_put_varint(buf, ext);
+        }
+        else
+        {
+            const uint8_t narrow[2] = { (uint8_t)dir, (uint8_t)ext };
+            buf_put(buf, narrow, sizeof narrow);
+        }
+        buf_put_wstr(buf, name, len, enc->format->wide);
+        return;
+    }
+
+    const int ext_count = enc->format->ext_count ? enc->format->ext_count : 1;
+    buf_put_varint(buf, (uint64_t)dir * ext_count + ext);
+    // narrow files cut names at UINT16_MAX characters like they always did
+    if (!enc->format->wide && len > UINT16_MAX)
+        len = UINT16_MAX;
+    if (len * 4 > enc->cap)
+    {
+        while (len * 4 > enc->cap)
+            enc->cap *= 2;
+        enc->prev = (uint8_t *)realloc(enc->prev, enc->cap);
+        enc->cur = (uint8_t *)realloc(enc->cur, enc->cap);
+    }
+    const int cur_len = wcs_to_utf8(enc->cur, name, len);
+    int prefix = 0;
+    while (prefix < cur_len && prefix < enc->prev_len && enc->cur[prefix] == enc->prev[prefix])
+        ++prefix;
+    buf_put_varint(buf, prefix);
+    buf_put_varint(buf, cur_len - prefix);
+    buf_put(buf, enc->cur + prefix, cur_len - prefix);
+
+    uint8_t *tmp = enc->prev;
+    enc->prev = enc->cur;
+    enc->cur = tmp;
+    enc->prev_len = cur_len;
+}
+
+static void serialize_task(void *arg, int worker)
+{
+    (void)worker;
+    unit_chunk *chunk = (unit_chunk *)arg;
+    const file_table *files = chunk->files;
+    byte_buf *buf = &chunk->buf;
+
+    buf->size = 0;
+    for (uint64_t u = 0; u < chunk->unit_count; ++u)
+    {
+        const uint32_t i = (chunk->first_unit + u) * chunk->unit_size;
+        const uint32_t count = files->count - i > chunk->unit_size ? chunk->unit_size : files->count - i;
+        chunk->unit_offsets[u] = buf->size;
+        chunk->unit_counts[u] = count;
+
+        put_unit_head(&chunk->enc, buf, count, files->dates[chunk->order[i]]);
+        for (uint32_t j = 0; j < count; ++j)
+        {
+            const uint32_t ind = chunk->order[i + j];
+            if (i + j + PREFETCH_DIST * 2 < files->count)
+                PSYM_PREFETCH(files->names + chunk->order[i + j + PREFETCH_DIST * 2]);
+            if (i + j + PREFETCH_DIST < files->count)
+            {
+                const uint32_t next = chunk->order[i + j + PREFETCH_DIST];
+                PSYM_PREFETCH(FILE_NAME(files, next));
+                PSYM_PREFETCH(files->dates + next);
+                PSYM_PREFETCH(files->dirs + next);
+                PSYM_PREFETCH(files->exts + next);
+            }
+            const wchar_t *name = FILE_NAME(files, ind);
+            put_unit_file(&chunk->enc, buf, files->dirs[ind], files->exts[ind], name, wcslen(name));
+        }
+    }
+}
+
+static int write_chunks(FILE *file, const unit_chunk *chunks, int count)
+{
+#ifdef _WIN32
+    for (int i = 0; i < count; ++i)
+    {
+        STAT_ADD(STAT_SYSCALLS, 1);
+        if (fwrite(chunks[i].buf.data, 1, chunks[i].buf.size, file) != chunks[i].buf.size)
+            return -1;
+    }
+    return 0;
+#else
+    // stdio is flushed before the first round, the buffers go straight to the descriptor
+    struct iovec vecs[64];
+    const int fd = fileno(file);
+    for (int i = 0; i < count;)
+    {
+        int vec_count = 0;
+        for (; vec_count < 64 && i + vec_count < count; ++vec_count)
+        {
+            vecs[vec_count].iov_base = chunks[i + vec_count].buf.data;
+            vecs[vec_count].iov_len = chunks[i + vec_count].buf.size;
+        }
+        i += vec_count;
+
+        struct iovec *it = vecs;
+        while (vec_count)
+        {
+            ssize_t written = writev(fd, it, vec_count);
+            STAT_ADD(STAT_SYSCALLS, 1);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            for (; vec_count && (size_t)written >= it->iov_len; ++it, --vec_count)
+                written -= it->iov_len;
+            if (vec_count)
+            {
+                it->iov_base = (char *)it->iov_base + written;
+                it->iov_len -= written;
+            }
+        }
+    }
+    return 0;
+#endif
+}
+
+int write_units(FILE *file, const file_table *files, const uint32_t *order, uint32_t unit_size,
+                const unit_format *format, uint64_t *unit_offsets, uint32_t *unit_counts, int workers)
+{
+    const uint64_t unit_count = ((uint64_t)files->count + unit_size - 1) / unit_size;
+    const uint64_t chunk_count = (unit_count + UNITS_PER_TASK - 1) / UNITS_PER_TASK;
+    const int round_size = chunk_count < (uint64_t)workers ? (int)chunk_count : workers > 1 ? workers : 1;
+    thread_pool *pool = round_size > 1 ? create_thread_pool(round_size) : NULL;
+
+    unit_chunk *chunks = (unit_chunk *)malloc(sizeof(unit_chunk) * (round_size ? round_size : 1));
+    for (int i = 0; i < round_size; ++i)
+    {
+        chunks[i].files = files;
+        chunks[i].order = order;
+        chunks[i].unit_size = unit_size;
+        init_unit_encoder(&chunks[i].enc, format);
+        init_byte_buf(&chunks[i].buf);
+    }
+
+    fflush(file);
+    int64_t offset = file_tell(file);
+    int ret = 0;
+    for (uint64_t round = 0; round < chunk_count && !ret; round += round_size)
+    {
+        const int count = chunk_count - round < (uint64_t)round_size ? (int)(chunk_count - round) : round_size;
+        double start = stat_begin();
+        for (int i = 0; i < count; ++i)
+        {
+            unit_chunk *chunk = chunks + i;
+            chunk->first_unit = (round + i) * UNITS_PER_TASK;
+            chunk->unit_count = unit_count - chunk->first_unit < UNITS_PER_TASK ? unit_count - chunk->first_unit : UNITS_PER_TASK;
+            chunk->unit_offsets = unit_offsets + chunk->first_unit;
+            chunk->unit_counts = unit_counts + chunk->first_unit;
+            if (pool)
+                pool_submit(pool, -1, serialize_task, chunk);
+            else
+                serialize_task(chunk, 0);
+        }
+        if (pool)
+            pool_wait(pool);
+
+        const int64_t round_offset = offset;
+        for (int i = 0; i < count; ++i)
+        {
+            for (uint64_t u = 0; u < chunks[i].unit_count; ++u)
+                chunks[i].unit_offsets[u] += offset;
+            offset += chunks[i].buf.size;
+        }
+        stat_end(STAT_SERIALIZE, start);
+        start = stat_begin();
+        ret = write_chunks(file, chunks, count);
+        stat_end(STAT_WRITE, start);
+        STAT_ADD(STAT_BYTES_WRITTEN, offset - round_offset);
+    }
+    // stdio did not see the descriptor move
+    if (!ret)
+        ret = file_seek(file, offset, SEEK_SET);
+
+    if (pool)
+        delete_thread_pool(pool);
+    for (int i = 0; i < round_size; ++i)
+    {
+        free_unit_encoder(&chunks[i].enc);
+        free_byte_buf(&chunks[i].buf);
+    }
+    free(chunks);
+    return ret;
+}
+
+static void write_varint_to_file(FILE *file, uint64_t value)
+{
+    uint8_t bytes[10];
+    int len = 0;
+    for (; value >= 0x80; value >>= 7)
+        bytes[len++] = 0x80 | (value & 0x7F);
+    bytes[len++] = value;
+    fwrite(bytes, 1, len, file);
+}
+
+static void write_wstr_to_file(FILE *file, const wchar_t *str, char wide)
+{
+    const int str_len = wcslen(str);
+    const uint32_t len = wcs_utf16_len(str, str_len);
+    if (wide)
+        write_varint_to_file(file, len);
+    else
+    {
+        const uint16_t narrow = len;
+        fwrite(&narrow, sizeof narrow, 1, file);
+    }
+
+    uint16_t buf[256];
+    for (int i = 0; i < str_len; i += 128)
+    {
+        const int chunk = str_len - i < 128 ? str_len - i : 128;
+        fwrite(buf, sizeof(uint16_t), wcs_to_utf16(buf, str + i, chunk), file);
+    }
+}
+
+void write_dir_state(FILE *file, const scan_opts *opts, const dir_state *state, char wide)
+{
+    const char scan_flags = opts->recursive | opts->stamp_source << 1 | state->dedup << 3;
+    fwrite(&scan_flags, sizeof scan_flags, 1, file);
+    fwrite(&opts->bound_lower, sizeof opts->bound_lower, 1, file);
+    fwrite(&opts->bound_upper, sizeof opts->bound_upper, 1, file);
+    fwrite(&state->count, sizeof state->count, 1, file);
+    for (uint32_t i = 0; i < state->count; ++i)
+    {
+        if (wide)
+            write_varint_to_file(file, state->roots[i]);
+        else
+        {
+            const uint8_t root = (uint8_t)state->roots[i];
+            fwrite(&root, sizeof root, 1, file);
+        }
+        fwrite(state->stamps + i, sizeof(uint64_t), 1, file);
+        write_wstr_to_file(file, DIR_PATH(state, i), wide);
+    }
+}
+
+void write_head(FILE *file, const scan_opts *opts, uint32_t unit_size, uint64_t unit_count, const uint64_t *seed,
+                const unit_format *format, uint64_t cursors, char state)
+{
+    const char wide = format->wide;
+    const uint16_t flags = (state ? PSYM4_FLAG_DIR_STATE : 0) | (seed ? PSYM4_FLAG_PERMUTED : 0) |
+        (format->compact ? PSYM4_FLAG_COMPACT : 0) | (cursors ? PSYM4_FLAG_CURSORS : 0) | (wide ? PSYM4_FLAG_WIDE : 0);
+    const uint64_t pos = 0, table_offset = 0, state_offset = 0;
+    // the 1b unit size is 0 in wide files, the real one follows the fixed fields
+    const uint8_t narrow_size = wide ? 0 : (uint8_t)unit_size;
+
+    fwrite("PSYM4", sizeof(char), 5, file);
+    fwrite(&narrow_size, sizeof narrow_size, 1, file);
+    fwrite(&flags, sizeof flags, 1, file);
+    fwrite(&pos, sizeof pos, 1, file);
+    fwrite(&unit_count, sizeof unit_count, 1, file);
+    fwrite(&table_offset, sizeof table_offset, 1, file);
+    if (state)
+        fwrite(&state_offset, sizeof state_offset, 1, file);
+    if (seed)
+        fwrite(seed, sizeof *seed, 1, file);
+    if (format->compact)
+        fwrite(&format->date_base, sizeof format->date_base, 1, file);
+    if (wide)
+    {
+        const uint64_t wide_size = unit_size;
+        fwrite(&wide_size, sizeof wide_size, 1, file);
+    }
+    if (cursors)
+    {
+        // free slots are all zero, the 8b fields before them keep every position aligned
+        const uint8_t slot[CURSOR_SLOT_SIZE] = { 0 };
+        fwrite(&cursors, sizeof cursors, 1, file);
+        for (uint64_t i = 0; i < cursors; ++i)
+            fwrite(slot, sizeof slot, 1, file);
+    }
+
+    if (wide)
+        write_varint_to_file(file, opts->ext_count);
+    else
+        fputc(opts->ext_count, file);
+    for (int i = 0; i < opts->ext_count; ++i)
+        write_wstr_to_file(file, opts->exts[i], wide);
+
+    if (wide)
+        write_varint_to_file(file, opts->dir_count);
+    else
+        fputc(opts->dir_count, file);
+    for (int i = 0; i < opts->dir_count; ++i)
+    {
+        wchar_t *full_dir = full_path(opts->dirs[i]);
+        write_wstr_to_file(file, full_dir, wide);
+        free(full_dir);
+    }
+}
+
+int write_bin(const scan_opts *opts, const wchar_t *output, uint32_t unit_size, const uint64_t *seed,
+              const unit_format *format, uint64_t cursors, const file_table *files, const uint32_t *order,
+              const dir_state *state)
+{
+    FILE *file = file_open(output, L"wb");
+    if (!file)
+        return WRITE_ERR_OPEN;
+
+    const uint64_t unit_count = ((uint64_t)files->count + unit_size - 1) / unit_size;
+    write_head(file, opts, unit_size, unit_count, seed, format, cursors, 1);
+
+    // units go after the table, it is filled in once their offsets are known
+    const uint64_t table_offset = file_tell(file);
+    uint64_t *unit_offsets = (uint64_t *)malloc(sizeof(uint64_t) * unit_count);
+    uint32_t *unit_counts = (uint32_t *)malloc(sizeof(uint32_t) * unit_count);
+    file_seek(file, table_offset + TABLE_ENTRY_SIZE(format->wide) * unit_count, SEEK_SET);
+
+    if (write_units(file, files, order, unit_size, format, unit_offsets, unit_counts, opts->workers))
+    {
+        free(unit_counts);
+        free(unit_offsets);
+        fclose(file);
+        return WRITE_ERR_IO;
+    }
+    const double start = stat_begin();
+    const uint64_t state_offset = file_tell(file);
+    write_dir_state(file, opts, state, format->wide);
+    const uint64_t end = file_tell(file);
+
+    file_seek(file, PSYM4_TABLE_OFFSET, SEEK_SET);
+    fwrite(&table_offset, sizeof table_offset, 1, file);
+    fwrite(&state_offset, sizeof state_offset, 1, file);
+    file_seek(file, table_offset, SEEK_SET);
+    fwrite(unit_offsets, sizeof(uint64_t), unit_count, file);
+    write_unit_counts(file, unit_counts, unit_count, format->wide);
+    free(unit_counts);
+    free(unit_offsets);
+    // a table that did not make it to the disk leaves the file unreadable
+    const int failed = ferror(file);
+    if (fclose(file) || failed)
+        return WRITE_ERR_IO;
+    // the units are counted as they go
+    STAT_ADD(STAT_BYTES_WRITTEN, table_offset + TABLE_ENTRY_SIZE(format->wide) * unit_count + end - state_offset);
+    stat_end(STAT_WRITE, start);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef PSYM_SERIALIZE
+#define PSYM_SERIALIZE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "dir_state.h"
+#include "file_table.h"
+#include "scan.h"
+
+#define WRITE_ERR_OPEN -1
+#define WRITE_ERR_IO -2
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t cap;
+} byte_buf;
+
+void init_byte_buf(byte_buf *buf);
+void free_byte_buf(byte_buf *buf);
+void buf_reserve(byte_buf *buf, size_t size);
+void buf_put(byte_buf *buf, const void *data, size_t size);
+// length + utf-16, same as the strings in the header; the length is 2b, or a varint in wide files
+void buf_put_wstr(byte_buf *buf, const wchar_t *str, int len, char wide);
+// little endian base 128
+void buf_put_varint(byte_buf *buf, uint64_t value);
+
+// unit layout, see the format description in psym.h
+typedef struct
+{
+    char compact;
+    time_t date_base; // compact unit dates are stored as zigzag varint deltas from it
+    uint16_t ext_count;
+    char wide; // PSYM4_FLAG_WIDE
+} unit_format;
+
+// the narrow fields of a file can't hold the scan or names of name_max utf-16 units
+char needs_wide(const scan_opts *opts, uint32_t unit_size, uint64_t name_max);
+// the file count that starts every unit and fills the count column of the table, UNIT_COUNT_SIZE(ref_map.h) bytes
+void put_unit_count(uint8_t *dst, uint32_t count, char wide);
+uint32_t get_unit_count(const uint8_t *src, char wide);
+// the count column of the table
+int write_unit_counts(FILE *file, const uint32_t *counts, uint64_t count, char wide);
+
+// front coding shares a prefix with the previous name of the unit
+typedef struct
+{
+    const unit_format *format;
+    uint8_t *prev;
+    uint8_t *cur;
+    int prev_len;
+    int cap; // of both name buffers
+} unit_encoder;
+
+void init_unit_encoder(unit_encoder *enc, const unit_format *format);
+void free_unit_encoder(unit_encoder *enc);
+// the file count is the first byte in either layout, it may be patched once the unit is done
+void put_unit_head(unit_encoder *enc, byte_buf *buf, uint32_t count, time_t date);
+void put_unit_file(unit_encoder *enc, byte_buf *buf, uint16_t dir, uint16_t ext, const wchar_t *name, int len);
+
+// units are serialized in parallel into per task buffers and written in order with a few large writes;
+// unit_offsets/unit_counts get one entry per unit, offsets are absolute in the file;
+// the file is left positioned after the last unit
+int write_units(FILE *file, const file_table *files, const uint32_t *order, uint32_t unit_size,
+                const unit_format *format, uint64_t *unit_offsets, uint32_t *unit_counts, int workers);
+
+// everything up to the unit table, which starts where the file is left; units of a file with a seed are in date order,
+// cursors free named cursor slots follow the fixed fields; without state there is no state offset and the file never
+// gets a directory state
+void write_head(FILE *file, const scan_opts *opts, uint32_t unit_size, uint64_t unit_count, const uint64_t *seed,
+                const unit_format *format, uint64_t cursors, char state);
+// the scan settings and the directories, gen --update picks the scan up from them
+void write_dir_state(FILE *file, const scan_opts *opts, const dir_state *state, char wide);
+// a whole file in one go, returns one of WRITE_ERR_*
+int write_bin(const scan_opts *opts, const wchar_t *output, uint32_t unit_size, const uint64_t *seed,
+              const unit_format *format, uint64_t cursors, const file_table *files, const uint32_t *order,
+              const dir_state *state);
+
+#endif
@@ -0,0 +1,614 @@
+#include "psym.h"
+#include "date_sort.h"
+#include "serialize.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+// longest request line, a client that sends more is dropped
+#define REQUEST_MAX 4096
+#define REQUEST_TOKENS 6
+// units of one reply
+#define REPLY_UNITS_MAX 65536
+#define RANGE_DEF_LIMIT 1024
+// cursors are written back at most this often while they move
+#define SYNC_INTERVAL 1.0
+#define POLL_TIMEOUT_MS 1000
+#define RECV_BUF_SIZE 4096
+// reply bytes a client may leave unread, past it the requests it sent wait and it is not read from
+#define OUT_MAX (1 << 20)
+#define LISTEN_BACKLOG 64
+
+typedef struct
+{
+    psym_reader *reader;
+    char *name; // as given on the command line, requests use it or the index
+    wchar_t **strs; // extensions then directories
+    time_t *dates; // by reading position
+    uint32_t *by_date; // reading positions, newest first
+    uint64_t handed;
+    uint64_t requests;
+    char dirty;
+} served_file;
+
+typedef struct
+{
+    int fd;
+    byte_buf in;
+    byte_buf out;
+    size_t sent;
+    char closing; // drop once the reply is out
+} client;
+
+struct psym_server
+{
+    served_file *files;
+    int file_count;
+    int fd;
+    char *socket_path;
+    client *clients;
+    int client_count;
+    int client_cap;
+    uint64_t clients_seen;
+    uint64_t requests;
+    double last_sync;
+};
+
+// reading positions by date, a range request is a binary search and a walk
+static int index_units(served_file *file)
+{
+    const ref_map *ref = psym_reader_ref(file->reader);
+    const uint64_t count = ref->unit_count;
+    if (count > UINT32_MAX)
+        return PSYM_ERR_TOO_MANY;
+    free(file->dates);
+    free(file->by_date);
+    file->dates = (time_t *)malloc(sizeof(time_t) * (count ? count : 1));
+    file->by_date = (uint32_t *)malloc(sizeof(uint32_t) * (count ? count : 1));
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        unit_view unit;
+        if (read_unit_view(ref, ref_unit_offset(ref, ref_unit_index(ref, i)), &unit))
+            return PSYM_ERR_TRUNCATED;
+        file->dates[i] = unit.date;
+    }
+    sort_by_date_desc(file->by_date, file->dates, count, cpu_count());
+    return 0;
+}
+
+static int load_file(served_file *file, const wchar_t *path)
+{
+    int ret = psym_open_reader(&file->reader, path, 1);
+    if (ret)
+    {
+        file->reader = NULL;
+        return ret;
+    }
+    const ref_map *ref = psym_reader_ref(file->reader);
+    if (ref->version < 4)
+        return PSYM_ERR_VERSION;
+
+    file->strs = (wchar_t **)malloc(sizeof(wchar_t *) * (ref->ext_count + ref->dir_count + 1));
+    for (uint32_t i = 0; i < ref->ext_count + ref->dir_count; ++i)
+    {
+        const str_view str = i < ref->ext_count ? ref->exts[i] : ref->dirs[i - ref->ext_count];
+        file->strs[i] = (wchar_t *)malloc(sizeof(wchar_t) * (str.len + 1));
+        str_view_to_wcs(file->strs[i], str);
+    }
+    return index_units(file);
+}
+
+static void free_served_file(served_file *file, const ref_map *ref)
+{
+    if (file->strs)
+    {
+        for (uint32_t i = 0; i < ref->ext_count + ref->dir_count; ++i)
+            free(file->strs[i]);
+        free(file->strs);
+    }
+    free(file->dates);
+    free(file->by_date);
+    free(file->name);
+}
+
+void psym_close_server(psym_server *server)
+{
+    for (int i = 0; i < server->file_count; ++i)
+    {
+        served_file *file = server->files + i;
+        if (file->reader)
+        {
+            psym_sync_reader(file->reader, 1);
+            free_served_file(file, psym_reader_ref(file->reader));
+            psym_close_reader(file->reader);
+        }
+        else
+            free_served_file(file, NULL);
+    }
+    free(server->files);
+#ifndef _WIN32
+    for (int i = 0; i < server->client_count; ++i)
+    {
+        close(server->clients[i].fd);
+        free_byte_buf(&server->clients[i].in);
+        free_byte_buf(&server->clients[i].out);
+    }
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+        unlink(server->socket_path);
+    }
+#endif
+    free(server->clients);
+    free(server->socket_path);
+    free(server);
+}
+
+#ifdef _WIN32
+int psym_open_server(psym_server **server, const wchar_t *socket_path, const wchar_t **paths, int count, int *failed)
+{
+    // nothing to close but the server itself
+    *server = (psym_server *)calloc(1, sizeof(psym_server));
+    *failed = -1;
+    return PSYM_ERR_PLATFORM;
+}
+
+int psym_run_server(psym_server *server, volatile sig_atomic_t *stop)
+{
+    return PSYM_ERR_PLATFORM;
+}
+#else
+static int listen_on(psym_server *server)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(server->socket_path) >= sizeof addr.sun_path)
+        return PSYM_ERR_SOCKET;
+    strcpy(addr.sun_path, server->socket_path);
+
+    // a socket left behind by a server that died is taken over, anything else at the path is not
+    struct stat st;
+    if (!lstat(server->socket_path, &st) && S_ISSOCK(st.st_mode))
+    {
+        const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int alive = probe >= 0 && !connect(probe, (struct sockaddr *)&addr, sizeof addr);
+        if (probe >= 0)
+            close(probe);
+        if (alive)
+            return PSYM_ERR_SOCKET;
+        unlink(server->socket_path);
+    }
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server->fd < 0)
+        return PSYM_ERR_SOCKET;
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof addr) || listen(server->fd, LISTEN_BACKLOG))
+    {
+        close(server->fd);
+        server->fd = -1;
+        return PSYM_ERR_SOCKET;
+    }
+    return 0;
+}
+
+int psym_open_server(psym_server **server, const wchar_t *socket_path, const wchar_t **paths, int count, int *failed)
+{
+    psym_server *s = (psym_server *)calloc(1, sizeof(psym_server));
+    s->fd = -1;
+    s->socket_path = wcs_to_path(socket_path);
+    s->files = (served_file *)calloc(count ? count : 1, sizeof(served_file));
+    s->file_count = count;
+    *server = s;
+    for (int i = 0; i < count; ++i)
+    {
+        s->files[i].name = wcs_to_path(paths[i]);
+        const int ret = load_file(s->files + i, paths[i]);
+        if (ret)
+        {
+            *failed = i;
+            return ret;
+        }
+    }
+    *failed = -1;
+    s->last_sync = time_now();
+    return listen_on(s);
+}
+
+static void put_str(byte_buf *buf, const char *str)
+{
+    buf_put(buf, str, strlen(str));
+}
+
+// printf into the reply, lines are short
+static void put_line(byte_buf *buf, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    const int len = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    buf_put(buf, line, len < (int)sizeof line ? len : (int)sizeof line - 1);
+}
+
+// source paths one per line, a backslash or a newline in them is escaped with a backslash
+static void put_path(byte_buf *buf, const char *path)
+{
+    for (const char *it = path; *it; ++it)
+    {
+        if (*it == '\\')
+            put_str(buf, "\\\\");
+        else if (*it == '\n')
+            put_str(buf, "\\n");
+        else
+            buf_put(buf, it, 1);
+    }
+    put_str(buf, "\n");
+}
+
+// unit <position> <date> <file count>, then its files
+static void put_unit(byte_buf *buf, const served_file *file, uint64_t pos, file_iter *iter)
+{
+    const ref_map *ref = psym_reader_ref(file->reader);
+    unit_view unit;
+    // the index was built from the same views, this can't fail
+    read_unit_view(ref, ref_unit_offset(ref, ref_unit_index(ref, pos)), &unit);
+    put_line(buf, "unit %llu %lld %u\n", (unsigned long long)pos, (long long)unit.date, unit.count);
+
+    wchar_t *path = NULL;
+    size_t path_cap = 0;
+    file_view view;
+    start_unit_files(iter, &unit);
+    while (next_file(iter, &view))
+    {
+        const wchar_t *dir = view.dir < ref->dir_count ? file->strs[ref->ext_count + view.dir] : L"";
+        const wchar_t *ext = view.ext < ref->ext_count ? file->strs[view.ext] : L"";
+        // names of wide files are not bound by PSYM_MAX_PATH
+        const size_t len = wcslen(dir) + view.len + wcslen(ext) + 3;
+        if (len > path_cap)
+        {
+            path_cap = len;
+            path = (wchar_t *)realloc(path, sizeof(wchar_t) * path_cap);
+        }
+        swprintf(path, len, L"%ls" PSYM_SEP L"%ls.%ls", dir, view.name, ext);
+        char *path_n = wcs_to_path(path);
+        put_path(buf, path_n);
+        free(path_n);
+    }
+    free(path);
+}
+
+static served_file *find_file(psym_server *server, const char *name)
+{
+    for (int i = 0; i < server->file_count; ++i)
+        if (!strcmp(server->files[i].name, name))
+            return server->files + i;
+    char *end;
+    const unsigned long ind = strtoul(name, &end, 10);
+    return *name && !*end && ind < (unsigned long)server->file_count ? server->files + ind : NULL;
+}
+
+// the units are claimed in the file, psym ext and other servers on it get different ones
+static void next_units(served_file *file, uint64_t count, byte_buf *out)
+{
+    const ref_map *ref = psym_reader_ref(file->reader);
+    uint64_t pos;
+    const int64_t claimed = psym_claim_units(file->reader, count, &pos);
+    const uint64_t end = pos + claimed;
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    put_str(out, "ok\n");
+    for (uint64_t i = pos; i < end; ++i)
+        put_unit(out, file, i, &iter);
+    free_file_iter(&iter);
+    file->handed += end - pos;
+    file->dirty |= end != pos;
+}
+
+// newest first, from and to are inclusive; the position does not move
+static void range_units(served_file *file, time_t from, time_t to, uint64_t limit, byte_buf *out)
+{
+    const ref_map *ref = psym_reader_ref(file->reader);
+    const uint32_t count = ref->unit_count;
+    // first unit not newer than to
+    uint32_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (file->dates[file->by_date[mid]] > to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    put_str(out, "ok\n");
+    for (uint32_t i = lo; i < count && limit && file->dates[file->by_date[i]] >= from; ++i, --limit)
+        put_unit(out, file, file->by_date[i], &iter);
+    free_file_iter(&iter);
+}
+
+static void put_stats(psym_server *server, byte_buf *out)
+{
+    put_str(out, "ok\n");
+    for (int i = 0; i < server->file_count; ++i)
+    {
+        const served_file *file = server->files + i;
+        const ref_map *ref = psym_reader_ref(file->reader);
+        const uint64_t tell = psym_tell(file->reader), pos = tell < ref->unit_count ? tell : ref->unit_count;
+        put_line(out, "file %i units %llu position %llu remaining %llu handed %llu requests %llu ", i,
+            (unsigned long long)ref->unit_count, (unsigned long long)pos, (unsigned long long)(ref->unit_count - pos),
+            (unsigned long long)file->handed, (unsigned long long)file->requests);
+        put_path(out, file->name);
+    }
+    put_line(out, "clients %i seen %llu requests %llu\n", server->client_count,
+        (unsigned long long)server->clients_seen, (unsigned long long)server->requests);
+}
+
+// a reply is ok or err <reason>, then its lines, then an empty line
+static void handle_request(psym_server *server, char *line, byte_buf *out)
+{
+    char *tokens[REQUEST_TOKENS];
+    int count = 0;
+    for (char *it = strtok(line, " \t\r"); it && count < REQUEST_TOKENS; it = strtok(NULL, " \t\r"))
+        tokens[count++] = it;
+    ++server->requests;
+
+    if (!count)
+        put_str(out, "err empty request\n");
+    else if (!strcmp(tokens[0], "stats") && count == 1)
+        put_stats(server, out);
+    else if (count < 2)
+        put_str(out, "err unknown request\n");
+    else
+    {
+        served_file *file = find_file(server, tokens[1]);
+        char *end = NULL;
+        if (file)
+            ++file->requests;
+        if (!file)
+            put_str(out, "err unknown file\n");
+        else if (!strcmp(tokens[0], "next") && count == 3)
+        {
+            const unsigned long long n = strtoull(tokens[2], &end, 10);
+            if (*end || !n || n > REPLY_UNITS_MAX)
+                put_str(out, "err invalid count\n");
+            else
+                next_units(file, n, out);
+        }
+        else if (!strcmp(tokens[0], "range") && (count == 4 || count == 5))
+        {
+            char *end_to, *end_limit = "";
+            const long long from = strtoll(tokens[2], &end, 10), to = strtoll(tokens[3], &end_to, 10);
+            const unsigned long long limit = count == 5 ? strtoull(tokens[4], &end_limit, 10) : RANGE_DEF_LIMIT;
+            if (*end || *end_to || *end_limit || !limit || limit > REPLY_UNITS_MAX)
+                put_str(out, "err invalid range\n");
+            else
+                range_units(file, from, to, limit, out);
+        }
+        else if (!strcmp(tokens[0], "reset") && (count == 2 || count == 3))
+        {
+            int ret = 0;
+            if (count == 3)
+            {
+                // the same seed as rst -x gets
+                const unsigned long long seed = strtoull(tokens[2], &end, 10);
+                if (*end)
+                    ret = -1;
+                else
+                {
+                    seed_rand(seed);
+                    ret = psym_reseed(file->reader, rand_u64());
+                    // reading positions moved, the dates go with them
+                    if (!ret)
+                        ret = index_units(file);
+                }
+            }
+            if (ret)
+                put_str(out, ret == PSYM_ERR_NOT_PERMUTED ? "err not permuted\n" : "err invalid seed\n");
+            else
+            {
+                psym_seek(file->reader, 0);
+                file->dirty = 1;
+                put_str(out, "ok\n");
+            }
+        }
+        else
+            put_str(out, "err unknown request\n");
+    }
+    put_str(out, "\n");
+}
+
+static void accept_clients(psym_server *server)
+{
+    for (;;)
+    {
+        const int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (server->client_count == server->client_cap)
+        {
+            server->client_cap = server->client_cap ? server->client_cap * 2 : 16;
+            server->clients = (client *)realloc(server->clients, sizeof(client) * server->client_cap);
+        }
+        client *c = server->clients + server->client_count++;
+        c->fd = fd;
+        c->sent = 0;
+        c->closing = 0;
+        init_byte_buf(&c->in);
+        init_byte_buf(&c->out);
+        ++server->clients_seen;
+    }
+}
+
+static size_t out_pending(const client *c)
+{
+    return c->out.size - c->sent;
+}
+
+// handles the complete lines of the input until the replies pass OUT_MAX, the rest waits for them to go out
+static void handle_lines(psym_server *server, client *c)
+{
+    size_t done = 0;
+    uint8_t *nl;
+    while (out_pending(c) <= OUT_MAX && (nl = (uint8_t *)memchr(c->in.data + done, '\n', c->in.size - done)))
+    {
+        *nl = '\0';
+        handle_request(server, (char *)c->in.data + done, &c->out);
+        done = nl + 1 - c->in.data;
+    }
+    memmove(c->in.data, c->in.data + done, c->in.size - done);
+    c->in.size -= done;
+}
+
+// returns nonzero once the client is gone
+static int read_client(psym_server *server, client *c)
+{
+    uint8_t buf[RECV_BUF_SIZE];
+    for (;;)
+    {
+        // a client that does not read its replies is not read from either
+        if (out_pending(c) > OUT_MAX)
+            return 0;
+        const ssize_t size = recv(c->fd, buf, sizeof buf, 0);
+        // replies to what came before the end still go out
+        if (size == 0)
+        {
+            c->closing = 1;
+            return 0;
+        }
+        if (size < 0)
+            return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        buf_put(&c->in, buf, size);
+        handle_lines(server, c);
+        if (c->in.size > REQUEST_MAX && !memchr(c->in.data, '\n', c->in.size))
+        {
+            put_str(&c->out, "err request too long\n\n");
+            c->in.size = 0;
+            c->closing = 1;
+            return 0;
+        }
+    }
+}
+
+static int write_client(client *c)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (c->sent < c->out.size)
+    {
+        const ssize_t size = send(c->fd, c->out.data + c->sent, c->out.size - c->sent, flags);
+        if (size < 0)
+            return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+        c->sent += size;
+    }
+    c->sent = 0;
+    c->out.size = 0;
+    return 0;
+}
+
+// sends what the socket takes, the lines held back are handled as the replies drain; nonzero once the client is gone
+static int flush_client(psym_server *server, client *c)
+{
+    while (c->out.size)
+    {
+        if (write_client(c))
+            return 1;
+        if (c->out.size)
+            return 0;
+        handle_lines(server, c);
+    }
+    return c->closing;
+}
+
+static void sync_cursors(psym_server *server, char wait)
+{
+    for (int i = 0; i < server->file_count; ++i)
+    {
+        if (server->files[i].dirty)
+            psym_sync_reader(server->files[i].reader, wait);
+        server->files[i].dirty = 0;
+    }
+    server->last_sync = time_now();
+}
+
+int psym_run_server(psym_server *server, volatile sig_atomic_t *stop)
+{
+    struct pollfd *fds = NULL;
+    int fd_cap = 0;
+    while (!*stop)
+    {
+        if (server->client_count + 1 > fd_cap)
+        {
+            fd_cap = (server->client_count + 1) * 2;
+            fds = (struct pollfd *)realloc(fds, sizeof(struct pollfd) * fd_cap);
+        }
+        fds[0].fd = server->fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < server->client_count; ++i)
+        {
+            const client *c = server->clients + i;
+            fds[i + 1].fd = c->fd;
+            fds[i + 1].events = (c->closing || out_pending(c) > OUT_MAX ? 0 : POLLIN) | (c->out.size ? POLLOUT : 0);
+        }
+        const int nfds = server->client_count + 1;
+        if (poll(fds, nfds, POLL_TIMEOUT_MS) < 0 && errno != EINTR)
+        {
+            free(fds);
+            return PSYM_ERR_SOCKET;
+        }
+
+        // clients of this round are at the same place in fds, new ones are only appended
+        const int polled = server->client_count;
+        if (fds[0].revents & POLLIN)
+            accept_clients(server);
+        for (int i = 0; i < polled; ++i)
+        {
+            client *c = server->clients + i;
+            int gone = 0;
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                gone = read_client(server, c);
+            // replies go out right away, most fit the socket buffer
+            if (!gone)
+                gone = flush_client(server, c);
+            if (gone)
+            {
+                close(c->fd);
+                free_byte_buf(&c->in);
+                free_byte_buf(&c->out);
+                c->fd = -1;
+            }
+        }
+        int kept = 0;
+        for (int i = 0; i < server->client_count; ++i)
+            if (server->clients[i].fd >= 0)
+                server->clients[kept++] = server->clients[i];
+        server->client_count = kept;
+
+        if (time_now() - server->last_sync >= SYNC_INTERVAL)
+            sync_cursors(server, 0);
+    }
+    free(fds);
+    sync_cursors(server, 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,415 @@
+#include "permute.h"
+#include "psym.h"
+#include "serialize.h"
+#include "stats.h"
+#include "util.h"
+#include "verify.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+// a file put together out of whole units of others, copied as they are; the table is written once they are all in
+typedef struct
+{
+    FILE *file;
+    uint64_t *offsets;
+    uint32_t *counts;
+    uint64_t count;
+    uint64_t table_offset;
+    char wide;
+    const uint64_t *seed; // units go in in reading order, the table is laid out through the permutation
+    const scan_opts *opts; // with state, written after the units
+    const dir_state *state;
+} unit_sink;
+
+// the header strings of ref as the scan options write_head takes, free the returned strings
+static wchar_t **header_opts(const ref_map *ref, scan_opts *opts)
+{
+    wchar_t **strs = (wchar_t **)malloc(sizeof(wchar_t *) * (ref->ext_count + ref->dir_count + 1));
+    for (uint32_t i = 0; i < ref->ext_count + ref->dir_count; ++i)
+    {
+        const str_view str = i < ref->ext_count ? ref->exts[i] : ref->dirs[i - ref->ext_count];
+        strs[i] = (wchar_t *)malloc(sizeof(wchar_t) * (str.len + 1));
+        str_view_to_wcs(strs[i], str);
+    }
+    memset(opts, 0, sizeof(scan_opts));
+    opts->exts = (const wchar_t **)strs;
+    opts->dirs = (const wchar_t **)strs + ref->ext_count;
+    opts->ext_count = ref->ext_count;
+    opts->dir_count = ref->dir_count;
+    return strs;
+}
+
+static void free_header_opts(wchar_t **strs, const scan_opts *opts)
+{
+    for (int i = 0; i < opts->ext_count + opts->dir_count; ++i)
+        free(strs[i]);
+    free(strs);
+}
+
+static unit_format ref_format(const ref_map *ref)
+{
+    const unit_format format = { (ref->flags & PSYM4_FLAG_COMPACT) != 0, ref->date_base, ref->ext_count,
+                                 (ref->flags & PSYM4_FLAG_WIDE) != 0 };
+    return format;
+}
+
+// units are laid out like the ones of ref; seed and state may be NULL, opts has to outlive the sink with a state
+static int open_sink(unit_sink *sink, const wchar_t *path, const ref_map *ref, const scan_opts *opts, uint64_t count,
+                     uint64_t cursors, const uint64_t *seed, const dir_state *state)
+{
+    const unit_format format = ref_format(ref);
+    sink->file = file_open(path, L"wb");
+    if (!sink->file)
+        return PSYM_ERR_WRITE;
+    sink->offsets = (uint64_t *)malloc(sizeof(uint64_t) * (count ? count : 1));
+    sink->counts = (uint32_t *)malloc(sizeof(uint32_t) * (count ? count : 1));
+    sink->count = 0;
+    sink->wide = format.wide;
+    sink->seed = seed;
+    sink->opts = opts;
+    sink->state = state;
+    write_head(sink->file, opts, ref->unit_size, count, seed, &format, cursors, state != NULL);
+    sink->table_offset = file_tell(sink->file);
+    file_seek(sink->file, sink->table_offset + TABLE_ENTRY_SIZE(format.wide) * count, SEEK_SET);
+    return 0;
+}
+
+static void put_bytes(unit_sink *sink, const uint8_t *data, uint64_t size, uint32_t count)
+{
+    sink->offsets[sink->count] = file_tell(sink->file);
+    sink->counts[sink->count++] = count;
+    fwrite(data, 1, size, sink->file);
+    STAT_ADD(STAT_BYTES_WRITTEN, size);
+}
+
+static void put_unit(unit_sink *sink, const ref_map *ref, const unit_view *unit)
+{
+    put_bytes(sink, ref->map.data + unit->offset, unit->size, unit->count);
+}
+
+static int close_sink(unit_sink *sink)
+{
+    if (sink->state)
+    {
+        const uint64_t state_offset = file_tell(sink->file);
+        write_dir_state(sink->file, sink->opts, sink->state, sink->wide);
+        STAT_ADD(STAT_BYTES_WRITTEN, file_tell(sink->file) - state_offset + sizeof state_offset);
+        file_seek(sink->file, PSYM4_STATE_OFFSET, SEEK_SET);
+        fwrite(&state_offset, sizeof state_offset, 1, sink->file);
+    }
+    if (sink->seed)
+    {
+        // the unit at reading position i is table entry permute_index(i)
+        uint64_t *offsets = (uint64_t *)malloc(sizeof(uint64_t) * (sink->count ? sink->count : 1));
+        uint32_t *counts = (uint32_t *)malloc(sizeof(uint32_t) * (sink->count ? sink->count : 1));
+        for (uint64_t i = 0; i < sink->count; ++i)
+        {
+            const uint64_t ind = permute_index(i, sink->count, *sink->seed);
+            offsets[ind] = sink->offsets[i];
+            counts[ind] = sink->counts[i];
+        }
+        free(sink->offsets);
+        free(sink->counts);
+        sink->offsets = offsets;
+        sink->counts = counts;
+    }
+    file_seek(sink->file, PSYM4_TABLE_OFFSET, SEEK_SET);
+    fwrite(&sink->table_offset, sizeof sink->table_offset, 1, sink->file);
+    file_seek(sink->file, sink->table_offset, SEEK_SET);
+    fwrite(sink->offsets, sizeof(uint64_t), sink->count, sink->file);
+    write_unit_counts(sink->file, sink->counts, sink->count, sink->wide);
+    STAT_ADD(STAT_BYTES_WRITTEN, sink->table_offset + TABLE_ENTRY_SIZE(sink->wide) * sink->count);
+    const int failed = ferror(sink->file);
+    free(sink->offsets);
+    free(sink->counts);
+    return fclose(sink->file) || failed ? PSYM_ERR_WRITE : 0;
+}
+
+// the unit at a reading position
+static int remaining_unit(const ref_map *ref, uint64_t pos, unit_view *unit)
+{
+    return read_unit_view(ref, ref_unit_offset(ref, ref_unit_index(ref, pos)), unit) ? PSYM_ERR_TRUNCATED : 0;
+}
+
+int psym_split(const wchar_t *input, const wchar_t **outputs, int count, int by, uint64_t *unit_counts)
+{
+    ref_map ref;
+    int ret = open_ref_map(&ref, input, 0);
+    if (ret)
+        return ret;
+    if (ref.version < 4)
+    {
+        close_ref_map(&ref);
+        return PSYM_ERR_VERSION;
+    }
+
+    // every shard is sized before it is written, so the assignment is made up front
+    const double start = stat_begin();
+    const uint64_t first = ref.pos < ref.unit_count ? ref.pos : ref.unit_count;
+    const uint64_t left = ref.unit_count - first;
+    uint32_t *shards = (uint32_t *)malloc(sizeof(uint32_t) * (left ? left : 1));
+    memset(unit_counts, 0, sizeof(uint64_t) * count);
+    for (uint64_t i = 0; i < left && !ret; ++i)
+    {
+        unit_view unit;
+        if (by == PSYM_SHARD_HASH && !(ret = remaining_unit(&ref, first + i, &unit)))
+            shards[i] = (uint32_t)(XXH3_64bits(ref.map.data + unit.offset, unit.size) % count);
+        else
+            shards[i] = (uint32_t)(i % count);
+        ++unit_counts[shards[i]];
+    }
+
+    scan_opts opts;
+    wchar_t **strs = header_opts(&ref, &opts);
+    unit_sink *sinks = (unit_sink *)malloc(sizeof(unit_sink) * count);
+    int opened = 0;
+    for (; opened < count && !ret; ++opened)
+        if ((ret = open_sink(sinks + opened, outputs[opened], &ref, &opts, unit_counts[opened], ref.cursor_count,
+                             NULL, NULL)))
+            break;
+    for (uint64_t i = 0; i < left && !ret; ++i)
+    {
+        unit_view unit;
+        if (!(ret = remaining_unit(&ref, first + i, &unit)))
+            put_unit(sinks + shards[i], &ref, &unit);
+    }
+    for (int i = 0; i < opened; ++i)
+    {
+        const int closed = close_sink(sinks + i);
+        ret = ret ? ret : closed;
+    }
+    stat_end(STAT_WRITE, start);
+
+    free(sinks);
+    free_header_opts(strs, &opts);
+    free(shards);
+    close_ref_map(&ref);
+    return ret;
+}
+
+// the same directories and extensions and units laid out the same way
+static int same_layout(const ref_map *a, const ref_map *b)
+{
+    const uint16_t layout_flags = PSYM4_FLAG_COMPACT | PSYM4_FLAG_WIDE;
+    if (a->ext_count != b->ext_count || a->dir_count != b->dir_count || a->unit_size != b->unit_size ||
+        (a->flags & layout_flags) != (b->flags & layout_flags) ||
+        ((a->flags & PSYM4_FLAG_COMPACT) && a->date_base != b->date_base))
+        return 0;
+    for (uint32_t i = 0; i < a->ext_count + a->dir_count; ++i)
+    {
+        const str_view x = i < a->ext_count ? a->exts[i] : a->dirs[i - a->ext_count];
+        const str_view y = i < a->ext_count ? b->exts[i] : b->dirs[i - a->ext_count];
+        if (x.len != y.len || memcmp(x.data, y.data, sizeof(uint16_t) * x.len))
+            return 0;
+    }
+    return 1;
+}
+
+int psym_merge(const wchar_t **inputs, int count, const wchar_t *output, uint64_t *unit_count, int *failed)
+{
+    *failed = -1;
+    *unit_count = 0;
+    ref_map *refs = (ref_map *)malloc(sizeof(ref_map) * count);
+    int opened = 0, ret = 0;
+    uint64_t cursors = 0;
+    for (; opened < count; ++opened)
+    {
+        ref_map *ref = refs + opened;
+        if ((ret = open_ref_map(ref, inputs[opened], 0)))
+            break;
+        // the position is kept for the loop below
+        ref->pos = ref->pos < ref->unit_count ? ref->pos : ref->unit_count;
+        if (ref->version < 4)
+            ret = PSYM_ERR_VERSION;
+        else if (opened && !same_layout(refs, ref))
+            ret = PSYM_ERR_MISMATCH;
+        else
+        {
+            *unit_count += ref->unit_count - ref->pos;
+            cursors = ref->cursor_count > cursors ? ref->cursor_count : cursors;
+            continue;
+        }
+        close_ref_map(ref);
+        break;
+    }
+    if (ret)
+        *failed = opened;
+
+    // one unit of every file in turn, the units left of each keep their order
+    const double start = stat_begin();
+    unit_sink sink;
+    scan_opts opts;
+    wchar_t **strs = NULL;
+    if (!ret)
+    {
+        strs = header_opts(refs, &opts);
+        ret = open_sink(&sink, output, refs, &opts, *unit_count, cursors, NULL, NULL);
+        for (uint64_t written = 0; written < *unit_count && !ret;)
+        {
+            for (int i = 0; i < count && !ret; ++i)
+            {
+                unit_view unit;
+                if (refs[i].pos == refs[i].unit_count)
+                    continue;
+                if ((ret = remaining_unit(refs + i, refs[i].pos++, &unit)))
+                    *failed = i;
+                else
+                {
+                    put_unit(&sink, refs + i, &unit);
+                    ++written;
+                }
+            }
+        }
+        if (!ret || *failed >= 0)
+        {
+            const int closed = close_sink(&sink);
+            ret = ret ? ret : closed;
+        }
+        free_header_opts(strs, &opts);
+    }
+    stat_end(STAT_WRITE, start);
+
+    for (int i = 0; i < opened; ++i)
+        close_ref_map(refs + i);
+    free(refs);
+    return ret;
+}
+
+// the units that keep files are written again in reading order, the ones that keep all of them byte for byte
+static int write_pruned(unit_sink *sink, const ref_map *ref, const ref_check *check, const uint32_t *kept)
+{
+    const unit_format format = ref_format(ref);
+    unit_encoder enc;
+    init_unit_encoder(&enc, &format);
+    byte_buf buf;
+    init_byte_buf(&buf);
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    int ret = 0;
+    for (uint64_t pos = 0; pos < ref->unit_count && !ret; ++pos)
+    {
+        const uint64_t ind = ref_unit_index(ref, pos);
+        unit_view unit;
+        if (!kept[ind] || (ret = remaining_unit(ref, pos, &unit)))
+            continue;
+        if (kept[ind] == unit.count)
+        {
+            put_unit(sink, ref, &unit);
+            continue;
+        }
+        buf.size = 0;
+        put_unit_head(&enc, &buf, kept[ind], unit.date);
+        start_unit_files(&iter, &unit);
+        file_view file;
+        for (uint64_t i = check->unit_first[ind]; next_file(&iter, &file); ++i)
+            if (!check->missing[i])
+                put_unit_file(&enc, &buf, file.dir, file.ext, file.name, file.len);
+        put_bytes(sink, buf.data, buf.size, kept[ind]);
+    }
+    free_file_iter(&iter);
+    free_byte_buf(&buf);
+    free_unit_encoder(&enc);
+    return ret;
+}
+
+// positions move back by the units dropped before them, left[p] is the units kept before reading position p
+static int move_positions(ref_map *ref, const wchar_t *path, const uint64_t *left)
+{
+    ref_map out;
+    const int ret = open_ref_map(&out, path, 1);
+    if (ret)
+        return ret;
+    const uint64_t pos = load_ref_pos(ref);
+    set_ref_pos(&out, left[pos < ref->unit_count ? pos : ref->unit_count]);
+    for (uint64_t slot = 0; slot < ref->cursor_count; ++slot)
+    {
+        int len;
+        const uint8_t *name = ref_cursor_name(ref, slot, &len);
+        if (!len)
+            continue;
+        const uint64_t cursor_pos = ref_cursor_pos(ref, slot);
+        use_ref_cursor(&out, add_ref_cursor(&out, name, len));
+        set_ref_pos(&out, left[cursor_pos < ref->unit_count ? cursor_pos : ref->unit_count]);
+    }
+    close_ref_map(&out);
+    return 0;
+}
+
+int psym_prune(const wchar_t *path, int workers, psym_verify_result *result)
+{
+    memset(result, 0, sizeof(psym_verify_result));
+    ref_map ref;
+    int ret = open_ref_map(&ref, path, 0);
+    if (ret)
+        return ret;
+    if (ref.version < 4)
+    {
+        close_ref_map(&ref);
+        return PSYM_ERR_VERSION;
+    }
+    ref_check check;
+    ret = check_ref_files(&ref, workers, &check, result);
+    result->units = result->units_left = ref.unit_count;
+    if (ret || !result->missing)
+    {
+        free_ref_check(&check);
+        close_ref_map(&ref);
+        return ret;
+    }
+
+    const double start = stat_begin();
+    const uint64_t unit_count = ref.unit_count;
+    uint32_t *kept = (uint32_t *)calloc(unit_count ? unit_count : 1, sizeof(uint32_t));
+    uint64_t *left = (uint64_t *)malloc(sizeof(uint64_t) * (unit_count + 1));
+    for (uint64_t i = 0; i < unit_count; ++i)
+        for (uint64_t file = check.unit_first[i]; file < check.unit_first[i + 1]; ++file)
+            kept[i] += !check.missing[file];
+    left[0] = 0;
+    for (uint64_t pos = 0; pos < unit_count; ++pos)
+        left[pos + 1] = left[pos] + (kept[ref_unit_index(&ref, pos)] != 0);
+    result->units_left = left[unit_count];
+
+    scan_opts opts;
+    wchar_t **strs = header_opts(&ref, &opts);
+    dir_state state;
+    const char has_state = (ref.flags & PSYM4_FLAG_DIR_STATE) != 0;
+    if (has_state && read_ref_dir_state(&ref, &state, &opts.recursive, &opts.stamp_source, &opts.bound_lower,
+                                        &opts.bound_upper))
+        ret = PSYM_ERR_TRUNCATED;
+    else if (!has_state)
+        init_dir_state(&state);
+
+    // written next to the file and moved over it once done
+    const size_t len = wcslen(path) + 8;
+    wchar_t *temp = (wchar_t *)malloc(sizeof(wchar_t) * len);
+    swprintf(temp, len, L"%ls.prune", path);
+    const uint64_t seed = ref.seed;
+    unit_sink sink;
+    if (!ret && !(ret = open_sink(&sink, temp, &ref, &opts, result->units_left, ref.cursor_count,
+                                  ref.flags & PSYM4_FLAG_PERMUTED ? &seed : NULL, has_state ? &state : NULL)))
+    {
+        ret = write_pruned(&sink, &ref, &check, kept);
+        const int closed = close_sink(&sink);
+        ret = ret ? ret : closed;
+        if (!ret)
+            ret = move_positions(&ref, temp, left);
+    }
+    stat_end(STAT_WRITE, start);
+    close_ref_map(&ref);
+    if (!ret && move_path(temp, path))
+        ret = PSYM_ERR_WRITE;
+    if (ret)
+        remove_path(temp);
+
+    free(temp);
+    free_dir_state(&state);
+    free_header_opts(strs, &opts);
+    free(left);
+    free(kept);
+    free_ref_check(&check);
+    return ret;
+}
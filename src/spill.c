@@ -0,0 +1,211 @@
+#include "spill.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// date, len, dir_len, dir, ext, then the name without the null term
+#define RECORD_HEAD_SIZE (sizeof(time_t) + sizeof(uint32_t) * 2 + sizeof(uint16_t) * 2)
+
+typedef struct
+{
+    FILE *file;
+    spilled_file cur;
+    wchar_t *name;
+    uint32_t name_cap;
+} run_reader;
+
+int cmp_spilled(const spilled_file *lhs, const spilled_file *rhs)
+{
+    if (lhs->date != rhs->date)
+        return lhs->date > rhs->date ? -1 : 1;
+    if (lhs->dir != rhs->dir)
+        return lhs->dir < rhs->dir ? -1 : 1;
+    // same as comparing the directory paths with wcscmp
+    const int cmp = wmemcmp(lhs->name, rhs->name, lhs->dir_len < rhs->dir_len ? lhs->dir_len : rhs->dir_len);
+    if (cmp)
+        return cmp;
+    if (lhs->dir_len != rhs->dir_len)
+        return lhs->dir_len < rhs->dir_len ? -1 : 1;
+    if (lhs->ext != rhs->ext)
+        return lhs->ext < rhs->ext ? -1 : 1;
+    return wcscmp(lhs->name, rhs->name);
+}
+
+static int cmp_key(const void *lhs, const void *rhs)
+{
+    return cmp_spilled((const spilled_file *)lhs, (const spilled_file *)rhs);
+}
+
+static int put_spilled(FILE *file, const spilled_file *spilled)
+{
+    uint8_t head[RECORD_HEAD_SIZE];
+    uint8_t *it = head;
+    memcpy(it, &spilled->date, sizeof spilled->date);
+    it += sizeof spilled->date;
+    memcpy(it, &spilled->len, sizeof spilled->len);
+    it += sizeof spilled->len;
+    memcpy(it, &spilled->dir_len, sizeof spilled->dir_len);
+    it += sizeof spilled->dir_len;
+    memcpy(it, &spilled->dir, sizeof spilled->dir);
+    it += sizeof spilled->dir;
+    memcpy(it, &spilled->ext, sizeof spilled->ext);
+    if (fwrite(head, sizeof head, 1, file) != 1 ||
+        fwrite(spilled->name, sizeof(wchar_t), spilled->len, file) != spilled->len)
+        return -1;
+    return 0;
+}
+
+// 1 when a file was read, 0 at the end of the run
+static int read_spilled(run_reader *reader)
+{
+    uint8_t head[RECORD_HEAD_SIZE];
+    const size_t read = fread(head, 1, sizeof head, reader->file);
+    if (read != sizeof head)
+        return read || ferror(reader->file) ? -1 : 0;
+
+    spilled_file *cur = &reader->cur;
+    const uint8_t *it = head;
+    memcpy(&cur->date, it, sizeof cur->date);
+    it += sizeof cur->date;
+    memcpy(&cur->len, it, sizeof cur->len);
+    it += sizeof cur->len;
+    memcpy(&cur->dir_len, it, sizeof cur->dir_len);
+    it += sizeof cur->dir_len;
+    memcpy(&cur->dir, it, sizeof cur->dir);
+    it += sizeof cur->dir;
+    memcpy(&cur->ext, it, sizeof cur->ext);
+
+    if (cur->len >= reader->name_cap)
+    {
+        reader->name_cap = cur->len + 64;
+        reader->name = (wchar_t *)realloc(reader->name, sizeof(wchar_t) * reader->name_cap);
+    }
+    if (fread(reader->name, sizeof(wchar_t), cur->len, reader->file) != cur->len)
+        return -1;
+    reader->name[cur->len] = L'\0';
+    cur->name = reader->name;
+    return 1;
+}
+
+static FILE *open_run(const wchar_t *path)
+{
+    FILE *run = temp_file(path);
+    if (run)
+        setvbuf(run, NULL, _IOFBF, SPILL_BUF_SIZE);
+    return run;
+}
+
+// flushes and rewinds the run for reading, closes it on failure
+static FILE *finish_run(FILE *run, int ret)
+{
+    if (ret || fflush(run))
+    {
+        fclose(run);
+        return NULL;
+    }
+    rewind(run);
+    return run;
+}
+
+FILE *spill_run(const wchar_t *path, const file_table *files)
+{
+    spilled_file *keys = (spilled_file *)malloc(sizeof(spilled_file) * (files->count ? files->count : 1));
+    for (uint32_t i = 0; i < files->count; ++i)
+    {
+        const wchar_t *name = FILE_NAME(files, i);
+        const wchar_t *sep = wcsrchr(name, PSYM_SEP_CHAR);
+        keys[i].date = files->dates[i];
+        keys[i].name = name;
+        keys[i].len = wcslen(name);
+        keys[i].dir_len = sep ? sep - name : 0;
+        keys[i].dir = files->dirs[i];
+        keys[i].ext = files->exts[i];
+    }
+    qsort(keys, files->count, sizeof(spilled_file), cmp_key);
+
+    FILE *run = open_run(path);
+    int ret = run ? 0 : -1;
+    for (uint32_t i = 0; i < files->count && !ret; ++i)
+        ret = put_spilled(run, keys + i);
+    free(keys);
+    return run ? finish_run(run, ret) : NULL;
+}
+
+static void sift_down(const run_reader *readers, int *heap, int size, int i)
+{
+    while (1)
+    {
+        int min = i;
+        const int left = i * 2 + 1, right = left + 1;
+        if (left < size && cmp_spilled(&readers[heap[left]].cur, &readers[heap[min]].cur) < 0)
+            min = left;
+        if (right < size && cmp_spilled(&readers[heap[right]].cur, &readers[heap[min]].cur) < 0)
+            min = right;
+        if (min == i)
+            return;
+        const int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+int merge_runs(FILE **runs, int count, spill_emit_fn emit, void *arg)
+{
+    run_reader *readers = (run_reader *)malloc(sizeof(run_reader) * (count ? count : 1));
+    int *heap = (int *)malloc(sizeof(int) * (count ? count : 1));
+    int heap_size = 0, ret = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        readers[i].file = runs[i];
+        readers[i].name = NULL;
+        readers[i].name_cap = 0;
+        const int read = ret ? 0 : read_spilled(readers + i);
+        if (read < 0)
+            ret = -1;
+        else if (read)
+            heap[heap_size++] = i;
+    }
+    for (int i = heap_size / 2 - 1; i >= 0; --i)
+        sift_down(readers, heap, heap_size, i);
+
+    while (!ret && heap_size)
+    {
+        run_reader *top = readers + heap[0];
+        if ((ret = emit(&top->cur, arg)))
+            break;
+        const int read = read_spilled(top);
+        if (read < 0)
+            ret = -1;
+        else if (!read)
+            heap[0] = heap[--heap_size];
+        sift_down(readers, heap, heap_size, 0);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        fclose(runs[i]);
+        free(readers[i].name);
+    }
+    free(heap);
+    free(readers);
+    return ret;
+}
+
+static int emit_to_run(const spilled_file *file, void *arg)
+{
+    return put_spilled((FILE *)arg, file);
+}
+
+FILE *merge_to_run(const wchar_t *path, FILE **runs, int count)
+{
+    FILE *run = open_run(path);
+    if (!run)
+    {
+        for (int i = 0; i < count; ++i)
+            fclose(runs[i]);
+        return NULL;
+    }
+    return finish_run(run, merge_runs(runs, count, emit_to_run, run));
+}
@@ -0,0 +1,38 @@
+#ifndef PSYM_SPILL
+#define PSYM_SPILL
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "file_table.h"
+
+// stdio buffer of every run, reading or writing
+#define SPILL_BUF_SIZE (1 << 20)
+// sort key of a spilled file, the name is null terminated
+typedef struct
+{
+    time_t date;
+    const wchar_t *name;
+    uint32_t len;
+    uint32_t dir_len; // name up to the last separator, 0 for files in the root
+    uint16_t dir;
+    uint16_t ext;
+} spilled_file;
+
+// newest first, equal dates keep the scan order(root, directory, extension, name)
+int cmp_spilled(const spilled_file *lhs, const spilled_file *rhs);
+
+// sorts the files in the order above into a new temporary file next to path, returned rewound;
+// takes a key per file on top of the table
+FILE *spill_run(const wchar_t *path, const file_table *files);
+
+// file is only valid during the call, nonzero stops the merge and is returned from it
+typedef int (*spill_emit_fn)(const spilled_file *file, void *arg);
+// k-way merge of sorted runs into emit, the runs are closed
+int merge_runs(FILE **runs, int count, spill_emit_fn emit, void *arg);
+// the same into a new rewound run next to path
+FILE *merge_to_run(const wchar_t *path, FILE **runs, int count);
+
+#endif
@@ -0,0 +1,91 @@
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static const wchar_t *_PHASE_NAMES[STAT_PHASE_COUNT] = {
+    L"scan", L"filter", L"sort", L"shuffle", L"serialize", L"write", L"header_parse", L"unit_parse", L"copy",
+    L"dedup", L"verify"
+};
+static const wchar_t *_COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+    L"syscalls", L"bytes_read", L"bytes_written", L"entries_seen", L"files_kept", L"files_copied", L"files_failed",
+    L"prefetched", L"cache_hits"
+};
+
+char stats_enabled = 0;
+static double _phases[STAT_PHASE_COUNT];
+static volatile int64_t _counters[STAT_COUNTER_COUNT];
+
+// allocations themselves aren't counted, the peak is what tells whether memory was the problem
+static uint64_t peak_memory(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof counters) ? counters.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void enable_stats(void)
+{
+    stats_enabled = 1;
+}
+
+double stat_begin(void)
+{
+    return stats_enabled ? time_now() : 0.0;
+}
+
+void stat_end(int phase, double start)
+{
+    if (stats_enabled)
+        _phases[phase] += time_now() - start;
+}
+
+void stat_add(int counter, uint64_t value)
+{
+    interlocked_add(_counters + counter, (int64_t)value);
+}
+
+void print_stats(char json)
+{
+    const uint64_t peak = peak_memory();
+    if (json)
+    {
+        fwprintf(stderr, L"{\"phases\":{");
+        for (int i = 0; i < STAT_PHASE_COUNT; ++i)
+            fwprintf(stderr, L"%ls\"%ls\":%.6f", i ? L"," : L"", _PHASE_NAMES[i], _phases[i]);
+        fwprintf(stderr, L"},\"counters\":{");
+        for (int i = 0; i < STAT_COUNTER_COUNT; ++i)
+            fwprintf(stderr, L"\"%ls\":%llu,", _COUNTER_NAMES[i], (unsigned long long)_counters[i]);
+        fwprintf(stderr, L"\"peak_memory\":%llu}}\n", (unsigned long long)peak);
+        return;
+    }
+
+    double total = 0.0;
+    fwprintf(stderr, L"%-14ls %12ls\n", L"phase", L"seconds");
+    for (int i = 0; i < STAT_PHASE_COUNT; ++i)
+    {
+        fwprintf(stderr, L"%-14ls %12.4f\n", _PHASE_NAMES[i], _phases[i]);
+        total += _phases[i];
+    }
+    fwprintf(stderr, L"%-14ls %12.4f\n", L"total", total);
+    for (int i = 0; i < STAT_COUNTER_COUNT; ++i)
+        fwprintf(stderr, L"%-14ls %12llu\n", _COUNTER_NAMES[i], (unsigned long long)_counters[i]);
+    fwprintf(stderr, L"%-14ls %12llu\n", L"peak_memory", (unsigned long long)peak);
+}
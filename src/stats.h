@@ -0,0 +1,44 @@
+#ifndef PSYM_STATS
+#define PSYM_STATS
+
+#include <stdint.h>
+
+// phases are timed from the thread that runs them, the timers add up if a phase runs more than once
+#define STAT_SCAN 0
+#define STAT_FILTER 1 // gen --update checking scanned files against the reference
+#define STAT_SORT 2
+#define STAT_SHUFFLE 3
+#define STAT_SERIALIZE 4
+#define STAT_WRITE 5
+#define STAT_HEADER_PARSE 6
+#define STAT_UNIT_PARSE 7
+#define STAT_COPY 8
+#define STAT_DEDUP 9 // gen --dedup grouping, reading and hashing candidates
+#define STAT_VERIFY 10 // verify and prune looking the files of a reference file up
+#define STAT_PHASE_COUNT 11
+
+// counters may be bumped from any thread
+#define STAT_SYSCALLS 0 // the ones made directly, buffered stdio is left out
+#define STAT_BYTES_READ 1
+#define STAT_BYTES_WRITTEN 2
+#define STAT_ENTRIES_SEEN 3 // directory entries the scan looked at
+#define STAT_FILES_KEPT 4 // the ones that passed the extension and date filters
+#define STAT_FILES_COPIED 5
+#define STAT_FILES_FAILED 6
+#define STAT_FILES_PREFETCHED 7 // sources ext read ahead of their copies
+#define STAT_FILES_CACHED 8 // sources already in the page cache when their copy started, linux only
+#define STAT_COUNTER_COUNT 9
+
+// everything is a no op until stats are enabled, one branch per call site
+extern char stats_enabled;
+#define STAT_ADD(counter, value) do { if (stats_enabled) stat_add(counter, value); } while (0)
+
+void enable_stats(void);
+// 0 when disabled, hand it to stat_end
+double stat_begin(void);
+void stat_end(int phase, double start);
+void stat_add(int counter, uint64_t value);
+// a table, or one line of json; either goes to stderr so the regular output is untouched
+void print_stats(char json);
+
+#endif
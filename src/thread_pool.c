@@ -0,0 +1,355 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+typedef CONDITION_VARIABLE psym_cond;
+typedef HANDLE psym_thread;
+#else
+#include <unistd.h>
+typedef pthread_cond_t psym_cond;
+typedef pthread_t psym_thread;
+#endif
+
+typedef struct
+{
+    pool_task_fn fn;
+    void *arg;
+} pool_task;
+
+// ring buffer, the owner works on the tail and thieves take from the head
+typedef struct
+{
+    pool_task *tasks;
+    int head;
+    int count;
+    int cap;
+    psym_mutex lock;
+} task_deque;
+
+typedef struct
+{
+    thread_pool *pool;
+    int ind;
+} pool_worker;
+
+struct thread_pool
+{
+    task_deque *deques;
+    pool_worker *workers;
+    psym_thread *threads;
+    int worker_count;
+
+    psym_mutex lock;
+    psym_cond work_cond;
+    psym_cond done_cond;
+    int queued;
+    int pending;
+    char stop;
+};
+
+void mutex_init(psym_mutex *mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_destroy(psym_mutex *mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void mutex_lock(psym_mutex *mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(psym_mutex *mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+int64_t interlocked_add(volatile int64_t *val, int64_t add)
+{
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd64((volatile LONG64 *)val, add) + add;
+#else
+    return __atomic_add_fetch(val, add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int64_t interlocked_load(const volatile int64_t *val)
+{
+#ifdef _MSC_VER
+    // aligned 64 bit reads are atomic on the 64 bit targets, and no locked instruction faults on read only pages
+    return *val;
+#else
+    return __atomic_load_n(val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int64_t interlocked_cas(volatile int64_t *val, int64_t expected, int64_t desired)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64((volatile LONG64 *)val, desired, expected);
+#else
+    __atomic_compare_exchange_n(val, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+#endif
+}
+
+static void cond_init(psym_cond *cond)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+static void cond_destroy(psym_cond *cond)
+{
+#ifdef _WIN32
+    (void)cond;
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+static void cond_wait(psym_cond *cond, psym_mutex *mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+static void cond_signal(psym_cond *cond)
+{
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+static void cond_broadcast(psym_cond *cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+static void deque_push(task_deque *deque, pool_task task)
+{
+    mutex_lock(&deque->lock);
+    if (deque->count == deque->cap)
+    {
+        pool_task *tasks = (pool_task *)malloc(sizeof(pool_task) * deque->cap * 2);
+        for (int i = 0; i < deque->count; ++i)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->cap];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->cap *= 2;
+    }
+    deque->tasks[(deque->head + deque->count++) % deque->cap] = task;
+    mutex_unlock(&deque->lock);
+}
+
+static int deque_pop(task_deque *deque, pool_task *task)
+{
+    mutex_lock(&deque->lock);
+    const int ret = deque->count > 0;
+    if (ret)
+        *task = deque->tasks[(deque->head + --deque->count) % deque->cap];
+    mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static int deque_steal(task_deque *deque, pool_task *task)
+{
+    mutex_lock(&deque->lock);
+    const int ret = deque->count > 0;
+    if (ret)
+    {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->cap;
+        --deque->count;
+    }
+    mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static int take_task(thread_pool *pool, int worker, pool_task *task)
+{
+    if (deque_pop(pool->deques + worker, task))
+        return 1;
+    for (int i = 1; i < pool->worker_count; ++i)
+        if (deque_steal(pool->deques + (worker + i) % pool->worker_count, task))
+            return 1;
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+#else
+static void *worker_main(void *arg)
+#endif
+{
+    const pool_worker *self = (const pool_worker *)arg;
+    thread_pool *pool = self->pool;
+
+    while (1)
+    {
+        pool_task task;
+        if (take_task(pool, self->ind, &task))
+        {
+            mutex_lock(&pool->lock);
+            --pool->queued;
+            mutex_unlock(&pool->lock);
+
+            task.fn(task.arg, self->ind);
+
+            mutex_lock(&pool->lock);
+            if (!--pool->pending)
+                cond_broadcast(&pool->done_cond);
+            mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        mutex_lock(&pool->lock);
+        while (!pool->queued && !pool->stop)
+            cond_wait(&pool->work_cond, &pool->lock);
+        const char stop = pool->stop && !pool->queued;
+        mutex_unlock(&pool->lock);
+        if (stop)
+            break;
+    }
+    return 0;
+}
+
+thread_pool *create_thread_pool(int worker_count)
+{
+    if (worker_count < 1)
+        worker_count = 1;
+
+    thread_pool *pool = (thread_pool *)malloc(sizeof(thread_pool));
+    pool->deques = (task_deque *)malloc(sizeof(task_deque) * worker_count);
+    pool->workers = (pool_worker *)malloc(sizeof(pool_worker) * worker_count);
+    pool->threads = (psym_thread *)malloc(sizeof(psym_thread) * worker_count);
+    pool->worker_count = worker_count;
+    pool->queued = 0;
+    pool->pending = 0;
+    pool->stop = 0;
+    mutex_init(&pool->lock);
+    cond_init(&pool->work_cond);
+    cond_init(&pool->done_cond);
+
+    for (int i = 0; i < worker_count; ++i)
+    {
+        pool->deques[i].cap = 64;
+        pool->deques[i].head = 0;
+        pool->deques[i].count = 0;
+        pool->deques[i].tasks = (pool_task *)malloc(sizeof(pool_task) * pool->deques[i].cap);
+        mutex_init(&pool->deques[i].lock);
+    }
+    for (int i = 0; i < worker_count; ++i)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].ind = i;
+#ifdef _WIN32
+        pool->threads[i] = CreateThread(NULL, 0, worker_main, pool->workers + i, 0, NULL);
+#else
+        pthread_create(pool->threads + i, NULL, worker_main, pool->workers + i);
+#endif
+    }
+    return pool;
+}
+
+void delete_thread_pool(thread_pool *pool)
+{
+    mutex_lock(&pool->lock);
+    pool->stop = 1;
+    cond_broadcast(&pool->work_cond);
+    mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->worker_count; ++i)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+        free(pool->deques[i].tasks);
+        mutex_destroy(&pool->deques[i].lock);
+    }
+
+    cond_destroy(&pool->done_cond);
+    cond_destroy(&pool->work_cond);
+    mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
+
+int pool_worker_count(const thread_pool *pool)
+{
+    return pool->worker_count;
+}
+
+void pool_submit(thread_pool *pool, int worker, pool_task_fn fn, void *arg)
+{
+    const pool_task task = { fn, arg };
+    // count the task before it becomes visible so that neither counter can go below zero
+    mutex_lock(&pool->lock);
+    ++pool->pending;
+    ++pool->queued;
+    mutex_unlock(&pool->lock);
+
+    deque_push(pool->deques + (worker < 0 ? 0 : worker), task);
+
+    mutex_lock(&pool->lock);
+    cond_signal(&pool->work_cond);
+    mutex_unlock(&pool->lock);
+}
+
+void pool_wait(thread_pool *pool)
+{
+    mutex_lock(&pool->lock);
+    while (pool->pending)
+        cond_wait(&pool->done_cond, &pool->lock);
+    mutex_unlock(&pool->lock);
+}
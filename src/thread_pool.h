@@ -0,0 +1,38 @@
+#ifndef PSYM_THREAD_POOL
+#define PSYM_THREAD_POOL
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+typedef CRITICAL_SECTION psym_mutex;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t psym_mutex;
+#endif
+
+void mutex_init(psym_mutex *mutex);
+void mutex_destroy(psym_mutex *mutex);
+void mutex_lock(psym_mutex *mutex);
+void mutex_unlock(psym_mutex *mutex);
+// returns the value after the addition
+int64_t interlocked_add(volatile int64_t *val, int64_t add);
+// works on read only memory as well
+int64_t interlocked_load(const volatile int64_t *val);
+// returns the value before, desired is stored only if it was expected
+int64_t interlocked_cas(volatile int64_t *val, int64_t expected, int64_t desired);
+
+// worker is the index of the calling worker, -1 outside of the pool
+typedef void (*pool_task_fn)(void *arg, int worker);
+typedef struct thread_pool thread_pool;
+
+int cpu_count(void);
+thread_pool *create_thread_pool(int worker_count);
+void delete_thread_pool(thread_pool *pool);
+int pool_worker_count(const thread_pool *pool);
+// tasks submitted by a worker go to its own deque, idle workers steal from the others
+void pool_submit(thread_pool *pool, int worker, pool_task_fn fn, void *arg);
+// blocks until every task, including the ones submitted by other tasks, has finished
+void pool_wait(thread_pool *pool);
+
+#endif
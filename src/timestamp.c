@@ -0,0 +1,119 @@
+#include "timestamp.h"
+
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#ifdef _WIN32
+#define STAMP_PER_SECOND 10000000ll
+#define STAMP_EPOCH_SECONDS 11644473600ll // 1601 to 1970
+#else
+#define STAMP_PER_SECOND 1000000000ll
+#define STAMP_EPOCH_SECONDS 0ll
+#endif
+
+// indexed by STAMP_*
+static const wchar_t *_SOURCE_NAMES[] = { L"mtime", L"ctime", L"btime", L"oldest" };
+
+int stamp_source(const wchar_t *name)
+{
+    for (int i = 0; i < STAMP_SOURCE_COUNT; ++i)
+        if (!wcscmp(name, _SOURCE_NAMES[i]))
+            return i;
+    return -1;
+}
+
+const wchar_t *stamp_source_name(int source)
+{
+    return source >= 0 && source < STAMP_SOURCE_COUNT ? _SOURCE_NAMES[source] : L"unknown";
+}
+
+time_t stamp_to_time(file_stamp stamp)
+{
+    // division rounds toward zero, dates before the epoch go one second down
+    const int64_t seconds = stamp >= 0 ? stamp / STAMP_PER_SECOND : (stamp + 1) / STAMP_PER_SECOND - 1;
+    return seconds - STAMP_EPOCH_SECONDS;
+}
+
+file_stamp time_to_stamp(time_t time)
+{
+    if (time > (INT64_MAX / STAMP_PER_SECOND) - STAMP_EPOCH_SECONDS)
+        return INT64_MAX;
+    if (time < INT64_MIN / STAMP_PER_SECOND)
+        return INT64_MIN;
+    return ((int64_t)time + STAMP_EPOCH_SECONDS) * STAMP_PER_SECOND;
+}
+
+void init_stamp_range(stamp_range *range, time_t bound_lower, time_t bound_upper)
+{
+    // time > lower is stamp >= the first stamp of the next second, time < upper is stamp < the first one of upper
+    const file_stamp lower = bound_lower < INT64_MAX ? time_to_stamp(bound_lower + 1) : INT64_MAX;
+    const file_stamp upper = time_to_stamp(bound_upper);
+    range->lower = lower;
+    range->span = upper > lower ? (uint64_t)upper - (uint64_t)lower : 0;
+}
+
+static file_stamp pick_stamp(int source, file_stamp mtime, file_stamp ctime, file_stamp btime)
+{
+    switch (source)
+    {
+    case STAMP_CTIME:
+        return ctime;
+    case STAMP_BTIME:
+        return btime;
+    case STAMP_OLDEST:
+        return btime < mtime ? btime : mtime;
+    default:
+        return mtime;
+    }
+}
+
+#ifdef _WIN32
+file_stamp filetime_stamp(const FILETIME *filetime)
+{
+    return (int64_t)(((uint64_t)filetime->dwHighDateTime << 32) | filetime->dwLowDateTime);
+}
+
+file_stamp find_data_stamp(const WIN32_FIND_DATAW *data, int source)
+{
+    const file_stamp created = filetime_stamp(&data->ftCreationTime);
+    return pick_stamp(source, filetime_stamp(&data->ftLastWriteTime), created, created);
+}
+#else
+#define TIMESPEC_STAMP(ts) ((int64_t)(ts).tv_sec * STAMP_PER_SECOND + (ts).tv_nsec)
+
+file_stamp stat_stamp(const struct stat *st, int source)
+{
+    const file_stamp mtime = TIMESPEC_STAMP(st->st_mtim);
+    return pick_stamp(source, mtime, TIMESPEC_STAMP(st->st_ctim), mtime);
+}
+
+int stat_file_stamp(int dir_fd, const char *name, int source, file_stamp *stamp, uint64_t *size)
+{
+#if defined(__linux__) && defined(STATX_BTIME)
+    if (!STAMP_FROM_STAT(source))
+    {
+        struct statx stx;
+        if (!statx(dir_fd, name, 0, STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_BTIME, &stx))
+        {
+            const file_stamp mtime = TIMESPEC_STAMP(stx.stx_mtime);
+            const file_stamp btime = stx.stx_mask & STATX_BTIME ? TIMESPEC_STAMP(stx.stx_btime) : mtime;
+            *stamp = pick_stamp(source, mtime, TIMESPEC_STAMP(stx.stx_ctime), btime);
+            *size = stx.stx_size;
+            return 0;
+        }
+        // kernels before 4.11
+        if (errno != ENOSYS)
+            return -1;
+    }
+#endif
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0))
+        return -1;
+    *stamp = stat_stamp(&st, source);
+    *size = st.st_size;
+    return 0;
+}
+#endif
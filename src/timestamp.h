@@ -0,0 +1,59 @@
+#ifndef PSYM_TIMESTAMP
+#define PSYM_TIMESTAMP
+
+#include <stdint.h>
+#include <time.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// a file time as the platform keeps it: FILETIME ticks(100 ns since 1601) on windows, ns since 1970 elsewhere
+typedef int64_t file_stamp;
+
+// which time of a file gen takes for its date, kept in the directory state for gen --update
+#define STAMP_MTIME 0
+#define STAMP_CTIME 1 // status change, creation on windows like the crt's st_ctime
+#define STAMP_BTIME 2 // birth(statx on linux, creation on windows), mtime where the filesystem has none
+#define STAMP_OLDEST 3 // the earlier of mtime and birth, copies that got a new mtime or a new birth keep the old one
+#define STAMP_SOURCE_COUNT 4
+
+// -1 for an unknown name
+int stamp_source(const wchar_t *name);
+const wchar_t *stamp_source_name(int source);
+
+// the -l/-u bounds of scan_opts(exclusive, whole seconds) as a half open range of stamps, made once per scan
+typedef struct
+{
+    file_stamp lower;
+    uint64_t span; // 0 keeps nothing
+} stamp_range;
+
+void init_stamp_range(stamp_range *range, time_t bound_lower, time_t bound_upper);
+// one subtraction and one compare, stamps below lower wrap around past span
+static inline int in_stamp_range(const stamp_range *range, file_stamp stamp)
+{
+    return (uint64_t)stamp - (uint64_t)range->lower < range->span;
+}
+
+// rounds down to the second, only for the files that are kept
+time_t stamp_to_time(file_stamp stamp);
+// saturates at the ends of file_stamp
+file_stamp time_to_stamp(time_t time);
+
+#ifdef _WIN32
+file_stamp filetime_stamp(const FILETIME *filetime);
+file_stamp find_data_stamp(const WIN32_FIND_DATAW *data, int source);
+#else
+// from a stat the scan already has; birth times are not in struct stat, those sources give mtime
+file_stamp stat_stamp(const struct stat *st, int source);
+// stats name in dir_fd following links, with statx where the source needs the birth time; 0 on success
+int stat_file_stamp(int dir_fd, const char *name, int source, file_stamp *stamp, uint64_t *size);
+// stat_stamp gives the same as stat_file_stamp for it
+#define STAMP_FROM_STAT(source) ((source) < STAMP_BTIME)
+#endif
+
+#endif
@@ -0,0 +1,342 @@
+#include "psym.h"
+#include "date_sort.h"
+#include "dedup.h"
+#include "file_table.h"
+#include "permute.h"
+#include "serialize.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// files already in the reference, by their record(2b dir, 2b ext, varint length, utf-16 name) whatever the unit layout
+typedef struct
+{
+    const uint8_t *base;
+    uint64_t *slots; // record offsets from base plus one, 0 is free
+    uint64_t mask;
+} record_set;
+
+static uint64_t hash_bytes(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+static size_t record_size(const uint8_t *rec)
+{
+    size_t size = sizeof(uint16_t) * 2;
+    uint64_t len = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        const uint8_t byte = rec[size++];
+        len |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return size + sizeof(uint16_t) * len;
+}
+
+static void put_record(byte_buf *buf, uint16_t dir, uint16_t ext, const wchar_t *name, int len)
+{
+    buf_put(buf, &dir, sizeof dir);
+    buf_put(buf, &ext, sizeof ext);
+    buf_put_wstr(buf, name, len, 1);
+}
+
+// the furthest the position or any cursor has gone, units before it keep their place
+static uint64_t read_pivot(ref_map *ref, uint64_t count)
+{
+    uint64_t pivot = load_ref_pos(ref);
+    for (uint64_t i = 0; i < ref->cursor_count; ++i)
+    {
+        const uint64_t cursor_pos = ref_cursor_pos(ref, i);
+        pivot = cursor_pos > pivot ? cursor_pos : pivot;
+    }
+    return pivot < count ? pivot : count;
+}
+
+// returns 1 when an equal record is in the set already
+static int record_find(record_set *set, const uint8_t *rec, size_t size, char insert)
+{
+    for (uint64_t i = hash_bytes(rec, size) & set->mask;; i = (i + 1) & set->mask)
+    {
+        if (!set->slots[i])
+        {
+            if (insert)
+                set->slots[i] = rec - set->base + 1;
+            return 0;
+        }
+        const uint8_t *other = set->base + set->slots[i] - 1;
+        if (record_size(other) == size && !memcmp(other, rec, size))
+            return 1;
+    }
+}
+
+int psym_update(const wchar_t *input, int workers, psym_update_result *result)
+{
+    ref_map ref;
+    int ret = open_ref_map(&ref, input, 0);
+    if (ret)
+        return ret;
+    if (ref.version < 4 || !(ref.flags & PSYM4_FLAG_DIR_STATE))
+    {
+        close_ref_map(&ref);
+        return PSYM_ERR_NO_STATE;
+    }
+
+    // the scan runs with the settings the file was generated with
+    scan_opts opts;
+    dir_state prev;
+    if (read_ref_dir_state(&ref, &prev, &opts.recursive, &opts.stamp_source, &opts.bound_lower,
+                           &opts.bound_upper))
+    {
+        close_ref_map(&ref);
+        return PSYM_ERR_TRUNCATED;
+    }
+    wchar_t **strs = (wchar_t **)malloc(sizeof(wchar_t *) * (ref.ext_count + ref.dir_count + 1));
+    for (uint32_t i = 0; i < ref.ext_count + ref.dir_count; ++i)
+    {
+        const str_view str = i < ref.ext_count ? ref.exts[i] : ref.dirs[i - ref.ext_count];
+        strs[i] = (wchar_t *)malloc(sizeof(wchar_t) * (str.len + 1));
+        str_view_to_wcs(strs[i], str);
+    }
+    opts.exts = (const wchar_t **)strs;
+    opts.dirs = (const wchar_t **)strs + ref.ext_count;
+    opts.ext_count = ref.ext_count;
+    opts.dir_count = ref.dir_count;
+    opts.workers = workers;
+    opts.sizes = 0;
+    opts.spill = NULL;
+    opts.prev = &prev;
+
+    // index what is there already
+    uint64_t file_total = 0, set_cap = 16;
+    for (uint64_t i = 0; i < ref.unit_count; ++i)
+        file_total += ref_unit_count(&ref, i);
+    while (set_cap < file_total * 2)
+        set_cap *= 2;
+    record_set known = { NULL, (uint64_t *)calloc(set_cap, sizeof(uint64_t)), set_cap - 1 };
+    byte_buf records;
+    file_iter iter;
+    // a file made with --dedup takes the files there already too, the new ones are deduplicated against them
+    file_table added;
+    init_file_table(&added);
+    init_byte_buf(&records);
+    init_file_iter(&iter, &ref);
+    uint64_t *old_offsets = (uint64_t *)malloc(sizeof(uint64_t) * (ref.unit_count ? ref.unit_count : 1));
+    uint32_t *old_counts = (uint32_t *)malloc(sizeof(uint32_t) * (ref.unit_count ? ref.unit_count : 1));
+    double start = stat_begin();
+    for (uint64_t i = 0; i < ref.unit_count && !ret; ++i)
+    {
+        unit_view unit;
+        // in reading order, permuted files are put back through their permutation once merged
+        old_offsets[i] = ref_unit_offset(&ref, ref_unit_index(&ref, i));
+        old_counts[i] = ref_unit_count(&ref, ref_unit_index(&ref, i));
+        if ((ret = read_unit_view(&ref, old_offsets[i], &unit)))
+            break;
+        file_view file;
+        start_unit_files(&iter, &unit);
+        while (next_file(&iter, &file) && !ret)
+        {
+            put_record(&records, file.dir, file.ext, file.name, file.len);
+            wchar_t *dst = prev.dedup ? add_file(&added, unit.date, file.dir, file.ext, file.len) : NULL;
+            if (dst)
+                memcpy(dst, file.name, sizeof(wchar_t) * file.len);
+            else if (prev.dedup)
+                ret = PSYM_ERR_MEMORY;
+        }
+    }
+    const uint32_t fixed = added.count;
+    free_file_iter(&iter);
+    stat_end(STAT_UNIT_PARSE, start);
+    // the arena doesn't move any more
+    known.base = records.data;
+    for (size_t it = 0; it < records.size; it += record_size(records.data + it))
+        record_find(&known, records.data + it, record_size(records.data + it), 1);
+
+    // the field widths of the file stay, a narrow one can't take names past UINT16_MAX utf-16 units
+    const char wide = (ref.flags & PSYM4_FLAG_WIDE) != 0;
+    file_table files;
+    dir_state state;
+    dedup_result dup = { 0, 0, 0, 0, 0 };
+    init_dir_state(&state);
+    if (ret)
+        ret = ret == PSYM_ERR_MEMORY ? ret : PSYM_ERR_TRUNCATED;
+    else if (scan_dirs(&opts, &files, &state))
+        ret = PSYM_ERR_MEMORY;
+    else
+    {
+        byte_buf rec;
+        init_byte_buf(&rec);
+        start = stat_begin();
+        for (uint32_t i = 0; i < files.count && !ret; ++i)
+        {
+            const wchar_t *name = FILE_NAME(&files, i);
+            const int len = wcslen(name);
+            if (!wide && wcs_utf16_len(name, len) > UINT16_MAX)
+                continue;
+            rec.size = 0;
+            put_record(&rec, files.dirs[i], files.exts[i], name, len);
+            if (record_find(&known, rec.data, rec.size, 0))
+                continue;
+            wchar_t *dst = add_file(&added, files.dates[i], files.dirs[i], files.exts[i], len);
+            if (dst)
+                memcpy(dst, name, sizeof(wchar_t) * len);
+            else
+                ret = PSYM_ERR_MEMORY;
+        }
+        stat_end(STAT_FILTER, start);
+        free_byte_buf(&rec);
+        free_file_table(&files);
+        state.dedup = prev.dedup;
+    }
+    if (fixed)
+    {
+        if (!ret && added.count > fixed)
+            dedup_files(&opts, &added, fixed, &dup);
+        // the files there already stay where they are
+        char *keep = (char *)malloc(added.count ? added.count : 1);
+        for (uint32_t i = 0; i < added.count; ++i)
+            keep[i] = i >= fixed;
+        filter_file_table(&added, keep);
+        free(keep);
+    }
+    free(known.slots);
+    free_byte_buf(&records);
+
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < state.count; ++i)
+    {
+        const int64_t ind = find_dir_state(&prev, state.roots[i], DIR_PATH(&state, i));
+        changed += ind < 0 || prev.stamps[ind] != state.stamps[i];
+    }
+
+    const uint32_t unit_size = ref.unit_size;
+    const uint64_t old_count = ref.unit_count;
+    uint64_t pivot = read_pivot(&ref, old_count);
+    const char permuted = (ref.flags & PSYM4_FLAG_PERMUTED) != 0;
+    const uint64_t seed = ref.seed;
+    // new units are laid out like the old ones
+    const unit_format format = { (ref.flags & PSYM4_FLAG_COMPACT) != 0, ref.date_base, ref.ext_count, wide };
+    // everything new goes past the end and the header is switched over to it last: readers that have the file open
+    // keep the old table and state, a crash leaves the file as it was
+    const uint64_t file_end = ref.map.size;
+    close_ref_map(&ref);
+
+    FILE *file = NULL;
+    if (!ret && !(file = file_open(input, L"rb+")))
+        ret = PSYM_ERR_OPEN;
+    if (!ret)
+    {
+        const uint64_t new_count = ((uint64_t)added.count + unit_size - 1) / unit_size;
+        uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * (added.count ? added.count : 1));
+        uint64_t *new_offsets = (uint64_t *)malloc(sizeof(uint64_t) * (new_count ? new_count : 1));
+        uint32_t *new_counts = (uint32_t *)malloc(sizeof(uint32_t) * (new_count ? new_count : 1));
+        order_units(order, added.dates, added.count, unit_size, 1, workers);
+
+        file_seek(file, file_end, SEEK_SET);
+        if (write_units(file, &added, order, unit_size, &format, new_offsets, new_counts, workers))
+            ret = PSYM_ERR_WRITE;
+        else
+        {
+            // read units keep their place, new ones are spread over the rest with every interleaving equally likely
+            start = stat_begin();
+            const uint64_t unit_count = old_count + new_count;
+            uint64_t *offsets = (uint64_t *)malloc(sizeof(uint64_t) * (unit_count ? unit_count : 1));
+            uint32_t *counts = (uint32_t *)malloc(sizeof(uint32_t) * (unit_count ? unit_count : 1));
+            // units claimed while the scan ran move the pivot, the interleaving is drawn again until it holds
+            for (;;)
+            {
+                memcpy(offsets, old_offsets, sizeof(uint64_t) * pivot);
+                memcpy(counts, old_counts, sizeof(uint32_t) * pivot);
+                for (uint64_t old_it = pivot, new_it = 0, i = pivot; i < unit_count; ++i)
+                {
+                    const uint64_t old_left = old_count - old_it, new_left = new_count - new_it;
+                    if (new_left && (uint64_t)rand_range(1, old_left + new_left) <= new_left)
+                    {
+                        offsets[i] = new_offsets[new_it];
+                        counts[i] = new_counts[new_it++];
+                    }
+                    else
+                    {
+                        offsets[i] = old_offsets[old_it];
+                        counts[i] = old_counts[old_it++];
+                    }
+                }
+                ref_map now;
+                if (open_ref_map(&now, input, 0))
+                    break;
+                const uint64_t moved = read_pivot(&now, old_count);
+                close_ref_map(&now);
+                if (moved <= pivot)
+                    break;
+                pivot = moved;
+            }
+
+            if (permuted)
+            {
+                // the permutation changes with the count, the table is laid out so that reading order stays
+                uint64_t *table_offsets = (uint64_t *)malloc(sizeof(uint64_t) * (unit_count ? unit_count : 1));
+                uint32_t *table_counts = (uint32_t *)malloc(sizeof(uint32_t) * (unit_count ? unit_count : 1));
+                for (uint64_t i = 0; i < unit_count; ++i)
+                {
+                    const uint64_t ind = permute_index(i, unit_count, seed);
+                    table_offsets[ind] = offsets[i];
+                    table_counts[ind] = counts[i];
+                }
+                free(offsets);
+                free(counts);
+                offsets = table_offsets;
+                counts = table_counts;
+            }
+
+            stat_end(STAT_SHUFFLE, start);
+
+            start = stat_begin();
+            const uint64_t table_offset = file_tell(file);
+            fwrite(offsets, sizeof(uint64_t), unit_count, file);
+            write_unit_counts(file, counts, unit_count, wide);
+            const uint64_t state_offset = file_tell(file);
+            write_dir_state(file, &opts, &state, wide);
+            const int64_t end = file_tell(file);
+
+            // the position is left to the readers, who move it with atomic operations on their mappings;
+            // the header only goes over to a table and state that are on the disk
+            if (ferror(file) || file_sync(file))
+                ret = PSYM_ERR_WRITE;
+            file_seek(file, PSYM4_UNIT_COUNT_OFFSET, SEEK_SET);
+            const uint64_t head[3] = { unit_count, table_offset, state_offset };
+            if (!ret && (fwrite(head, sizeof head, 1, file) != 1 || file_sync(file)))
+                ret = PSYM_ERR_WRITE;
+            STAT_ADD(STAT_BYTES_WRITTEN, end - table_offset + sizeof head);
+            stat_end(STAT_WRITE, start);
+            free(counts);
+            free(offsets);
+
+            result->changed_dirs = changed;
+            result->dir_count = state.count;
+            result->new_files = added.count;
+            result->duplicates = dup.removed;
+            result->new_units = new_count;
+        }
+        free(new_counts);
+        free(new_offsets);
+        free(order);
+    }
+    if (file)
+        fclose(file);
+
+    free(old_counts);
+    free(old_offsets);
+    free_file_table(&added);
+    free_dir_state(&state);
+    free_dir_state(&prev);
+    for (int i = 0; i < opts.ext_count + opts.dir_count; ++i)
+        free(strs[i]);
+    free(strs);
+    return ret;
+}
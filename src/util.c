@@ -1,27 +1,50 @@
 #include "util.h"
+#include "stats.h"
+#include "timestamp.h"
 
-int rand_range(int min, int max)
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#endif
+#endif
+
+static uint64_t _rand_state = 0;
+
+uint64_t mix_u64(uint64_t x)
 {
-    return rand() * (1.0 / RAND_MAX) * (max - min + 1) + min;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
 }
 
-time_t file_modify_time(const FILETIME *filetime)
+void seed_rand(uint64_t seed)
 {
-    SYSTEMTIME stime;
-
-    FileTimeToSystemTime(filetime, &stime);
+    _rand_state = seed;
+}
 
-    struct tm time;
-    memset(&time, 0, sizeof(struct tm));
-    time.tm_isdst = -1;
-    time.tm_year = stime.wYear - 1900;
-    time.tm_mon = stime.wMonth - 1;
-    time.tm_mday = stime.wDay;
-    time.tm_hour = stime.wHour;
-    time.tm_min = stime.wMinute;
-    time.tm_sec = stime.wSecond;
+uint64_t rand_u64(void)
+{
+    _rand_state += 0x9E3779B97F4A7C15ull;
+    return mix_u64(_rand_state);
+}
 
-    return mktime(&time);
+int rand_range(int min, int max)
+{
+    // rand() has 15 bits on msvc, the high half of a 64 bit draw scaled by a multiply covers any int range
+    return min + (int)(((rand_u64() >> 32) * ((uint64_t)max - min + 1)) >> 32);
 }
 
 time_t wcstot_t(const wchar_t *str)
@@ -32,7 +55,8 @@ time_t wcstot_t(const wchar_t *str)
         struct tm time;
         memset(&time, 0, sizeof(struct tm));
         time.tm_isdst = -1;
-        time.tm_year = y + 100;
+        // two digit years pivot like %y of strptime, 69 to 99 are 19xx; longer ones are taken as they are
+        time.tm_year = y < 69 ? y + 100 : y < 100 ? y : y - 1900;
         time.tm_mon = m - 1;
         time.tm_mday = d;
 
@@ -41,17 +65,938 @@ time_t wcstot_t(const wchar_t *str)
     return -1;
 }
 
-int create_dir_dupsafe(wchar_t *out_dir, const wchar_t *dir)
+int64_t file_tell(FILE *file)
+{
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return ftello(file);
+#endif
+}
+
+int file_seek(FILE *file, int64_t offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin);
+#else
+    return fseeko(file, offset, origin);
+#endif
+}
+
+int file_truncate(FILE *file, int64_t size)
+{
+    fflush(file);
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size) ? -1 : 0;
+#else
+    return ftruncate(fileno(file), size);
+#endif
+}
+
+int file_sync(FILE *file)
+{
+    if (fflush(file))
+        return -1;
+#ifdef _WIN32
+    return _commit(_fileno(file)) ? -1 : 0;
+#else
+    return fsync(fileno(file));
+#endif
+}
+
+wchar_t *create_dir_dupsafe(const wchar_t *dir)
 {
+    const size_t len = wcslen(dir) + 16;
+    wchar_t *out_dir = (wchar_t *)malloc(sizeof(wchar_t) * len);
     wcscpy(out_dir, dir);
     int dir_attempt = 1;
-    while (!CreateDirectoryW(out_dir, NULL))
+    int err;
+    while ((err = create_dir(out_dir)))
+    {
+        if (err > 0)
+            swprintf(out_dir, len, L"%ls(%i)", dir, dir_attempt++);
+        else
+        {
+            free(out_dir);
+            return NULL;
+        }
+    }
+    return out_dir;
+}
+
+int wcs_to_utf16(uint16_t *dst, const wchar_t *src, int len)
+{
+#if WCHAR_MAX > 0xFFFF
+    int out = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        const uint32_t c = src[i];
+        if (c > 0xFFFF)
+        {
+            dst[out++] = 0xD800 | ((c - 0x10000) >> 10);
+            dst[out++] = 0xDC00 | ((c - 0x10000) & 0x3FF);
+        }
+        else
+            dst[out++] = c;
+    }
+    return out;
+#else
+    memcpy(dst, src, sizeof(uint16_t) * len);
+    return len;
+#endif
+}
+
+int utf16_to_wcs(wchar_t *dst, const uint16_t *src, int len)
+{
+#if WCHAR_MAX > 0xFFFF
+    int out = 0;
+    for (int i = 0; i < len; ++i)
     {
-        DWORD err = GetLastError();
-        if (err == ERROR_ALREADY_EXISTS)
-            wsprintfW(out_dir, L"%s(%i)", dir, dir_attempt++);
+        const uint32_t c = src[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] < 0xE000)
+            dst[out++] = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
         else
+            dst[out++] = c;
+    }
+    return out;
+#else
+    memcpy(dst, src, sizeof(uint16_t) * len);
+    return len;
+#endif
+}
+
+int wcs_utf16_len(const wchar_t *str, int len)
+{
+#if WCHAR_MAX > 0xFFFF
+    int out = len;
+    for (int i = 0; i < len; ++i)
+        out += (uint32_t)str[i] > 0xFFFF;
+    return out;
+#else
+    (void)str;
+    return len;
+#endif
+}
+
+int utf16_wcs_len(const uint16_t *str, int len)
+{
+#if WCHAR_MAX > 0xFFFF
+    int out = len;
+    for (int i = 0; i + 1 < len; ++i)
+    {
+        if (str[i] >= 0xD800 && str[i] < 0xDC00 && str[i + 1] >= 0xDC00 && str[i + 1] < 0xE000)
+        {
+            --out;
+            ++i;
+        }
+    }
+    return out;
+#else
+    (void)str;
+    return len;
+#endif
+}
+
+int wcs_to_utf8(uint8_t *dst, const wchar_t *src, int len)
+{
+    uint8_t *it = dst;
+    for (int i = 0; i < len; ++i)
+    {
+        uint32_t c = src[i];
+#if WCHAR_MAX <= 0xFFFF
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+#endif
+        if (c < 0x80)
+            *it++ = c;
+        else if (c < 0x800)
+        {
+            *it++ = 0xC0 | (c >> 6);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+        else if (c < 0x10000)
+        {
+            *it++ = 0xE0 | (c >> 12);
+            *it++ = 0x80 | ((c >> 6) & 0x3F);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            *it++ = 0xF0 | (c >> 18);
+            *it++ = 0x80 | ((c >> 12) & 0x3F);
+            *it++ = 0x80 | ((c >> 6) & 0x3F);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+    }
+    return it - dst;
+}
+
+int utf8_to_wcs(wchar_t *dst, const uint8_t *src, int len)
+{
+    static const uint32_t min_cp[4] = { 0, 0x80, 0x800, 0x10000 };
+    const uint8_t *end = src + len;
+    int out = 0;
+    while (src != end)
+    {
+        const uint8_t c = *src;
+        if (c < 0x80)
+        {
+            dst[out++] = c;
+            ++src;
+            continue;
+        }
+        const int extra = c < 0x80 ? 0 : c < 0xC2 ? -1 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : c < 0xF5 ? 3 : -1;
+        uint32_t cp = extra > 0 ? c & (0x3F >> extra) : c;
+        int ok = extra >= 0 && end - src > extra;
+        for (int i = 1; ok && i <= extra; ++i)
+        {
+            ok = (src[i] & 0xC0) == 0x80;
+            cp = (cp << 6) | (src[i] & 0x3F);
+        }
+        if (!ok || cp < min_cp[extra] || cp > 0x10FFFF)
+        {
+            dst[out++] = 0xFFFD;
+            ++src;
+            continue;
+        }
+        src += extra + 1;
+#if WCHAR_MAX <= 0xFFFF
+        if (cp > 0xFFFF)
+        {
+            dst[out++] = 0xD800 | ((cp - 0x10000) >> 10);
+            dst[out++] = 0xDC00 | ((cp - 0x10000) & 0x3FF);
+            continue;
+        }
+#endif
+        dst[out++] = cp;
+    }
+    return out;
+}
+
+#ifdef _WIN32
+wchar_t **get_wargv(int *argc, char **argv)
+{
+    (void)argv;
+    return CommandLineToArgvW(GetCommandLineW(), argc);
+}
+
+void free_wargv(wchar_t **wargv)
+{
+    LocalFree(wargv);
+}
+
+FILE *file_open(const wchar_t *path, const wchar_t *mode)
+{
+    return _wfopen(path, mode);
+}
+
+int is_dir(const wchar_t *path)
+{
+    const DWORD attribs = GetFileAttributesW(path);
+    return attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+int64_t path_size(const wchar_t *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attribs) ||
+        (attribs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return -1;
+    return ((int64_t)attribs.nFileSizeHigh << 32) | attribs.nFileSizeLow;
+}
+
+int create_dir(const wchar_t *path)
+{
+    if (CreateDirectoryW(path, NULL))
+        return 0;
+    return GetLastError() == ERROR_ALREADY_EXISTS ? 1 : -1;
+}
+
+int remove_path(const wchar_t *path)
+{
+    return DeleteFileW(path) || RemoveDirectoryW(path) ? 0 : -1;
+}
+
+int move_path(const wchar_t *src, const wchar_t *dst)
+{
+    return MoveFileExW(src, dst, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
+
+int set_modify_time(const wchar_t *path, time_t date)
+{
+    const file_stamp stamp = time_to_stamp(date);
+    FILETIME filetime;
+    filetime.dwLowDateTime = (DWORD)stamp;
+    filetime.dwHighDateTime = (DWORD)((uint64_t)stamp >> 32);
+    HANDLE file = CreateFileW(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                              FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+    const int ret = SetFileTime(file, NULL, NULL, &filetime) ? 0 : -1;
+    CloseHandle(file);
+    return ret;
+}
+
+int copy_file(const wchar_t *src, const wchar_t *dst, uint64_t *size, char *cached)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attribs;
+    if (cached)
+        *cached = 0;
+    if (!CopyFileW(src, dst, FALSE))
+        return -1;
+    *size = GetFileAttributesExW(dst, GetFileExInfoStandard, &attribs) ?
+        ((uint64_t)attribs.nFileSizeHigh << 32) | attribs.nFileSizeLow : 0;
+    return 0;
+}
+
+int open_ahead_file(ahead_file *file, const wchar_t *path)
+{
+    file->file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file->file == INVALID_HANDLE_VALUE)
+        return -1;
+    BY_HANDLE_FILE_INFORMATION info;
+    file->key = GetFileInformationByHandle(file->file, &info) ?
+        ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow : 0;
+    return 0;
+}
+
+void read_ahead_file(ahead_file *file)
+{
+    // no hint that starts the reads and returns, the prefetch thread reads the file through the cache itself
+    char buf[1 << 16];
+    DWORD n;
+    while (ReadFile(file->file, buf, sizeof buf, &n, NULL) && n);
+    CloseHandle(file->file);
+}
+
+int open_dir_handle(dir_handle *dir, const wchar_t *path)
+{
+    dir->path = NULL;
+    if (!is_dir(path))
+        return -1;
+    dir->path = _wcsdup(path);
+    return 0;
+}
+
+void close_dir_handle(dir_handle *dir)
+{
+    free(dir->path);
+    dir->path = NULL;
+}
+
+int dir_has_file(const dir_handle *dir, const wchar_t *name)
+{
+    const size_t len = wcslen(dir->path) + wcslen(name) + 2;
+    wchar_t *path = (wchar_t *)malloc(sizeof(wchar_t) * len);
+    swprintf(path, len, L"%ls" PSYM_SEP L"%ls", dir->path, name);
+    const int ret = GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES;
+    free(path);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    return ret;
+}
+
+wchar_t *full_path(const wchar_t *path)
+{
+    const DWORD len = GetFullPathNameW(path, 0, NULL, NULL);
+    wchar_t *ret = (wchar_t *)malloc(sizeof(wchar_t) * len);
+    GetFullPathNameW(path, len, ret, NULL);
+    return ret;
+}
+
+int link_file(const wchar_t *src, const wchar_t *dst, int kind)
+{
+    // block cloning is ReFS only and needs the extents duplicated by hand, leave it to the copy
+    if (kind == LINK_REFLINK)
+        return 1;
+
+    DeleteFileW(dst);
+    const BOOL linked = kind == LINK_HARD ?
+        CreateHardLinkW(dst, src, NULL) :
+        CreateSymbolicLinkW(dst, src, SYMBOLIC_LINK_FLAG_ALLOW_UNPRIVILEGED_CREATE);
+    if (linked)
+        return 0;
+    switch (GetLastError())
+    {
+    case ERROR_NOT_SAME_DEVICE:
+    case ERROR_NOT_SUPPORTED:
+    case ERROR_INVALID_FUNCTION:
+    case ERROR_PRIVILEGE_NOT_HELD:
+    case ERROR_TOO_MANY_LINKS:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+FILE *temp_file(const wchar_t *path)
+{
+    static unsigned counter = 0;
+    const int len = wcslen(path) + 32;
+    wchar_t *name = (wchar_t *)malloc(sizeof(wchar_t) * len);
+    HANDLE file = INVALID_HANDLE_VALUE;
+    for (int tries = 0; tries < 100 && file == INVALID_HANDLE_VALUE; ++tries)
+    {
+        swprintf(name, len, L"%ls.%lu.%u.tmp", path, GetCurrentProcessId(), counter++);
+        file = CreateFileW(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                           FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if (file == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_EXISTS)
+            break;
+    }
+    free(name);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    const int fd = _open_osfhandle((intptr_t)file, 0);
+    if (fd < 0)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    FILE *ret = _fdopen(fd, "w+b");
+    if (!ret)
+        _close(fd);
+    return ret;
+}
+
+double time_now(void)
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / freq.QuadPart;
+}
+
+int map_file(file_map *map, const wchar_t *path, char writable)
+{
+    memset(map, 0, sizeof(file_map));
+    map->file = CreateFileW(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE)
+        return -1;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size))
+    {
+        unmap_file(map);
+        return -1;
+    }
+    map->size = size.QuadPart;
+    // empty files can't be mapped, they are handed out as an empty view
+    if (!map->size)
+        return 0;
+
+    map->mapping = CreateFileMappingW(map->file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    if (map->mapping)
+        map->data = (uint8_t *)MapViewOfFile(map->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    if (!map->data)
+    {
+        unmap_file(map);
+        return -1;
+    }
+    return 0;
+}
+
+void unmap_file(file_map *map)
+{
+    if (map->data)
+        UnmapViewOfFile(map->data);
+    if (map->mapping)
+        CloseHandle(map->mapping);
+    if (map->file && map->file != INVALID_HANDLE_VALUE)
+        CloseHandle(map->file);
+    memset(map, 0, sizeof(file_map));
+}
+
+int sync_file_map(file_map *map, char wait)
+{
+    if (!map->data)
+        return 0;
+    if (!FlushViewOfFile(map->data, 0))
+        return -1;
+    return wait && !FlushFileBuffers(map->file) ? -1 : 0;
+}
+
+int lock_file_map(file_map *map, uint64_t offset, uint64_t size)
+{
+    OVERLAPPED range;
+    memset(&range, 0, sizeof range);
+    range.Offset = (DWORD)offset;
+    range.OffsetHigh = (DWORD)(offset >> 32);
+    return LockFileEx(map->file, LOCKFILE_EXCLUSIVE_LOCK, 0, (DWORD)size, (DWORD)(size >> 32), &range) ? 0 : -1;
+}
+
+void unlock_file_map(file_map *map, uint64_t offset, uint64_t size)
+{
+    OVERLAPPED range;
+    memset(&range, 0, sizeof range);
+    range.Offset = (DWORD)offset;
+    range.OffsetHigh = (DWORD)(offset >> 32);
+    UnlockFileEx(map->file, 0, (DWORD)size, (DWORD)(size >> 32), &range);
+}
+#else
+char *wcs_to_path(const wchar_t *str)
+{
+    const size_t len = wcslen(str);
+    char *ret = (char *)malloc(len * 4 + 1);
+    char *it = ret;
+    for (size_t i = 0; i < len; ++i)
+    {
+        const uint32_t c = str[i];
+        if (c < 0x80)
+            *it++ = c;
+        else if (c >= 0xDC80 && c < 0xDD00) // escaped raw byte
+            *it++ = c - 0xDC00;
+        else if (c < 0x800)
+        {
+            *it++ = 0xC0 | (c >> 6);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+        else if (c < 0x10000)
+        {
+            *it++ = 0xE0 | (c >> 12);
+            *it++ = 0x80 | ((c >> 6) & 0x3F);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            *it++ = 0xF0 | (c >> 18);
+            *it++ = 0x80 | ((c >> 12) & 0x3F);
+            *it++ = 0x80 | ((c >> 6) & 0x3F);
+            *it++ = 0x80 | (c & 0x3F);
+        }
+    }
+    *it = '\0';
+    return ret;
+}
+
+int path_to_wcs(wchar_t *dst, const char *src, int len)
+{
+    const unsigned char *it = (const unsigned char *)src, *end = it + len;
+    int out = 0;
+    while (it != end)
+    {
+        const unsigned char c = *it;
+        const int extra = c < 0xC2 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : c < 0xF5 ? 3 : 0;
+        if (c < 0x80 || !extra || end - it <= extra)
+        {
+            dst[out++] = c < 0x80 ? c : 0xDC00 | c;
+            ++it;
+            continue;
+        }
+
+        uint32_t cp = c & (0x3F >> extra);
+        int valid = 1;
+        for (int i = 1; i <= extra; ++i)
+        {
+            if ((it[i] & 0xC0) != 0x80)
+            {
+                valid = 0;
+                break;
+            }
+            cp = (cp << 6) | (it[i] & 0x3F);
+        }
+        // reject overlong forms and surrogates so that the round trip stays exact
+        if (!valid || (extra == 2 && cp < 0x800) || (extra == 3 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+            (cp >= 0xD800 && cp < 0xE000))
+        {
+            dst[out++] = 0xDC00 | c;
+            ++it;
+            continue;
+        }
+        dst[out++] = cp;
+        it += extra + 1;
+    }
+    return out;
+}
+
+wchar_t **get_wargv(int *argc, char **argv)
+{
+    wchar_t **ret = (wchar_t **)malloc(sizeof(wchar_t *) * (*argc + 1));
+    for (int i = 0; i < *argc; ++i)
+    {
+        const int len = strlen(argv[i]);
+        ret[i] = (wchar_t *)malloc(sizeof(wchar_t) * (len + 1));
+        ret[i][path_to_wcs(ret[i], argv[i], len)] = L'\0';
+    }
+    ret[*argc] = NULL;
+    return ret;
+}
+
+void free_wargv(wchar_t **wargv)
+{
+    for (wchar_t **it = wargv; *it; ++it)
+        free(*it);
+    free(wargv);
+}
+
+FILE *file_open(const wchar_t *path, const wchar_t *mode)
+{
+    char *path_n = wcs_to_path(path);
+    char *mode_n = wcs_to_path(mode);
+    FILE *ret = fopen(path_n, mode_n);
+    free(mode_n);
+    free(path_n);
+    return ret;
+}
+
+int is_dir(const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    struct stat st;
+    const int ret = !stat(path_n, &st) && S_ISDIR(st.st_mode);
+    free(path_n);
+    return ret;
+}
+
+int64_t path_size(const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    struct stat st;
+    const int64_t ret = !stat(path_n, &st) && S_ISREG(st.st_mode) ? (int64_t)st.st_size : -1;
+    free(path_n);
+    return ret;
+}
+
+int create_dir(const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    const int ret = mkdir(path_n, 0777) ? (errno == EEXIST ? 1 : -1) : 0;
+    free(path_n);
+    return ret;
+}
+
+int remove_path(const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    const int ret = remove(path_n) ? -1 : 0;
+    free(path_n);
+    return ret;
+}
+
+int move_path(const wchar_t *src, const wchar_t *dst)
+{
+    char *src_n = wcs_to_path(src);
+    char *dst_n = wcs_to_path(dst);
+    const int ret = rename(src_n, dst_n) ? -1 : 0;
+    free(dst_n);
+    free(src_n);
+    return ret;
+}
+
+int set_modify_time(const wchar_t *path, time_t date)
+{
+    char *path_n = wcs_to_path(path);
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = date;
+    times[1].tv_nsec = 0;
+    const int ret = utimensat(AT_FDCWD, path_n, times, 0) ? -1 : 0;
+    free(path_n);
+    return ret;
+}
+
+int copy_file(const wchar_t *src, const wchar_t *dst, uint64_t *size, char *cached)
+{
+    char *src_n = wcs_to_path(src);
+    char *dst_n = wcs_to_path(dst);
+    int ret = -1;
+    int in = -1, out = -1;
+    struct stat st;
+    uint64_t calls = 3;
+
+    if (cached)
+        *cached = 0;
+    if ((in = open(src_n, O_RDONLY | O_CLOEXEC)) < 0 || fstat(in, &st))
+        goto ret_point;
+#if defined(__linux__) && defined(RWF_NOWAIT)
+    if (cached)
+    {
+        // the last byte without blocking, reads ahead fill a file front to back
+        char last;
+        struct iovec iov = { &last, 1 };
+        *cached = !st.st_size || preadv2(in, &iov, 1, st.st_size - 1, RWF_NOWAIT) == 1;
+        ++calls;
+    }
+#endif
+    if ((out = open(dst_n, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777)) < 0)
+        goto ret_point;
+
+    off_t left = st.st_size;
+#ifdef __linux__
+    // in kernel copies first, copy_file_range shares extents where the filesystem can
+    while (left > 0)
+    {
+        const ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        ++calls;
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+    while (left > 0)
+    {
+        const ssize_t n = sendfile(out, in, NULL, left);
+        ++calls;
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+#endif
+    if (left > 0)
+    {
+        // both unavailable or refused, finish with plain reads
+        char buf[1 << 16];
+        ssize_t n;
+        while ((n = read(in, buf, sizeof buf)) > 0)
+        {
+            calls += 2;
+            if (write(out, buf, n) != n)
+                goto ret_point;
+            left -= n;
+        }
+        ++calls;
+        if (n < 0)
+            goto ret_point;
+    }
+    *size = st.st_size;
+    ret = 0;
+
+ret_point:
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out))
+        ret = -1;
+    STAT_ADD(STAT_SYSCALLS, calls + (in >= 0) + (out >= 0));
+    free(dst_n);
+    free(src_n);
+    return ret;
+}
+
+int open_ahead_file(ahead_file *file, const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    file->fd = open(path_n, O_RDONLY | O_CLOEXEC);
+    free(path_n);
+    if (file->fd < 0)
+    {
+        STAT_ADD(STAT_SYSCALLS, 1);
+        return -1;
+    }
+    struct stat st;
+    file->key = fstat(file->fd, &st) ? 0 : (uint64_t)st.st_ino;
+    STAT_ADD(STAT_SYSCALLS, 2);
+    return 0;
+}
+
+void read_ahead_file(ahead_file *file)
+{
+#ifdef POSIX_FADV_WILLNEED
+    // starts the reads and returns, the pages land in the cache while the copies before this one are written
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    close(file->fd);
+    STAT_ADD(STAT_SYSCALLS, 2);
+}
+
+int open_dir_handle(dir_handle *dir, const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    dir->fd = open(path_n, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(path_n);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    return dir->fd < 0 ? -1 : 0;
+}
+
+void close_dir_handle(dir_handle *dir)
+{
+    if (dir->fd >= 0)
+    {
+        close(dir->fd);
+        STAT_ADD(STAT_SYSCALLS, 1);
+    }
+    dir->fd = -1;
+}
+
+int dir_has_file(const dir_handle *dir, const wchar_t *name)
+{
+    char *name_n = wcs_to_path(name);
+    const int ret = !faccessat(dir->fd, name_n, F_OK, 0);
+    free(name_n);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    return ret;
+}
+
+wchar_t *full_path(const wchar_t *path)
+{
+    char *path_n = wcs_to_path(path);
+    char *real = realpath(path_n, NULL);
+    free(path_n);
+    if (!real)
+        return wcsdup(path);
+
+    const int len = strlen(real);
+    wchar_t *ret = (wchar_t *)malloc(sizeof(wchar_t) * (len + 1));
+    ret[path_to_wcs(ret, real, len)] = L'\0';
+    free(real);
+    return ret;
+}
+
+static int link_unsupported(int err)
+{
+    return err == EXDEV || err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EPERM || err == EMLINK;
+}
+
+int link_file(const wchar_t *src, const wchar_t *dst, int kind)
+{
+    char *src_n = wcs_to_path(src);
+    char *dst_n = wcs_to_path(dst);
+    int ret = -1;
+
+    if (kind == LINK_REFLINK)
+    {
+#ifdef FICLONE
+        const int in = open(src_n, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (in >= 0 && !fstat(in, &st))
+        {
+            const int out = open(dst_n, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+            if (out >= 0)
+            {
+                ret = ioctl(out, FICLONE, in) ? (link_unsupported(errno) ? 1 : -1) : 0;
+                if (close(out) && !ret)
+                    ret = -1;
+                // the empty file is left for the copy to take over
+            }
+        }
+        if (in >= 0)
+            close(in);
+#else
+        ret = 1;
+#endif
+    }
+    else
+    {
+        if (unlink(dst_n) && errno != ENOENT)
+            goto ret_point;
+        if (!(kind == LINK_HARD ? link(src_n, dst_n) : symlink(src_n, dst_n)))
+            ret = 0;
+        else
+            ret = link_unsupported(errno) ? 1 : -1;
+    }
+
+ret_point:
+    free(dst_n);
+    free(src_n);
+    return ret;
+}
+
+FILE *temp_file(const wchar_t *path)
+{
+    static unsigned counter = 0;
+    char *path_n = wcs_to_path(path);
+    const size_t len = strlen(path_n) + 32;
+    char *name = (char *)malloc(len);
+    int fd = -1;
+    for (int tries = 0; tries < 100 && fd < 0; ++tries)
+    {
+        snprintf(name, len, "%s.%ld.%u.tmp", path_n, (long)getpid(), counter++);
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno != EEXIST)
+            break;
+    }
+    // the open descriptor keeps the data around
+    if (fd >= 0)
+        unlink(name);
+    free(name);
+    free(path_n);
+    if (fd < 0)
+        return NULL;
+
+    FILE *ret = fdopen(fd, "w+b");
+    if (!ret)
+        close(fd);
+    return ret;
+}
+
+double time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int map_file(file_map *map, const wchar_t *path, char writable)
+{
+    memset(map, 0, sizeof(file_map));
+    char *path_n = wcs_to_path(path);
+    map->fd = open(path_n, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    free(path_n);
+    if (map->fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(map->fd, &st))
+    {
+        unmap_file(map);
+        return -1;
+    }
+    map->size = st.st_size;
+    if (map->size)
+    {
+        void *data = mmap(NULL, map->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, map->fd, 0);
+        if (data == MAP_FAILED)
+        {
+            unmap_file(map);
             return -1;
+        }
+        map->data = (uint8_t *)data;
     }
     return 0;
 }
+
+void unmap_file(file_map *map)
+{
+    if (map->data)
+        munmap(map->data, map->size);
+    if (map->fd >= 0)
+        close(map->fd);
+    memset(map, 0, sizeof(file_map));
+    map->fd = -1;
+}
+
+int sync_file_map(file_map *map, char wait)
+{
+    return map->data ? msync(map->data, map->size, wait ? MS_SYNC : MS_ASYNC) : 0;
+}
+
+#ifdef F_OFD_SETLKW
+// owned by the open file, not the process, so two maps in one process exclude each other
+#define RANGE_LOCK_CMD F_OFD_SETLKW
+#else
+#define RANGE_LOCK_CMD F_SETLKW
+#endif
+
+static int set_range_lock(file_map *map, uint64_t offset, uint64_t size, short type)
+{
+    struct flock range;
+    memset(&range, 0, sizeof range);
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = offset;
+    range.l_len = size;
+    int ret;
+    while ((ret = fcntl(map->fd, RANGE_LOCK_CMD, &range)) && errno == EINTR);
+    return ret;
+}
+
+int lock_file_map(file_map *map, uint64_t offset, uint64_t size)
+{
+    return set_range_lock(map, offset, size, F_WRLCK) ? -1 : 0;
+}
+
+void unlock_file_map(file_map *map, uint64_t offset, uint64_t size)
+{
+    set_range_lock(map, offset, size, F_UNLCK);
+}
+#endif
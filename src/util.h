@@ -1,13 +1,141 @@
 #ifndef PSYM_UTIL
 #define PSYM_UTIL
 
+#include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <wchar.h>
+
+#ifdef _WIN32
 #include <Windows.h>
+#define PSYM_MAX_PATH MAX_PATH
+#define PSYM_SEP L"\\"
+#define PSYM_SEP_CHAR L'\\'
+#else
+#include <limits.h>
+#define PSYM_MAX_PATH PATH_MAX
+#define PSYM_SEP L"/"
+#define PSYM_SEP_CHAR L'/'
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PSYM_PREFETCH(ptr) __builtin_prefetch(ptr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define PSYM_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define PSYM_PREFETCH(ptr) ((void)(ptr))
+#endif
 
+// splitmix64, the same 64 bit stream on every platform for a given seed; not thread safe
+void seed_rand(uint64_t seed);
+uint64_t rand_u64(void);
 int rand_range(int min, int max);
-time_t file_modify_time(const FILETIME *filetime);
+// splitmix64 finalizer, a cheap bijective mix of the bits
+uint64_t mix_u64(uint64_t x);
+// d.m.yy or d.m.yyyy at local midnight, -1 if it does not parse
 time_t wcstot_t(const wchar_t *str);
-int create_dir_dupsafe(wchar_t *out_dir, const wchar_t *dir);
+wchar_t *create_dir_dupsafe(const wchar_t *dir);
+
+// on disk strings are utf-16, wchar_t is utf-32 outside of windows
+int wcs_to_utf16(uint16_t *dst, const wchar_t *src, int len);
+int utf16_to_wcs(wchar_t *dst, const uint16_t *src, int len);
+int wcs_utf16_len(const wchar_t *str, int len);
+int utf16_wcs_len(const uint16_t *str, int len);
+// compact names are utf-8 with lone surrogates(escaped path bytes, unpaired utf-16) kept as 3 byte sequences;
+// dst takes up to 4 bytes per character, or one character per byte the other way, bad bytes become U+FFFD
+int wcs_to_utf8(uint8_t *dst, const wchar_t *src, int len);
+int utf8_to_wcs(wchar_t *dst, const uint8_t *src, int len);
+#ifndef _WIN32
+// paths are converted to utf-8, undecodable bytes round trip through lone surrogates
+char *wcs_to_path(const wchar_t *str);
+int path_to_wcs(wchar_t *dst, const char *src, int len);
+#endif
+
+wchar_t **get_wargv(int *argc, char **argv);
+void free_wargv(wchar_t **wargv);
+FILE *file_open(const wchar_t *path, const wchar_t *mode);
+int64_t file_tell(FILE *file);
+int file_seek(FILE *file, int64_t offset, int origin);
+// flushes first
+int file_truncate(FILE *file, int64_t size);
+// flushes, then waits for the data to reach the disk
+int file_sync(FILE *file);
+int is_dir(const wchar_t *path);
+// -1 for anything but a regular file
+int64_t path_size(const wchar_t *path);
+int create_dir(const wchar_t *path);
+// a file or an empty directory
+int remove_path(const wchar_t *path);
+// replaces dst, a file on the same filesystem
+int move_path(const wchar_t *src, const wchar_t *dst);
+int set_modify_time(const wchar_t *path, time_t date);
+// size gets the byte count of the copied file; cached may be NULL, otherwise it tells whether the source was in the
+// page cache already(its last byte, checked without blocking), always 0 where that can't be checked(windows)
+int copy_file(const wchar_t *src, const wchar_t *dst, uint64_t *size, char *cached);
+
+// a file opened to be read ahead of its copy, key orders files the way they lie on disk
+typedef struct
+{
+    uint64_t key; // inode, file index on windows
+#ifdef _WIN32
+    HANDLE file;
+#else
+    int fd;
+#endif
+} ahead_file;
+
+int open_ahead_file(ahead_file *file, const wchar_t *path);
+// the whole file into the page cache, then closes it: posix_fadvise(WILLNEED) only starts the reads,
+// on windows it is read through on the calling thread
+void read_ahead_file(ahead_file *file);
+
+// a directory opened once to look files up in by name, windows has no lookups relative to a handle and keeps the path
+typedef struct
+{
+#ifdef _WIN32
+    wchar_t *path;
+#else
+    int fd;
+#endif
+} dir_handle;
+
+int open_dir_handle(dir_handle *dir, const wchar_t *path);
+void close_dir_handle(dir_handle *dir);
+// 1 when name, relative to dir, exists; links are followed so a dangling one is not there
+int dir_has_file(const dir_handle *dir, const wchar_t *name);
+#define LINK_REFLINK 0
+#define LINK_HARD 1
+#define LINK_SYM 2
+// replaces dst, returns 1 when the filesystem can't link the two files that way and a copy is needed
+int link_file(const wchar_t *src, const wchar_t *dst, int kind);
+wchar_t *full_path(const wchar_t *path);
+// read/write file named after path that is gone once closed, even if the process dies;
+// it lives next to path so that spilled data lands on the same disk and not in a memory backed /tmp
+FILE *temp_file(const wchar_t *path);
+// monotonic, in seconds
+double time_now(void);
+
+// whole file mapping, writable maps are shared with the file
+typedef struct
+{
+    uint8_t *data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd; // kept for range locks
+#endif
+} file_map;
+
+int map_file(file_map *map, const wchar_t *path, char writable);
+void unmap_file(file_map *map);
+// writes the changes of a writable map back, without wait it only starts the writeback
+int sync_file_map(file_map *map, char wait);
+// exclusive lock on a byte range of the file, it blocks; separate maps of one file exclude each other even within
+// a process, and the lock goes with the process if it dies
+int lock_file_map(file_map *map, uint64_t offset, uint64_t size);
+void unlock_file_map(file_map *map, uint64_t offset, uint64_t size);
 
 #endif
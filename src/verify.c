@@ -0,0 +1,233 @@
+#include "verify.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// files per lookup task, the files of a bigger directory are cut into several
+#define VERIFY_TASK_FILES 1024
+
+// the names looked up, <name>.<ext> relative to the directory, null terminated one after another
+typedef struct
+{
+    wchar_t **dirs;
+    uint16_t *file_dirs;
+    uint64_t *name_offsets;
+    wchar_t *names;
+    uint64_t *by_dir; // file indices grouped by directory, in file order within one
+    uint8_t *missing;
+} file_list;
+
+typedef struct
+{
+    const file_list *files;
+    uint64_t first; // into by_dir
+    uint64_t count;
+} check_task;
+
+static void check_files(void *arg, int worker)
+{
+    (void)worker;
+    const check_task *task = (const check_task *)arg;
+    const file_list *files = task->files;
+    // a directory that can't be opened takes its files with it
+    dir_handle dir;
+    const int opened = !open_dir_handle(&dir, files->dirs[files->file_dirs[files->by_dir[task->first]]]);
+    for (uint64_t i = task->first; i < task->first + task->count; ++i)
+    {
+        const uint64_t ind = files->by_dir[i];
+        files->missing[ind] = !opened || !dir_has_file(&dir, files->names + files->name_offsets[ind]);
+    }
+    if (opened)
+        close_dir_handle(&dir);
+}
+
+// table entry i of PSYM4, the unit at offset of PSYM3 which is moved past it; 1 once there are no more
+static int next_unit(const ref_map *ref, uint64_t i, uint64_t *offset, unit_view *unit)
+{
+    if (ref->version == 4 ? i == ref->unit_count : *offset >= ref->map.size)
+        return 1;
+    if (ref->version == 4)
+        *offset = ref_unit_offset(ref, i);
+    if (read_unit_view(ref, *offset, unit))
+        return PSYM_ERR_TRUNCATED;
+    *offset += unit->size;
+    return 0;
+}
+
+// units are counted first so that everything but the names is allocated once
+static int collect_files(const ref_map *ref, const wchar_t **exts, file_list *files, ref_check *check)
+{
+    int ret;
+    unit_view unit;
+    uint64_t offset = ref->units_offset;
+    for (uint64_t i = 0; !(ret = next_unit(ref, i, &offset, &unit)); ++i)
+    {
+        ++check->unit_count;
+        check->count += unit.count;
+    }
+    if (ret < 0)
+        return ret;
+
+    const uint64_t count = check->count ? check->count : 1;
+    check->unit_first = (uint64_t *)malloc(sizeof(uint64_t) * (check->unit_count + 1));
+    check->missing = (uint8_t *)calloc(count, sizeof(uint8_t));
+    files->file_dirs = (uint16_t *)malloc(sizeof(uint16_t) * count);
+    files->name_offsets = (uint64_t *)malloc(sizeof(uint64_t) * count);
+    files->missing = check->missing;
+    size_t names_cap = 1 << 16, names_len = 0;
+    files->names = (wchar_t *)malloc(sizeof(wchar_t) * names_cap);
+
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    uint64_t file = 0;
+    offset = ref->units_offset;
+    for (uint64_t i = 0; !(ret = next_unit(ref, i, &offset, &unit)); ++i)
+    {
+        check->unit_first[i] = file;
+        start_unit_files(&iter, &unit);
+        file_view view;
+        while (next_file(&iter, &view))
+        {
+            if (view.dir >= ref->dir_count || view.ext >= ref->ext_count)
+            {
+                free_file_iter(&iter);
+                return PSYM_ERR_FORMAT;
+            }
+            const size_t ext_len = wcslen(exts[view.ext]), len = view.len + ext_len + 2;
+            if (names_len + len > names_cap)
+            {
+                names_cap = (names_len + len) * 2;
+                files->names = (wchar_t *)realloc(files->names, sizeof(wchar_t) * names_cap);
+            }
+            wchar_t *name = files->names + names_len;
+            wmemcpy(name, view.name, view.len);
+            name[view.len] = L'.';
+            wmemcpy(name + view.len + 1, exts[view.ext], ext_len + 1);
+            files->file_dirs[file] = view.dir;
+            files->name_offsets[file++] = names_len;
+            names_len += len;
+        }
+    }
+    check->unit_first[check->unit_count] = file;
+    free_file_iter(&iter);
+    return ret < 0 ? ret : 0;
+}
+
+int check_ref_files(const ref_map *ref, int workers, ref_check *check, psym_verify_result *result)
+{
+    memset(check, 0, sizeof(ref_check));
+    memset(result, 0, sizeof(psym_verify_result));
+    result->dir_count = ref->dir_count;
+    result->dir_files = (uint64_t *)calloc(ref->dir_count + 1, sizeof(uint64_t));
+    result->dir_missing = (uint64_t *)calloc(ref->dir_count + 1, sizeof(uint64_t));
+
+    // the directories stay with the result
+    wchar_t **exts = (wchar_t **)malloc(sizeof(wchar_t *) * (ref->ext_count + 1));
+    result->dirs = (wchar_t **)malloc(sizeof(wchar_t *) * (ref->dir_count + 1));
+    for (uint32_t i = 0; i < ref->ext_count + ref->dir_count; ++i)
+    {
+        const str_view str = i < ref->ext_count ? ref->exts[i] : ref->dirs[i - ref->ext_count];
+        wchar_t **dst = i < ref->ext_count ? exts + i : result->dirs + i - ref->ext_count;
+        *dst = (wchar_t *)malloc(sizeof(wchar_t) * (str.len + 1));
+        str_view_to_wcs(*dst, str);
+    }
+    file_list files;
+    memset(&files, 0, sizeof files);
+    files.dirs = result->dirs;
+
+    const double start = stat_begin();
+    int ret = collect_files(ref, (const wchar_t **)exts, &files, check);
+    if (!ret && check->count)
+    {
+        // a counting sort by directory, then a task per directory or per VERIFY_TASK_FILES of one
+        const uint64_t count = check->count;
+        uint64_t *dir_first = (uint64_t *)calloc(ref->dir_count + 1, sizeof(uint64_t));
+        for (uint64_t i = 0; i < count; ++i)
+            ++result->dir_files[files.file_dirs[i]];
+        for (uint32_t i = 0; i < ref->dir_count; ++i)
+            dir_first[i + 1] = dir_first[i] + result->dir_files[i];
+        files.by_dir = (uint64_t *)malloc(sizeof(uint64_t) * count);
+        for (uint64_t i = 0; i < count; ++i)
+            files.by_dir[dir_first[files.file_dirs[i]]++] = i;
+
+        check_task *tasks = (check_task *)malloc(sizeof(check_task) * (count / VERIFY_TASK_FILES + ref->dir_count));
+        int task_count = 0;
+        for (uint64_t dir = 0, first = 0; dir < ref->dir_count; first += result->dir_files[dir++])
+        {
+            for (uint64_t done = 0; done < result->dir_files[dir]; done += VERIFY_TASK_FILES)
+            {
+                const uint64_t left = result->dir_files[dir] - done;
+                check_task task = { &files, first + done, left < VERIFY_TASK_FILES ? left : VERIFY_TASK_FILES };
+                tasks[task_count++] = task;
+            }
+        }
+
+        const double lookup_start = time_now();
+        thread_pool *pool = workers > 1 ? create_thread_pool(workers) : NULL;
+        for (int i = 0; i < task_count; ++i)
+        {
+            if (pool)
+                pool_submit(pool, -1, check_files, tasks + i);
+            else
+                check_files(tasks + i, -1);
+        }
+        if (pool)
+        {
+            pool_wait(pool);
+            delete_thread_pool(pool);
+        }
+        result->seconds = time_now() - lookup_start;
+
+        for (uint64_t i = 0; i < count; ++i)
+            result->dir_missing[files.file_dirs[i]] += check->missing[i];
+        for (uint32_t i = 0; i < ref->dir_count; ++i)
+            result->missing += result->dir_missing[i];
+        result->files = count;
+        free(tasks);
+        free(dir_first);
+    }
+    stat_end(STAT_VERIFY, start);
+
+    free(files.by_dir);
+    free(files.names);
+    free(files.name_offsets);
+    free(files.file_dirs);
+    for (uint32_t i = 0; i < ref->ext_count; ++i)
+        free(exts[i]);
+    free(exts);
+    return ret;
+}
+
+void free_ref_check(ref_check *check)
+{
+    free(check->unit_first);
+    free(check->missing);
+    memset(check, 0, sizeof(ref_check));
+}
+
+int psym_verify(const wchar_t *path, int workers, psym_verify_result *result)
+{
+    memset(result, 0, sizeof(psym_verify_result));
+    ref_map ref;
+    int ret = open_ref_map(&ref, path, 0);
+    if (ret)
+        return ret;
+    ref_check check;
+    ret = check_ref_files(&ref, workers, &check, result);
+    free_ref_check(&check);
+    close_ref_map(&ref);
+    return ret;
+}
+
+void psym_free_verify_result(psym_verify_result *result)
+{
+    for (uint32_t i = 0; result->dirs && i < result->dir_count; ++i)
+        free(result->dirs[i]);
+    free(result->dirs);
+    free(result->dir_files);
+    free(result->dir_missing);
+    memset(result, 0, sizeof(psym_verify_result));
+}
@@ -0,0 +1,23 @@
+#ifndef PSYM_VERIFY
+#define PSYM_VERIFY
+
+#include <stdint.h>
+
+#include "psym.h"
+
+// every file of a reference file and whether it is still there, files are numbered unit by unit in table order
+// (file order in PSYM3)
+typedef struct
+{
+    uint64_t count;
+    uint64_t unit_count;
+    uint64_t *unit_first; // unit_count + 1 entries, unit i has files unit_first[i] to unit_first[i + 1]
+    uint8_t *missing;
+} ref_check;
+
+// looks every file up on workers threads, a task per run of files in one directory, which it opens once; the totals
+// and per directory counts go into result, free both whatever it returns
+int check_ref_files(const ref_map *ref, int workers, ref_check *check, psym_verify_result *result);
+void free_ref_check(ref_check *check);
+
+#endif
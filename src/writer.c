@@ -0,0 +1,752 @@
+#include "psym.h"
+#include "date_sort.h"
+#include "list.h"
+#include "serialize.h"
+#include "spill.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// bounded writers: the files spill to sorted runs next to the output, they are merged into units that are
+// distributed over bucket files by their shuffled position, and every bucket is put in place and written in one pass;
+// the unit permutation itself stays in memory, 4b per unit. permuted files keep the date order,
+// their units go straight to the output as they are merged
+// stdio buffer of every bucket while the units are distributed
+#define BUCKET_BUF_SIZE (1 << 16)
+// in memory per unit while a bucket is put in place: offset in the bucket, table offset, size, file count
+#define BUCKET_UNIT_SIZE (sizeof(uint64_t) * 2 + sizeof(uint32_t) * 2)
+// table entries held back while units are streamed
+#define TABLE_CHUNK 65536
+// unit records start with 8b position, 4b unit size, the unit follows as it goes to the file
+#define UNIT_RECORD_HEAD (sizeof(uint64_t) + sizeof(uint32_t))
+// files handed to a psym_scan callback at a time
+#define SCAN_BATCH 4096
+#define SCAN_BATCH_ARENA (1 << 18)
+// the most a file takes on top of its utf-16 name: the dir, ext and length varints of a wide file
+#define FILE_HEAD_MAX 11
+
+struct psym_writer
+{
+    const scan_opts *opts;
+    wchar_t *output;
+    uint32_t unit_size;
+    uint64_t mem;
+    uint64_t seed;
+    char permute;
+    char compact;
+    uint32_t cursors;
+    file_table files; // every file, or the ones since the last run of a bounded writer
+    uint64_t *counts;
+    uint64_t count_rows; // directories counts has room for
+    uint32_t count_exts; // entries per directory
+    uint64_t file_count;
+    time_t date_max;
+    uint64_t name_max; // utf-16 units, longer than UINT16_MAX needs a wide file
+    // bounded only
+    uint32_t spill_count;
+    uint32_t spill_arena;
+    FILE **runs;
+    int run_count;
+    int run_cap;
+    uint64_t file_bytes; // serialized size of every file, an upper bound for compact units
+};
+
+typedef struct
+{
+    uint32_t unit_size;
+    char wide;
+    uint64_t full_count; // units that are shuffled, the appendix stays last
+    uint64_t unit_count;
+    uint64_t per_bucket;
+    const uint32_t *positions; // by date, NULL streams the units in date order
+    FILE **buckets;
+    uint64_t *bucket_sizes;
+    // streaming only
+    FILE *file;
+    uint64_t table_offset;
+    uint64_t offset; // of the next unit
+    uint64_t *offsets;
+    uint32_t *counts;
+    uint64_t table_first;
+    int table_fill;
+    byte_buf buf;
+    unit_encoder enc;
+    uint64_t unit; // by date
+    uint32_t unit_files;
+} unit_dist;
+
+typedef struct
+{
+    psym_record_fn fn;
+    void *arg;
+    int stopped;
+} record_sink;
+
+static int stream_files(const file_table *files, void *arg)
+{
+    record_sink *sink = (record_sink *)arg;
+    for (uint32_t i = 0; i < files->count && !sink->stopped; ++i)
+    {
+        psym_record record;
+        record.name = FILE_NAME(files, i);
+        record.len = wcslen(record.name);
+        record.date = files->dates[i];
+        record.dir = files->dirs[i];
+        record.ext = files->exts[i];
+        sink->stopped = sink->fn(&record, sink->arg);
+    }
+    return sink->stopped ? -1 : 0;
+}
+
+int psym_scan(const scan_opts *opts, psym_record_fn fn, void *arg, dir_state *state)
+{
+    // the scan hands its files over in batches under its lock, the batch is the only copy
+    record_sink sink = { fn, arg, 0 };
+    scan_spill spill = { stream_files, &sink, SCAN_BATCH, SCAN_BATCH_ARENA };
+    scan_opts stream_opts = *opts;
+    stream_opts.spill = &spill;
+    file_table files;
+    if (scan_dirs(&stream_opts, &files, state))
+        return sink.stopped ? sink.stopped : PSYM_ERR_MEMORY;
+    return 0;
+}
+
+// a name of len characters is at most 2 * len utf-16 units, only long ones are counted
+static void note_name(psym_writer *writer, const wchar_t *name, int len)
+{
+    if ((uint64_t)len * 2 > writer->name_max)
+    {
+        const uint64_t units = wcs_utf16_len(name, len);
+        writer->name_max = units > writer->name_max ? units : writer->name_max;
+    }
+}
+
+// directories and extensions of a listing come in with its files, the counts grow with them;
+// directories double the rows, a new extension lays every row out again
+static void fit_counts(psym_writer *writer)
+{
+    const scan_opts *opts = writer->opts;
+    if (opts->dir_count <= writer->count_rows && opts->ext_count == writer->count_exts)
+        return;
+    uint64_t rows = writer->count_rows ? writer->count_rows : 1;
+    while (rows < opts->dir_count)
+        rows *= 2;
+    uint64_t *counts = (uint64_t *)calloc(rows * opts->ext_count + 1, sizeof(uint64_t));
+    for (uint64_t dir = 0; dir < writer->count_rows && writer->count_exts; ++dir)
+        memcpy(counts + dir * opts->ext_count, writer->counts + dir * writer->count_exts,
+               sizeof(uint64_t) * writer->count_exts);
+    free(writer->counts);
+    writer->counts = counts;
+    writer->count_rows = rows;
+    writer->count_exts = opts->ext_count;
+}
+
+static void tally_files(psym_writer *writer, const file_table *files)
+{
+    fit_counts(writer);
+    for (uint32_t i = 0; i < files->count; ++i)
+    {
+        ++writer->counts[(uint64_t)files->dirs[i] * writer->opts->ext_count + files->exts[i]];
+        if (files->dates[i] > writer->date_max)
+            writer->date_max = files->dates[i];
+        const wchar_t *name = FILE_NAME(files, i);
+        note_name(writer, name, wcslen(name));
+    }
+    writer->file_count += files->count;
+}
+
+static int spill_to_run(const file_table *files, psym_writer *writer)
+{
+    FILE *run = spill_run(writer->output, files);
+    if (!run)
+        return -1;
+    if (writer->run_count == writer->run_cap)
+    {
+        writer->run_cap = writer->run_cap ? writer->run_cap * 2 : 16;
+        writer->runs = (FILE **)realloc(writer->runs, sizeof(FILE *) * writer->run_cap);
+    }
+    writer->runs[writer->run_count++] = run;
+
+    for (uint32_t i = 0; i < files->count; ++i)
+    {
+        const wchar_t *name = FILE_NAME(files, i);
+        writer->file_bytes += FILE_HEAD_MAX + sizeof(uint16_t) * wcs_utf16_len(name, wcslen(name));
+    }
+    return 0;
+}
+
+static int spill_scanned(const file_table *files, void *arg)
+{
+    tally_files((psym_writer *)arg, files);
+    return spill_to_run(files, (psym_writer *)arg);
+}
+
+// merges in passes of at most fan_in runs until the last pass can take all of them
+static int reduce_runs(psym_writer *writer, int fan_in)
+{
+    while (writer->run_count > fan_in)
+    {
+        int count = 0;
+        for (int i = 0; i < writer->run_count; i += fan_in)
+        {
+            const int group = writer->run_count - i < fan_in ? writer->run_count - i : fan_in;
+            FILE *run = merge_to_run(writer->output, writer->runs + i, group);
+            if (!run)
+            {
+                // the rest of the group is closed already
+                for (int j = i + group; j < writer->run_count; ++j)
+                    fclose(writer->runs[j]);
+                for (int j = 0; j < count; ++j)
+                    fclose(writer->runs[j]);
+                writer->run_count = 0;
+                return -1;
+            }
+            writer->runs[count++] = run;
+        }
+        writer->run_count = count;
+    }
+    return 0;
+}
+
+// the same swaps as order_units, on whole units
+static uint32_t *unit_positions(uint64_t full_count)
+{
+    uint32_t *perm = (uint32_t *)malloc(sizeof(uint32_t) * (full_count ? full_count : 1));
+    for (uint64_t i = 0; i < full_count; ++i)
+        perm[i] = i;
+    const int count = (int)full_count - 1;
+    for (int i = 0; i < count; ++i)
+    {
+        const int ind = rand_range(i + 1, count);
+        const uint32_t tmp = perm[ind];
+        perm[ind] = perm[i];
+        perm[i] = tmp;
+    }
+
+    // perm holds the unit at every position, invert it in place by walking the cycles with the top bit as a mark
+    const uint32_t mark = 0x80000000u;
+    for (uint64_t start = 0; start < full_count; ++start)
+    {
+        if (perm[start] & mark)
+            continue;
+        uint32_t prev = start, cur = perm[start];
+        while (cur != start)
+        {
+            const uint32_t next = perm[cur];
+            perm[cur] = prev | mark;
+            prev = cur;
+            cur = next;
+        }
+        perm[start] = prev | mark;
+    }
+    for (uint64_t i = 0; i < full_count; ++i)
+        perm[i] &= ~mark;
+    return perm;
+}
+
+static int flush_table(unit_dist *dist)
+{
+    file_seek(dist->file, dist->table_offset + sizeof(uint64_t) * dist->table_first, SEEK_SET);
+    fwrite(dist->offsets, sizeof(uint64_t), dist->table_fill, dist->file);
+    file_seek(dist->file, dist->table_offset + sizeof(uint64_t) * dist->unit_count +
+        UNIT_COUNT_SIZE(dist->wide) * dist->table_first, SEEK_SET);
+    write_unit_counts(dist->file, dist->counts, dist->table_fill, dist->wide);
+    dist->table_first += dist->table_fill;
+    dist->table_fill = 0;
+    return file_seek(dist->file, dist->offset, SEEK_SET);
+}
+
+static int flush_unit(unit_dist *dist)
+{
+    const uint32_t size = dist->buf.size - UNIT_RECORD_HEAD;
+    put_unit_count(dist->buf.data + UNIT_RECORD_HEAD, dist->unit_files, dist->wide);
+    if (!dist->positions)
+    {
+        dist->offsets[dist->table_fill] = dist->offset;
+        dist->counts[dist->table_fill++] = dist->unit_files;
+        dist->offset += size;
+        ++dist->unit;
+        dist->unit_files = 0;
+        if (fwrite(dist->buf.data + UNIT_RECORD_HEAD, 1, size, dist->file) != size)
+            return -1;
+        return dist->table_fill == TABLE_CHUNK ? flush_table(dist) : 0;
+    }
+
+    const uint64_t pos = dist->unit < dist->full_count ? dist->positions[dist->unit] : dist->unit_count - 1;
+    memcpy(dist->buf.data, &pos, sizeof pos);
+    memcpy(dist->buf.data + sizeof pos, &size, sizeof size);
+    const uint64_t bucket = pos / dist->per_bucket;
+    dist->bucket_sizes[bucket] += dist->buf.size;
+    ++dist->unit;
+    dist->unit_files = 0;
+    return fwrite(dist->buf.data, 1, dist->buf.size, dist->buckets[bucket]) == dist->buf.size ? 0 : -1;
+}
+
+static int distribute_file(const spilled_file *file, void *arg)
+{
+    unit_dist *dist = (unit_dist *)arg;
+    if (!dist->unit_files)
+    {
+        // the record head and the file count are filled in once the unit is complete
+        dist->buf.size = 0;
+        buf_reserve(&dist->buf, UNIT_RECORD_HEAD);
+        dist->buf.size = UNIT_RECORD_HEAD;
+        put_unit_head(&dist->enc, &dist->buf, dist->unit_files, file->date);
+    }
+    put_unit_file(&dist->enc, &dist->buf, file->dir, file->ext, file->name, file->len);
+    return ++dist->unit_files == dist->unit_size ? flush_unit(dist) : 0;
+}
+
+// reads a bucket back and writes its units in table order, the table slice is filled in right after
+static int place_bucket(FILE *file, FILE *bucket, uint64_t bucket_size, uint64_t first, uint64_t count,
+                        uint64_t table_offset, uint64_t unit_count, char wide)
+{
+    uint8_t *data = (uint8_t *)malloc(bucket_size ? bucket_size : 1);
+    uint64_t *slots = (uint64_t *)malloc(sizeof(uint64_t) * count);
+    uint64_t *offsets = (uint64_t *)malloc(sizeof(uint64_t) * count);
+    uint32_t *sizes = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    uint32_t *counts = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    int ret = 0;
+
+    rewind(bucket);
+    if (fread(data, 1, bucket_size, bucket) != bucket_size)
+        ret = -1;
+    for (uint64_t i = 0; i < count; ++i)
+        sizes[i] = 0;
+    for (uint64_t it = 0; !ret && it < bucket_size;)
+    {
+        uint64_t pos;
+        uint32_t size;
+        memcpy(&pos, data + it, sizeof pos);
+        memcpy(&size, data + it + sizeof pos, sizeof size);
+        it += sizeof pos + sizeof size;
+        if (pos < first || pos - first >= count || it + size > bucket_size)
+            ret = -1;
+        else
+        {
+            slots[pos - first] = it;
+            sizes[pos - first] = size;
+        }
+        it += size;
+    }
+
+    uint64_t offset = file_tell(file);
+    for (uint64_t i = 0; i < count && !ret; ++i)
+    {
+        // every position of the bucket has to be there once
+        if (!sizes[i] || fwrite(data + slots[i], 1, sizes[i], file) != sizes[i])
+        {
+            ret = -1;
+            break;
+        }
+        offsets[i] = offset;
+        counts[i] = get_unit_count(data + slots[i], wide);
+        offset += sizes[i];
+    }
+    if (!ret)
+    {
+        file_seek(file, table_offset + sizeof(uint64_t) * first, SEEK_SET);
+        fwrite(offsets, sizeof(uint64_t), count, file);
+        file_seek(file, table_offset + sizeof(uint64_t) * unit_count + UNIT_COUNT_SIZE(wide) * first, SEEK_SET);
+        write_unit_counts(file, counts, count, wide);
+        file_seek(file, offset, SEEK_SET);
+    }
+    free(counts);
+    free(sizes);
+    free(offsets);
+    free(slots);
+    free(data);
+    return ret;
+}
+
+static int finish_bounded(psym_writer *writer, const dir_state *state)
+{
+    const scan_opts *opts = writer->opts;
+    const wchar_t *output = writer->output;
+    const uint32_t unit_size = writer->unit_size;
+    const uint64_t mem = writer->mem;
+    const uint64_t *seed = writer->permute ? &writer->seed : NULL;
+    if (writer->files.count && spill_to_run(&writer->files, writer))
+        return PSYM_ERR_SPILL;
+    writer->files.count = 0;
+    writer->files.arena_size = 0;
+
+    const uint64_t unit_count = (writer->file_count + unit_size - 1) / unit_size;
+    const uint64_t full_count = writer->file_count / unit_size;
+    if (unit_count > INT_MAX)
+        return PSYM_ERR_TOO_MANY;
+
+    // a bucket averages an eighth of the budget once in place, the random positions keep them close to that
+    const uint64_t total_size = writer->file_bytes + (UNIT_RECORD_HEAD + sizeof(uint32_t) + sizeof(time_t) +
+                                BUCKET_UNIT_SIZE) * unit_count;
+    // big units can make for more buckets than units, a bucket needs at least one
+    uint64_t bucket_count = seed ? 0 : (total_size + mem / 8 - 1) / (mem / 8);
+    bucket_count = bucket_count < unit_count ? bucket_count : unit_count;
+    // and the rounded up bucket can leave the last ones empty
+    const uint64_t per_bucket = bucket_count ? (unit_count + bucket_count - 1) / bucket_count : unit_count;
+    bucket_count = bucket_count ? (unit_count + per_bucket - 1) / per_bucket : 0;
+    const int64_t merge_mem = (int64_t)(mem / 2) - (int64_t)(BUCKET_BUF_SIZE * bucket_count) - (seed ?
+        (int64_t)((sizeof(uint64_t) + sizeof(uint32_t)) * TABLE_CHUNK) : (int64_t)(sizeof(uint32_t) * full_count));
+    const int fan_in = merge_mem / (SPILL_BUF_SIZE * 2) > 2 ? (int)(merge_mem / (SPILL_BUF_SIZE * 2)) : 2;
+    if (reduce_runs(writer, fan_in))
+        return PSYM_ERR_SPILL;
+
+    int ret = 0;
+    unit_dist dist;
+    memset(&dist, 0, sizeof dist);
+    dist.unit_size = unit_size;
+    dist.wide = needs_wide(opts, unit_size, writer->name_max);
+    dist.full_count = full_count;
+    dist.unit_count = unit_count;
+    dist.per_bucket = per_bucket;
+    dist.buckets = (FILE **)calloc(bucket_count + 1, sizeof(FILE *));
+    dist.bucket_sizes = (uint64_t *)calloc(bucket_count + 1, sizeof(uint64_t));
+    init_byte_buf(&dist.buf);
+    const unit_format format = { writer->compact, writer->date_max, opts->ext_count, dist.wide };
+    init_unit_encoder(&dist.enc, &format);
+    for (uint64_t i = 0; i < bucket_count && !ret; ++i)
+    {
+        if (!(dist.buckets[i] = temp_file(output)))
+            ret = PSYM_ERR_SPILL;
+        else
+            setvbuf(dist.buckets[i], NULL, _IOFBF, BUCKET_BUF_SIZE);
+    }
+
+    FILE *file = NULL;
+    if (!ret && !(file = file_open(output, L"wb")))
+        ret = PSYM_ERR_OPEN;
+    if (!ret)
+    {
+        setvbuf(file, NULL, _IOFBF, SPILL_BUF_SIZE);
+        write_head(file, opts, unit_size, unit_count, seed, &format, writer->cursors, 1);
+        dist.file = file;
+        dist.table_offset = file_tell(file);
+        dist.offset = dist.table_offset + TABLE_ENTRY_SIZE(dist.wide) * unit_count;
+        file_seek(file, dist.offset, SEEK_SET);
+
+        double start = stat_begin();
+        uint32_t *positions = seed ? NULL : unit_positions(full_count);
+        dist.positions = positions;
+        stat_end(STAT_SHUFFLE, start);
+        if (seed)
+        {
+            dist.offsets = (uint64_t *)malloc(sizeof(uint64_t) * TABLE_CHUNK);
+            dist.counts = (uint32_t *)malloc(sizeof(uint32_t) * TABLE_CHUNK);
+        }
+        // merging the runs is where the units are made
+        start = stat_begin();
+        const int merged = merge_runs(writer->runs, writer->run_count, distribute_file, &dist);
+        writer->run_count = 0;
+        stat_end(STAT_SERIALIZE, start);
+        if (merged || (dist.unit_files && flush_unit(&dist)) || (seed && flush_table(&dist)))
+            ret = PSYM_ERR_SPILL;
+        free(dist.counts);
+        free(dist.offsets);
+        free(positions);
+    }
+    free_unit_encoder(&dist.enc);
+    free_byte_buf(&dist.buf);
+
+    if (file)
+    {
+        const double start = stat_begin();
+        int placed = 0;
+        for (uint64_t i = 0; i < bucket_count && !ret && !placed; ++i)
+        {
+            const uint64_t first = dist.per_bucket * i;
+            const uint64_t count = unit_count - first < dist.per_bucket ? unit_count - first : dist.per_bucket;
+            placed = place_bucket(file, dist.buckets[i], dist.bucket_sizes[i], first, count, dist.table_offset, unit_count,
+                                  dist.wide);
+            fclose(dist.buckets[i]);
+            dist.buckets[i] = NULL;
+            // read back from the bucket as well
+            STAT_ADD(STAT_BYTES_WRITTEN, dist.bucket_sizes[i]);
+            STAT_ADD(STAT_BYTES_READ, dist.bucket_sizes[i]);
+        }
+
+        const uint64_t state_offset = file_tell(file);
+        write_dir_state(file, opts, state, dist.wide);
+        STAT_ADD(STAT_BYTES_WRITTEN, file_tell(file));
+        stat_end(STAT_WRITE, start);
+        file_seek(file, PSYM4_TABLE_OFFSET, SEEK_SET);
+        fwrite(&dist.table_offset, sizeof dist.table_offset, 1, file);
+        fwrite(&state_offset, sizeof state_offset, 1, file);
+        const int failed = ferror(file);
+        if ((fclose(file) || failed || placed) && !ret)
+            ret = PSYM_ERR_WRITE;
+    }
+    for (uint64_t i = 0; i < bucket_count; ++i)
+        if (dist.buckets[i])
+            fclose(dist.buckets[i]);
+    free(dist.bucket_sizes);
+    free(dist.buckets);
+    return ret;
+}
+
+static int finish_in_memory(psym_writer *writer, const dir_state *state)
+{
+    const int file_count = writer->files.count;
+    const uint64_t *seed = writer->permute ? &writer->seed : NULL;
+    // sort and shuffle only move indices, the table stays in the order it was filled
+    uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * file_count);
+    order_units(order, writer->files.dates, file_count, writer->unit_size, !seed, writer->opts->workers);
+
+    const unit_format format = { writer->compact, writer->date_max, writer->opts->ext_count,
+                                 needs_wide(writer->opts, writer->unit_size, writer->name_max) };
+    const int ret = write_bin(writer->opts, writer->output, writer->unit_size, seed, &format, writer->cursors,
+                              &writer->files, order, state);
+    free(order);
+    if (ret)
+        return ret == WRITE_ERR_OPEN ? PSYM_ERR_OPEN : PSYM_ERR_WRITE;
+    return 0;
+}
+
+int psym_open_writer(psym_writer **writer, const wchar_t *output, const scan_opts *opts, const psym_write_opts *wopts)
+{
+    psym_writer *w = (psym_writer *)calloc(1, sizeof(psym_writer));
+    const size_t output_size = sizeof(wchar_t) * (wcslen(output) + 1);
+    w->opts = opts;
+    w->output = (wchar_t *)memcpy(malloc(output_size), output, output_size);
+    w->unit_size = wopts->unit_size;
+    w->mem = wopts->mem;
+    w->permute = wopts->seed != NULL;
+    w->seed = wopts->seed ? *wopts->seed : 0;
+    w->compact = wopts->compact;
+    w->cursors = wopts->cursors;
+    w->counts = (uint64_t *)calloc(opts->dir_count * opts->ext_count + 1, sizeof(uint64_t));
+    w->count_rows = opts->dir_count;
+    w->count_exts = opts->ext_count;
+    w->date_max = LLONG_MIN;
+    init_file_table(&w->files);
+    if (w->mem)
+    {
+        // the table and the keys of a run take an eighth, the names a quarter; the rest is headroom for the pool,
+        // the scan staging and stdio, none of which the budget controls
+        const uint64_t spill_count = w->mem / 8 /
+            (sizeof(time_t) + sizeof(uint16_t) * 2 + sizeof(uint32_t) + sizeof(spilled_file));
+        const uint64_t spill_arena = w->mem / 4 / sizeof(wchar_t);
+        w->spill_count = spill_count > UINT32_MAX ? UINT32_MAX : spill_count;
+        w->spill_arena = spill_arena > UINT32_MAX ? UINT32_MAX : spill_arena;
+    }
+    *writer = w;
+    return 0;
+}
+
+int psym_add_file(psym_writer *writer, const psym_record *record)
+{
+    file_table *files = &writer->files;
+    if (writer->mem && files->count && (files->count == writer->spill_count ||
+        (uint64_t)files->arena_size + record->len + 1 > writer->spill_arena))
+    {
+        if (spill_to_run(files, writer))
+            return PSYM_ERR_SPILL;
+        files->count = 0;
+        files->arena_size = 0;
+    }
+    wchar_t *dst = add_file(files, record->date, record->dir, record->ext, record->len);
+    if (!dst)
+        return PSYM_ERR_MEMORY;
+    memcpy(dst, record->name, sizeof(wchar_t) * record->len);
+    note_name(writer, record->name, record->len);
+    if (record->dir >= writer->count_rows || writer->opts->ext_count != writer->count_exts)
+        fit_counts(writer);
+    ++writer->counts[(uint64_t)record->dir * writer->opts->ext_count + record->ext];
+    if (record->date > writer->date_max)
+        writer->date_max = record->date;
+    ++writer->file_count;
+    return 0;
+}
+
+const uint64_t *psym_writer_counts(const psym_writer *writer)
+{
+    return writer->counts;
+}
+
+int psym_finish_writer(psym_writer *writer, const dir_state *state)
+{
+    if (!writer->file_count)
+        return 0;
+    dir_state empty;
+    init_dir_state(&empty);
+    const int ret = writer->mem ? finish_bounded(writer, state ? state : &empty) :
+        finish_in_memory(writer, state ? state : &empty);
+    free_dir_state(&empty);
+    return ret;
+}
+
+void psym_close_writer(psym_writer *writer)
+{
+    for (int i = 0; i < writer->run_count; ++i)
+        fclose(writer->runs[i]);
+    free(writer->runs);
+    free_file_table(&writer->files);
+    free(writer->counts);
+    free(writer->output);
+    free(writer);
+}
+
+int psym_gen(const scan_opts *opts, const wchar_t *output, const psym_write_opts *wopts, uint64_t *counts,
+             dedup_result *dedup)
+{
+    for (int i = 0; i < opts->dir_count; ++i)
+        if (!is_dir(opts->dirs[i]))
+            return PSYM_ERR_NO_DIR;
+
+    if (dedup)
+        memset(dedup, 0, sizeof(dedup_result));
+    psym_writer *writer;
+    psym_open_writer(&writer, output, opts, wopts);
+    dir_state state;
+    scan_opts scan = *opts;
+    int ret = 0;
+    if (writer->mem)
+    {
+        // the scan spills straight into runs, nothing is copied on the way
+        scan_spill spill = { spill_scanned, writer, writer->spill_count, writer->spill_arena };
+        scan.spill = &spill;
+        file_table files;
+        if (scan_dirs(&scan, &files, &state))
+            ret = PSYM_ERR_SPILL;
+    }
+    else
+    {
+        // the writer takes the scanned table as it is, already in scan order
+        scan.spill = NULL;
+        scan.sizes = wopts->dedup;
+        free_file_table(&writer->files);
+        if (scan_dirs(&scan, &writer->files, &state))
+        {
+            init_file_table(&writer->files);
+            ret = PSYM_ERR_MEMORY;
+        }
+        else
+        {
+            // duplicates go before anything is counted
+            dedup_result removed;
+            if (wopts->dedup)
+            {
+                dedup_files(&scan, &writer->files, 0, dedup ? dedup : &removed);
+                state.dedup = 1;
+            }
+            tally_files(writer, &writer->files);
+        }
+    }
+
+    if (!ret)
+    {
+        if (counts)
+            memcpy(counts, writer->counts, sizeof(uint64_t) * opts->dir_count * opts->ext_count);
+        ret = psym_finish_writer(writer, &state);
+        free_dir_state(&state);
+    }
+    psym_close_writer(writer);
+    return ret;
+}
+
+// copies of the directories and extensions of opts, the counts are left to the caller
+static void keep_list_opts(psym_list_result *result, const scan_opts *opts)
+{
+    wchar_t **strs = (wchar_t **)malloc(sizeof(wchar_t *) * ((size_t)opts->dir_count + opts->ext_count + 1));
+    for (int i = 0; i < opts->dir_count + opts->ext_count; ++i)
+    {
+        const wchar_t *str = i < opts->dir_count ? opts->dirs[i] : opts->exts[i - opts->dir_count];
+        const size_t size = sizeof(wchar_t) * (wcslen(str) + 1);
+        strs[i] = (wchar_t *)memcpy(malloc(size), str, size);
+    }
+    result->opts = *opts;
+    result->opts.dirs = (const wchar_t **)strs;
+    result->opts.exts = (const wchar_t **)strs + opts->dir_count;
+}
+
+int psym_gen_list(const wchar_t *list, const scan_opts *opts, const wchar_t *output, const psym_write_opts *wopts,
+                  psym_list_result *result, dedup_result *dedup)
+{
+    memset(result, 0, sizeof(psym_list_result));
+    if (dedup)
+        memset(dedup, 0, sizeof(dedup_result));
+    list_reader *reader;
+    if (open_list(&reader, list, opts))
+        return PSYM_ERR_LIST;
+
+    // the writer sees the directories and extensions of the listing through scan as they are found
+    scan_opts scan = *opts;
+    scan.recursive = opts->dir_count != 0;
+    scan.spill = NULL;
+    scan.prev = NULL;
+    list_scan_opts(reader, &scan);
+    psym_writer *writer;
+    psym_open_writer(&writer, output, &scan, wopts);
+    file_table *files = &writer->files;
+    files->keep_sizes = !writer->mem && wopts->dedup;
+    char sized = 1;
+
+    const double start = stat_begin();
+    int ret = 0, got;
+    list_file file;
+    while ((got = next_list_file(reader, &file)) > 0)
+    {
+        list_scan_opts(reader, &scan);
+        if (writer->mem)
+        {
+            const psym_record record = { file.name, file.len, file.date, file.dir, file.ext };
+            if ((ret = psym_add_file(writer, &record)))
+                break;
+            continue;
+        }
+        // the files are counted once the duplicates are gone, as after a scan
+        wchar_t *dst = add_file(files, file.date, file.dir, file.ext, file.len);
+        if (!dst)
+        {
+            ret = PSYM_ERR_MEMORY;
+            break;
+        }
+        memcpy(dst, file.name, sizeof(wchar_t) * file.len);
+        if (files->keep_sizes)
+            files->sizes[files->count - 1] = file.size;
+        sized &= file.size >= 0;
+    }
+    if (!ret && got < 0)
+        ret = got == LIST_ERR_TOO_MANY ? PSYM_ERR_TOO_MANY : PSYM_ERR_LIST;
+    STAT_ADD(STAT_FILES_KEPT, writer->mem ? writer->file_count : files->count);
+    stat_end(STAT_SCAN, start);
+
+    if (!ret && !writer->mem)
+    {
+        // one record without a size and dedup looks them all up
+        files->keep_sizes &= sized;
+        dedup_result removed;
+        if (wopts->dedup)
+            dedup_files(&scan, files, 0, dedup ? dedup : &removed);
+        tally_files(writer, files);
+    }
+    if (!ret)
+    {
+        fit_counts(writer);
+        keep_list_opts(result, &scan);
+        const uint64_t count = (uint64_t)scan.dir_count * scan.ext_count;
+        result->counts = (uint64_t *)memcpy(malloc(sizeof(uint64_t) * (count + 1)), writer->counts,
+                                            sizeof(uint64_t) * count);
+        ret = psym_finish_writer(writer, NULL);
+    }
+    const list_tally *tally = list_reader_tally(reader);
+    result->records = tally->records;
+    result->malformed = tally->malformed;
+    result->filtered = tally->filtered;
+    psym_close_writer(writer);
+    close_list(reader);
+    return ret;
+}
+
+void psym_free_list_result(psym_list_result *result)
+{
+    if (!result->opts.dirs)
+        return;
+    for (int i = 0; i < result->opts.dir_count + result->opts.ext_count; ++i)
+        free((wchar_t *)result->opts.dirs[i]);
+    free((wchar_t **)result->opts.dirs);
+    free(result->counts);
+    memset(result, 0, sizeof(psym_list_result));
+}
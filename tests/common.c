@@ -0,0 +1,86 @@
+#include "common.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void test_scan_opts(scan_opts *opts, const wchar_t **dirs, uint16_t dir_count, const wchar_t **exts,
+                    uint16_t ext_count)
+{
+    memset(opts, 0, sizeof(scan_opts));
+    opts->dirs = dirs;
+    opts->exts = exts;
+    opts->dir_count = dir_count;
+    opts->ext_count = ext_count;
+    opts->bound_upper = INT64_MAX;
+    opts->workers = 1;
+}
+
+int write_records(const wchar_t *output, const scan_opts *opts, const psym_write_opts *wopts, uint64_t seed,
+                  uint64_t count, test_record_fn fn, void *arg)
+{
+    seed_rand(seed);
+    psym_writer *writer;
+    int ret = psym_open_writer(&writer, output, opts, wopts);
+    if (ret)
+        return ret;
+    for (uint64_t i = 0; i < count && !ret; ++i)
+    {
+        psym_record record;
+        memset(&record, 0, sizeof record);
+        ret = fn(i, &record, arg) ? PSYM_ERR_FORMAT : psym_add_file(writer, &record);
+    }
+    if (!ret)
+        ret = psym_finish_writer(writer, NULL);
+    psym_close_writer(writer);
+    return ret;
+}
+
+int walk_files(const wchar_t *path, test_file_fn fn, void *arg)
+{
+    psym_reader *reader;
+    if (psym_open_reader(&reader, path, 0))
+    {
+        fprintf(stderr, "%ls does not open\n", path);
+        return 1;
+    }
+    const ref_map *ref = psym_reader_ref(reader);
+    int ret = 0;
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    for (uint64_t i = 0; i < ref->unit_count && !ret; ++i)
+    {
+        unit_view unit;
+        const uint64_t offset = ref_unit_offset(ref, i);
+        if (read_unit_view(ref, offset, &unit))
+        {
+            fprintf(stderr, "%ls: unit %llu at %llu is truncated\n", path, (unsigned long long)i,
+                    (unsigned long long)offset);
+            ret = 1;
+            break;
+        }
+        start_unit_files(&iter, &unit);
+        file_view view;
+        while (!ret && next_file(&iter, &view))
+            ret = fn(i, offset, &view, arg);
+    }
+    free_file_iter(&iter);
+    psym_close_reader(reader);
+    return ret;
+}
+
+int same_files(const wchar_t *a, const wchar_t *b)
+{
+    file_map x, y;
+    if (map_file(&x, a, 0))
+        return 0;
+    if (map_file(&y, b, 0))
+    {
+        unmap_file(&x);
+        return 0;
+    }
+    const int same = x.size == y.size && !memcmp(x.data, y.data, x.size);
+    unmap_file(&x);
+    unmap_file(&y);
+    return same;
+}
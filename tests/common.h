@@ -0,0 +1,36 @@
+#ifndef PSYM_TEST_COMMON
+#define PSYM_TEST_COMMON
+
+#include <stdint.h>
+
+#include "psym.h"
+
+/*
+* what the test programs share, linked into each of them; the programs are tests/test_*.c
+*/
+
+// ctest SKIP_RETURN_CODE
+#define SKIPPED 77
+
+// one worker, every date taken, the rest zero
+void test_scan_opts(scan_opts *opts, const wchar_t **dirs, uint16_t dir_count, const wchar_t **exts,
+                    uint16_t ext_count);
+
+// fills record i, name has to stay valid until the next call; nonzero fails the write
+typedef int (*test_record_fn)(uint64_t i, psym_record *record, void *arg);
+
+// count records from fn through a writer, the global rand seeded with seed first so the shuffle repeats;
+// returns one of PSYM_ERR_*
+int write_records(const wchar_t *output, const scan_opts *opts, const psym_write_opts *wopts, uint64_t seed,
+                  uint64_t count, test_record_fn fn, void *arg);
+
+// nonzero stops the walk and fails it
+typedef int (*test_file_fn)(uint64_t unit, uint64_t offset, const file_view *file, void *arg);
+
+// every file of a PSYM4 file in table order, 1 when it does not open, a unit is truncated or fn stops it
+int walk_files(const wchar_t *path, test_file_fn fn, void *arg);
+
+// the same size and bytes
+int same_files(const wchar_t *a, const wchar_t *b);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "util.h"
+
+/*
+* a reference file past 4 GiB: long names make 5 GiB of units through a bounded writer, every unit is read back, the
+* ones past 4 GiB included, and every name checked; takes 5 GiB of disk and as much again in spill, so it only runs
+* with PSYM_LARGE_TESTS set
+*/
+
+#define NAME_LEN 4000
+// utf-16 on disk, a little over 5 GiB of names
+#define FILE_COUNT ((uint32_t)((5ull << 30) / (NAME_LEN * 2) + 1))
+#define UNIT_SIZE 50
+#define BUDGET (256ull << 20)
+#define SEED 777
+
+// the file number, then letters that follow from it
+static void make_name(wchar_t *name, uint32_t file)
+{
+    swprintf(name, NAME_LEN + 1, L"%010u", file);
+    for (int i = 10; i < NAME_LEN; ++i)
+        name[i] = L'a' + (file + i) % 26;
+    name[NAME_LEN] = 0;
+}
+
+static int make_record(uint64_t i, psym_record *record, void *arg)
+{
+    wchar_t *name = (wchar_t *)arg;
+    make_name(name, (uint32_t)i);
+    record->name = name;
+    record->len = NAME_LEN;
+    record->date = (time_t)(1420070400 + mix_u64(i + SEED) % 315360000);
+    return 0;
+}
+
+static int write_files(const wchar_t *output)
+{
+    static const wchar_t *dirs[] = { L"/psym_test_large" };
+    static const wchar_t *exts[] = { L"jpg" };
+    scan_opts opts;
+    test_scan_opts(&opts, dirs, 1, exts, 1);
+    const psym_write_opts wopts = { UNIT_SIZE, BUDGET, NULL, 0, 0, 0 };
+    wchar_t *name = (wchar_t *)malloc(sizeof(wchar_t) * (NAME_LEN + 1));
+    const int ret = write_records(output, &opts, &wopts, SEED, FILE_COUNT, make_record, name);
+    free(name);
+    return ret;
+}
+
+typedef struct
+{
+    uint8_t *seen;
+    wchar_t *name;
+    uint64_t count;
+    uint64_t past_4g; // units
+    uint64_t last_unit;
+} file_check;
+
+// the name has to be the one its number gives, every number once
+static int check_file(uint64_t unit, uint64_t offset, const file_view *view, void *arg)
+{
+    file_check *check = (file_check *)arg;
+    if (unit != check->last_unit)
+        check->past_4g += offset > (4ull << 30);
+    check->last_unit = unit;
+    unsigned file = FILE_COUNT;
+    if (view->len == NAME_LEN)
+        swscanf(view->name, L"%10u", &file);
+    if (file < FILE_COUNT)
+        make_name(check->name, file);
+    if (file >= FILE_COUNT || check->seen[file] || wmemcmp(check->name, view->name, NAME_LEN))
+    {
+        fprintf(stderr, "unit %llu at %llu: bad file %.*ls\n", (unsigned long long)unit, (unsigned long long)offset,
+                view->len < 16 ? view->len : 16, view->name);
+        return 1;
+    }
+    check->seen[file] = 1;
+    ++check->count;
+    return 0;
+}
+
+static int check_files(const wchar_t *path)
+{
+    const int64_t size = path_size(path);
+    if (size <= (int64_t)(4ull << 30))
+    {
+        fprintf(stderr, "%ls is only %lld bytes\n", path, (long long)size);
+        return 1;
+    }
+    file_check check = { (uint8_t *)calloc(FILE_COUNT, 1), (wchar_t *)malloc(sizeof(wchar_t) * (NAME_LEN + 1)), 0, 0,
+                         UINT64_MAX };
+    int ret = walk_files(path, check_file, &check);
+    if (!ret && (check.count != FILE_COUNT || !check.past_4g))
+    {
+        fprintf(stderr, "%llu files out of %u, %llu units past 4 GiB\n", (unsigned long long)check.count, FILE_COUNT,
+                (unsigned long long)check.past_4g);
+        ret = 1;
+    }
+    else if (!ret)
+        fprintf(stderr, "%u files, %lld bytes, %llu units past 4 GiB\n", FILE_COUNT, (long long)size,
+                (unsigned long long)check.past_4g);
+    free(check.name);
+    free(check.seen);
+    return ret;
+}
+
+int main(void)
+{
+    if (!getenv("PSYM_LARGE_TESTS"))
+        return SKIPPED;
+    const wchar_t *path = L"test_large_file.psym";
+    int ret = write_files(path);
+    if (ret)
+        fprintf(stderr, "write failed: %i\n", ret);
+    else
+        ret = check_files(path);
+    remove_path(path);
+    return ret;
+}
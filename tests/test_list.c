@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "util.h"
+
+/*
+* listings through psym_gen_list: one with crlf lines, comma and tab separators, a record past the 1 MiB buffer,
+* negative and fractional dates and paths under either spelling of the given directory, deduplicated by the listed
+* sizes; one null terminated with optional sizes and no directories given; the tally and every file read back
+*/
+
+#define LIST_DIR L"test_list.d"
+#define LONG_PATH (3 << 19) // past the buffer
+
+typedef struct
+{
+    const wchar_t *dir; // NULL for the given directory
+    const wchar_t *name;
+    const wchar_t *ext;
+    time_t date;
+} expected_file;
+
+typedef struct
+{
+    const char *label;
+    const ref_map *ref;
+    const psym_list_result *result;
+    const expected_file *files;
+    int count;
+    uint8_t *seen;
+} file_check;
+
+static int write_bytes(const wchar_t *path, const char *bytes, size_t len)
+{
+    FILE *file = file_open(path, L"wb");
+    if (!file)
+        return 1;
+    const int failed = fwrite(bytes, 1, len, file) != len;
+    return fclose(file) || failed;
+}
+
+// the directory, name, extension and date the listing gave, every file once
+static int check_file(uint64_t unit, uint64_t offset, const file_view *view, void *arg)
+{
+    (void)unit;
+    file_check *check = (file_check *)arg;
+    unit_view unit_head;
+    if (read_unit_view(check->ref, offset, &unit_head))
+        return 1;
+    const scan_opts *opts = &check->result->opts;
+    for (int i = 0; i < check->count; ++i)
+    {
+        const expected_file *file = check->files + i;
+        if (wcslen(file->name) != (size_t)view->len || wmemcmp(file->name, view->name, view->len) ||
+            wcscmp(file->ext, opts->exts[view->ext]) || (file->dir ? wcscmp(file->dir, opts->dirs[view->dir]) :
+                                                                    view->dir != 0))
+            continue;
+        if (check->seen[i] || file->date != unit_head.date)
+            break;
+        check->seen[i] = 1;
+        return 0;
+    }
+    fprintf(stderr, "%s: file %.*ls.%ls in %ls dated %lld\n", check->label, view->len, view->name,
+            opts->exts[view->ext], opts->dirs[view->dir], (long long)unit_head.date);
+    return 1;
+}
+
+static int check_files(const char *label, const wchar_t *path, const psym_list_result *result,
+                       const expected_file *files, int count)
+{
+    psym_reader *reader;
+    if (psym_open_reader(&reader, path, 0))
+    {
+        fprintf(stderr, "%s: %ls does not open\n", label, path);
+        return 1;
+    }
+    uint8_t seen[8] = { 0 };
+    file_check check = { label, psym_reader_ref(reader), result, files, count, seen };
+    int ret = walk_files(path, check_file, &check);
+    for (int i = 0; i < count && !ret; ++i)
+        if (!seen[i])
+        {
+            fprintf(stderr, "%s: %ls.%ls is missing\n", label, files[i].name, files[i].ext);
+            ret = 1;
+        }
+    psym_close_reader(reader);
+    return ret;
+}
+
+static int check_tally(const char *label, const psym_list_result *result, uint64_t records, uint64_t malformed,
+                       uint64_t filtered)
+{
+    if (result->records == records && result->malformed == malformed && result->filtered == filtered)
+        return 0;
+    fprintf(stderr, "%s: %llu records, %llu malformed, %llu filtered\n", label, (unsigned long long)result->records,
+            (unsigned long long)result->malformed, (unsigned long long)result->filtered);
+    return 1;
+}
+
+// the given directory as a relative path with a trailing separator and as the full path; a and b are copies but b is
+// older, c is one too under another listed size and stays
+static int crlf_listing(const wchar_t *list, const wchar_t *output)
+{
+    static const char content[] = "hello";
+    const wchar_t *files[] = { LIST_DIR L"/a.jpg", LIST_DIR L"/sub/b.jpg", LIST_DIR L"/c.png" };
+    int ret = 0;
+    for (int i = 0; i < 3 && !ret; ++i)
+        ret = write_bytes(files[i], content, sizeof content - 1);
+    if (ret)
+    {
+        fprintf(stderr, "crlf: the listed files could not be written\n");
+        return 1;
+    }
+
+    wchar_t *full = full_path(LIST_DIR);
+    const int full_len = (int)wcslen(full);
+    char *full_utf8 = (char *)malloc(full_len * 4 + 1);
+    full_utf8[wcs_to_utf8((uint8_t *)full_utf8, full, full_len)] = 0;
+    free(full);
+
+    char *bytes = (char *)malloc(LONG_PATH + 4096);
+    int len = 0;
+    len += sprintf(bytes + len, "1600000000.75\t5\ttest_list.d/a.jpg\r\n");
+    len += sprintf(bytes + len, "1500000000,5,%s/sub/b.jpg\r\n", full_utf8);
+    len += sprintf(bytes + len, "\r\n");
+    len += sprintf(bytes + len, "-86400.5\t9\ttest_list.d/c.png\r\n");
+    len += sprintf(bytes + len, "1600000000\t5\ttest_list.d/");
+    memset(bytes + len, 'x', LONG_PATH);
+    len += LONG_PATH;
+    len += sprintf(bytes + len, ".jpg\r\n");
+    len += sprintf(bytes + len, "1600000000\t5\t/psym_test_elsewhere/d.jpg\r\n");
+    len += sprintf(bytes + len, "yesterday\t5\ttest_list.d/e.jpg\r\n");
+    len += sprintf(bytes + len, "1600000000\t5\ttest_list.d/noext\r\n");
+    free(full_utf8);
+    ret = write_bytes(list, bytes, len);
+    free(bytes);
+    if (ret)
+        return 1;
+
+    const wchar_t *dirs[] = { LIST_DIR L"/" };
+    scan_opts opts;
+    test_scan_opts(&opts, dirs, 1, NULL, 0);
+    opts.bound_lower = INT64_MIN;
+    const psym_write_opts wopts = { 1, 0, NULL, 0, 0, 1 };
+    psym_list_result result;
+    dedup_result dedup;
+    seed_rand(1);
+    ret = psym_gen_list(list, &opts, output, &wopts, &result, &dedup);
+    // names keep the separator of the platform
+    wchar_t sub_b[] = L"sub/b";
+    sub_b[3] = PSYM_SEP_CHAR;
+    const expected_file expected[] = { { NULL, sub_b, L"jpg", 1500000000 }, { NULL, L"c", L"png", -86401 } };
+    if (ret)
+        fprintf(stderr, "crlf: gen failed: %i\n", ret);
+    else if (check_tally("crlf", &result, 6, 2, 2))
+        ret = 1;
+    else if (dedup.removed != 1 || dedup.hashed != 2)
+    {
+        fprintf(stderr, "crlf: %u of %u hashed files removed\n", dedup.removed, dedup.hashed);
+        ret = 1;
+    }
+    else if (result.opts.dir_count != 1 || result.opts.ext_count != 2 || result.counts[0] != 1 || result.counts[1] != 1)
+    {
+        fprintf(stderr, "crlf: %u directories, %u extensions\n", result.opts.dir_count, result.opts.ext_count);
+        ret = 1;
+    }
+    else
+        ret = check_files("crlf", output, &result, expected, 2);
+    psym_free_list_result(&result);
+    for (int i = 0; i < 3; ++i)
+        remove_path(files[i]);
+    return ret;
+}
+
+// null terminated records, a newline is part of the name; sizes on some records only, a directory of digits is not
+// one
+static int null_listing(const wchar_t *list, const wchar_t *output)
+{
+    static const char bytes[] = "1600000000\t12\tx/2024/f.jpg\0"
+                                "1600000001\t2024/g.jpg\0"
+                                "1600000002,h.jpg\0"
+                                "1600000003\tx/2024/i.png\0"
+                                "1600000004\tline\nbreak.jpg\0";
+    if (write_bytes(list, bytes, sizeof bytes - 1))
+        return 1;
+
+    const wchar_t *exts[] = { L"jpg" };
+    scan_opts opts;
+    test_scan_opts(&opts, NULL, 0, exts, 1);
+    const psym_write_opts wopts = { 1, 0, NULL, 0, 0, 0 };
+    psym_list_result result;
+    seed_rand(2);
+    int ret = psym_gen_list(list, &opts, output, &wopts, &result, NULL);
+    const expected_file expected[] = { { L"x/2024", L"f", L"jpg", 1600000000 },
+                                       { L"2024", L"g", L"jpg", 1600000001 },
+                                       { L".", L"h", L"jpg", 1600000002 },
+                                       { L".", L"line\nbreak", L"jpg", 1600000004 } };
+    if (ret)
+        fprintf(stderr, "null: gen failed: %i\n", ret);
+    else if (check_tally("null", &result, 5, 0, 1))
+        ret = 1;
+    else if (result.opts.dir_count != 3)
+    {
+        fprintf(stderr, "null: %u directories\n", result.opts.dir_count);
+        ret = 1;
+    }
+    else
+        ret = check_files("null", output, &result, expected, 4);
+    psym_free_list_result(&result);
+    return ret;
+}
+
+int main(void)
+{
+    const wchar_t *list = L"test_list.txt", *output = L"test_list.psym";
+    int ret = 1;
+    if (create_dir(LIST_DIR) < 0 || create_dir(LIST_DIR L"/sub") < 0)
+        fprintf(stderr, "%ls could not be made\n", LIST_DIR);
+    else
+        ret = crlf_listing(list, output) || null_listing(list, output);
+
+    remove_path(list);
+    remove_path(output);
+    remove_path(LIST_DIR L"/sub");
+    remove_path(LIST_DIR);
+    return ret;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "util.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// sanitizer shadow memory counts toward the peak
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define SANITIZED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define SANITIZED
+#endif
+#endif
+
+/*
+* gen --mem: a bounded writer stays under its budget where the same files in memory go well past it, and both write
+* the same file; the files are made up and added straight to the writer so the scan and the disk don't count
+*/
+
+#define FILE_COUNT 600000
+#define BUDGET PSYM_MEM_MIN
+#define SEED 12345
+
+#ifndef _WIN32
+static uint64_t peak_rss(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss << 10;
+#endif
+}
+#endif
+
+// names in order, the scan order, so both writers have to give the same file
+static int make_record(uint64_t i, psym_record *record, void *arg)
+{
+    wchar_t *name = (wchar_t *)arg;
+    record->name = name;
+    record->len = swprintf(name, 64, L"IMG_%08u_%06u", (unsigned)i, (unsigned)(mix_u64(i) % 1000000));
+    // ten years from 2015, plenty of equal dates
+    record->date = (time_t)(1420070400 + mix_u64(i + SEED) % 315360000 / 60 * 60);
+    return 0;
+}
+
+// one directory and one extension
+static int write_files(const wchar_t *output, uint64_t mem)
+{
+    static const wchar_t *dirs[] = { L"/psym_test_mem" };
+    static const wchar_t *exts[] = { L"jpg" };
+    scan_opts opts;
+    test_scan_opts(&opts, dirs, 1, exts, 1);
+    const psym_write_opts wopts = { 5, mem, NULL, 0, 0, 0 };
+    wchar_t name[64];
+    return write_records(output, &opts, &wopts, SEED, FILE_COUNT, make_record, name);
+}
+
+int main(void)
+{
+#if defined(_WIN32) || defined(SANITIZED)
+    return SKIPPED;
+#else
+    const wchar_t *bounded = L"test_mem_budget.bounded.psym", *in_memory = L"test_mem_budget.memory.psym";
+    int ret = 1;
+    // the bounded run goes first, the peak only ever grows
+    const uint64_t base = peak_rss();
+    if (write_files(bounded, BUDGET))
+        fprintf(stderr, "bounded write failed\n");
+    else
+    {
+        const uint64_t bounded_peak = peak_rss();
+        if (write_files(in_memory, 0))
+            fprintf(stderr, "in memory write failed\n");
+        else
+        {
+            const uint64_t memory_peak = peak_rss();
+            fprintf(stderr, "%u files, budget %.1f MB: bounded peak %.1f MB, in memory peak %.1f MB over %.1f MB\n",
+                    FILE_COUNT, BUDGET / 1e6, bounded_peak / 1e6, memory_peak / 1e6, base / 1e6);
+            if (bounded_peak > base + BUDGET)
+                fprintf(stderr, "the bounded writer went over its budget\n");
+            else if (memory_peak <= base + BUDGET)
+                fprintf(stderr, "the files fit in the budget anyway, nothing was tested\n");
+            else if (!same_files(bounded, in_memory))
+                fprintf(stderr, "the bounded and in memory files differ\n");
+            else
+                ret = 0;
+        }
+    }
+    remove_path(bounded);
+    remove_path(in_memory);
+    return ret;
+#endif
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "util.h"
+
+/*
+* psym_prune on a permuted file with cursors: files of a few units are deleted, whole units before and at the
+* position and a cursor and part of another one; what is left reads in the order it did, without the deleted files,
+* and the position and cursors stay on their units or move to the next one left
+*/
+
+#define PRUNE_DIR L"test_prune.d"
+#define FILE_COUNT 60
+#define UNIT_SIZE 3
+#define UNIT_COUNT (FILE_COUNT / UNIT_SIZE)
+#define SEED 99
+
+// reading positions
+#define POS 4
+#define CURSOR_POS 10
+#define GONE_BEFORE 2 // all of it
+#define GONE_PART 6 // its first file
+#define GONE_AT_CURSOR CURSOR_POS // all of it, the cursor goes to the next one
+#define GONE_AFTER 12 // all of it
+
+// file numbers per reading position, -1 past the end of a unit
+typedef struct
+{
+    int files[UNIT_COUNT][UNIT_SIZE];
+    uint64_t count;
+} read_order;
+
+static int make_record(uint64_t file, psym_record *record, void *arg)
+{
+    wchar_t *name = (wchar_t *)arg;
+    record->name = name;
+    record->len = swprintf(name, 8, L"f%02u", (unsigned)file);
+    record->date = (time_t)(1420070400 + mix_u64(file) % 315360000);
+    return 0;
+}
+
+static void file_path(wchar_t *path, int file)
+{
+    swprintf(path, 64, PRUNE_DIR L"/f%02i.jpg", file);
+}
+
+static int get_order(const wchar_t *path, read_order *order)
+{
+    psym_reader *reader;
+    if (psym_open_reader(&reader, path, 0))
+    {
+        fprintf(stderr, "%ls does not open\n", path);
+        return 1;
+    }
+    const ref_map *ref = psym_reader_ref(reader);
+    int ret = ref->unit_count > UNIT_COUNT;
+    memset(order->files, -1, sizeof order->files);
+    order->count = ref->unit_count;
+    file_iter iter;
+    init_file_iter(&iter, ref);
+    for (uint64_t pos = 0; pos < ref->unit_count && !ret; ++pos)
+    {
+        unit_view unit;
+        if ((ret = read_unit_view(ref, ref_unit_offset(ref, ref_unit_index(ref, pos)), &unit)))
+            break;
+        start_unit_files(&iter, &unit);
+        file_view view;
+        for (int i = 0; next_file(&iter, &view); ++i)
+        {
+            unsigned file = FILE_COUNT;
+            swscanf(view.name, L"f%u", &file);
+            if (i == UNIT_SIZE || file >= FILE_COUNT)
+            {
+                ret = 1;
+                break;
+            }
+            order->files[pos][i] = (int)file;
+        }
+    }
+    free_file_iter(&iter);
+    psym_close_reader(reader);
+    if (ret)
+        fprintf(stderr, "%ls does not read back\n", path);
+    return ret;
+}
+
+// the position past POS units, cursor a past CURSOR_POS and cursor b at the first unit
+static int move_readers(const wchar_t *path)
+{
+    psym_reader *reader;
+    if (psym_open_reader(&reader, path, 1))
+        return 1;
+    unit_view units[CURSOR_POS];
+    const int ret = psym_next_units(reader, units, POS) != POS || psym_use_cursor(reader, L"a", 1) ||
+        psym_next_units(reader, units, CURSOR_POS) != CURSOR_POS || psym_use_cursor(reader, L"b", 1);
+    psym_close_reader(reader);
+    return ret;
+}
+
+static int check_pos(psym_reader *reader, const wchar_t *cursor, uint64_t expected)
+{
+    if (cursor && psym_use_cursor(reader, cursor, 0))
+    {
+        fprintf(stderr, "cursor %ls is gone\n", cursor);
+        return 1;
+    }
+    const uint64_t pos = psym_tell(reader);
+    if (pos == expected)
+        return 0;
+    fprintf(stderr, "%ls at %llu, not %llu\n", cursor ? cursor : L"the position", (unsigned long long)pos,
+            (unsigned long long)expected);
+    return 1;
+}
+
+int main(void)
+{
+    const wchar_t *output = L"test_prune.psym";
+    wchar_t path[64];
+    int ret = create_dir(PRUNE_DIR) < 0;
+    for (int i = 0; i < FILE_COUNT && !ret; ++i)
+    {
+        file_path(path, i);
+        FILE *file = file_open(path, L"wb");
+        ret = !file || fclose(file);
+    }
+    const wchar_t *dirs[] = { PRUNE_DIR };
+    const wchar_t *exts[] = { L"jpg" };
+    scan_opts opts;
+    test_scan_opts(&opts, dirs, 1, exts, 1);
+    const uint64_t seed = SEED;
+    const psym_write_opts wopts = { UNIT_SIZE, 0, &seed, 0, 2, 0 };
+    wchar_t name[8];
+    read_order before, after;
+    if (ret || write_records(output, &opts, &wopts, SEED, FILE_COUNT, make_record, name) || move_readers(output) ||
+        get_order(output, &before))
+    {
+        fprintf(stderr, "the file to prune could not be made\n");
+        ret = 1;
+    }
+
+    // what should be left: the order without the deleted files and the units they empty
+    read_order expected;
+    memset(expected.files, -1, sizeof expected.files);
+    expected.count = 0;
+    int deleted = 0;
+    for (uint64_t pos = 0; pos < before.count && !ret; ++pos)
+    {
+        const int gone = pos == GONE_BEFORE || pos == GONE_AT_CURSOR || pos == GONE_AFTER ? UNIT_SIZE :
+            pos == GONE_PART;
+        for (int i = 0; i < gone; ++i)
+        {
+            file_path(path, before.files[pos][i]);
+            if (remove_path(path))
+            {
+                fprintf(stderr, "%ls could not be deleted\n", path);
+                ret = 1;
+            }
+            ++deleted;
+        }
+        if (gone < UNIT_SIZE)
+            memcpy(expected.files[expected.count++], before.files[pos] + gone, sizeof(int) * (UNIT_SIZE - gone));
+    }
+
+    psym_verify_result result;
+    memset(&result, 0, sizeof result);
+    if (!ret)
+    {
+        if ((ret = psym_prune(output, 2, &result)))
+            fprintf(stderr, "prune failed: %i\n", ret);
+        else if (result.missing != (uint64_t)deleted || result.units_left != expected.count)
+        {
+            fprintf(stderr, "%llu missing, %llu units left\n", (unsigned long long)result.missing,
+                    (unsigned long long)result.units_left);
+            ret = 1;
+        }
+        else if (!(ret = get_order(output, &after)) &&
+                 (after.count != expected.count || memcmp(after.files, expected.files, sizeof expected.files)))
+        {
+            fprintf(stderr, "the reading order changed\n");
+            ret = 1;
+        }
+    }
+    psym_free_verify_result(&result);
+
+    psym_reader *reader;
+    if (!ret && !(ret = psym_open_reader(&reader, output, 0)))
+    {
+        // one unit dropped before the position and the cursor, the cursor's own unit is gone as well
+        ret = check_pos(reader, NULL, POS - 1) || check_pos(reader, L"a", CURSOR_POS - 1) ||
+            check_pos(reader, L"b", 0);
+        psym_close_reader(reader);
+    }
+
+    remove_path(output);
+    for (int i = 0; i < FILE_COUNT; ++i)
+    {
+        file_path(path, i);
+        remove_path(path);
+    }
+    remove_path(PRUNE_DIR);
+    return ret;
+}
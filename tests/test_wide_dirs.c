@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "util.h"
+
+/*
+* 10K directories take the wide fields: every file reads back with its directory, extension and name, plain and
+* compact, and a bounded writer gives the same file as an in memory one
+*/
+
+#define DIR_COUNT 10000
+#define EXT_COUNT 2
+#define DIR_FILES 3 // per extension
+#define FILE_COUNT (DIR_COUNT * EXT_COUNT * DIR_FILES)
+#define UNIT_SIZE 300
+#define SEED 4242
+
+static const wchar_t *exts[EXT_COUNT] = { L"jpg", L"png" };
+
+// by directory, extension and number, the scan order, so that the budget does not change the file
+static int make_record(uint64_t file, psym_record *record, void *arg)
+{
+    wchar_t *name = (wchar_t *)arg;
+    const uint32_t dir = (uint32_t)(file / DIR_FILES / EXT_COUNT);
+    record->name = name;
+    record->len = swprintf(name, 32, L"f%u_%u", (unsigned)file, dir);
+    record->date = (time_t)(1420070400 + mix_u64(file) % 315360000);
+    record->dir = (uint16_t)dir;
+    record->ext = (uint16_t)(file / DIR_FILES % EXT_COUNT);
+    return 0;
+}
+
+static int write_files(const wchar_t *output, const wchar_t **dirs, uint64_t mem, char compact)
+{
+    scan_opts opts;
+    test_scan_opts(&opts, dirs, DIR_COUNT, exts, EXT_COUNT);
+    const psym_write_opts wopts = { UNIT_SIZE, mem, NULL, compact, 0, 0 };
+    wchar_t name[32];
+    return write_records(output, &opts, &wopts, SEED, FILE_COUNT, make_record, name);
+}
+
+typedef struct
+{
+    const wchar_t *path;
+    uint8_t *seen;
+    uint64_t count;
+} file_check;
+
+// every file once, in the directory and with the extension its name says
+static int check_file(uint64_t unit, uint64_t offset, const file_view *view, void *arg)
+{
+    (void)unit;
+    (void)offset;
+    file_check *check = (file_check *)arg;
+    wchar_t name[32];
+    unsigned file = FILE_COUNT, dir = DIR_COUNT;
+    if (view->len < 32)
+    {
+        wmemcpy(name, view->name, view->len);
+        name[view->len] = 0;
+        swscanf(name, L"f%u_%u", &file, &dir);
+    }
+    if (file >= FILE_COUNT || check->seen[file] || dir != view->dir || file / DIR_FILES / EXT_COUNT != view->dir ||
+        file / DIR_FILES % EXT_COUNT != view->ext)
+    {
+        fprintf(stderr, "%ls: file %.*ls in directory %u with extension %u\n", check->path, view->len, view->name,
+                view->dir, view->ext);
+        return 1;
+    }
+    check->seen[file] = 1;
+    ++check->count;
+    return 0;
+}
+
+static int check_files(const wchar_t *path)
+{
+    psym_reader *reader;
+    if (psym_open_reader(&reader, path, 0))
+    {
+        fprintf(stderr, "%ls does not open\n", path);
+        return 1;
+    }
+    const ref_map *ref = psym_reader_ref(reader);
+    const int head_ok = (ref->flags & PSYM4_FLAG_WIDE) && ref->dir_count == DIR_COUNT &&
+                        ref->ext_count == EXT_COUNT && ref->unit_size == UNIT_SIZE;
+    if (!head_ok)
+        fprintf(stderr, "%ls: flags %x, %u directories, %u extensions, unit size %u\n", path, ref->flags,
+                ref->dir_count, ref->ext_count, ref->unit_size);
+    psym_close_reader(reader);
+    if (!head_ok)
+        return 1;
+
+    file_check check = { path, (uint8_t *)calloc(FILE_COUNT, 1), 0 };
+    int ret = walk_files(path, check_file, &check);
+    if (!ret && check.count != FILE_COUNT)
+    {
+        fprintf(stderr, "%ls: %llu files out of %u\n", path, (unsigned long long)check.count, FILE_COUNT);
+        ret = 1;
+    }
+    free(check.seen);
+    return ret;
+}
+
+int main(void)
+{
+    const wchar_t *plain = L"test_wide_dirs.plain.psym", *bounded = L"test_wide_dirs.bounded.psym",
+                  *compact = L"test_wide_dirs.compact.psym";
+    wchar_t **dirs = (wchar_t **)malloc(sizeof(wchar_t *) * DIR_COUNT);
+    for (int i = 0; i < DIR_COUNT; ++i)
+    {
+        dirs[i] = (wchar_t *)malloc(sizeof(wchar_t) * 32);
+        swprintf(dirs[i], 32, L"/psym_test_wide/%05i", i);
+    }
+
+    int ret = 1;
+    if (write_files(plain, (const wchar_t **)dirs, 0, 0) || write_files(bounded, (const wchar_t **)dirs, PSYM_MEM_MIN, 0)
+        || write_files(compact, (const wchar_t **)dirs, 0, 1))
+        fprintf(stderr, "write failed\n");
+    else if (!check_files(plain) && !check_files(compact))
+    {
+        if (!same_files(plain, bounded))
+            fprintf(stderr, "the bounded and in memory files differ\n");
+        else
+            ret = 0;
+    }
+
+    remove_path(plain);
+    remove_path(bounded);
+    remove_path(compact);
+    for (int i = 0; i < DIR_COUNT; ++i)
+        free(dirs[i]);
+    free(dirs);
+    return ret;
+}